@@ -1,30 +1,265 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <optional>
 #include <unordered_map>
+#include <unordered_set>
 #include <list>
+#include <mutex>
+#include <type_traits>
+#include <vector>
 #include <ag_defs.h>
 
 namespace ag {
 
 /**
- * Generic cache with least-recently-used eviction policy
+ * Least-recently-used eviction policy: an accessed entry moves to the front of the queue,
+ * and the entries are displaced from the back.
+ *
+ * An eviction policy keeps the entries of `lru_cache` and decides which one goes first.
+ * It provides the following interface:
+ *     handle                               stable reference to a stored node
+ *     static Node &get(handle)             get the node by its handle
+ *     handle insert(Node)                  store a new node (the cache makes room in advance)
+ *     void touch(handle) const             the entry is accessed
+ *     void demote(handle) const            the entry must be the next one to be displaced
+ *     handle victim()                      select the entry to be displaced next (there must be one)
+ *     void erase(handle, bool displaced)   remove the node (`displaced` is true if the cache makes room)
+ *     void clear()                         remove all the nodes
+ *     void for_each(F) const               call a function for each node starting from the ones
+ *                                          to be displaced first (the order may be approximate)
+ *     void set_capacity(size_t)            the cache capacity is changed
+ * The `const` functions may be called concurrently by the clients sharing access to the cache.
  */
-template <typename Key, typename Val>
+template <typename Node>
+class lru_policy {
+public:
+    using handle = typename std::list<Node>::iterator;
+
+    static Node &get(handle h) {
+        return *h;
+    }
+
+    handle insert(Node n) {
+        std::unique_lock l(m_queue.mtx);
+        m_queue.val.push_front(std::move(n));
+        return m_queue.val.begin();
+    }
+
+    void touch(handle h) const {
+        std::unique_lock l(m_queue.mtx);
+        m_queue.val.splice(m_queue.val.begin(), m_queue.val, h);
+    }
+
+    void demote(handle h) const {
+        std::unique_lock l(m_queue.mtx);
+        m_queue.val.splice(m_queue.val.end(), m_queue.val, h);
+    }
+
+    handle victim() {
+        std::unique_lock l(m_queue.mtx);
+        assert(!m_queue.val.empty());
+        return std::prev(m_queue.val.end());
+    }
+
+    void erase(handle h, bool) {
+        std::unique_lock l(m_queue.mtx);
+        m_queue.val.erase(h);
+    }
+
+    void clear() {
+        std::unique_lock l(m_queue.mtx);
+        m_queue.val.clear();
+    }
+
+    void set_capacity(size_t) {
+    }
+
+    template <typename F>
+    void for_each(F &&f) const {
+        std::unique_lock l(m_queue.mtx);
+        for (auto i = m_queue.val.rbegin(); i != m_queue.val.rend(); ++i) {
+            f(*i);
+        }
+    }
+
+private:
+    /** MRU gravitate to the front, LRU gravitate to the back */
+    // This is guarded with its own mutex to allow clients to share access to the
+    // "const" (from their point of view) functions, which actually modify this list
+    mutable with_mtx<std::list<Node>> m_queue;
+};
+
+/**
+ * S3-FIFO eviction policy (see "FIFO queues are all you need for cache eviction", SOSP'23).
+ * New entries go to a small FIFO queue. The ones accessed while there are moved to the main FIFO
+ * queue when they reach its end, and the others are displaced with their keys remembered
+ * in a ghost FIFO queue. The entries whose keys are found in the ghost queue go straight
+ * to the main queue. The entries of the main queue accessed since they were checked last time
+ * are reinserted instead of being displaced.
+ * So the entries requested once leave the cache quickly without displacing the popular ones,
+ * and an access only bumps a counter without reordering the queues.
+ */
+template <typename Node>
+class s3fifo_policy {
+    struct item {
+        Node node;
+        mutable std::atomic<uint8_t> freq{0}; // number of accesses since the last check (saturating)
+        bool in_main = false;
+        bool demoted = false; // must be displaced first unless accessed after that
+
+        explicit item(Node n) : node(std::move(n)) {}
+    };
+
+    using key_type = std::remove_const_t<typename Node::first_type>;
+
+    /** Small queue share of the capacity (in percents) */
+    static constexpr size_t SMALL_QUEUE_SHARE = 10;
+    static constexpr uint8_t MAX_FREQ = 3;
+
+public:
+    using handle = typename std::list<item>::iterator;
+
+    static Node &get(handle h) {
+        return h->node;
+    }
+
+    handle insert(Node n) {
+        std::unique_lock l(m_mtx);
+        auto ghost = m_ghost_keys.find(std::hash<key_type>{}(n.first));
+        bool to_main = ghost != m_ghost_keys.end();
+        if (to_main) {
+            m_ghost_keys.erase(ghost);
+        }
+        std::list<item> &queue = to_main ? m_main : m_small;
+        queue.emplace_front(std::move(n));
+        queue.front().in_main = to_main;
+        return queue.begin();
+    }
+
+    void touch(handle h) const {
+        // The counter is approximate, so a lost update of concurrent accesses does not matter
+        uint8_t freq = h->freq.load(std::memory_order_relaxed);
+        if (freq < MAX_FREQ) {
+            h->freq.store(freq + 1, std::memory_order_relaxed);
+        }
+    }
+
+    void demote(handle h) const {
+        std::unique_lock l(m_mtx);
+        h->freq.store(0, std::memory_order_relaxed);
+        h->demoted = true;
+        m_small.splice(m_small.end(), h->in_main ? m_main : m_small, h);
+        h->in_main = false;
+    }
+
+    handle victim() {
+        std::unique_lock l(m_mtx);
+        assert(!m_small.empty() || !m_main.empty());
+        if (!m_small.empty() && m_small.back().demoted && m_small.back().freq.load(std::memory_order_relaxed) == 0) {
+            return std::prev(m_small.end());
+        }
+        // Each iteration either promotes an entry or decrements its counter, so the loop is finite
+        while (true) {
+            if (!m_small.empty() && (m_small.size() >= m_small_capacity || m_main.empty())) {
+                handle h = std::prev(m_small.end());
+                if (h->freq.load(std::memory_order_relaxed) == 0) {
+                    return h;
+                }
+                h->freq.store(0, std::memory_order_relaxed);
+                h->in_main = true;
+                h->demoted = false;
+                m_main.splice(m_main.begin(), m_small, h);
+            } else {
+                handle h = std::prev(m_main.end());
+                uint8_t freq = h->freq.load(std::memory_order_relaxed);
+                if (freq == 0) {
+                    return h;
+                }
+                h->freq.store(freq - 1, std::memory_order_relaxed);
+                m_main.splice(m_main.begin(), m_main, h);
+            }
+        }
+    }
+
+    void erase(handle h, bool displaced) {
+        std::unique_lock l(m_mtx);
+        if (displaced && !h->in_main) {
+            size_t key_hash = std::hash<key_type>{}(h->node.first);
+            m_ghost_queue.push_back(key_hash);
+            m_ghost_keys.insert(key_hash);
+            while (m_ghost_queue.size() > m_ghost_capacity) {
+                // A key may be already gone if it has been readmitted
+                if (auto i = m_ghost_keys.find(m_ghost_queue.front()); i != m_ghost_keys.end()) {
+                    m_ghost_keys.erase(i);
+                }
+                m_ghost_queue.pop_front();
+            }
+        }
+        (h->in_main ? m_main : m_small).erase(h);
+    }
+
+    void clear() {
+        std::unique_lock l(m_mtx);
+        m_small.clear();
+        m_main.clear();
+        m_ghost_queue.clear();
+        m_ghost_keys.clear();
+    }
+
+    void set_capacity(size_t max_size) {
+        std::unique_lock l(m_mtx);
+        m_small_capacity = std::max(max_size * SMALL_QUEUE_SHARE / 100, (size_t) 1);
+        m_ghost_capacity = max_size - std::min(m_small_capacity, max_size);
+    }
+
+    template <typename F>
+    void for_each(F &&f) const {
+        std::unique_lock l(m_mtx);
+        for (const std::list<item> *queue : { &m_small, &m_main }) {
+            for (auto i = queue->rbegin(); i != queue->rend(); ++i) {
+                f(i->node);
+            }
+        }
+    }
+
+private:
+    // New entries are inserted at the front, the entries are checked for eviction at the back.
+    // The queues are guarded with their own mutex for the same reason as in `lru_policy`.
+    mutable std::mutex m_mtx;
+    mutable std::list<item> m_small;
+    mutable std::list<item> m_main;
+    // Hashes of the keys of the entries recently displaced from the small queue
+    std::deque<size_t> m_ghost_queue;
+    std::unordered_multiset<size_t> m_ghost_keys;
+    size_t m_small_capacity = 1;
+    size_t m_ghost_capacity = 0;
+};
+
+/**
+ * Generic cache with a pluggable eviction policy (least-recently-used by default)
+ */
+template <typename Key, typename Val, template <typename> class Policy = lru_policy>
 class lru_cache {
 public:
     using node = std::pair<const Key, Val>;
 
 private:
+    using policy_type = Policy<node>;
+
     /** Cache capacity */
     size_t m_max_size;
 
-    /** MRU gravitate to the front, LRU gravitate to the back */
-    // This is guarded with its own mutex to allow clients to share access to the
-    // "const" (from their point of view) functions, which actually modify this list
-    mutable with_mtx<std::list<node>> m_key_values;
+    /** The entries ordered by the eviction policy */
+    mutable policy_type m_policy;
 
     /** The main map */
-    using map_type = std::unordered_map<Key, typename std::list<node>::iterator>;
+    using map_type = std::unordered_map<Key, typename policy_type::handle>;
     mutable map_type m_mapped_values;
 
 public:
@@ -44,11 +279,11 @@ public:
         }
 
         const Val &operator*() const {
-            return m_it->second->second;
+            return policy_type::get(m_it->second).second;
         }
 
         const Val *operator->() const {
-            return &m_it->second->second;
+            return &policy_type::get(m_it->second).second;
         }
     };
 
@@ -71,21 +306,16 @@ public:
     bool insert(Key k, Val v) {
         auto i = m_mapped_values.find(k);
         if (i != m_mapped_values.end()) {
-            m_key_values.mtx.lock();
-            m_key_values.val.splice(m_key_values.val.begin(), m_key_values.val, i->second);
-            i->second = m_key_values.val.begin();
-            m_key_values.mtx.unlock();
-            i->second->second = std::move(v);
+            m_policy.touch(i->second);
+            policy_type::get(i->second).second = std::move(v);
             return false;
         } else {
             assert(m_max_size);
-            std::unique_lock l(m_key_values.mtx);
-            if (m_key_values.val.size() == m_max_size) {
-                m_mapped_values.erase(m_key_values.val.back().first);
-                m_key_values.val.pop_back();
+            if (m_mapped_values.size() == m_max_size) {
+                displace_one();
             }
-            m_key_values.val.push_front(std::make_pair(k, std::move(v)));
-            m_mapped_values.emplace(std::make_pair(std::move(k), m_key_values.val.begin()));
+            auto h = m_policy.insert(std::make_pair(k, std::move(v)));
+            m_mapped_values.emplace(std::make_pair(std::move(k), h));
             return true;
         }
     }
@@ -101,21 +331,53 @@ public:
     accessor get(const Key &k) const {
         auto i = m_mapped_values.find(k);
         if (i != m_mapped_values.end()) {
-            std::unique_lock l(m_key_values.mtx);
-            m_key_values.val.splice(m_key_values.val.begin(), m_key_values.val, i->second);
+            m_policy.touch(i->second);
             return accessor(i);
         } else {
             return {};
         }
     }
 
+    /**
+     * Modify the value of an existing entry in place.
+     * Unlike `insert()`, this does not count as an access, so the eviction order is not affected.
+     * @param k the key
+     * @param f function taking `Val &`
+     * @return true if the entry was found
+     */
+    template <typename F>
+    bool update(const Key &k, F &&f) {
+        auto i = m_mapped_values.find(k);
+        if (i == m_mapped_values.end()) {
+            return false;
+        }
+        f(policy_type::get(i->second).second);
+        return true;
+    }
+
+    /**
+     * Remove the entry which the eviction policy selects to be displaced next,
+     * as if the room for a new entry was needed
+     * @return the removed entry, or
+     *         nullopt if the cache is empty
+     */
+    std::optional<node> displace() {
+        if (m_mapped_values.empty()) {
+            return std::nullopt;
+        }
+        auto h = m_policy.victim();
+        std::optional<node> n{std::move(policy_type::get(h))};
+        m_mapped_values.erase(n->first);
+        m_policy.erase(h, true);
+        return n;
+    }
+
     /**
      * Forcibly make the specified cache entry least-recently-used
      * @param acc the accessor for the cache entry to become LRU
      */
     void make_lru(accessor acc) {
-        std::unique_lock l(m_key_values.mtx);
-        m_key_values.val.splice(m_key_values.val.end(), m_key_values.val, acc.m_it->second);
+        m_policy.demote(acc.m_it->second);
     }
 
     /**
@@ -125,8 +387,7 @@ public:
     void erase(const Key &k) {
         auto i = m_mapped_values.find(k);
         if (i != m_mapped_values.end()) {
-            std::unique_lock l(m_key_values.mtx);
-            m_key_values.val.erase(i->second);
+            m_policy.erase(i->second, false);
             m_mapped_values.erase(i);
         }
     }
@@ -135,11 +396,20 @@ public:
      * Clear the cache
      */
     void clear() {
-        std::unique_lock l(m_key_values.mtx);
-        m_key_values.val.clear();
+        m_policy.clear();
         m_mapped_values.clear();
     }
 
+    /**
+     * Call a function for each entry starting from the ones to be displaced first.
+     * The eviction order is not affected.
+     * @param f function taking `const node &`
+     */
+    template <typename F>
+    void for_each(F &&f) const {
+        m_policy.for_each(std::forward<F>(f));
+    }
+
     /**
      * @return current cache size
      */
@@ -154,24 +424,372 @@ public:
         return m_max_size;
     }
 
+    /**
+     * Set cache capacity. If the new capacity is less than the current,
+     * the entries are displaced according to the eviction policy.
+     * @param max_size new capacity, 0 means default capacity
+     */
+    void set_capacity(size_t max_size) {
+        if (!max_size) {
+            max_size = DEFAULT_CAPACITY;
+        }
+        while (max_size < size()) {
+            displace_one();
+        }
+        m_max_size = max_size;
+        m_policy.set_capacity(max_size);
+    }
+
+private:
+    void displace_one() {
+        auto h = m_policy.victim();
+        // The key is still alive at this point since the node is erased after the map entry
+        m_mapped_values.erase(policy_type::get(h).first);
+        m_policy.erase(h, true);
+    }
+};
+
+/**
+ * Cache with least-recently-used eviction policy keeping the entries in a contiguous array
+ * allocated once for the whole capacity.
+ * The recency list is linked with the slot indexes, and the keys are indexed with an open-addressing
+ * hash table, so neither inserting nor looking up an entry allocates memory or follows pointers
+ * to separately allocated nodes.
+ * Has the same interface and semantics as `lru_cache` with the default policy.
+ */
+template <typename Key, typename Val, typename Hash = std::hash<Key>>
+class flat_lru_cache {
+public:
+    using node = std::pair<const Key, Val>;
+
+private:
+    static constexpr uint32_t NIL = UINT32_MAX;
+
+    struct slot {
+        std::optional<node> kv; // empty if the slot is free
+        size_t hash = 0;
+        uint32_t prev = NIL; // more recently used entry
+        uint32_t next = NIL; // less recently used entry, or the next free slot
+    };
+
+    /** Cache capacity */
+    size_t m_max_size = 0;
+    size_t m_size = 0;
+
+    /** MRU is at the head, LRU is at the tail */
+    // The recency list is guarded with its own mutex to allow clients to share access to the
+    // "const" (from their point of view) functions, which actually modify this list
+    mutable std::vector<slot> m_slots;
+    mutable uint32_t m_head = NIL;
+    mutable uint32_t m_tail = NIL;
+    mutable std::mutex m_list_mtx;
+    uint32_t m_free = NIL;
+
+    /** Slot indexes by key hash (linear probing, the size is a power of two) */
+    std::vector<uint32_t> m_index;
+    uint32_t m_index_shift = 0;
+
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 128;
+
+    /** A pointer-like object for accessing the cached value */
+    struct accessor {
+        const slot *m_slot = nullptr;
+
+        accessor() = default;
+
+        explicit accessor(const slot *s) : m_slot{s} {}
+
+        explicit operator bool() const {
+            return m_slot != nullptr;
+        }
+
+        const Val &operator*() const {
+            return m_slot->kv->second;
+        }
+
+        const Val *operator->() const {
+            return &m_slot->kv->second;
+        }
+    };
+
+    /**
+     * Initialize a new cache
+     * @param max_size cache capacity, 0 means default
+     */
+    explicit flat_lru_cache(size_t max_size = DEFAULT_CAPACITY) {
+        set_capacity(max_size);
+    }
+
+    flat_lru_cache(const flat_lru_cache &) = delete;
+    flat_lru_cache &operator=(const flat_lru_cache &) = delete;
+
+    /**
+     * Insert a new key-value pair or update an existing one.
+     * The new or updated entry will become most-recently-used.
+     * @param k key
+     * @param v value
+     * @return false if an entry with this key already exists and was updated, or
+     *         true if an entry with this key didn't exist.
+     */
+    bool insert(Key k, Val v) {
+        size_t hash = Hash{}(k);
+        size_t pos = find_pos(k, hash);
+        if (m_index[pos] != NIL) {
+            slot &s = m_slots[m_index[pos]];
+            touch(m_index[pos]);
+            s.kv->second = std::move(v);
+            return false;
+        }
+
+        if (m_size == m_max_size) {
+            displace_one();
+            // the displacement may have shifted the index entries
+            pos = find_pos(k, hash);
+        }
+        uint32_t idx = m_free;
+        slot &s = m_slots[idx];
+        m_free = s.next;
+        s.kv.emplace(std::move(k), std::move(v));
+        s.hash = hash;
+        std::unique_lock l(m_list_mtx);
+        link_front(idx);
+        m_index[pos] = idx;
+        ++m_size;
+        return true;
+    }
+
+    /**
+     * Get the value associated with the given key.
+     * The corresponding entry will become most-recently-used.
+     * The returned pointer will only be valid until the next modification of the cache!
+     * @param k the key
+     * @return pointer to the found value, or
+     *         nullptr if nothing was found
+     */
+    accessor get(const Key &k) const {
+        uint32_t idx = m_index[find_pos(k, Hash{}(k))];
+        if (idx == NIL) {
+            return {};
+        }
+        touch(idx);
+        return accessor(&m_slots[idx]);
+    }
+
+    /**
+     * Modify the value of an existing entry in place.
+     * Unlike `insert()`, this does not count as an access, so the eviction order is not affected.
+     * @param k the key
+     * @param f function taking `Val &`
+     * @return true if the entry was found
+     */
+    template <typename F>
+    bool update(const Key &k, F &&f) {
+        uint32_t idx = m_index[find_pos(k, Hash{}(k))];
+        if (idx == NIL) {
+            return false;
+        }
+        f(m_slots[idx].kv->second);
+        return true;
+    }
+
+    /**
+     * Remove the least-recently-used entry, as if the room for a new entry was needed
+     * @return the removed entry, or
+     *         nullopt if the cache is empty
+     */
+    std::optional<node> displace() {
+        if (m_size == 0) {
+            return std::nullopt;
+        }
+        std::optional<node> n{std::move(m_slots[m_tail].kv)};
+        remove(m_tail);
+        return n;
+    }
+
+    /**
+     * Forcibly make the specified cache entry least-recently-used
+     * @param acc the accessor for the cache entry to become LRU
+     */
+    void make_lru(accessor acc) {
+        uint32_t idx = (uint32_t) (acc.m_slot - m_slots.data());
+        std::unique_lock l(m_list_mtx);
+        if (idx != m_tail) {
+            unlink(idx);
+            link_back(idx);
+        }
+    }
+
+    /**
+     * Delete the value with the given key from the cache
+     * @param k the key
+     */
+    void erase(const Key &k) {
+        uint32_t idx = m_index[find_pos(k, Hash{}(k))];
+        if (idx != NIL) {
+            remove(idx);
+        }
+    }
+
+    /**
+     * Clear the cache
+     */
+    void clear() {
+        std::unique_lock l(m_list_mtx);
+        for (slot &s : m_slots) {
+            s.kv.reset();
+        }
+        std::fill(m_index.begin(), m_index.end(), NIL);
+        reset_lists();
+    }
+
+    /**
+     * Call a function for each entry starting from the least recently used one.
+     * The eviction order is not affected.
+     * @param f function taking `const node &`
+     */
+    template <typename F>
+    void for_each(F &&f) const {
+        std::unique_lock l(m_list_mtx);
+        for (uint32_t idx = m_tail; idx != NIL; idx = m_slots[idx].prev) {
+            f(*m_slots[idx].kv);
+        }
+    }
+
+    /**
+     * @return current cache size
+     */
+    size_t size() const {
+        return m_size;
+    }
+
+    /**
+     * @return maximum cache size
+     */
+    size_t max_size() const {
+        return m_max_size;
+    }
+
     /**
      * Set cache capacity. If the new capacity is less than the current,
      * the least recenlty used entries are removed from the cache.
+     * Unlike the other functions, this one reallocates the storage.
      * @param max_size new capacity, 0 means default capacity
      */
     void set_capacity(size_t max_size) {
         if (!max_size) {
             max_size = DEFAULT_CAPACITY;
         }
-        if (max_size < size()) {
-            size_t diff = size() - max_size;
-            std::unique_lock l(m_key_values.mtx);
-            for (size_t i = 0; i < diff; i++) {
-                m_mapped_values.erase(m_key_values.val.back().first);
-                m_key_values.val.pop_back();
-            }
+        // The slots are addressed by 32-bit indices, and NIL is reserved
+        assert(max_size < NIL);
+        while (max_size < m_size) {
+            displace_one();
         }
+
+        std::vector<slot> old_slots(max_size);
+        old_slots.swap(m_slots);
+        uint32_t old_tail = m_tail;
         m_max_size = max_size;
+        size_t index_size = 2;
+        for (m_index_shift = 63; index_size < 2 * max_size; index_size *= 2) {
+            --m_index_shift;
+        }
+        m_index.assign(index_size, NIL);
+        reset_lists();
+        m_size = 0;
+
+        // re-insert from the least recently used to keep the order
+        for (uint32_t idx = old_tail; idx != NIL; idx = old_slots[idx].prev) {
+            insert(std::move(old_slots[idx].kv->first), std::move(old_slots[idx].kv->second));
+        }
+    }
+
+private:
+    size_t home_pos(size_t hash) const {
+        // Fibonacci hashing spreads the sequential hashes (e.g. of integers) over the table
+        return (uint64_t(hash) * UINT64_C(11400714819323198485)) >> m_index_shift;
+    }
+
+    // Get the index position of the key, or the empty position where it would be
+    size_t find_pos(const Key &k, size_t hash) const {
+        size_t mask = m_index.size() - 1;
+        for (size_t pos = home_pos(hash);; pos = (pos + 1) & mask) {
+            uint32_t idx = m_index[pos];
+            if (idx == NIL || (m_slots[idx].hash == hash && m_slots[idx].kv->first == k)) {
+                return pos;
+            }
+        }
+    }
+
+    void touch(uint32_t idx) const {
+        std::unique_lock l(m_list_mtx);
+        if (idx != m_head) {
+            unlink(idx);
+            link_front(idx);
+        }
+    }
+
+    void displace_one() {
+        remove(m_tail);
+    }
+
+    // Remove the entry from the index and the recency list and free its slot
+    void remove(uint32_t idx) {
+        slot &s = m_slots[idx];
+        size_t mask = m_index.size() - 1;
+        size_t pos = home_pos(s.hash);
+        while (m_index[pos] != idx) {
+            pos = (pos + 1) & mask;
+        }
+        // Backward shift deletion: move the following entries of the probe sequence
+        // into the hole unless they would precede their home position
+        for (size_t next = (pos + 1) & mask; m_index[next] != NIL; next = (next + 1) & mask) {
+            size_t home = home_pos(m_slots[m_index[next]].hash);
+            if (((next - home) & mask) >= ((next - pos) & mask)) {
+                m_index[pos] = m_index[next];
+                pos = next;
+            }
+        }
+        m_index[pos] = NIL;
+
+        std::unique_lock l(m_list_mtx);
+        unlink(idx);
+        s.kv.reset();
+        s.next = m_free;
+        m_free = idx;
+        --m_size;
+    }
+
+    void unlink(uint32_t idx) const {
+        slot &s = m_slots[idx];
+        (s.prev != NIL ? m_slots[s.prev].next : m_head) = s.next;
+        (s.next != NIL ? m_slots[s.next].prev : m_tail) = s.prev;
+    }
+
+    void link_front(uint32_t idx) const {
+        slot &s = m_slots[idx];
+        s.prev = NIL;
+        s.next = m_head;
+        (m_head != NIL ? m_slots[m_head].prev : m_tail) = idx;
+        m_head = idx;
+    }
+
+    void link_back(uint32_t idx) {
+        slot &s = m_slots[idx];
+        s.next = NIL;
+        s.prev = m_tail;
+        (m_tail != NIL ? m_slots[m_tail].next : m_head) = idx;
+        m_tail = idx;
+    }
+
+    void reset_lists() {
+        assert(m_slots.size() < NIL);
+        m_head = m_tail = NIL;
+        m_free = m_slots.empty() ? NIL : 0;
+        for (size_t i = 0; i < m_slots.size(); ++i) {
+            m_slots[i].next = (i + 1 < m_slots.size()) ? (uint32_t) (i + 1) : NIL;
+        }
+        m_size = 0;
     }
 };
 
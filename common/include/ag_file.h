@@ -28,6 +28,7 @@ namespace ag::file {
         WRONLY = O_WRONLY,
         RDWR = O_RDWR,
         CREAT = O_CREAT,
+        TRUNC = O_TRUNC,
     };
 #elif defined(_WIN32)
     enum flags {
@@ -35,6 +36,7 @@ namespace ag::file {
         WRONLY = _O_WRONLY,
         RDWR = _O_RDWR,
         CREAT = _O_CREAT,
+        TRUNC = _O_TRUNC,
     };
 #else
     #error not supported
@@ -52,9 +54,25 @@ namespace ag::file {
      * @brief      Open file by path
      * @param[in]  path   system path
      * @param[in]  flags  file mode flags
+     * @param[in]  mode   permissions of the file if it's created (ignored on Windows)
      * @return     Handle of file
      */
-    handle open(std::string_view path, int flags);
+    handle open(std::string_view path, int flags, int mode = 0666);
+
+    /**
+     * @brief      Rename file replacing the existing one, if any
+     * @param[in]  old_path  system path of the file
+     * @param[in]  new_path  new system path
+     * @return     0 in case of success, <0 otherwise
+     */
+    int rename(std::string_view old_path, std::string_view new_path);
+
+    /**
+     * @brief      Remove file
+     * @param[in]  path  system path
+     * @return     0 in case of success, <0 otherwise
+     */
+    int remove(std::string_view path);
 
     /**
      * @brief      Close file
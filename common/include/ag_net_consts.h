@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+
 namespace ag {
 
 // An ldns_buffer grows automatically.
@@ -16,4 +19,9 @@ constexpr size_t REQUEST_BUFFER_INITIAL_CAPACITY = 64;
 // (remember, this constant only affects incoming packets, we always send back as much as the upstream returned)
 static constexpr size_t UDP_RECV_BUF_SIZE = 4096;
 
+// EDNS option codes (https://www.iana.org/assignments/dns-parameters/dns-parameters.xhtml#dns-parameters-11)
+constexpr uint16_t EDNS_COOKIE_OPTION_CODE = 10;
+constexpr uint16_t EDNS_TCP_KEEPALIVE_OPTION_CODE = 11;
+constexpr uint16_t EDNS_PADDING_OPTION_CODE = 12;
+
 }
@@ -559,6 +559,13 @@ size_t hash_combine(const Ts&... objs) {
     return seed;
 }
 
+/**
+ * Find the first line break character (`\r` or `\n`) in a string
+ * @param str string
+ * @return position of the character, or `std::string_view::npos` if there is no one
+ */
+size_t find_line_break(std::string_view str);
+
 /**
  * Function to be called from `for_each_line`
  * @param pos  position in containing data at which the line starts
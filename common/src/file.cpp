@@ -1,3 +1,4 @@
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ag_file.h>
@@ -9,8 +10,16 @@ bool ag::file::is_valid(const handle f) {
     return f >= 0;
 }
 
-ag::file::handle ag::file::open(std::string_view path, int flags) {
-    return ::open(path.data(), flags, 0666);
+ag::file::handle ag::file::open(std::string_view path, int flags, int mode) {
+    return ::open(path.data(), flags, mode);
+}
+
+int ag::file::rename(std::string_view old_path, std::string_view new_path) {
+    return ::rename(std::string(old_path).c_str(), std::string(new_path).c_str());
+}
+
+int ag::file::remove(std::string_view path) {
+    return ::unlink(std::string(path).c_str());
 }
 
 void ag::file::close(handle f) {
@@ -50,10 +59,19 @@ bool ag::file::is_valid(const handle f) {
     return f >= 0;
 }
 
-ag::file::handle ag::file::open(std::string_view path, int flags) {
+ag::file::handle ag::file::open(std::string_view path, int flags, int) {
     return ::_wopen(ag::utils::to_wstring(path).c_str(), flags | _O_BINARY, _S_IWRITE);
 }
 
+int ag::file::rename(std::string_view old_path, std::string_view new_path) {
+    return ::MoveFileExW(ag::utils::to_wstring(old_path).c_str(), ag::utils::to_wstring(new_path).c_str(),
+                         MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+}
+
+int ag::file::remove(std::string_view path) {
+    return ::_wunlink(ag::utils::to_wstring(path).c_str());
+}
+
 void ag::file::close(handle f) {
     if (ag::file::is_valid(f)) {
         ::close(f);
@@ -104,30 +122,35 @@ int ag::file::for_each_line(const handle f, line_action action, void *arg) {
     const size_t chunk_size = std::min(MAX_CHUNK_SIZE, (size_t)file_size);
 
     std::vector<char> buffer(chunk_size);
-    std::string line;
+    // the beginning of the line which is continued in the next chunk
+    std::string partial_line;
     size_t file_idx = 0;
     size_t line_idx = 0;
     int r;
-    while (0 < (r = file::read(f, &buffer[0], buffer.size()))) {
-        for (int i = 0; i < r; ++i) {
-            int c = buffer[i];
-            if (c != '\r' && c != '\n') {
-                line.push_back(c);
-                continue;
+    while (0 < (r = file::read(f, buffer.data(), buffer.size()))) {
+        std::string_view chunk{buffer.data(), (size_t)r};
+        size_t start = 0;
+        size_t length;
+        while (chunk.npos != (length = utils::find_line_break(chunk.substr(start)))) {
+            // the lines fitting in the chunk are passed as is, without copying
+            std::string_view line = chunk.substr(start, length);
+            if (!partial_line.empty()) {
+                partial_line.append(line);
+                line = partial_line;
             }
-            std::string_view line_view = ag::utils::trim(line);
-            if (!action(line_idx, line_view, arg)) {
+            if (!action(line_idx, ag::utils::trim(line), arg)) {
                 return 0;
             }
-            line.clear();
-            line_idx = file_idx + i + 1;
+            partial_line.clear();
+            start += length + 1;
+            line_idx = file_idx + start;
         }
+        partial_line.append(chunk.substr(start));
         file_idx += r;
     }
 
-    if ((size_t)(file_size - 1) > line_idx) {
-        std::string_view line_view = ag::utils::trim(line);
-        action(line_idx, line_view, arg);
+    if (line_idx < file_idx) {
+        action(line_idx, ag::utils::trim(partial_line), arg);
     }
 
     return r;
@@ -143,22 +166,12 @@ std::optional<std::string> ag::file::read_line(const handle f, size_t pos) {
 
     std::string line;
     int r;
-    while (0 < (r = file::read(f, &buffer[0], CHUNK_SIZE))) {
-        int from = 0;
-        int i;
-        for (i = 0; i < r; ++i) {
-            int c = buffer[i];
-            if (c == '\r' || c == '\n') {
-                size_t length = i - from;
-                line.append(&buffer[from], length);
-                break;
-            }
-        }
-
-        if (i < r) {
+    while (0 < (r = file::read(f, buffer.data(), CHUNK_SIZE))) {
+        std::string_view chunk{buffer.data(), (size_t)r};
+        size_t length = utils::find_line_break(chunk);
+        line.append(chunk.substr(0, length));
+        if (length != chunk.npos) {
             break;
-        } else {
-            line.append(&buffer[0], r);
         }
     }
 
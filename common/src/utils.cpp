@@ -8,6 +8,17 @@
 #include <ag_utils.h>
 #include <ag_socket_address.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define AG_UTILS_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define AG_UTILS_NEON
+#include <arm_neon.h>
+#endif
+
 std::vector<std::string_view> ag::utils::split_by(std::string_view str, std::string_view delim) {
     if (str.empty()) {
         return { str };
@@ -124,11 +135,48 @@ std::string ag::utils::from_wstring(std::wstring_view wsv) {
     return std::wstring_convert<std::codecvt_utf8<wchar_t>>().to_bytes(wsv.data(), wsv.data() + wsv.size());
 }
 
+size_t ag::utils::find_line_break(std::string_view str) {
+    size_t i = 0;
+#if defined(AG_UTILS_SSE2)
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    for (; i + 16 <= str.length(); i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&str[i]);
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        if (mask != 0) {
+#ifdef _MSC_VER
+            unsigned long idx;
+            _BitScanForward(&idx, mask);
+            return i + idx;
+#else
+            return i + __builtin_ctz(mask);
+#endif
+        }
+    }
+#elif defined(AG_UTILS_NEON)
+    const uint8x16_t cr = vdupq_n_u8('\r');
+    const uint8x16_t lf = vdupq_n_u8('\n');
+    for (; i + 16 <= str.length(); i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)&str[i]);
+        if (vmaxvq_u8(vorrq_u8(vceqq_u8(v, cr), vceqq_u8(v, lf))) != 0) {
+            // the exact position is found by the scalar loop below
+            break;
+        }
+    }
+#endif
+    for (; i < str.length(); ++i) {
+        if (str[i] == '\r' || str[i] == '\n') {
+            return i;
+        }
+    }
+    return std::string_view::npos;
+}
+
 int ag::utils::for_each_line(std::string_view str, line_action action, void *arg) {
     using size_type = std::string_view::size_type;
     size_type start = 0;
     while (start != str.size()) {
-        size_type end = str.find_first_of("\r\n", start);
+        size_type end = find_line_break(str.substr(start));
 
         if (end == str.npos) {
             str.remove_prefix(start);
@@ -137,7 +185,7 @@ int ag::utils::for_each_line(std::string_view str, line_action action, void *arg
             return 0;
         }
 
-        size_type len = end - start;
+        size_type len = end;
         std::string_view line = ag::utils::trim({&str[start], len});
 
         if (!action(start, line, arg)) {
@@ -157,10 +205,12 @@ std::optional<std::string_view> ag::utils::read_line(std::string_view str, size_
     }
 
     size_type start = pos;
-    size_type end = str.find_first_of("\r\n", start);
+    size_type end = find_line_break(str.substr(start));
 
     if (end == str.npos) {
         end = str.size();
+    } else {
+        end += start;
     }
 
     return ag::utils::trim({&str[start], end - start});
@@ -1,14 +1,16 @@
 #include <gtest/gtest.h>
+#include <random>
 #include <ag_cache.h>
 
 static constexpr size_t CACHE_SIZE = 1000u;
 
+template <typename Cache>
 class lru_cache_test : public ::testing::Test {
 public:
     lru_cache_test() : cache(CACHE_SIZE) {}
 
 protected:
-    ag::lru_cache<int, std::string> cache;
+    Cache cache;
 
     void SetUp() override {
         for (size_t i = 0; i < CACHE_SIZE; ++i) {
@@ -22,107 +24,287 @@ protected:
     }
 };
 
-TEST_F(lru_cache_test, clear) {
-    ASSERT_NE(cache.size(), 0u);
-    cache.clear();
-    ASSERT_EQ(cache.size(), 0u);
+using lru_cache_types = ::testing::Types<ag::lru_cache<int, std::string>, ag::flat_lru_cache<int, std::string>>;
+TYPED_TEST_CASE(lru_cache_test, lru_cache_types);
+
+TYPED_TEST(lru_cache_test, clear) {
+    ASSERT_NE(this->cache.size(), 0u);
+    this->cache.clear();
+    ASSERT_EQ(this->cache.size(), 0u);
 }
 
-TEST_F(lru_cache_test, insert_and_get) {
+TYPED_TEST(lru_cache_test, insert_and_get) {
     // check that values were inserted
     for (size_t i = 0; i < CACHE_SIZE; ++i) {
-        auto v = cache.get(i);
+        auto v = this->cache.get(i);
         ASSERT_TRUE(v);
         ASSERT_EQ(*v, std::to_string(i));
     }
 
     // check that cache grows no more
     for (size_t i = CACHE_SIZE; i < CACHE_SIZE * 2; ++i) {
-        cache.insert(i, std::to_string(i));
-        ASSERT_EQ(cache.size(), CACHE_SIZE);
+        this->cache.insert(i, std::to_string(i));
+        ASSERT_EQ(this->cache.size(), CACHE_SIZE);
     }
 
     // check that old values were displaced
     for (size_t i = 0; i < CACHE_SIZE; ++i) {
-        ASSERT_FALSE(cache.get(i));
+        ASSERT_FALSE(this->cache.get(i));
     }
 
     // check that new values were inserted
     for (size_t i = CACHE_SIZE; i < CACHE_SIZE * 2; ++i) {
-        auto v = cache.get(i);
+        auto v = this->cache.get(i);
         ASSERT_TRUE(v);
         ASSERT_EQ(*v, std::to_string(i));
     }
 }
 
-TEST_F(lru_cache_test, erase) {
+TYPED_TEST(lru_cache_test, erase) {
     // erase every second entry
     for (size_t i = 0; i < CACHE_SIZE; i += 2) {
-        cache.erase(i);
+        this->cache.erase(i);
     }
 
     // check that size corresponds to the entries number
-    ASSERT_EQ(cache.size(), CACHE_SIZE / 2);
+    ASSERT_EQ(this->cache.size(), CACHE_SIZE / 2);
 
     // check that erased entries were deleted and other ones are still in cache
     for (size_t i = 0; i < CACHE_SIZE; ++i) {
         if ((i % 2) == 0) {
-            ASSERT_FALSE(cache.get(i));
+            ASSERT_FALSE(this->cache.get(i));
         } else {
-            ASSERT_TRUE(cache.get(i));
+            ASSERT_TRUE(this->cache.get(i));
         }
     }
 }
 
-TEST_F(lru_cache_test, make_lru) {
-    auto acc = cache.get(CACHE_SIZE - 1);
+TYPED_TEST(lru_cache_test, make_lru) {
+    auto acc = this->cache.get(CACHE_SIZE - 1);
     ASSERT_TRUE(acc);
-    cache.make_lru(acc);
-    cache.insert(1234, "1234");
+    this->cache.make_lru(acc);
+    this->cache.insert(1234, "1234");
 
     // Check that the MRU entry that has been made LRU has been pushed out of the cache
-    ASSERT_FALSE(cache.get(CACHE_SIZE - 1));
-    ASSERT_TRUE(cache.get(1234));
-    ASSERT_EQ(CACHE_SIZE, cache.size());
+    ASSERT_FALSE(this->cache.get(CACHE_SIZE - 1));
+    ASSERT_TRUE(this->cache.get(1234));
+    ASSERT_EQ(CACHE_SIZE, this->cache.size());
 }
 
-TEST_F(lru_cache_test, displace_order) {
+TYPED_TEST(lru_cache_test, displace) {
+    // check that the entry displaced on demand is the least recently used one
+    this->cache.get(0);
+    for (size_t i = 1; i < CACHE_SIZE; ++i) {
+        auto n = this->cache.displace();
+        ASSERT_TRUE(n);
+        ASSERT_EQ(n->first, (int) i);
+        ASSERT_EQ(n->second, std::to_string(i));
+        ASSERT_FALSE(this->cache.get(i));
+    }
+    ASSERT_EQ(this->cache.size(), 1u);
+    ASSERT_TRUE(this->cache.displace());
+    ASSERT_FALSE(this->cache.displace());
+}
+
+TYPED_TEST(lru_cache_test, for_each) {
+    // check that the entries are visited from the least recently used one
+    this->cache.get(0);
+    size_t i = 1;
+    this->cache.for_each([&i] (const auto &n) {
+        ASSERT_EQ(n.first, (int) (i % CACHE_SIZE));
+        ASSERT_EQ(n.second, std::to_string(i % CACHE_SIZE));
+        ++i;
+    });
+    ASSERT_EQ(i, CACHE_SIZE + 1);
+
+    // check that visiting does not refresh entries
+    this->cache.insert(CACHE_SIZE, std::to_string(CACHE_SIZE));
+    ASSERT_FALSE(this->cache.get(1));
+}
+
+TYPED_TEST(lru_cache_test, displace_order) {
     // check that the least recent used values are being displaced first
     size_t j = 0;
     size_t i = CACHE_SIZE;
     for (; i < CACHE_SIZE * 2; ++i, ++j) {
-        cache.insert(i, std::to_string(i));
-        ASSERT_FALSE(cache.get(j));
+        this->cache.insert(i, std::to_string(i));
+        ASSERT_FALSE(this->cache.get(j));
     }
 }
 
-TEST_F(lru_cache_test, refresh_on_insert) {
+TYPED_TEST(lru_cache_test, refresh_on_insert) {
     // check that inserting existing key refreshes entry
-    cache.insert(0, "42");
-    cache.insert(CACHE_SIZE, std::to_string(CACHE_SIZE));
+    this->cache.insert(0, "42");
+    this->cache.insert(CACHE_SIZE, std::to_string(CACHE_SIZE));
 
-    ASSERT_TRUE(cache.get(0));
-    ASSERT_EQ(*cache.get(0), "42");
-    ASSERT_FALSE(cache.get(1));
-    ASSERT_TRUE(cache.get(CACHE_SIZE));
+    ASSERT_TRUE(this->cache.get(0));
+    ASSERT_EQ(*this->cache.get(0), "42");
+    ASSERT_FALSE(this->cache.get(1));
+    ASSERT_TRUE(this->cache.get(CACHE_SIZE));
 }
 
-TEST_F(lru_cache_test, refresh_on_get) {
+TYPED_TEST(lru_cache_test, refresh_on_get) {
     // check that getting key refreshes entry
-    ASSERT_TRUE(cache.get(0));
-    cache.insert(CACHE_SIZE, std::to_string(CACHE_SIZE));
+    ASSERT_TRUE(this->cache.get(0));
+    this->cache.insert(CACHE_SIZE, std::to_string(CACHE_SIZE));
 
-    ASSERT_TRUE(cache.get(0));
-    ASSERT_FALSE(cache.get(1));
-    ASSERT_TRUE(cache.get(CACHE_SIZE));
+    ASSERT_TRUE(this->cache.get(0));
+    ASSERT_FALSE(this->cache.get(1));
+    ASSERT_TRUE(this->cache.get(CACHE_SIZE));
 }
 
-TEST_F(lru_cache_test, update_capacity) {
+TYPED_TEST(lru_cache_test, update_capacity) {
     // check that changing capacity to lower value removes LRU entries
+    this->cache.set_capacity(CACHE_SIZE / 2);
+    ASSERT_EQ(this->cache.size(), CACHE_SIZE / 2);
+
+    for (size_t i = 0; i < CACHE_SIZE / 2; ++i) {
+        ASSERT_FALSE(this->cache.get(i)) << i << std::endl;
+    }
+}
+
+TEST(flat_lru_cache_test, same_as_lru_cache) {
+    // random operations on a small key space with a lot of index collisions and deletions
+    // must give the same results as the node-based cache
+    ag::lru_cache<int, int> expected(64);
+    ag::flat_lru_cache<int, int> cache(64);
+    std::mt19937 rng(42);
+    for (int i = 0; i < 100000; ++i) {
+        int key = rng() % 256;
+        switch (rng() % 8) {
+        case 0:
+            expected.erase(key);
+            cache.erase(key);
+            break;
+        case 1: {
+            auto e = expected.displace();
+            auto n = cache.displace();
+            ASSERT_EQ(e.has_value(), n.has_value());
+            if (e.has_value()) {
+                ASSERT_EQ(e->first, n->first);
+            }
+            break;
+        }
+        case 2:
+            if (auto e = expected.get(key); e) {
+                expected.make_lru(e);
+                cache.make_lru(cache.get(key));
+            }
+            break;
+        case 3:
+        case 4:
+            ASSERT_EQ(expected.insert(key, i), cache.insert(key, i));
+            break;
+        default: {
+            auto e = expected.get(key);
+            auto n = cache.get(key);
+            ASSERT_EQ(bool(e), bool(n)) << key;
+            if (e) {
+                ASSERT_EQ(*e, *n);
+            }
+            break;
+        }
+        }
+        ASSERT_EQ(expected.size(), cache.size());
+    }
+
+    // growing the capacity keeps the entries and their order
+    cache.set_capacity(128);
+    expected.set_capacity(128);
+    ASSERT_EQ(expected.size(), cache.size());
+    while (auto e = expected.displace()) {
+        ASSERT_EQ(e->first, cache.displace()->first);
+    }
+}
+
+class s3fifo_cache_test : public ::testing::Test {
+public:
+    s3fifo_cache_test() : cache(CACHE_SIZE) {}
+
+protected:
+    ag::lru_cache<int, std::string, ag::s3fifo_policy> cache;
+};
+
+TEST_F(s3fifo_cache_test, insert_get_erase) {
+    for (size_t i = 0; i < CACHE_SIZE * 2; ++i) {
+        ASSERT_TRUE(cache.insert(i, std::to_string(i)));
+        ASSERT_EQ(cache.size(), std::min(i + 1, CACHE_SIZE));
+    }
+    ASSERT_FALSE(cache.insert(CACHE_SIZE * 2 - 1, "42"));
+    ASSERT_EQ(*cache.get(CACHE_SIZE * 2 - 1), "42");
+
+    cache.erase(CACHE_SIZE * 2 - 1);
+    ASSERT_FALSE(cache.get(CACHE_SIZE * 2 - 1));
+    ASSERT_EQ(cache.size(), CACHE_SIZE - 1);
+
     cache.set_capacity(CACHE_SIZE / 2);
     ASSERT_EQ(cache.size(), CACHE_SIZE / 2);
 
+    cache.clear();
+    ASSERT_EQ(cache.size(), 0u);
+    ASSERT_FALSE(cache.displace());
+}
+
+TEST_F(s3fifo_cache_test, scan_resistance) {
+    // the entries accessed repeatedly survive a scan of the entries accessed once,
+    // which would flush an LRU cache
+    for (size_t i = 0; i < CACHE_SIZE / 2; ++i) {
+        cache.insert(i, std::to_string(i));
+        cache.get(i);
+    }
+    for (size_t i = CACHE_SIZE; i < CACHE_SIZE * 10; ++i) {
+        cache.insert(i, std::to_string(i));
+        ASSERT_EQ(cache.size(), std::min(i - CACHE_SIZE / 2 + 1, CACHE_SIZE));
+    }
+    for (size_t i = 0; i < CACHE_SIZE / 2; ++i) {
+        ASSERT_TRUE(cache.get(i)) << i;
+    }
+}
+
+TEST_F(s3fifo_cache_test, ghost_readmission) {
+    // an entry displaced without being accessed goes straight to the main queue
+    // if it is inserted again soon, so it survives the following scan
+    for (size_t i = 0; i < CACHE_SIZE; ++i) {
+        cache.insert(i, std::to_string(i));
+    }
+    cache.insert(CACHE_SIZE, std::to_string(CACHE_SIZE));
+    ASSERT_FALSE(cache.get(0));
+    cache.insert(0, "0");
+    for (size_t i = CACHE_SIZE + 1; i < CACHE_SIZE * 3; ++i) {
+        cache.insert(i, std::to_string(i));
+    }
+    ASSERT_TRUE(cache.get(0));
+}
+
+TEST_F(s3fifo_cache_test, make_lru) {
+    for (size_t i = 0; i < CACHE_SIZE; ++i) {
+        cache.insert(i, std::to_string(i));
+        cache.get(i);
+    }
+    auto acc = cache.get(CACHE_SIZE / 2);
+    ASSERT_TRUE(acc);
+    cache.make_lru(acc);
+    auto n = cache.displace();
+    ASSERT_TRUE(n);
+    ASSERT_EQ(n->first, (int) CACHE_SIZE / 2);
+}
+
+TEST_F(s3fifo_cache_test, update_keeps_place) {
+    // the entries accessed repeatedly and then updated still survive a scan
+    for (size_t i = 0; i < CACHE_SIZE / 2; ++i) {
+        cache.insert(i, std::to_string(i));
+        cache.get(i);
+    }
+    for (size_t i = 0; i < CACHE_SIZE / 2; ++i) {
+        ASSERT_TRUE(cache.update(i, [] (std::string &v) { v += "!"; }));
+    }
+    ASSERT_FALSE(cache.update(CACHE_SIZE, [] (std::string &) {}));
+    for (size_t i = CACHE_SIZE; i < CACHE_SIZE * 10; ++i) {
+        cache.insert(i, std::to_string(i));
+    }
     for (size_t i = 0; i < CACHE_SIZE / 2; ++i) {
-        ASSERT_FALSE(cache.get(i)) << i << std::endl;
+        auto acc = cache.get(i);
+        ASSERT_TRUE(acc) << i;
+        ASSERT_EQ(*acc, std::to_string(i) + "!");
     }
 }
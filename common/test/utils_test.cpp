@@ -1,4 +1,6 @@
 #include <gtest/gtest.h>
+#include <cstdio>
+#include <ag_file.h>
 #include <ag_utils.h>
 #include <ag_net_utils.h>
 #include <ag_socket_address.h>
@@ -30,3 +32,58 @@ TEST(net_utils, generally_work) {
     ASSERT_TRUE(ag::utils::str_to_socket_address("[::1]").valid());
     ASSERT_TRUE(ag::utils::str_to_socket_address("[::1]:80").valid());
 }
+
+TEST(utils, find_line_break) {
+    ASSERT_EQ(ag::utils::find_line_break(""), std::string_view::npos);
+    ASSERT_EQ(ag::utils::find_line_break("no line breaks in this fairly long string"), std::string_view::npos);
+    for (size_t i = 0; i < 40; ++i) {
+        std::string str(40, 'a');
+        str[i] = (i % 2) ? '\r' : '\n';
+        ASSERT_EQ(ag::utils::find_line_break(str), i);
+    }
+}
+
+using line_list = std::vector<std::pair<uint32_t, std::string>>;
+
+static bool collect_line(uint32_t pos, std::string_view line, void *arg) {
+    ((line_list *)arg)->emplace_back(pos, line);
+    return true;
+}
+
+TEST(utils, for_each_line) {
+    static const std::string FILE_NAME = "for_each_line_test.txt";
+
+    // lines crossing the file reading chunk boundaries
+    std::string content = " first line \r\n\n" + std::string(100 * 1024, 'a') + "\n";
+    for (size_t i = 0; i < 10000; ++i) {
+        content += "\tline " + std::to_string(i) + ((i % 3) ? "\n" : "\r\n");
+    }
+    content += "last";
+
+    line_list expected = { { 0, "first line" }, { 13, "" }, { 14, "" }, { 15, std::string(100 * 1024, 'a') } };
+    line_list from_string;
+    ASSERT_EQ(0, ag::utils::for_each_line(content, &collect_line, &from_string));
+    ASSERT_GT(from_string.size(), expected.size());
+    ASSERT_TRUE(std::equal(expected.begin(), expected.end(), from_string.begin()));
+    ASSERT_EQ(from_string.back(), std::make_pair((uint32_t)content.length() - 4, std::string("last")));
+    for (const auto &[pos, line] : from_string) {
+        ASSERT_EQ(line, ag::utils::read_line(content, pos).value()) << pos;
+    }
+
+    std::remove(FILE_NAME.c_str());
+    ag::file::handle file = ag::file::open(FILE_NAME, ag::file::CREAT | ag::file::WRONLY);
+    ASSERT_TRUE(ag::file::is_valid(file));
+    ASSERT_EQ((int)content.length(), ag::file::write(file, content.data(), content.length()));
+    ag::file::close(file);
+
+    file = ag::file::open(FILE_NAME, ag::file::RDONLY);
+    ASSERT_TRUE(ag::file::is_valid(file));
+    line_list from_file;
+    ASSERT_LE(0, ag::file::for_each_line(file, &collect_line, &from_file));
+    ASSERT_EQ(from_string, from_file);
+    for (const auto &[pos, line] : from_file) {
+        ASSERT_EQ(line, ag::file::read_line(file, pos).value()) << pos;
+    }
+    ag::file::close(file);
+    std::remove(FILE_NAME.c_str());
+}
@@ -77,6 +77,39 @@ public:
      */
     std::vector<rule> match(handle obj, std::string_view domain);
 
+    /**
+     * Match domain against the rules of the specified filters only
+     * @detail     Allows a single engine with all the lists loaded to serve several clients,
+     *             each of which has its own subset of the lists enabled
+     * @param[in]  obj         filtering engine handle
+     * @param[in]  domain      domain to be matched
+     * @param[in]  filter_ids  ids of the enabled filters (the filters with other ids are skipped)
+     * @return     List of matched rules (see `match(handle, std::string_view)`)
+     */
+    std::vector<rule> match(handle obj, std::string_view domain, const std::vector<int32_t> &filter_ids);
+
+    /**
+     * Match IP address against added rules
+     * @detail     Unlike matching the text representation of the address, the filters
+     *             are looked up by the raw address, so the network rules (e.g. `192.168.0.0/16`)
+     *             are matched with no text conversions, unless a filter contains some rules
+     *             which may match the address text (e.g. `192.168.*`)
+     * @param[in]  obj      filtering engine handle
+     * @param[in]  address  address to be matched (4 or 16 bytes)
+     * @return     List of matched rules (see `match(handle, std::string_view)`)
+     */
+    std::vector<rule> match_ip(handle obj, uint8_view address);
+
+    /**
+     * Match IP address against the rules of the specified filters only
+     * (see `match(handle, std::string_view, const std::vector<int32_t> &)`)
+     * @param[in]  obj         filtering engine handle
+     * @param[in]  address     address to be matched (4 or 16 bytes)
+     * @param[in]  filter_ids  ids of the enabled filters (the filters with other ids are skipped)
+     * @return     List of matched rules (see `match(handle, std::string_view)`)
+     */
+    std::vector<rule> match_ip(handle obj, uint8_view address, const std::vector<int32_t> &filter_ids);
+
     /**
      * Select the rules which should be applied to the request
      * @detail     In the case of several rules which have hosts file syntax were matched this
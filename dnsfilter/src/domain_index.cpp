@@ -0,0 +1,226 @@
+#include <algorithm>
+#include "domain_index.h"
+
+
+// Slot value flag meaning the value is an offset of the positions list in `multi_positions`
+static constexpr uint32_t MULTI_FLAG = UINT32_C(1) << 31;
+// Pilot flag meaning the pilot contains the slot index itself (used for the single-key buckets)
+static constexpr uint32_t DIRECT_PILOT_FLAG = UINT32_C(1) << 31;
+
+// Average number of keys per bucket: the greater it is, the less memory the pilots occupy,
+// but the longer it takes to find the displacements
+static constexpr size_t AVG_BUCKET_SIZE = 4;
+// Maximum number of displacements to try for a bucket before giving up with the current seed
+static constexpr uint32_t MAX_BUCKET_TRIES = UINT32_C(1) << 24;
+// Number of seeds to try before the build is considered failed
+static constexpr size_t MAX_SEED_TRIES = 8;
+
+
+// Finalizer of MurmurHash3
+static inline uint64_t mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= UINT64_C(0xff51afd7ed558ccd);
+    x ^= x >> 33;
+    x *= UINT64_C(0xc4ceb9fe1a85ec53);
+    x ^= x >> 33;
+    return x;
+}
+
+struct key_hashes {
+    uint32_t bucket;
+    uint64_t hash;
+};
+
+static inline key_hashes hash_key(uint64_t fp, uint64_t seed, size_t buckets_num) {
+    uint64_t h = mix(fp ^ seed);
+    return { (uint32_t)((h >> 32) % buckets_num), h };
+}
+
+static inline uint32_t slot_index(const key_hashes &h, uint32_t displacement, size_t slots_num) {
+    return (uint32_t)(mix(h.hash ^ (displacement * UINT64_C(0x9e3779b97f4a7c15))) % slots_num);
+}
+
+static inline uint32_t check_value(uint64_t fp) {
+    return (uint32_t)(fp >> 32);
+}
+
+
+uint64_t domain_index::fingerprint(std::string_view domain) {
+    // FNV-1a
+    uint64_t h = UINT64_C(0xcbf29ce484222325);
+    for (unsigned char c : domain) {
+        h ^= c;
+        h *= UINT64_C(0x100000001b3);
+    }
+    return mix(h);
+}
+
+bool domain_index::build(std::vector<entry> entries) {
+    *this = {};
+
+    std::sort(entries.begin(), entries.end(),
+        [] (const entry &l, const entry &r) {
+            return l.fingerprint < r.fingerprint || (l.fingerprint == r.fingerprint && l.file_idx < r.file_idx);
+        });
+    entries.erase(std::unique(entries.begin(), entries.end(),
+            [] (const entry &l, const entry &r) {
+                return l.fingerprint == r.fingerprint && l.file_idx == r.file_idx;
+            }),
+        entries.end());
+
+    // fingerprint -> slot value
+    std::vector<std::pair<uint64_t, uint32_t>> keys;
+    for (size_t i = 0; i < entries.size();) {
+        size_t j = i + 1;
+        while (j < entries.size() && entries[j].fingerprint == entries[i].fingerprint) {
+            ++j;
+        }
+
+        uint32_t value;
+        if (j - i == 1 && !(entries[i].file_idx & MULTI_FLAG)) {
+            value = entries[i].file_idx;
+        } else {
+            // positions with the highest bit set do not fit in a slot, so they go to the lists too
+            value = MULTI_FLAG | (uint32_t)this->multi_positions.size();
+            this->multi_positions.push_back(j - i);
+            for (size_t k = i; k < j; ++k) {
+                this->multi_positions.push_back(entries[k].file_idx);
+            }
+            this->multi_rule_domains += (j - i > 1) ? 1 : 0;
+        }
+        keys.emplace_back(entries[i].fingerprint, value);
+
+        i = j;
+    }
+    entries = {};
+    this->multi_positions.shrink_to_fit();
+
+    if (keys.empty()) {
+        return true;
+    }
+
+    for (size_t i = 0; i < MAX_SEED_TRIES; ++i) {
+        if (this->place(keys, mix(i + 1))) {
+            return true;
+        }
+    }
+
+    *this = {};
+    return false;
+}
+
+bool domain_index::place(const std::vector<std::pair<uint64_t, uint32_t>> &keys, uint64_t seed) {
+    size_t slots_num = keys.size();
+    size_t buckets_num = slots_num / AVG_BUCKET_SIZE + 1;
+
+    // distribute the keys among the buckets
+    std::vector<key_hashes> hashes(keys.size());
+    std::vector<uint32_t> bucket_starts(buckets_num + 1, 0);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        hashes[i] = hash_key(keys[i].first, seed, buckets_num);
+        ++bucket_starts[hashes[i].bucket + 1];
+    }
+    for (size_t i = 0; i < buckets_num; ++i) {
+        bucket_starts[i + 1] += bucket_starts[i];
+    }
+    std::vector<uint32_t> bucket_keys(keys.size());
+    {
+        std::vector<uint32_t> fill(bucket_starts.begin(), bucket_starts.end() - 1);
+        for (size_t i = 0; i < keys.size(); ++i) {
+            bucket_keys[fill[hashes[i].bucket]++] = i;
+        }
+    }
+
+    // the largest buckets are placed first while there are plenty of free slots
+    std::vector<uint32_t> buckets_order(buckets_num);
+    for (size_t i = 0; i < buckets_num; ++i) {
+        buckets_order[i] = i;
+    }
+    auto bucket_size = [&bucket_starts] (uint32_t b) { return bucket_starts[b + 1] - bucket_starts[b]; };
+    std::stable_sort(buckets_order.begin(), buckets_order.end(),
+        [&bucket_size] (uint32_t l, uint32_t r) { return bucket_size(l) > bucket_size(r); });
+
+    std::vector<uint32_t> pilots(buckets_num, 0);
+    std::vector<slot> slots(slots_num);
+    std::vector<bool> taken(slots_num, false);
+    std::vector<uint32_t> bucket_slots;
+    size_t next_free_slot = 0;
+    for (uint32_t b : buckets_order) {
+        size_t size = bucket_size(b);
+        if (size == 0) {
+            break;
+        }
+
+        const uint32_t *bucket = &bucket_keys[bucket_starts[b]];
+        if (size == 1) {
+            // single-key buckets go last, so just fill the remaining slots in order
+            while (taken[next_free_slot]) {
+                ++next_free_slot;
+            }
+            uint32_t s = next_free_slot;
+            taken[s] = true;
+            pilots[b] = DIRECT_PILOT_FLAG | s;
+            slots[s] = { check_value(keys[bucket[0]].first), keys[bucket[0]].second };
+            continue;
+        }
+
+        bool placed = false;
+        for (uint32_t d = 0; d < MAX_BUCKET_TRIES && !placed; ++d) {
+            bucket_slots.clear();
+            for (size_t i = 0; i < size; ++i) {
+                uint32_t s = slot_index(hashes[bucket[i]], d, slots_num);
+                if (taken[s] || bucket_slots.end() != std::find(bucket_slots.begin(), bucket_slots.end(), s)) {
+                    break;
+                }
+                bucket_slots.push_back(s);
+            }
+            if (bucket_slots.size() != size) {
+                continue;
+            }
+
+            for (size_t i = 0; i < size; ++i) {
+                uint32_t s = bucket_slots[i];
+                taken[s] = true;
+                slots[s] = { check_value(keys[bucket[i]].first), keys[bucket[i]].second };
+            }
+            pilots[b] = d;
+            placed = true;
+        }
+        if (!placed) {
+            return false;
+        }
+    }
+
+    this->seed = seed;
+    this->pilots = std::move(pilots);
+    this->slots = std::move(slots);
+    return true;
+}
+
+domain_index::positions domain_index::find(uint64_t fp) const {
+    if (this->slots.empty()) {
+        return {};
+    }
+
+    key_hashes h = hash_key(fp, this->seed, this->pilots.size());
+    uint32_t pilot = this->pilots[h.bucket];
+    uint32_t idx = (pilot & DIRECT_PILOT_FLAG)
+        ? (pilot & ~DIRECT_PILOT_FLAG)
+        : slot_index(h, pilot, this->slots.size());
+    const slot &s = this->slots[idx];
+    if (s.check != check_value(fp)) {
+        return {};
+    }
+
+    if (!(s.value & MULTI_FLAG)) {
+        return { &s.value, &s.value + 1 };
+    }
+    const uint32_t *list = &this->multi_positions[s.value & ~MULTI_FLAG];
+    return { list + 1, list + 1 + list[0] };
+}
+
+size_t domain_index::mem_usage() const {
+    return this->pilots.capacity() * sizeof(uint32_t)
+        + this->slots.capacity() * sizeof(slot)
+        + this->multi_positions.capacity() * sizeof(uint32_t);
+}
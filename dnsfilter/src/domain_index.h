@@ -0,0 +1,99 @@
+#pragma once
+
+
+#include <cstdint>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+
+/**
+ * Read-only index of the domain rules built on a minimal perfect hash function over
+ * 64-bit domain fingerprints.
+ * Every indexed domain occupies exactly one slot, which contains either the file position
+ * of the only rule for the domain, or a reference to the list of positions in case there are
+ * several rules for the domain. So a lookup costs a single slot probe regardless of the rules number.
+ * The index is intended to be built once after the rule list is loaded and never modified.
+ */
+class domain_index {
+public:
+    // A domain fingerprint with the file position of the rule containing the domain
+    struct entry {
+        uint64_t fingerprint; // see `domain_index::fingerprint`
+        uint32_t file_idx; // rule file position
+    };
+
+    // Range of the file positions of the rules found for a domain
+    struct positions {
+        const uint32_t *first;
+        const uint32_t *last;
+
+        const uint32_t *begin() const { return this->first; }
+        const uint32_t *end() const { return this->last; }
+        bool empty() const { return this->first == this->last; }
+    };
+
+    /**
+     * Calculate the fingerprint of a domain
+     * @param      domain  domain name (expected to be in lower case)
+     * @return     64-bit fingerprint
+     */
+    static uint64_t fingerprint(std::string_view domain);
+
+    /**
+     * Build the index replacing the current contents
+     * @param      entries  list of the domain entries (duplicates are allowed)
+     * @return     True if built successfully, false otherwise
+     */
+    bool build(std::vector<entry> entries);
+
+    /**
+     * Find the rules for a domain
+     * @param      domain  domain name (expected to be in lower case)
+     * @return     Range of the rule file positions (empty if the domain is not in the index)
+     */
+    positions find(std::string_view domain) const {
+        return this->find(fingerprint(domain));
+    }
+
+    /**
+     * Find the rules for a domain fingerprint
+     * @param      fp    domain fingerprint
+     * @return     Range of the rule file positions (empty if the domain is not in the index)
+     */
+    positions find(uint64_t fp) const;
+
+    /**
+     * Get the number of indexed domains
+     */
+    size_t size() const { return this->slots.size(); }
+
+    /**
+     * Get the number of indexed domains having several rules
+     */
+    size_t multi_rule_domains_num() const { return this->multi_rule_domains; }
+
+    /**
+     * Get the number of bytes occupied by the index
+     */
+    size_t mem_usage() const;
+
+private:
+    struct slot {
+        uint32_t check; // upper half of the fingerprint to filter out the domains which are not indexed
+        uint32_t value; // rule file position or offset in `multi_positions` (see `MULTI_FLAG`)
+    };
+
+    bool place(const std::vector<std::pair<uint64_t, uint32_t>> &keys, uint64_t seed);
+
+    // Seed of the hash functions the index was built with
+    uint64_t seed = 0;
+    // Bucket -> displacement used to find the slot of a key from the bucket
+    std::vector<uint32_t> pilots;
+    // Exactly one slot per indexed domain
+    std::vector<slot> slots;
+    // Lists of the rule file positions for the domains having several rules,
+    // each list is prefixed with its length
+    std::vector<uint32_t> multi_positions;
+    size_t multi_rule_domains = 0;
+};
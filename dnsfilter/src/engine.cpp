@@ -4,6 +4,7 @@
 #include "filter.h"
 #include "rule_utils.h"
 #include <ag_utils.h>
+#include <ag_net_utils.h>
 #include <unordered_set>
 
 using namespace ag;
@@ -79,15 +80,27 @@ void dnsfilter::destroy(handle obj) {
     delete e;
 }
 
-std::vector<dnsfilter::rule> dnsfilter::match(handle obj, std::string_view domain) {
-    engine *e = (engine *)obj;
+/**
+ * @param filter_ids ids of the enabled filters (if null, all the filters are enabled)
+ */
+static bool is_filter_enabled(const filter &f, const std::vector<int32_t> *filter_ids) {
+    return filter_ids == nullptr
+            || filter_ids->end() != std::find(filter_ids->begin(), filter_ids->end(), f.params.id);
+}
 
+/**
+ * @param filter_ids ids of the filters to match against (if null, all the filters are matched)
+ */
+static std::vector<dnsfilter::rule> match_filters(engine *e, std::string_view domain,
+                                                  const std::vector<int32_t> *filter_ids) {
     tracelog(e->log, "Matching {}", domain);
 
     filter::match_context context = filter::create_match_context(domain);
 
     for (filter &f : e->filters) {
-        f.match(context);
+        if (is_filter_enabled(f, filter_ids)) {
+            f.match(context);
+        }
     }
 
     tracelog(e->log, "Matched {} rules", context.matched_rules.size());
@@ -95,6 +108,48 @@ std::vector<dnsfilter::rule> dnsfilter::match(handle obj, std::string_view domai
     return context.matched_rules;
 }
 
+/**
+ * @param filter_ids ids of the filters to match against (if null, all the filters are matched)
+ */
+static std::vector<dnsfilter::rule> match_ip_filters(engine *e, uint8_view address,
+                                                     const std::vector<int32_t> *filter_ids) {
+    bool need_text = std::any_of(e->filters.begin(), e->filters.end(),
+        [filter_ids] (const filter &f) { return is_filter_enabled(f, filter_ids) && f.has_address_text_rules(); });
+    if (need_text) {
+        return match_filters(e, utils::addr_to_str(address), filter_ids);
+    }
+
+    filter::match_context context = filter::create_match_context(address);
+
+    for (filter &f : e->filters) {
+        if (is_filter_enabled(f, filter_ids)) {
+            f.match(context);
+        }
+    }
+
+    tracelog(e->log, "Matched {} rules", context.matched_rules.size());
+
+    return context.matched_rules;
+}
+
+std::vector<dnsfilter::rule> dnsfilter::match_ip(handle obj, uint8_view address) {
+    return match_ip_filters((engine *)obj, address, nullptr);
+}
+
+std::vector<dnsfilter::rule> dnsfilter::match_ip(handle obj, uint8_view address,
+                                                 const std::vector<int32_t> &filter_ids) {
+    return match_ip_filters((engine *)obj, address, &filter_ids);
+}
+
+std::vector<dnsfilter::rule> dnsfilter::match(handle obj, std::string_view domain) {
+    return match_filters((engine *)obj, domain, nullptr);
+}
+
+std::vector<dnsfilter::rule> dnsfilter::match(handle obj, std::string_view domain,
+                                              const std::vector<int32_t> &filter_ids) {
+    return match_filters((engine *)obj, domain, &filter_ids);
+}
+
 static bool has_higher_priority(const dnsfilter::rule &l, const dnsfilter::rule &r) {
     // in ascending order (the higher index, the higher priority)
     static constexpr std::bitset<dnsfilter::RP_NUM> PRIORITY_TABLE[] = {
@@ -1,5 +1,6 @@
 #include <string_view>
 #include <cstdlib>
+#include <cstring>
 #include <cinttypes>
 #include <algorithm>
 #include <cassert>
@@ -9,9 +10,12 @@
 #include <ag_utils.h>
 #include <ag_file.h>
 #include <ag_sys.h>
+#include <ag_socket_address.h>
 #include <dnsfilter.h>
 #include <khash.h>
 #include "filter.h"
+#include "domain_index.h"
+#include "ip_index.h"
 #include "rule_utils.h"
 
 
@@ -25,6 +29,30 @@ static constexpr double APPROX_FRAGMENTATION_COEF = 1.5;
 
 static constexpr size_t SHORTCUT_LENGTH = 5;
 
+// node + rule position (there are usually not so many IP rules to care about the tree structure)
+static constexpr size_t APPROX_IP_RULE_BYTES = 64;
+
+static constexpr std::string_view ADDRESS_CHARS = "0123456789abcdefABCDEF.:";
+
+// Check if a string may be an IP address (the IP address parser is much more expensive)
+static inline bool may_be_address(std::string_view str) {
+    return !str.empty() && (std::isdigit((unsigned char)str.front()) || str.npos != str.find(':'))
+        && str.npos == str.find_first_not_of(ADDRESS_CHARS);
+}
+
+// Check if a domain rule part which is not an address itself may match the text representation
+// of an IP address as a domain, e.g. `||3.4^` matches `1.2.3.4`. Such a part may only consist of
+// the dot-separated decimal labels, since there are no dots in the other parts of the address text.
+static inline bool may_match_address_labels(std::string_view part) {
+    return !part.empty() && part.npos == part.find_first_not_of("0123456789.");
+}
+
+// Check if the rule shortcuts may be found in the text representation of an IP address
+static inline bool may_match_address(const std::vector<std::string> &shortcuts) {
+    return shortcuts.end() == std::find_if(shortcuts.begin(), shortcuts.end(),
+        [] (const std::string &sc) { return sc.npos != sc.find_first_not_of(ADDRESS_CHARS); });
+}
+
 KHASH_MAP_INIT_INT(hash_to_unique_index, uint32_t)
 KHASH_MAP_INIT_INT(hash_to_indexes, std::vector<uint32_t>*)
 
@@ -66,26 +94,63 @@ struct leftover_entry {
     uint32_t file_idx; // file index
 };
 
+// Map a character to its bit in `filter::signature::chars`.
+// Characters allowed in domain names get their own bits, the rest share the remaining ones.
+static constexpr uint32_t signature_char_bit(uint8_t c) {
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a';
+    }
+    if (c >= '0' && c <= '9') {
+        return 26 + (c - '0');
+    }
+    switch (c) {
+    case '-':
+        return 36;
+    case '.':
+        return 37;
+    case '_':
+        return 38;
+    default:
+        return 39 + c % 25;
+    }
+}
+
+// Map a pair of adjacent characters to its bit in `filter::signature::bigrams`
+static constexpr uint32_t signature_bigram_bit(uint8_t c1, uint8_t c2) {
+    return ((c1 * 31u) ^ c2) % 64;
+}
+
+static filter::signature make_shortcuts_signature(const std::vector<std::string> &shortcuts) {
+    filter::signature sig = {};
+    for (const std::string &sc : shortcuts) {
+        sig |= filter::signature::of(sc);
+    }
+    return sig;
+}
+
+filter::signature filter::signature::of(std::string_view str) {
+    signature sig = {};
+    for (size_t i = 0; i < str.length(); ++i) {
+        sig.chars |= UINT64_C(1) << signature_char_bit(str[i]);
+        if (i > 0) {
+            sig.bigrams |= UINT64_C(1) << signature_bigram_bit(str[i - 1], str[i]);
+        }
+    }
+    return sig;
+}
+
 class filter::impl {
 public:
     impl()
-        : unique_domains_table(kh_init(hash_to_unique_index))
-        , domains_table(kh_init(hash_to_indexes))
-        , shortcuts_table(kh_init(hash_to_indexes))
+        : shortcuts_table(kh_init(hash_to_indexes))
         , badfilter_table(kh_init(hash_to_unique_index))
     {}
 
     ~impl() {
-        destroy_unique_index_table(this->unique_domains_table);
-        destroy_multi_index_table(this->domains_table);
         destroy_multi_index_table(this->shortcuts_table);
         destroy_unique_index_table(this->badfilter_table);
     }
 
-    void put_hash_into_tables(uint32_t hash, uint32_t file_idx,
-                              kh_hash_to_unique_index_t *unique_table,
-                              kh_hash_to_indexes_t *multi_table);
-
     struct load_line_arg {
         impl *filter;
         size_t approx_mem;  // approximate usage so far
@@ -101,20 +166,18 @@ public:
     void search_by_shortcuts(match_arg &match) const;
     void search_in_leftovers(match_arg &match) const;
     void search_badfilter_rules(match_arg &match) const;
+    void search_ip_rules(match_arg &match) const;
 
     ag::logger log;
 
-    // unique domain -> rule string file index
-    // This table contains indexes of the rules that match exact domains (and their subdomains)
+    // domain -> rule string file indexes
+    // This index contains indexes of the rules that match exact domains (and their subdomains)
     // (e.g. `example.org`, but for example not `example.org|` or `example.org^` as they
     // match `eeexample.org` as well)
-    // As the lion's share of rule domains are unique, using a separate table
-    // for such domains saves a lot of memory
-    kh_hash_to_unique_index_t *unique_domains_table;
-    // non-unique domain -> list of rule string file indexes
-    // Similar to the previous one, but contains lists of indexes if the rules that match
-    // the same domain.
-    kh_hash_to_indexes_t *domains_table;
+    // It is built once the whole list is loaded (see `domain_index` for details)
+    domain_index domains_index;
+    // Domain entries collected while loading the list, the source of `domains_index`
+    std::vector<domain_index::entry> pending_domains;
 
     // shortcut -> rule string file index
     // Contains indexes of the rules that can be filtered out by checking, if matching domain
@@ -129,6 +192,16 @@ public:
     //   was not found (e.g. `ex*.com`)
     // - a regex rule with some complicated expression (see `rule_utils::parse` for details)
     std::vector<leftover_entry> leftovers_table;
+    // Signatures of the shortcuts of the corresponding `leftovers_table` entries.
+    // Kept apart from the entries, so that the lookup scans a contiguous array and
+    // touches an entry only if the matching domain signature contains the entry's one.
+    std::vector<filter::signature> leftover_signatures;
+
+    // Contains indexes of the rules that match IP addresses and networks
+    // (e.g. `|1.2.3.4|`, `0.0.0.0 1.2.3.4` or `1.2.3.0/24`)
+    ip_index ip_rules;
+    // Whether there are rules besides the IP ones, which may match an IP address text
+    bool has_address_text_rules = false;
 
     // rule text -> badfilter rule file index
     // Contains indexes of the badfilter rules that could be found by rule text without
@@ -152,55 +225,6 @@ filter &filter::operator=(filter &&other) {
     return *this;
 }
 
-void filter::impl::put_hash_into_tables(uint32_t hash, uint32_t file_idx,
-                                        kh_hash_to_unique_index_t *unique_table, kh_hash_to_indexes_t *multi_table) {
-    bool already_exists = false;
-    size_t stored_idx = 0;
-
-    int ret;
-    khiter_t iter = kh_get(hash_to_indexes, multi_table, hash);
-    if (iter == kh_end(multi_table)) {
-        // there is no such domain in non-unique table
-        iter = kh_put(hash_to_unique_index, unique_table, hash, &ret);
-        if (ret < 0) {
-            errlog(log, "Out of memory");
-            return;
-        }
-        already_exists = ret == 0;
-        if (!already_exists) {
-            // domain is unique - save index
-            kh_value(unique_table, iter) = file_idx;
-            return;
-        } else {
-            // we have one record for this domain - remove from unique table
-            stored_idx = kh_value(unique_table, iter);
-            kh_del(hash_to_unique_index, unique_table, iter);
-        }
-    }
-
-    // create record in non-unique table
-    iter = kh_put(hash_to_indexes, multi_table, hash, &ret);
-    if (ret < 0) {
-        errlog(log, "Out of memory");
-        return;
-    } else if (ret > 0) {
-        // the record is a new one
-        auto *positions = new(std::nothrow) std::vector<uint32_t>;
-        if (positions == nullptr) {
-            errlog(log, "Out of memory");
-            return;
-        }
-        kh_value(multi_table, iter) = positions;
-    }
-    std::vector<uint32_t> *positions = kh_value(multi_table, iter);
-    if (already_exists) {
-        // put previously stored unique index, if it existed
-        positions->reserve(positions->size() + 2);
-        positions->push_back(stored_idx);
-    }
-    positions->push_back(file_idx);
-}
-
 struct rules_stat {
     size_t simple_domain_rules;
     size_t shortcut_rules;
@@ -232,6 +256,8 @@ static bool count_rules(uint32_t idx, std::string_view line, void *arg) {
     case rule_utils::rule::MMID_REGEX:
         ++stat->leftover_rules;
         break;
+    case rule_utils::rule::MMID_CIDR:
+        break;
     }
 
     return true;
@@ -279,16 +305,35 @@ bool filter::impl::load_line(uint32_t file_idx, std::string_view line, void *arg
     switch (rule->match_method) {
     case rule_utils::rule::MMID_EXACT:
     case rule_utils::rule::MMID_SUBDOMAINS:
-        // count * (k + v) * empty buckets coef (assume non-unique domain rules are rare)
-        approx_rule_mem = rule->matching_parts.size() * 4 * sizeof(uint32_t);
+        // count * pending entry (the built index takes less than that)
+        approx_rule_mem = rule->matching_parts.size() * sizeof(domain_index::entry);
         CHECK_MEM();
         tracelog(self->log, "Placing a rule in domains table: {}", str);
         for (const std::string &d : rule->matching_parts) {
-            self->put_hash_into_tables(ag::utils::hash(d), file_idx, self->unique_domains_table, self->domains_table);
+            self->pending_domains.push_back({ domain_index::fingerprint(d), file_idx });
+            // IP addresses are also put in the IP rules index to be matched against raw addresses
+            if (std::optional<rule_utils::ip_network> net = may_be_address(d) ? rule_utils::parse_ip_network(d) : std::nullopt;
+                    net.has_value()) {
+                approx_rule_mem += APPROX_IP_RULE_BYTES;
+                self->ip_rules.insert({ net->addr.data(), net->addr.size() }, net->prefix_len, file_idx);
+            } else if (may_match_address_labels(d)) {
+                self->has_address_text_rules = true;
+            }
+        }
+        goto next_line;
+    case rule_utils::rule::MMID_CIDR:
+        approx_rule_mem = rule->matching_parts.size() * APPROX_IP_RULE_BYTES;
+        CHECK_MEM();
+        tracelog(self->log, "Placing a rule in IP rules index: {}", str);
+        for (const std::string &n : rule->matching_parts) {
+            if (std::optional<rule_utils::ip_network> net = rule_utils::parse_ip_network(n); net.has_value()) {
+                self->ip_rules.insert({ net->addr.data(), net->addr.size() }, net->prefix_len, file_idx);
+            }
         }
         goto next_line;
     case rule_utils::rule::MMID_SHORTCUTS:
     case rule_utils::rule::MMID_SHORTCUTS_AND_REGEX: {
+        self->has_address_text_rules = self->has_address_text_rules || may_match_address(rule->matching_parts);
         std::string_view sc = {};
         for (size_t i = 0; i < rule->matching_parts.size(); ++i) {
             const std::string &part = rule->matching_parts[i];
@@ -331,6 +376,10 @@ bool filter::impl::load_line(uint32_t file_idx, std::string_view line, void *arg
         [[fallthrough]];
     }
     case rule_utils::rule::MMID_REGEX: {
+        // there are no shortcuts to check against, so assume the worst
+        self->has_address_text_rules = self->has_address_text_rules
+                || rule->match_method == rule_utils::rule::MMID_REGEX
+                || may_match_address(rule->matching_parts);
         std::vector<std::string> shortcuts = std::move(rule->matching_parts);
         std::transform(shortcuts.begin(), shortcuts.end(), shortcuts.begin(), ag::utils::to_lower);
         std::optional<ag::regex> re = (rule->match_method == rule_utils::rule::MMID_SHORTCUTS)
@@ -338,8 +387,11 @@ bool filter::impl::load_line(uint32_t file_idx, std::string_view line, void *arg
                                       : std::make_optional(ag::regex(rule_utils::get_regex(*rule)));
         assert(!shortcuts.empty() || re.has_value());
         approx_rule_mem -= self->leftovers_table.capacity() * sizeof(leftover_entry);
+        approx_rule_mem -= self->leftover_signatures.capacity() * sizeof(filter::signature);
+        self->leftover_signatures.emplace_back(make_shortcuts_signature(shortcuts));
         self->leftovers_table.emplace_back(leftover_entry{ std::move(shortcuts), std::move(re), file_idx });
         approx_rule_mem += self->leftovers_table.capacity() * sizeof(leftover_entry);
+        approx_rule_mem += self->leftover_signatures.capacity() * sizeof(filter::signature);
         tracelog(self->log, "Rule placed in leftovers table: {}", str);
         for (auto &s : self->leftovers_table.back().shortcuts) {
             approx_rule_mem += s.size();
@@ -390,9 +442,10 @@ std::pair<filter::load_result, size_t> filter::load(const ag::dnsfilter::filter_
     }
 
     impl *f = this->pimpl.get();
-    kh_resize(hash_to_unique_index, f->unique_domains_table, stat.simple_domain_rules);
+    f->pending_domains.reserve(stat.simple_domain_rules);
     kh_resize(hash_to_indexes, f->shortcuts_table, kh_size(f->shortcuts_table));
     f->leftovers_table.reserve(stat.leftover_rules);
+    f->leftover_signatures.reserve(stat.leftover_rules);
     kh_resize(hash_to_unique_index, f->badfilter_table, stat.badfilter_rules);
 
     filter::impl::load_line_arg load_line_arg{};
@@ -413,17 +466,22 @@ std::pair<filter::load_result, size_t> filter::load(const ag::dnsfilter::filter_
         this->params = p;
     }
 
-    kh_resize(hash_to_unique_index, f->unique_domains_table, kh_size(f->unique_domains_table));
-    kh_resize(hash_to_indexes, f->domains_table, kh_size(f->domains_table));
+    if (!f->domains_index.build(std::move(f->pending_domains))) {
+        errlog(pimpl->log, "Failed to build domains index");
+        return {LR_ERROR, 0};
+    }
     kh_resize(hash_to_indexes, f->shortcuts_table, kh_size(f->shortcuts_table));
     f->leftovers_table.shrink_to_fit();
+    f->leftover_signatures.shrink_to_fit();
     kh_resize(hash_to_unique_index, f->badfilter_table, kh_size(f->badfilter_table));
+    f->ip_rules.shrink_to_fit();
 
-    infolog(pimpl->log, "Unique domains table size: {}", kh_size(f->unique_domains_table));
-    infolog(pimpl->log, "Non-unique domains table size: {}", kh_size(f->domains_table));
+    infolog(pimpl->log, "Domains index size: {} ({} with several rules, {}K)", f->domains_index.size(),
+            f->domains_index.multi_rule_domains_num(), (f->domains_index.mem_usage() / 1024) + 1);
     infolog(pimpl->log, "Shortcuts table size: {}", kh_size(f->shortcuts_table));
     infolog(pimpl->log, "Leftovers table size: {}", f->leftovers_table.size());
     infolog(pimpl->log, "Badfilter table size: {}", kh_size(f->badfilter_table));
+    infolog(pimpl->log, "IP rules index size: {}", f->ip_rules.size());
     infolog(pimpl->log, "Approximate memory usage: {}K", (load_line_arg.approx_mem / 1024) + 1);
 
     return {load_line_arg.result, load_line_arg.approx_mem};
@@ -442,6 +500,28 @@ static inline bool match_shortcuts(const std::vector<std::string> &shortcuts, st
     return found;
 }
 
+// Check if the address belongs to any of the networks (the parts which are not networks are skipped)
+static bool match_networks(const std::vector<std::string> &networks, const ag::uint8_vector &address) {
+    for (const std::string &n : networks) {
+        if (!may_be_address(n.substr(0, n.find('/')))) {
+            continue;
+        }
+        std::optional<rule_utils::ip_network> net = rule_utils::parse_ip_network(n);
+        if (!net.has_value() || net->addr.size() != address.size()) {
+            continue;
+        }
+        size_t full_bytes = net->prefix_len / 8;
+        size_t rest_bits = net->prefix_len % 8;
+        if (0 != std::memcmp(net->addr.data(), address.data(), full_bytes)) {
+            continue;
+        }
+        if (rest_bits == 0 || 0 == ((net->addr[full_bytes] ^ address[full_bytes]) & (0xff << (8 - rest_bits)))) {
+            return true;
+        }
+    }
+    return false;
+}
+
 bool filter::impl::match_against_line(match_arg &match, std::string_view line) {
     bool matched = false;
     std::optional<rule_utils::rule> rule = rule_utils::parse(line);
@@ -463,6 +543,9 @@ bool filter::impl::match_against_line(match_arg &match, std::string_view line) {
                 break;
             }
         }
+        if (!matched && !match.ctx.address.empty()) {
+            matched = match_networks(rule->matching_parts, match.ctx.address);
+        }
         break;
     case rule_utils::rule::MMID_SUBDOMAINS: {
         for (auto &part : rule->matching_parts) {
@@ -472,9 +555,15 @@ bool filter::impl::match_against_line(match_arg &match, std::string_view line) {
                 }
             }
         }
+        if (!match.ctx.address.empty()) {
+            matched = match_networks(rule->matching_parts, match.ctx.address);
+        }
     loopexit:
         break;
     }
+    case rule_utils::rule::MMID_CIDR:
+        matched = match_networks(rule->matching_parts, match.ctx.address);
+        break;
     case rule_utils::rule::MMID_SHORTCUTS:
         matched = match_shortcuts(rule->matching_parts, match.ctx.host);
         break;
@@ -549,22 +638,18 @@ void filter::impl::match_by_file_position(match_arg &match, size_t idx) {
     match_against_line(match, line);
 }
 
+void filter::impl::search_ip_rules(match_arg &match) const {
+    std::vector<uint32_t> positions;
+    this->ip_rules.find({ match.ctx.address.data(), match.ctx.address.size() }, positions);
+    for (uint32_t p : positions) {
+        match_by_file_position(match, p);
+    }
+}
+
 void filter::impl::search_by_domains(match_arg &match) const {
     for (const std::string_view &domain : match.ctx.subdomains) {
-        uint32_t hash = ag::utils::hash(domain);
-        khiter_t iter = kh_get(hash_to_unique_index, this->unique_domains_table, hash);
-        if (iter != kh_end(this->unique_domains_table)) {
-            uint32_t position = kh_value(this->unique_domains_table, iter);
-            match_by_file_position(match, position);
-            continue;
-        }
-
-        iter = kh_get(hash_to_indexes, this->domains_table, hash);
-        if (iter != kh_end(this->domains_table)) {
-            const std::vector<uint32_t> &positions = *kh_value(this->domains_table, iter);
-            for (uint32_t p : positions) {
-                match_by_file_position(match, p);
-            }
+        for (uint32_t p : this->domains_index.find(domain)) {
+            match_by_file_position(match, p);
         }
     }
 }
@@ -587,7 +672,14 @@ void filter::impl::search_by_shortcuts(match_arg &match) const {
 }
 
 void filter::impl::search_in_leftovers(match_arg &match) const {
-    for (const leftover_entry &entry : this->leftovers_table) {
+    const filter::signature host_sig = match.ctx.host_signature;
+    const filter::signature *signatures = this->leftover_signatures.data();
+    for (size_t i = 0; i < this->leftover_signatures.size(); ++i) {
+        if (!host_sig.contains(signatures[i])) {
+            continue;
+        }
+
+        const leftover_entry &entry = this->leftovers_table[i];
         const std::vector<std::string> &shortcuts = entry.shortcuts;
         if (!shortcuts.empty() && !match_shortcuts(shortcuts, match.ctx.host)) {
             continue;
@@ -614,9 +706,14 @@ void filter::match(match_context &ctx) {
 
     size_t matched_rule_pos = m.ctx.matched_rules.size();
 
-    this->pimpl->search_by_domains(m);
-    this->pimpl->search_by_shortcuts(m);
-    this->pimpl->search_in_leftovers(m);
+    if (!m.ctx.host.empty()) {
+        this->pimpl->search_by_domains(m);
+        this->pimpl->search_by_shortcuts(m);
+        this->pimpl->search_in_leftovers(m);
+    }
+    if (!m.ctx.address.empty()) {
+        this->pimpl->search_ip_rules(m);
+    }
     this->pimpl->search_badfilter_rules(m);
 
     for (; matched_rule_pos < m.ctx.matched_rules.size(); ++matched_rule_pos) {
@@ -627,7 +724,14 @@ void filter::match(match_context &ctx) {
 }
 
 filter::match_context filter::create_match_context(std::string_view host) {
-    match_context ctx = { ag::utils::to_lower(host), {}, {} };
+    match_context ctx = { ag::utils::to_lower(host), {}, {}, {}, {} };
+    ctx.host_signature = signature::of(ctx.host);
+    if (may_be_address(ctx.host)) {
+        if (ag::socket_address addr(ctx.host, 0); addr.valid()) {
+            ag::uint8_view bytes = addr.addr();
+            ctx.address.assign(bytes.begin(), bytes.end());
+        }
+    }
 
     size_t n = std::count(ctx.host.begin(), ctx.host.end(), '.');
     if (n > 0) {
@@ -644,3 +748,11 @@ filter::match_context filter::create_match_context(std::string_view host) {
 
     return ctx;
 }
+
+filter::match_context filter::create_match_context(ag::uint8_view address) {
+    return { {}, {}, {}, {}, { address.begin(), address.end() } };
+}
+
+bool filter::has_address_text_rules() const {
+    return this->pimpl->has_address_text_rules;
+}
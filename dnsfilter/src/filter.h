@@ -9,15 +9,55 @@
 
 class filter {
 public:
+    // Bitmask signature of the characters and character bigrams contained in a string.
+    // If string `a` contains string `b`, then `signature::of(a).contains(signature::of(b))`
+    // is true, so the signatures can be used to quickly reject non-matching rules.
+    struct signature {
+        uint64_t chars; // set of characters (see `signature::of` for the mapping)
+        uint64_t bigrams; // set of hashed character pairs
+
+        /**
+         * Compute signature of a string
+         * @param      str   string
+         * @return     The signature
+         */
+        static signature of(std::string_view str);
+
+        /**
+         * Merge another signature into this one
+         */
+        signature &operator|=(const signature &other) {
+            this->chars |= other.chars;
+            this->bigrams |= other.bigrams;
+            return *this;
+        }
+
+        /**
+         * Check if every bit of the other signature is also set in this one
+         */
+        bool contains(const signature &other) const {
+            return 0 == ((other.chars & ~this->chars) | (other.bigrams & ~this->bigrams));
+        }
+    };
+
     // Context of domain match
     struct match_context {
         std::string host; // matching domain name
         std::vector<std::string_view> subdomains; // list of subdomains
         std::vector<ag::dnsfilter::rule> matched_rules; // list of matched rules
+        signature host_signature; // signature of the matching domain name
+        ag::uint8_vector address; // raw address if the matching domain name is an IP address
     };
 
     static match_context create_match_context(std::string_view host);
 
+    /**
+     * Create context for matching an IP address against the IP rules only
+     * (see `has_address_text_rules`)
+     * @param      address  raw address (4 or 16 bytes)
+     */
+    static match_context create_match_context(ag::uint8_view address);
+
     filter();
     ~filter();
 
@@ -45,6 +85,14 @@ public:
      */
     void match(match_context &ctx);
 
+    /**
+     * Check if the filter contains rules, which may match the text representation of an IP address
+     * besides the IP rules (e.g. `1.2.3.*` or `||3.4^`)
+     * @detail     If it does not, IP addresses can be matched against the filter using
+     *             a context without the text representation
+     */
+    bool has_address_text_rules() const;
+
     // Filter parameters
     ag::dnsfilter::filter_params params;
 
@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <cassert>
+#include "ip_index.h"
+
+
+static inline int get_bit(const uint8_t *addr, size_t i) {
+    return (addr[i / 8] >> (7 - i % 8)) & 1;
+}
+
+// Get the length of the common prefix of two addresses limited with `max_len` bits
+static size_t common_prefix_len(const uint8_t *l, const uint8_t *r, size_t max_len) {
+    size_t len = 0;
+    for (size_t i = 0; len < max_len; ++i, len += 8) {
+        uint8_t diff = l[i] ^ r[i];
+        if (diff != 0) {
+            while (!(diff & 0x80)) {
+                diff <<= 1;
+                ++len;
+            }
+            break;
+        }
+    }
+    return std::min(len, max_len);
+}
+
+static ag::ipv6_address_array make_prefix(const uint8_t *addr, size_t prefix_len) {
+    ag::ipv6_address_array prefix = {};
+    std::copy(addr, addr + (prefix_len + 7) / 8, prefix.begin());
+    if (prefix_len % 8 != 0) {
+        prefix[prefix_len / 8] &= (uint8_t)(0xff << (8 - prefix_len % 8));
+    }
+    return prefix;
+}
+
+ip_index::ip_index()
+    : v4_nodes(1)
+    , v6_nodes(1)
+{}
+
+void ip_index::insert(ag::uint8_view addr, size_t prefix_len, uint32_t file_idx) {
+    assert(addr.size() == ag::ipv4_address_size || addr.size() == ag::ipv6_address_size);
+    assert(prefix_len <= addr.size() * 8);
+
+    std::vector<node> &nodes = this->tree(addr.size());
+    ++this->networks_num;
+
+    // the invariant: `addr` matches the prefix of the current node
+    uint32_t idx = 0;
+    while (true) {
+        if (nodes[idx].prefix_len == prefix_len) {
+            nodes[idx].positions.push_back(file_idx);
+            return;
+        }
+
+        int bit = get_bit(addr.data(), nodes[idx].prefix_len);
+        uint32_t child = nodes[idx].children[bit];
+        if (child == 0) {
+            nodes[idx].children[bit] = nodes.size();
+            nodes.push_back({ make_prefix(addr.data(), prefix_len), (uint8_t)prefix_len,
+                              {}, { file_idx } });
+            return;
+        }
+
+        size_t common = common_prefix_len(addr.data(), nodes[child].prefix.data(),
+                                          std::min(prefix_len, (size_t)nodes[child].prefix_len));
+        if (common == nodes[child].prefix_len) {
+            idx = child;
+            continue;
+        }
+
+        // the child network is not a part of the new one, so insert the node
+        // of their common prefix between the current node and the child
+        uint32_t middle = nodes.size();
+        nodes.push_back({ make_prefix(addr.data(), common), (uint8_t)common, {}, {} });
+        nodes[middle].children[get_bit(nodes[child].prefix.data(), common)] = child;
+        if (common == prefix_len) {
+            nodes[middle].positions.push_back(file_idx);
+        } else {
+            nodes[middle].children[get_bit(addr.data(), common)] = nodes.size();
+            nodes.push_back({ make_prefix(addr.data(), prefix_len), (uint8_t)prefix_len,
+                              {}, { file_idx } });
+        }
+        nodes[idx].children[bit] = middle;
+        return;
+    }
+}
+
+void ip_index::find(ag::uint8_view addr, std::vector<uint32_t> &positions) const {
+    if (addr.size() != ag::ipv4_address_size && addr.size() != ag::ipv6_address_size) {
+        return;
+    }
+
+    const std::vector<node> &nodes = this->tree(addr.size());
+    const size_t addr_bits = addr.size() * 8;
+    uint32_t idx = 0;
+    do {
+        const node &n = nodes[idx];
+        if (n.prefix_len != common_prefix_len(addr.data(), n.prefix.data(), n.prefix_len)) {
+            break;
+        }
+        positions.insert(positions.end(), n.positions.begin(), n.positions.end());
+        if (n.prefix_len == addr_bits) {
+            break;
+        }
+        idx = n.children[get_bit(addr.data(), n.prefix_len)];
+    } while (idx != 0);
+}
+
+size_t ip_index::mem_usage() const {
+    size_t size = (this->v4_nodes.capacity() + this->v6_nodes.capacity()) * sizeof(node);
+    for (const std::vector<node> *nodes : { &this->v4_nodes, &this->v6_nodes }) {
+        for (const node &n : *nodes) {
+            size += n.positions.capacity() * sizeof(uint32_t);
+        }
+    }
+    return size;
+}
+
+void ip_index::shrink_to_fit() {
+    for (std::vector<node> *nodes : { &this->v4_nodes, &this->v6_nodes }) {
+        nodes->shrink_to_fit();
+        for (node &n : *nodes) {
+            n.positions.shrink_to_fit();
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+
+#include <cstdint>
+#include <vector>
+#include <ag_defs.h>
+
+
+/**
+ * Index of the IP address rules: a binary radix (Patricia) tree per address family
+ * keyed on raw address bytes.
+ * Each rule is attached to the node of its network (a single address is a network
+ * of the full length), so a lookup collects the rules of all the networks containing
+ * the address walking down from the root, without any text conversions.
+ */
+class ip_index {
+public:
+    ip_index();
+
+    /**
+     * Add a network
+     * @param      addr        network address (4 or 16 bytes, the bits beyond the prefix are ignored)
+     * @param      prefix_len  network prefix length in bits
+     * @param      file_idx    rule file position
+     */
+    void insert(ag::uint8_view addr, size_t prefix_len, uint32_t file_idx);
+
+    /**
+     * Find the rules for the networks containing an address
+     * @param      addr       address (4 or 16 bytes)
+     * @param      positions  rule file positions are appended to this list
+     */
+    void find(ag::uint8_view addr, std::vector<uint32_t> &positions) const;
+
+    /**
+     * Get the number of added networks
+     */
+    size_t size() const { return this->networks_num; }
+
+    /**
+     * Get the approximate number of bytes occupied by the index
+     */
+    size_t mem_usage() const;
+
+    /**
+     * Release the unused memory
+     */
+    void shrink_to_fit();
+
+private:
+    struct node {
+        ag::ipv6_address_array prefix; // network address (the bits beyond `prefix_len` are zero)
+        uint8_t prefix_len; // in bits
+        uint32_t children[2]; // indexes in the family tree by the next bit after the prefix (0 means none)
+        std::vector<uint32_t> positions; // file positions of the rules for this exact network
+    };
+
+    std::vector<node> &tree(size_t addr_size) {
+        return (addr_size == ag::ipv4_address_size) ? this->v4_nodes : this->v6_nodes;
+    }
+    const std::vector<node> &tree(size_t addr_size) const {
+        return (addr_size == ag::ipv4_address_size) ? this->v4_nodes : this->v6_nodes;
+    }
+
+    // Trees for IPv4 and IPv6 addresses, the root node (`/0`) is at index 0
+    std::vector<node> v4_nodes;
+    std::vector<node> v6_nodes;
+    size_t networks_num = 0;
+};
@@ -1,6 +1,7 @@
 #include <algorithm>
 #include <array>
 #include <cassert>
+#include <charconv>
 #include <ag_logger.h>
 #include <ag_utils.h>
 #include <ag_regex.h>
@@ -8,6 +9,17 @@
 #include <ag_net_utils.h>
 #include "rule_utils.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RU_SIMD_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define RU_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
 
 #define ru_warnlog(l_, ...) do { if ((l_) != nullptr) warnlog(*(l_), __VA_ARGS__); } while (0)
 #define ru_dbglog(l_, ...) do { if ((l_) != nullptr) dbglog(*(l_), __VA_ARGS__); } while (0)
@@ -339,6 +351,150 @@ static std::vector<std::string_view> extract_regex_shortcuts(std::string_view te
     return shortcuts;
 }
 
+static inline bool is_fast_domain_char(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+        || c == '.' || c == '-' || c == '_';
+}
+
+#ifdef RU_SIMD_SSE2
+static inline unsigned first_set_bit(unsigned mask) {
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanForward(&idx, mask);
+    return idx;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+#endif
+
+/**
+ * Get the length of the longest prefix of the string consisting of the domain name
+ * characters (letters, digits, '.', '-' and '_')
+ */
+static size_t fast_domain_chars_span(std::string_view str) {
+    size_t i = 0;
+#if defined(RU_SIMD_SSE2)
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    for (; i + 16 <= str.length(); i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&str[i]);
+        // only letters are checked in the case-folded block, as folding moves
+        // some control characters to the digits and punctuation ranges
+        __m128i l = _mm_or_si128(v, case_bit);
+        // signed comparisons reject the bytes above 0x7f as they are negative
+        __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8('a' - 1)),
+                                      _mm_cmplt_epi8(l, _mm_set1_epi8('z' + 1)));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                      _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+        __m128i punct = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('.')),
+                                                  _mm_cmpeq_epi8(v, _mm_set1_epi8('-'))),
+                                     _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+        unsigned mask = ~(unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), punct)) & 0xffff;
+        if (mask != 0) {
+            return i + first_set_bit(mask);
+        }
+    }
+#elif defined(RU_SIMD_NEON)
+    const uint8x16_t case_bit = vdupq_n_u8(0x20);
+    for (; i + 16 <= str.length(); i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)&str[i]);
+        uint8x16_t l = vorrq_u8(v, case_bit);
+        uint8x16_t alpha = vandq_u8(vcgeq_u8(l, vdupq_n_u8('a')), vcleq_u8(l, vdupq_n_u8('z')));
+        uint8x16_t digit = vandq_u8(vcgeq_u8(v, vdupq_n_u8('0')), vcleq_u8(v, vdupq_n_u8('9')));
+        uint8x16_t punct = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('.')), vceqq_u8(v, vdupq_n_u8('-'))),
+                                    vceqq_u8(v, vdupq_n_u8('_')));
+        if (vminvq_u8(vorrq_u8(vorrq_u8(alpha, digit), punct)) != 0xff) {
+            // the exact position is found by the scalar loop below
+            break;
+        }
+    }
+#endif
+    for (; i < str.length() && is_fast_domain_char(str[i]); ++i) {
+    }
+    return i;
+}
+
+// Equivalent of `is_valid_domain_pattern` for a string consisting of the domain name characters
+static inline bool check_fast_domain_limits(std::string_view domain) {
+    if (domain.empty() || domain.length() > MAX_DOMAIN_LENGTH) {
+        return false;
+    }
+    for (size_t start = 0; start <= domain.length();) {
+        size_t end = std::min(domain.find('.', start), domain.length());
+        if (end - start > MAX_LABEL_LENGTH) {
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+/**
+ * Parse a rule of one of the most common forms in a single scan:
+ *  - plain domain name (e.g. `example.org`)
+ *  - adblock-style domain rule without modifiers (e.g. `||example.org^`)
+ *  - hosts file rule without comments (e.g. `0.0.0.0 example.org example.com`)
+ * @param orig_str original rule text
+ * @param str      trimmed rule text
+ * @return The same rule as the general parser produces, or nullopt if the string
+ *         is not one of the forms above and should be parsed by the general parser
+ */
+static std::optional<rule_utils::rule> parse_fast(std::string_view orig_str, std::string_view str) {
+    size_t span = fast_domain_chars_span(str);
+    if (span == str.length()) {
+        if (str.front() == '.' || str.back() == '.' || str.npos == str.find('.')
+                || !check_fast_domain_limits(str)
+                // may be an IP address
+                || str.npos == str.find_first_not_of("0123456789.")) {
+            return std::nullopt;
+        }
+        return make_exact_domain_name_rule(str);
+    }
+
+    if (span == 0 && str.length() > 3 && ag::utils::starts_with(str, "||") && str.back() == '^') {
+        std::string_view domain = str.substr(2, str.length() - 3);
+        if (fast_domain_chars_span(domain) != domain.length() || !check_fast_domain_limits(domain)
+                || domain.npos == domain.find_first_not_of('.')) {
+            return std::nullopt;
+        }
+        rule_utils::rule r = { { 0, std::string(orig_str), {}, std::nullopt }, rule_utils::rule::MMID_SUBDOMAINS, {} };
+        r.matching_parts.emplace_back(ag::utils::to_lower(domain));
+        return std::make_optional(std::move(r));
+    }
+
+    size_t ip_end = str.find_first_of(" \t");
+    if (ip_end == str.npos) {
+        return std::nullopt;
+    }
+    std::string_view ip = str.substr(0, ip_end);
+    if (!(std::isxdigit((unsigned char)ip.front()) || ip.front() == ':')
+            || !(ag::utils::is_valid_ip4(ip) || ag::utils::is_valid_ip6(ip))) {
+        return std::nullopt;
+    }
+
+    rule_utils::rule r = { { 0, std::string(str), {}, std::make_optional(std::string(ip)) },
+                           rule_utils::rule::MMID_SUBDOMAINS, {} };
+    std::string_view tail = str.substr(ip_end);
+    while (!tail.empty()) {
+        if (tail.front() == ' ' || tail.front() == '\t') {
+            tail.remove_prefix(1);
+            continue;
+        }
+        size_t length = fast_domain_chars_span(tail);
+        if (length == 0 || (length < tail.length() && tail[length] != ' ' && tail[length] != '\t')) {
+            return std::nullopt;
+        }
+        std::string_view domain = tail.substr(0, length);
+        if (!check_fast_domain_limits(domain)) {
+            return std::nullopt;
+        }
+        r.matching_parts.emplace_back(ag::utils::to_lower(domain));
+        tail.remove_prefix(length);
+    }
+
+    return std::make_optional(std::move(r));
+}
+
 std::optional<rule_utils::rule> rule_utils::parse(std::string_view str, ag::logger *log) {
     std::string_view orig_str = str;
     if (is_comment(str)) {
@@ -351,6 +507,10 @@ std::optional<rule_utils::rule> rule_utils::parse(std::string_view str, ag::logg
         return std::nullopt;
     }
 
+    if (std::optional<rule> r = parse_fast(orig_str, str); r.has_value()) {
+        return r;
+    }
+
     if (is_domain_name(str)) {
         return make_exact_domain_name_rule(str);
     }
@@ -371,6 +531,19 @@ std::optional<rule_utils::rule> rule_utils::parse(std::string_view str, ag::logg
         str = parts[0];
     }
 
+    if (str.npos != str.find('/') && !check_regex(str)) {
+        if (std::optional<ip_network> net = parse_ip_network(str); net.has_value()) {
+            if (!extract_modifiers(parts[1], &props, log)) {
+                return std::nullopt;
+            }
+            rule r = { { 0, std::string(orig_str), props, std::nullopt }, rule::MMID_CIDR, {} };
+            if (!props.test(ag::dnsfilter::RP_BADFILTER)) {
+                r.matching_parts.emplace_back(AG_FMT("{}/{}", ag::utils::addr_to_str({ net->addr.data(), net->addr.size() }), net->prefix_len));
+            }
+            return std::make_optional(std::move(r));
+        }
+    }
+
     match_info info = extract_match_info(str);
     str = info.text;
     if (str.empty() || str.find_first_not_of(".*") == str.npos) {
@@ -445,6 +618,27 @@ std::optional<rule_utils::rule> rule_utils::parse(std::string_view str, ag::logg
     return std::make_optional(std::move(r));
 }
 
+std::optional<rule_utils::ip_network> rule_utils::parse_ip_network(std::string_view str) {
+    size_t slash = str.find('/');
+    ag::socket_address addr(str.substr(0, slash), 0);
+    if (!addr.valid()) {
+        return std::nullopt;
+    }
+
+    ag::uint8_view bytes = addr.addr();
+    size_t prefix_len = bytes.size() * 8;
+    if (slash != str.npos) {
+        std::string_view len_str = str.substr(slash + 1);
+        auto [end, ec] = std::from_chars(len_str.data(), len_str.data() + len_str.length(), prefix_len);
+        if (len_str.empty() || ec != std::errc() || end != len_str.data() + len_str.length()
+                || prefix_len > bytes.size() * 8) {
+            return std::nullopt;
+        }
+    }
+
+    return ip_network{ { bytes.begin(), bytes.end() }, prefix_len };
+}
+
 std::string rule_utils::get_regex(const rule &r) {
     assert(r.match_method == rule::MMID_REGEX || r.match_method == rule::MMID_SHORTCUTS_AND_REGEX);
 
@@ -28,6 +28,8 @@ namespace rule_utils {
                                       // `/exampl.*\.com/` -> { `exampl`, `.com` }), and if a domain
                                       // contains these shortcuts in corresponding order and matches
                                       // the regex, it is matched against the rule
+            MMID_CIDR, // an IP address can be matched against such rule, if it belongs to any of the networks
+                       // in `matching_parts` (e.g. `192.168.0.0/16` or `fd00::/8`)
         };
 
         // public part of rule structure (see `ag::dnsfilter::rule`)
@@ -39,6 +41,12 @@ namespace rule_utils {
     };
 
 
+    struct ip_network {
+        ag::uint8_vector addr; // network address (4 or 16 bytes)
+        size_t prefix_len; // network prefix length in bits
+    };
+
+
     /**
      * Check if string is a commentary
      */
@@ -55,6 +63,14 @@ namespace rule_utils {
      */
     std::optional<rule> parse(std::string_view str, ag::logger *log = nullptr);
 
+    /**
+     * Parse IP network in CIDR notation (e.g. `10.0.0.0/8` or `fd00::/8`)
+     * @param[in]  str   input string (a single address is considered a network of the full length)
+     * @return     A network if parsed successfully,
+     *             nullopt otherwise
+     */
+    std::optional<ip_network> parse_ip_network(std::string_view str);
+
     /**
      * Extract a regular expression text from rule
      * @param[in]  r     rule
@@ -4,9 +4,12 @@
 #include <ag_file.h>
 #include <ag_sys.h>
 #include <ag_logger.h>
+#include <ag_socket_address.h>
 #include <dnsfilter.h>
 #include <spdlog/spdlog.h>
 #include <rule_utils.h>
+#include <filter.h>
+#include <domain_index.h>
 
 class dnsfilter_test : public ::testing::Test {
 protected:
@@ -113,6 +116,10 @@ TEST_F(dnsfilter_test, successful_rule_parsing) {
             { "172.16.*.1", { {}, rule_utils::rule::MMID_SHORTCUTS } },
             { "172.16.*.1:80", { {}, rule_utils::rule::MMID_SHORTCUTS_AND_REGEX } },
             { "|172.16.*.1:80^", { {}, rule_utils::rule::MMID_SHORTCUTS_AND_REGEX } },
+            { "192.168.0.0/16", { {}, rule_utils::rule::MMID_CIDR } },
+            { "@@192.168.1.0/24", { { .props = { 1 << ag::dnsfilter::RP_EXCEPTION } }, rule_utils::rule::MMID_CIDR } },
+            { "fd00::/8$important", { { .props = { 1 << ag::dnsfilter::RP_IMPORTANT } }, rule_utils::rule::MMID_CIDR } },
+            { "0.0.0.0/0", { {}, rule_utils::rule::MMID_CIDR } },
         };
 
     ag::logger log = ag::create_logger("dnsfilter_test");
@@ -161,6 +168,53 @@ TEST_F(dnsfilter_test, successful_host_syntax_rule_parsing) {
     }
 }
 
+TEST_F(dnsfilter_test, common_forms_rule_parsing) {
+    struct test_data {
+        std::string text;
+        rule_utils::rule::match_method_id expected_method;
+        std::vector<std::string> expected_parts;
+        std::optional<std::string> expected_ip;
+    };
+
+    const test_data TEST_DATA[] =
+        {
+            { "Some-Long.Sub_Domain.Example.ORG", rule_utils::rule::MMID_EXACT,
+                { "some-long.sub_domain.example.org" }, std::nullopt },
+            { "  ||Some-Long.Sub_Domain.Example.ORG^ ", rule_utils::rule::MMID_SUBDOMAINS,
+                { "some-long.sub_domain.example.org" }, std::nullopt },
+            { "||1.2.3.4^", rule_utils::rule::MMID_SUBDOMAINS, { "1.2.3.4" }, std::nullopt },
+            { "0.0.0.0\tsome-long.sub_domain.Example.org  \t example.com", rule_utils::rule::MMID_SUBDOMAINS,
+                { "some-long.sub_domain.example.org", "example.com" }, "0.0.0.0" },
+            { "::1 localhost", rule_utils::rule::MMID_SUBDOMAINS, { "localhost" }, "::1" },
+            { "0.0.0.0 example.org #comment", rule_utils::rule::MMID_SUBDOMAINS, { "example.org" }, "0.0.0.0" },
+            { "0.0.0.0 some-long.sub_domain*.example.org", rule_utils::rule::MMID_SUBDOMAINS,
+                { "some-long.sub_domain*.example.org" }, "0.0.0.0" },
+            { "1.2.3.4", rule_utils::rule::MMID_SHORTCUTS, { "1.2.3.4" }, std::nullopt },
+        };
+
+    for (const test_data &entry : TEST_DATA) {
+        SPDLOG_INFO("testing {}", entry.text);
+        std::optional<rule_utils::rule> rule = rule_utils::parse(entry.text);
+        ASSERT_TRUE(rule.has_value());
+        ASSERT_EQ(rule->match_method, entry.expected_method);
+        ASSERT_EQ(rule->matching_parts, entry.expected_parts);
+        ASSERT_EQ(rule->public_part.ip, entry.expected_ip);
+    }
+
+    const std::string WRONG_DATA[] =
+        {
+            "some-long.sub_domain\x01.example.org",
+            "||some-long.sub_domain.\xd0\xb5xample.org^",
+            "0.0.0.0 some-long.sub_domain.example.org\x7f",
+            "0.0.0.0 some-long.sub_domain.example.org/",
+            "||....^",
+        };
+
+    for (const std::string &entry : WRONG_DATA) {
+        ASSERT_FALSE(rule_utils::parse(entry).has_value()) << entry;
+    }
+}
+
 TEST_F(dnsfilter_test, wrong_rule_parsing) {
     const std::string TEST_DATA[] =
         {
@@ -192,6 +246,9 @@ TEST_F(dnsfilter_test, wrong_rule_parsing) {
             "///example.com",
             "333.333.333.333 example.org",
             "45:67 example.org",
+            "10.0.0.0/33",
+            "10.0.0.0/8a",
+            "fd00::/129",
         };
 
     ag::logger log = ag::create_logger("dnsfilter_test");
@@ -572,6 +629,137 @@ TEST_F(dnsfilter_test, multifilters) {
     std::remove(file_by_filter_name(TEST_FILTER_NAME + "2").c_str());
 }
 
+TEST_F(dnsfilter_test, filter_subsets) {
+    ag::dnsfilter::engine_params params = {
+        {
+            { 1, "example.org\nexample.com", true },
+            { 2, "@@example.org", true },
+            { 3, "||example.net^", true },
+        }
+    };
+    auto [handle, err_or_warn] = filter.create(params);
+    ASSERT_TRUE(handle) << *err_or_warn;
+
+    struct test_data {
+        std::vector<int32_t> filter_ids;
+        std::string domain;
+        std::vector<std::string> expected_rules;
+    };
+
+    const test_data TEST_DATA[] =
+        {
+            { { 1, 2, 3 }, "example.org", { "example.org", "@@example.org" } },
+            { { 1 }, "example.org", { "example.org" } },
+            { { 2, 3 }, "example.org", { "@@example.org" } },
+            { { 3 }, "example.org", {} },
+            { { 2 }, "example.com", {} },
+            { { 3, 42 }, "sub.example.net", { "||example.net^" } },
+            { {}, "sub.example.net", {} },
+        };
+
+    for (const test_data &entry : TEST_DATA) {
+        std::vector<ag::dnsfilter::rule> rules = filter.match(handle, entry.domain, entry.filter_ids);
+        std::vector<std::string> rule_texts;
+        for (const ag::dnsfilter::rule &r : rules) {
+            ASSERT_NE(entry.filter_ids.end(), std::find(entry.filter_ids.begin(), entry.filter_ids.end(), r.filter_id));
+            rule_texts.emplace_back(r.text);
+        }
+        std::sort(rule_texts.begin(), rule_texts.end());
+        std::vector<std::string> expected_rules = entry.expected_rules;
+        std::sort(expected_rules.begin(), expected_rules.end());
+        ASSERT_EQ(rule_texts, expected_rules) << entry.domain;
+    }
+
+    filter.destroy(handle);
+}
+
+TEST_F(dnsfilter_test, ip_rules) {
+    ag::dnsfilter::engine_params params = {
+        {
+            {
+                1,
+                "10.0.0.0/8\n"
+                "@@10.1.0.0/16\n"
+                "|1.2.3.4|\n"
+                "0.0.0.0 5.6.7.8\n"
+                "||9.9.9.9^\n"
+                "fd00::/8\n"
+                "|12:34::56^\n"
+                "example.org\n",
+                true
+            },
+        }
+    };
+    auto [handle, err_or_warn] = filter.create(params);
+    ASSERT_TRUE(handle) << *err_or_warn;
+
+    struct test_data {
+        std::string address;
+        std::vector<std::string> expected_rules;
+    };
+
+    const test_data TEST_DATA[] =
+        {
+            { "10.2.3.4", { "10.0.0.0/8" } },
+            { "10.1.2.3", { "10.0.0.0/8", "@@10.1.0.0/16" } },
+            { "11.1.2.3", {} },
+            { "1.2.3.4", { "|1.2.3.4|" } },
+            { "1.2.3.5", {} },
+            { "5.6.7.8", { "0.0.0.0 5.6.7.8" } },
+            { "9.9.9.9", { "||9.9.9.9^" } },
+            { "fd12::1", { "fd00::/8" } },
+            { "fe12::1", {} },
+            { "12:34::56", { "|12:34::56^" } },
+            { "::ffff:10.1.2.3", {} },
+        };
+
+    for (const test_data &entry : TEST_DATA) {
+        SPDLOG_INFO("testing {}", entry.address);
+        ag::socket_address addr(entry.address, 0);
+        ASSERT_TRUE(addr.valid());
+
+        std::vector<std::string> expected_rules = entry.expected_rules;
+        std::sort(expected_rules.begin(), expected_rules.end());
+        for (const std::vector<ag::dnsfilter::rule> &rules
+                : { filter.match_ip(handle, addr.addr()), filter.match(handle, entry.address) }) {
+            std::vector<std::string> rule_texts;
+            for (const ag::dnsfilter::rule &r : rules) {
+                rule_texts.emplace_back(r.text);
+            }
+            std::sort(rule_texts.begin(), rule_texts.end());
+            ASSERT_EQ(rule_texts, expected_rules) << entry.address;
+        }
+    }
+
+    filter.destroy(handle);
+
+    // the rules which may match the address text are still applied
+    params.filters[0].data = "10.0.0.0/8\n10.1.*.4\n";
+    std::tie(handle, err_or_warn) = filter.create(params);
+    ASSERT_TRUE(handle) << *err_or_warn;
+    ag::socket_address addr("10.1.3.4", 0);
+    std::vector<ag::dnsfilter::rule> rules = filter.match_ip(handle, addr.addr());
+    ASSERT_EQ(rules.size(), 2);
+    filter.destroy(handle);
+
+    // so are the domain rules which may match the address text
+    params.filters[0].data = "10.0.0.0/8\n||3.4^\n0.0.0.0 7.8\n";
+    std::tie(handle, err_or_warn) = filter.create(params);
+    ASSERT_TRUE(handle) << *err_or_warn;
+    addr = ag::socket_address("10.1.3.4", 0);
+    rules = filter.match_ip(handle, addr.addr());
+    ASSERT_EQ(rules.size(), 2);
+    addr = ag::socket_address("1.2.7.8", 0);
+    rules = filter.match_ip(handle, addr.addr());
+    ASSERT_EQ(rules.size(), 1);
+    ASSERT_EQ(rules[0].text, "0.0.0.0 7.8");
+
+    // only the specified filters are matched
+    ASSERT_TRUE(filter.match_ip(handle, addr.addr(), { params.filters[0].id + 1 }).empty());
+    ASSERT_EQ(filter.match_ip(handle, addr.addr(), { params.filters[0].id }).size(), 1);
+    filter.destroy(handle);
+}
+
 TEST_F(dnsfilter_test, rule_selection) {
     struct test_data {
         std::vector<std::string> rules;
@@ -615,3 +803,60 @@ TEST_F(dnsfilter_test, rule_selection) {
         ASSERT_EQ(effective_rules.size(), 0);
     }
 }
+
+TEST_F(dnsfilter_test, leftover_signature) {
+    const std::string HOST = "sub.ex-ample_1.org";
+    const filter::signature host_sig = filter::signature::of(HOST);
+
+    // Signature of a string contains the signatures of all its substrings
+    for (size_t i = 0; i < HOST.length(); ++i) {
+        for (size_t n = 0; i + n <= HOST.length(); ++n) {
+            ASSERT_TRUE(host_sig.contains(filter::signature::of(std::string_view(HOST).substr(i, n))))
+                << HOST.substr(i, n);
+        }
+    }
+
+    // Strings with characters absent in the host are always rejected
+    const std::string NOT_CONTAINED[] = { "xyz", "www", "ex-ample2", "_0", };
+    for (const std::string &str : NOT_CONTAINED) {
+        ASSERT_FALSE(host_sig.contains(filter::signature::of(str))) << str;
+    }
+}
+
+TEST_F(dnsfilter_test, domain_index) {
+    static constexpr uint32_t DOMAINS_NUM = 10000;
+    static constexpr uint32_t MULTI_RULE_DOMAINS_NUM = 100;
+
+    std::vector<domain_index::entry> entries;
+    for (uint32_t i = 0; i < DOMAINS_NUM; ++i) {
+        entries.push_back({ domain_index::fingerprint("domain" + std::to_string(i) + ".com"), i });
+    }
+    for (uint32_t i = 0; i < MULTI_RULE_DOMAINS_NUM; ++i) {
+        entries.push_back({ domain_index::fingerprint("domain" + std::to_string(i) + ".com"), DOMAINS_NUM + i });
+        // duplicates are folded
+        entries.push_back({ domain_index::fingerprint("domain" + std::to_string(i) + ".com"), i });
+    }
+
+    domain_index index;
+    ASSERT_TRUE(index.build(std::move(entries)));
+    ASSERT_EQ(index.size(), DOMAINS_NUM);
+    ASSERT_EQ(index.multi_rule_domains_num(), MULTI_RULE_DOMAINS_NUM);
+
+    for (uint32_t i = 0; i < DOMAINS_NUM; ++i) {
+        domain_index::positions found = index.find("domain" + std::to_string(i) + ".com");
+        std::vector<uint32_t> positions(found.begin(), found.end());
+        std::vector<uint32_t> expected = { i };
+        if (i < MULTI_RULE_DOMAINS_NUM) {
+            expected.push_back(DOMAINS_NUM + i);
+        }
+        ASSERT_EQ(positions, expected) << i;
+    }
+
+    for (uint32_t i = 0; i < DOMAINS_NUM; ++i) {
+        ASSERT_TRUE(index.find("other" + std::to_string(i) + ".com").empty()) << i;
+    }
+
+    ASSERT_TRUE(index.build({}));
+    ASSERT_EQ(index.size(), 0);
+    ASSERT_TRUE(index.find("domain0.com").empty());
+}
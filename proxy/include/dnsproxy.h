@@ -1,5 +1,6 @@
 #pragma once
 
+#include <functional>
 #include <memory>
 #include <ag_defs.h>
 #include "dnsproxy_settings.h"
@@ -13,6 +14,11 @@ namespace ag {
  */
 class dnsproxy {
 public:
+    /**
+     * Receives the response to a message passed to `handle_message_async()`
+     */
+    using handle_message_callback = std::function<void(std::vector<uint8_t> response)>;
+
     dnsproxy();
     ~dnsproxy();
 
@@ -51,6 +57,24 @@ public:
      */
     std::vector<uint8_t> handle_message(ag::uint8_view message);
 
+    /**
+     * @brief Handle a DNS message without blocking on the upstream exchange
+     *
+     * The cached and blocked responses are passed to the callback before this function returns.
+     * Otherwise, the callback is called on another thread once the upstream exchange completes.
+     * The message is not referenced after this function returns.
+     *
+     * @param message message from client
+     * @param callback receives the response, see `handle_message()`
+     */
+    void handle_message_async(ag::uint8_view message, handle_message_callback callback);
+
+    /**
+     * @brief Get the number of bytes occupied by the cached responses, record sets and filtering outcomes
+     * (see `dnsproxy_settings::dns_cache_memory_limit`)
+     */
+    size_t get_cache_memory_usage() const;
+
     /**
      * @brief Return the DNS proxy library version
      *
@@ -16,6 +16,26 @@ struct dns64_settings {
     std::chrono::milliseconds wait_time; // How long to wait before a dns64 prefixes discovery attempt
 };
 
+struct dns_cache_prefetch_settings {
+    uint32_t min_hits{2}; // Prefetch only the responses served from the cache at least this many times
+    uint32_t remaining_ttl_percent{10}; // Prefetch a response when this share of its TTL remains
+    uint32_t max_in_flight{16}; // Maximum number of prefetch requests in flight at once
+    uint32_t max_per_second{32}; // Maximum number of prefetch requests started per second
+};
+
+struct upstream_hedging_settings {
+    uint32_t delay_percentile{90}; // Hedge an exchange taking longer than this percentile of the upstream's response times
+    std::chrono::milliseconds min_delay{20}; // Never hedge an exchange earlier than this
+    std::chrono::milliseconds max_delay{1000}; // Never hedge an exchange later than this (also used until the response
+                                               // times of the upstream are known)
+    uint32_t max_ratio_percent{5}; // Maximum number of hedged exchanges per 100 exchanges
+};
+
+struct upstream_circuit_breaker_settings {
+    uint32_t failures_threshold{5}; // Consider an upstream down after this many exchanges with it failed in a row
+    std::chrono::milliseconds probe_interval{2000}; // How often a down upstream is probed to find out if it's back up
+};
+
 enum class listener_protocol {
     UDP,
     TCP,
@@ -32,6 +52,25 @@ enum class dnsproxy_blocking_mode {
     CUSTOM_ADDRESS, // Always return custom configured IP address (see dnsproxy_settings)
 };
 
+/**
+ * Specifies which responses are displaced from the full cache
+ */
+enum class dnsproxy_cache_policy {
+    LRU, // The least recently used ones
+    S3_FIFO, // The recently requested only once ones first, so that a burst of such requests
+             // does not push out the popular responses (see `ag::s3fifo_policy`)
+};
+
+/**
+ * Specifies which of the upstreams the requests are sent to first.
+ * If it fails, the rest of the upstreams are tried in the order of their health scores.
+ */
+enum class dnsproxy_upstream_balancing {
+    LOWEST_SCORE, // The upstream with the lowest expected exchange time (see `ag::upstream::update_stats()`)
+    WEIGHTED_ROUND_ROBIN, // Each upstream in turn, in proportion to its weight (see `ag::upstream_options::weight`)
+    LEAST_OUTSTANDING_REQUESTS, // The upstream with the fewest exchanges in flight
+};
+
 struct listener_settings {
     std::string address{"::"}; // The address to listen on
     uint16_t port{53}; // The port to listen on
@@ -80,12 +119,84 @@ struct dnsproxy_settings {
 
     size_t dns_cache_size; // Maximum number of cached responses
 
+    /**
+     * Maximum number of cached negative responses (NXDOMAIN and NODATA, see RFC 2308).
+     * These are kept apart from the other responses, so that they do not displace them.
+     * 0 disables negative caching. Has no effect if `dns_cache_size` is 0.
+     */
+    size_t dns_cache_negative_size;
+
+    /**
+     * Maximum number of records sets in the RRset cache. If a response is not cached as a whole,
+     * it is synthesized from the cached CNAME chain of the question name and the records of the requested type,
+     * which may have come with the responses to the other questions.
+     * 0 disables the RRset cache. Has no effect if `dns_cache_size` is 0.
+     */
+    size_t dns_cache_rrset_size;
+
+    /**
+     * Maximum number of bytes occupied by the cached responses (0 means no limit).
+     * Unlike `dns_cache_size`, this accounts for the actual size of each response,
+     * so it puts a hard cap on the cache memory regardless of the responses sizes.
+     * Both limits apply if both are set.
+     * The limit covers the cached outcomes of filtering the requests, which get a small share of it.
+     * The rest is split between the positive responses, the negative ones (see `dns_cache_negative_size`)
+     * and the record sets (see `dns_cache_rrset_size`) in proportion to the numbers of entries they are limited with.
+     */
+    size_t dns_cache_memory_limit;
+
+    /**
+     * Number of independently locked parts of the response cache.
+     * The more parts, the less the threads processing requests contend on the cache locks.
+     * 0 means the number of hardware threads.
+     */
+    size_t dns_cache_shards_num;
+
+    dnsproxy_cache_policy dns_cache_policy; // Which responses are displaced from the full cache
+
+    /**
+     * Path of the file which the response cache is saved to on shutdown and loaded from on startup,
+     * so that the cache is warm right after a restart. Empty means the cache is not saved.
+     */
+    std::string dns_cache_snapshot_path;
+
     /**
      * Enable optimistic cache mode.
      * Expired cache entries will be returned with a TTL of 1 second
      * while upstreams are queried in the background.
      */
     bool optimistic_cache;
+
+    /**
+     * If set, the popular cached responses are refreshed in the background shortly
+     * before they expire, so that they are neither served stale nor missed
+     */
+    std::optional<dns_cache_prefetch_settings> dns_cache_prefetch;
+
+    /**
+     * If set, an exchange with the first of the upstreams (ranked by RTT) taking longer than usual for it
+     * is duplicated to the second one, and the first of the responses is used.
+     * This cuts the response time when an upstream stalls occasionally, at the cost of the extra exchanges.
+     * Applies to the messages handled asynchronously (see `dnsproxy::handle_message_async()`),
+     * which includes the messages received by the listeners.
+     */
+    std::optional<upstream_hedging_settings> upstream_hedging;
+
+    /**
+     * How the requests are spread between the upstreams (the fallback upstreams are not balanced).
+     * By default, all the requests go to the fastest upstream, which may become a hotspot
+     * if the upstreams are equally good.
+     */
+    dnsproxy_upstream_balancing upstream_balancing;
+
+    /**
+     * If set, the upstreams which fail a number of exchanges in a row are considered down,
+     * and the requests are sent to the other upstreams (or the fallbacks) without trying them first,
+     * so an outage of an upstream doesn't make every request wait for its timeout.
+     * A down upstream is probed with a query in the background until it responds.
+     * If all the upstreams are down, they are tried as usual.
+     */
+    std::optional<upstream_circuit_breaker_settings> upstream_circuit_breaker;
 };
 
 }
@@ -5,10 +5,12 @@
 #include <default_verifier.h>
 #include <ag_utils.h>
 #include <ag_cache.h>
+#include <ag_net_consts.h>
 #include <string>
 #include <cstring>
 
 #include <ldns/ldns.h>
+#include <event2/event.h>
 
 
 #define errlog_id(l_, pkt_, fmt_, ...) errlog((l_), "[{}] " fmt_, ldns_pkt_id(pkt_), ##__VA_ARGS__)
@@ -34,38 +36,51 @@ static constexpr size_t RESPONSE_BUFFER_INITIAL_CAPACITY = 512;
 static constexpr uint32_t SOA_RETRY_DEFAULT = 900;
 static constexpr uint32_t SOA_RETRY_IPV6_BLOCK = 60;
 
-static std::string get_cache_key(const ldns_pkt *request) {
-    const auto *question = ldns_rr_list_rr(ldns_pkt_question(request), 0);
-    std::string key = fmt::format("{}|{}|{}{}|", // '|' is to avoid collisions
-                                  ldns_rr_get_type(question),
-                                  ldns_rr_get_class(question),
-                                  ldns_pkt_edns_do(request) ? "1" : "0",
-                                  ldns_pkt_cd(request) ? "1" : "0");
+// RFC 8467 recommends padding the responses to a multiple of this size
+static constexpr size_t RESPONSE_PADDING_BLOCK_SIZE = 468;
 
-    // Compute the domain name, in lower case for case-insensitivity
-    const auto *owner = ldns_rr_owner(question);
-    const size_t size = ldns_rdf_size(owner);
-    key.reserve(key.size() + size);
-    if (size == 1) {
-        key.push_back('.');
-    } else {
-        auto *data = (uint8_t *) ldns_rdf_data(owner);
-        uint8_t len = data[0];
-        uint8_t src_pos = 0;
-        while ((len > 0) && (src_pos < size)) {
-            ++src_pos;
-            for (int_fast32_t i = 0; i < len; ++i) {
-                key.push_back(std::tolower(data[src_pos]));
-                ++src_pos;
-            }
-            if (src_pos < size) {
-                key.push_back('.');
-            }
-            len = data[src_pos];
-        }
+// RFC 2308 section 5 suggests not caching negative responses for longer than 1-3 hours
+static constexpr uint32_t MAX_NEGATIVE_TTL = 3 * 60 * 60;
+
+// The filtering outcomes are few and small compared to the responses,
+// so they get this fraction of `dnsproxy_settings::dns_cache_memory_limit`
+static constexpr size_t FILTERING_CACHE_MEMORY_LIMIT_DIVISOR = 16;
+
+// Shares of `dnsproxy_settings::dns_cache_memory_limit` (0 means no limit)
+struct cache_memory_limits {
+    size_t responses;
+    size_t negative;
+    size_t rrsets;
+    size_t filtering;
+};
+
+static cache_memory_limits split_cache_memory_limit(const dnsproxy_settings &settings) {
+    size_t limit = settings.dns_cache_memory_limit;
+    if (limit == 0) {
+        return {};
     }
+    // a zero share would mean no limit at all
+    size_t filtering = std::max(limit / FILTERING_CACHE_MEMORY_LIMIT_DIVISOR, (size_t) 1);
+    size_t rest = limit - std::min(filtering, limit);
+    // the response caches share the rest in proportion to their capacities
+    double total_capacity = (double) settings.dns_cache_size + (double) settings.dns_cache_negative_size
+            + (double) settings.dns_cache_rrset_size;
+    auto share = [&] (size_t capacity) -> size_t {
+        return (capacity == 0) ? 0 : std::max((size_t) ((double) rest * capacity / total_capacity), (size_t) 1);
+    };
+    size_t negative = share(settings.dns_cache_negative_size);
+    size_t rrsets = share(settings.dns_cache_rrset_size);
+    return { std::max(rest - std::min(negative + rrsets, rest), (size_t) 1), negative, rrsets, filtering };
+}
 
-    return key;
+static cache_key get_cache_key(const ldns_pkt *request) {
+    const auto *question = ldns_rr_list_rr(ldns_pkt_question(request), 0);
+    // The owner data is the name in the uncompressed wire format, it's lower-cased by the key itself
+    const auto *owner = ldns_rr_owner(question);
+    return cache_key({ ldns_rdf_data(owner), ldns_rdf_size(owner) },
+                     ldns_rr_get_type(question), ldns_rr_get_class(question),
+                     (ldns_pkt_edns_do(request) ? cache_key::DNSSEC_OK : 0)
+                        | (ldns_pkt_cd(request) ? cache_key::CHECKING_DISABLED : 0));
 }
 
 static void log_packet(const logger &log, const ldns_pkt *packet, const char *pkt_name) {
@@ -84,6 +99,18 @@ static void log_packet(const logger &log, const ldns_pkt *packet, const char *pk
     ldns_buffer_free(str_dns);
 }
 
+static void log_packet(const logger &log, uint8_view wire, const char *pkt_name) {
+    if (!log->should_log((spdlog::level::level_enum)DEBUG)) {
+        return;
+    }
+
+    ldns_pkt *packet = nullptr;
+    if (LDNS_STATUS_OK == ldns_wire2pkt(&packet, wire.data(), wire.size())) {
+        log_packet(log, packet, pkt_name);
+        ldns_pkt_free(packet);
+    }
+}
+
 static ldns_pkt *create_response_by_request(const ldns_pkt *request) {
     ldns_pkt *response = nullptr;
     if (ldns_rr *question = ldns_rr_list_rr(ldns_pkt_question(request), 0)) {
@@ -427,7 +454,7 @@ void dns_forwarder::finalize_processed_event(dns_request_processed_event &event,
         auto status = ag::allocated_ptr<char>(ldns_pkt_rcode2str(ldns_pkt_get_rcode(response)));
         event.status = status != nullptr ? status.get() : "";
         event.answer = dns_forwarder_utils::rr_list_to_string(ldns_pkt_answer(response));
-    } else {
+    } else if (!event.cache_hit) { // the cached response fields are filled by the caller
         event.status.clear();
         event.answer.clear();
     }
@@ -559,6 +586,15 @@ static std::vector<uint8_t> transform_response_to_raw_data(const ldns_pkt *messa
 }
 
 
+static std::vector<upstream *> get_raw_pointers(const std::vector<upstream_ptr> &upstreams) {
+    std::vector<upstream *> pointers;
+    pointers.reserve(upstreams.size());
+    for (const upstream_ptr &u : upstreams) {
+        pointers.push_back(u.get());
+    }
+    return pointers;
+}
+
 dns_forwarder::dns_forwarder() = default;
 
 dns_forwarder::~dns_forwarder() = default;
@@ -631,6 +667,10 @@ std::pair<bool, err_string> dns_forwarder::init(const dnsproxy_settings &setting
         this->deinit();
         return {false, err};
     }
+    std::vector<upstream *> upstream_pointers = get_raw_pointers(this->upstreams);
+    this->balancer.init(settings.upstream_balancing, upstream_pointers);
+    this->upstreams_ranking.init(std::move(upstream_pointers));
+    this->fallbacks_ranking.init(get_raw_pointers(this->fallbacks));
     infolog(log, "Upstreams initialized");
 
     infolog(log, "Initializing the filtering module...");
@@ -695,9 +735,81 @@ std::pair<bool, err_string> dns_forwarder::init(const dnsproxy_settings &setting
         prefixes_discovery_thread.detach();
     }
 
-    {
-        std::scoped_lock l(this->response_cache.mtx);
-        this->response_cache.val.set_capacity(this->settings->dns_cache_size);
+    // a follower never waits longer than its own exchange could take
+    this->inflight_wait_timeout = std::chrono::milliseconds(0);
+    for (auto *upstream_vector : { &this->upstreams, &this->fallbacks }) {
+        for (const upstream_ptr &u : *upstream_vector) {
+            this->inflight_wait_timeout += u->options().timeout;
+        }
+    }
+
+    if (settings.upstream_hedging.has_value()) {
+        const upstream_hedging_settings &hedging = settings.upstream_hedging.value();
+        if (hedging.delay_percentile == 0 || hedging.delay_percentile > 100
+                || hedging.min_delay > hedging.max_delay) {
+            constexpr auto err = "Invalid upstream hedging settings";
+            errlog(log, "{}", err);
+            this->deinit();
+            return {false, err};
+        }
+        for (const upstream_ptr &u : this->upstreams) {
+            this->response_times.emplace(u.get(), std::make_unique<response_time_histogram>());
+        }
+        for (const upstream_ptr &u : this->fallbacks) {
+            this->response_times.emplace(u.get(), std::make_unique<response_time_histogram>());
+        }
+        this->hedge_budget.reset(hedging.max_ratio_percent);
+        infolog(log, "Upstream hedging is enabled");
+    }
+
+    if (settings.upstream_circuit_breaker.has_value()) {
+        const upstream_circuit_breaker_settings &breaker = settings.upstream_circuit_breaker.value();
+        if (breaker.failures_threshold == 0 || breaker.probe_interval.count() <= 0) {
+            constexpr auto err = "Invalid upstream circuit breaker settings";
+            errlog(log, "{}", err);
+            this->deinit();
+            return {false, err};
+        }
+        std::vector<upstream *> all_upstreams = get_raw_pointers(this->upstreams);
+        for (const upstream_ptr &u : this->fallbacks) {
+            all_upstreams.push_back(u.get());
+        }
+        this->circuit_breaker.init(breaker.failures_threshold, all_upstreams);
+        infolog(log, "Upstream circuit breaker is enabled");
+    }
+
+    if (settings.upstream_hedging.has_value() || settings.upstream_circuit_breaker.has_value()) {
+        this->timers_loop = event_loop::create();
+    }
+    this->upstream_probing_stopped = false;
+    if (settings.upstream_circuit_breaker.has_value()) {
+        for (auto *upstream_vector : { &this->upstreams, &this->fallbacks }) {
+            for (const upstream_ptr &u : *upstream_vector) {
+                auto probe = std::make_unique<upstream_probe>();
+                probe->forwarder = this;
+                probe->target = u.get();
+                probe->timer = evtimer_new(this->timers_loop->c_base(), on_upstream_probe_timer, probe.get());
+                this->upstream_probes.emplace(u.get(), std::move(probe));
+            }
+        }
+    }
+
+    cache_memory_limits memory_limits = split_cache_memory_limit(*this->settings);
+    this->cache.init(this->settings->dns_cache_size, memory_limits.responses,
+                     this->settings->dns_cache_shards_num, this->settings->dns_cache_policy);
+    this->negative_cache.init(this->settings->dns_cache_negative_size, memory_limits.negative,
+                              this->settings->dns_cache_shards_num, this->settings->dns_cache_policy);
+    this->filtering_cache.clear();
+    this->filtering_cache.set_capacity(this->settings->dns_cache_size);
+    this->filtering_cache_mem_usage = 0;
+    this->filtering_cache_memory_limit = memory_limits.filtering;
+    this->rrsets.init(this->settings->dns_cache_rrset_size, memory_limits.rrsets);
+    if (!this->settings->dns_cache_snapshot_path.empty() && this->settings->dns_cache_size != 0) {
+        infolog(log, "Loading cache snapshot...");
+        if (err_string err = this->cache.load(this->settings->dns_cache_snapshot_path); err.has_value()) {
+            warnlog(log, "Failed to load cache snapshot from {}: {}", this->settings->dns_cache_snapshot_path, *err);
+        }
+        infolog(log, "Loaded {} cached responses", this->cache.size());
     }
 
     infolog(log, "Forwarder initialized");
@@ -719,17 +831,39 @@ void dns_forwarder::deinit() {
             }
         }
 
+        this->upstream_probing_stopped = true;
+
         infolog(log, "Wait for started async requests to finish...");
         this->async_reqs_cv.wait(l, [&]() {
-            return this->async_reqs.empty();
+            return this->async_reqs.empty() && this->async_exchanges_in_flight == 0;
         });
         infolog(log, "Done");
+        // the cancelled requests have been erased without going through the finalizer
+        this->prefetches_in_flight = 0;
 
         infolog(log, "All async requests are cancelled");
     }
+
+    // the probes are not started anymore, but their timers may still be pending
+    this->upstream_probes.clear();
+    this->timers_loop.reset();
+    this->response_times.clear();
+
+    if (this->settings != nullptr && !this->settings->dns_cache_snapshot_path.empty()
+            && this->settings->dns_cache_size != 0) {
+        infolog(log, "Saving cache snapshot...");
+        if (err_string err = this->cache.save(this->settings->dns_cache_snapshot_path); err.has_value()) {
+            warnlog(log, "Failed to save cache snapshot to {}: {}", this->settings->dns_cache_snapshot_path, *err);
+        }
+        infolog(log, "Done");
+    }
     this->settings = nullptr;
 
     infolog(log, "Destroying upstreams...");
+    this->balancer.init(dnsproxy_upstream_balancing::LOWEST_SCORE, {});
+    this->circuit_breaker.init(0, {});
+    this->upstreams_ranking.init({});
+    this->fallbacks_ranking.init({});
     this->upstreams.clear();
     infolog(log, "Done");
 
@@ -743,26 +877,112 @@ void dns_forwarder::deinit() {
 
     {
         infolog(log, "Clearing cache...");
-        std::scoped_lock l(this->response_cache.mtx);
-        this->response_cache.val.clear();
+        this->cache.clear();
+        this->negative_cache.clear();
+        this->filtering_cache.clear();
+        this->filtering_cache_mem_usage = 0;
+        this->rrsets.clear();
         infolog(log, "Done");
     }
 
     infolog(log, "Deinitialized");
 }
 
+// Calls `f(code, data)` for each EDNS option of the packet.
+// Returns false if the options are malformed.
+template <typename F>
+static bool for_each_edns_option(const ldns_pkt *pkt, F &&f) {
+    const ldns_rdf *rdf = ldns_pkt_edns_data(pkt);
+    if (rdf == nullptr) {
+        return true;
+    }
+    uint8_view options = { ldns_rdf_data(rdf), ldns_rdf_size(rdf) };
+    while (!options.empty()) {
+        if (options.size() < 4) {
+            return false;
+        }
+        uint16_t code = (options[0] << 8) | options[1];
+        uint16_t length = (options[2] << 8) | options[3];
+        if (options.size() < 4 + (size_t) length) {
+            return false;
+        }
+        f(code, options.substr(4, length));
+        options.remove_prefix(4 + length);
+    }
+    return true;
+}
+
+// EDNS options which are specific to the client or the transport and do not affect the answer
+static bool is_cache_neutral_edns_option(uint16_t code) {
+    return code == EDNS_COOKIE_OPTION_CODE
+           || code == EDNS_TCP_KEEPALIVE_OPTION_CODE
+           || code == EDNS_PADDING_OPTION_CODE;
+}
+
+// Cache-neutral EDNS options are not considered extensions, as they don't affect the answer
 static bool has_unsupported_extensions(const ldns_pkt *pkt) {
-    return ldns_pkt_edns_data(pkt)
-           || ldns_pkt_edns_extended_rcode(pkt)
-           || ldns_pkt_edns_unassigned(pkt);
+    if (ldns_pkt_edns_extended_rcode(pkt) || ldns_pkt_edns_unassigned(pkt)) {
+        return true;
+    }
+    bool has_other_options = false;
+    bool well_formed = for_each_edns_option(pkt, [&] (uint16_t code, uint8_view) {
+        has_other_options = has_other_options || !is_cache_neutral_edns_option(code);
+    });
+    return !well_formed || has_other_options;
+}
+
+static bool has_edns_option(const ldns_pkt *pkt, uint16_t code) {
+    bool found = false;
+    for_each_edns_option(pkt, [&] (uint16_t c, uint8_view) {
+        found = found || c == code;
+    });
+    return found;
+}
+
+// Removes the cache-neutral EDNS options from the packet, so that the response of the upstream
+// to one client (e.g. its cookie) is not given to the other ones
+static void strip_cache_neutral_edns_options(ldns_pkt *pkt) {
+    uint8_vector kept;
+    bool stripped = false;
+    for_each_edns_option(pkt, [&] (uint16_t code, uint8_view data) {
+        if (is_cache_neutral_edns_option(code)) {
+            stripped = true;
+            return;
+        }
+        kept.insert(kept.end(), { uint8_t(code >> 8), uint8_t(code), uint8_t(data.size() >> 8), uint8_t(data.size()) });
+        kept.insert(kept.end(), data.begin(), data.end());
+    });
+    if (!stripped) {
+        return;
+    }
+    ldns_rdf_deep_free(ldns_pkt_edns_data(pkt));
+    ldns_pkt_set_edns_data(pkt, kept.empty()
+            ? nullptr
+            : ldns_rdf_new_frm_data(LDNS_RDF_TYPE_UNKNOWN, kept.size(), kept.data()));
+}
+
+// Get a copy of the response to the identical request patched to answer this request
+static upstream_exchange_result make_follower_result(const ldns_pkt *request, const ldns_pkt *leader_response,
+                                                     const err_string &error, upstream *selected_upstream) {
+    if (leader_response == nullptr) {
+        return {nullptr, error, selected_upstream};
+    }
+    ldns_pkt_ptr response(ldns_pkt_clone(leader_response));
+    ldns_pkt_set_id(response.get(), ldns_pkt_id(request));
+    strip_cache_neutral_edns_options(response.get());
+    // the question may differ in the name case
+    ldns_rr_list_deep_free(ldns_pkt_question(response.get()));
+    ldns_pkt_set_question(response.get(), ldns_rr_list_clone(ldns_pkt_question(request)));
+    return {std::move(response), std::nullopt, selected_upstream};
 }
 
-// Returns null result if no cache entry satisfies the given key.
+// Returns empty result if no cache entry satisfies the given key.
 // Otherwise, a response is synthesized from the cached template.
-// If the cache entry is expired, it becomes least recently used,
+// If the cache entry is expired, it is displaced first,
 // all response records' TTLs are set to 1 second,
 // and `expired` is set to `true`.
-cache_result dns_forwarder::create_response_from_cache(const std::string &key, const ldns_pkt *request) {
+cache_result dns_forwarder::create_response_from_cache(const cache_key &key, const ldns_pkt *request,
+                                                       uint8_view request_wire) {
     cache_result r{};
 
     if (!this->settings->dns_cache_size) { // Caching disabled
@@ -774,53 +994,45 @@ cache_result dns_forwarder::create_response_from_cache(const std::string &key, c
         return r;
     }
 
-    uint32_t ttl;
-    {
-        std::shared_lock l(this->response_cache.mtx);
-        auto &cache = this->response_cache.val;
-
-        auto cached_response_acc = cache.get(key);
-        if (!cached_response_acc) {
-            dbglog(log, "{}: Cache miss for key {}", __func__, key);
-            return {nullptr};
-        }
-
-        r.upstream_id = cached_response_acc->upstream_id;
-        auto cached_response_ttl = ceil<seconds>(cached_response_acc->expires_at - ag::steady_clock::now());
+    bool padding_requested = has_edns_option(request, EDNS_PADDING_OPTION_CODE);
+    auto make_response = [&] (const cached_response &entry) {
+        uint32_t ttl;
+        auto cached_response_ttl = ceil<seconds>(entry.expires_at - ag::steady_clock::now());
         if (cached_response_ttl.count() <= 0) {
-            cache.make_lru(cached_response_acc);
-            dbglog(log, "{}: Expired cache entry for key {}", __func__, key);
+            dbglog(log, "{}: Expired cache entry for key {}", __func__, key.str());
             ttl = 1;
             r.expired = true;
         } else {
             ttl = cached_response_ttl.count();
+            uint32_t hits = entry.hits.increment();
+            const std::optional<dns_cache_prefetch_settings> &prefetch = this->settings->dns_cache_prefetch;
+            r.prefetch = prefetch.has_value() && hits >= prefetch->min_hits
+                    && (uint64_t) ttl * 100 <= (uint64_t) entry.ttl * prefetch->remaining_ttl_percent;
         }
 
-        r.response.reset(ldns_pkt_clone(cached_response_acc->response.get()));
-    }
-
-    // Patch response id
-    ldns_pkt_set_id(r.response.get(), ldns_pkt_id(request));
-
-    // Patch EDNS UDP SIZE
-    if (ldns_pkt_edns(r.response.get())) {
-        ldns_pkt_set_edns_udp_size(r.response.get(), ag::UDP_RECV_BUF_SIZE);
-    }
-
-    // Patch response question section
-    assert(!ldns_pkt_question(r.response.get()));
-    ldns_pkt_set_qdcount(r.response.get(), ldns_pkt_qdcount(request));
-    ldns_pkt_set_question(r.response.get(), ldns_pkt_get_section_clone(request, LDNS_SECTION_QUESTION));
-
-    // Patch response TTLs
-    for (int_fast32_t i = 0; i < ldns_pkt_ancount(r.response.get()); ++i) {
-        ldns_rr_set_ttl(ldns_rr_list_rr(ldns_pkt_answer(r.response.get()), i), ttl);
-    }
-    for (int_fast32_t i = 0; i < ldns_pkt_nscount(r.response.get()); ++i) {
-        ldns_rr_set_ttl(ldns_rr_list_rr(ldns_pkt_authority(r.response.get()), i), ttl);
+        // The ID, question and TTLs are patched right in the copy of the cached wire data
+        if (!entry.make_response(request_wire, ttl, r.response)) {
+            dbglog(log, "{}: Request question doesn't fit cache entry for key {}", __func__, key.str());
+            r.response.clear();
+            return r.expired;
+        }
+        // The cookie and keepalive options are not restored: the cookie of the upstream is not valid
+        // for the client, and both are optional in a response. The padding is restored if it fits.
+        if (padding_requested) {
+            entry.add_padding(r.response, RESPONSE_PADDING_BLOCK_SIZE, ldns_pkt_edns_udp_size(request));
+        }
+        r.status = entry.status;
+        r.answer = entry.answer;
+        r.upstream_id = entry.upstream_id;
+        return r.expired;
+    };
+    bool found = this->cache.find(key, make_response)
+            || (this->settings->dns_cache_negative_size != 0 && this->negative_cache.find(key, make_response));
+    if (!found) {
+        dbglog(log, "{}: Cache miss for key {}", __func__, key.str());
     }
-    for (int_fast32_t i = 0; i < ldns_pkt_arcount(r.response.get()); ++i) {
-        ldns_rr_set_ttl(ldns_rr_list_rr(ldns_pkt_additional(r.response.get()), i), ttl);
+    if (r.response.empty()) {
+        return {};
     }
 
     return r;
@@ -843,15 +1055,96 @@ uint32_t compute_min_rr_ttl(const ldns_pkt *pkt) {
     return min_rr_ttl;
 }
 
+// Synthesizes the response from the cached RRsets of the CNAME chain of the question.
+// The records may have been cached for the other questions, so the answer is filtered
+// the same way as the one from an upstream.
+std::optional<uint8_vector> dns_forwarder::create_response_from_rrsets(request_context &ctx) {
+    const ldns_pkt *request = ctx.request.get();
+    if (!this->settings->dns_cache_size || !this->settings->dns_cache_rrset_size || ctx.cache_key.flags != 0
+            || has_unsupported_extensions(request)) {
+        return std::nullopt;
+    }
+    const ldns_rr *question = ldns_rr_list_rr(ldns_pkt_question(request), 0);
+    std::optional<rrset_cache::answer> answer = this->rrsets.find(question);
+    if (!answer.has_value()) {
+        return std::nullopt;
+    }
+    dbglog_fid(log, request, "Synthesized response from {} cached records",
+               ldns_rr_list_rr_count(answer->records.get()));
+
+    ldns_pkt_ptr response(create_response_by_request(request));
+    ldns_pkt_set_rcode(response.get(), LDNS_RCODE_NOERROR);
+    ldns_pkt_set_rd(response.get(), ldns_pkt_rd(request));
+    if (ldns_pkt_edns(request)) {
+        ldns_pkt_set_edns_udp_size(response.get(), UDP_RECV_BUF_SIZE);
+    }
+    ldns_rr_list_deep_free(ldns_pkt_answer(response.get()));
+    ldns_pkt_set_answer(response.get(), answer->records.release());
+    ldns_pkt_set_ancount(response.get(), ldns_rr_list_rr_count(ldns_pkt_answer(response.get())));
+
+    for (size_t i = 0; i < ldns_pkt_ancount(response.get()); ++i) {
+        const ldns_rr *rr = ldns_rr_list_rr(ldns_pkt_answer(response.get()), i);
+        std::optional<uint8_vector> raw_blocking_response;
+        if (ldns_rr_get_type(rr) == LDNS_RR_TYPE_CNAME) {
+            raw_blocking_response = apply_cname_filter(rr, request, response.get(), ctx.event, ctx.effective_rules);
+        } else if (ldns_rr_get_type(rr) == LDNS_RR_TYPE_A || ldns_rr_get_type(rr) == LDNS_RR_TYPE_AAAA) {
+            raw_blocking_response = apply_ip_filter(rr, request, response.get(), ctx.event, ctx.effective_rules);
+        }
+        if (raw_blocking_response.has_value()) {
+            return raw_blocking_response;
+        }
+    }
+
+    log_packet(log, response.get(), "Response synthesized from cached records");
+    ctx.event.cache_hit = true;
+    finalize_processed_event(ctx.event, request, response.get(), nullptr, answer->upstream_id, std::nullopt);
+    return transform_response_to_raw_data(response.get());
+}
+
+size_t dns_forwarder::get_cache_memory_usage() const {
+    size_t filtering_cache_mem_usage;
+    {
+        std::shared_lock l(this->filtering_cache_mtx);
+        filtering_cache_mem_usage = this->filtering_cache_mem_usage;
+    }
+    return this->cache.mem_usage() + this->negative_cache.mem_usage() + this->rrsets.mem_usage()
+            + filtering_cache_mem_usage;
+}
+
+static bool has_answer_of_type(const ldns_pkt *pkt, ldns_rr_type type) {
+    for (int_fast32_t i = 0; i < ldns_pkt_ancount(pkt); ++i) {
+        const ldns_rr *rr = ldns_rr_list_rr(ldns_pkt_answer(pkt), i);
+        if (rr && (ldns_rr_get_type(rr) == type || type == LDNS_RR_TYPE_ANY)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Get the TTL of a negative response from its SOA record (RFC 2308 section 5), 0 if it has none
+static uint32_t compute_negative_ttl(const ldns_pkt *pkt) {
+    for (int_fast32_t i = 0; i < ldns_pkt_nscount(pkt); ++i) {
+        const ldns_rr *rr = ldns_rr_list_rr(ldns_pkt_authority(pkt), i);
+        if (rr == nullptr || ldns_rr_get_type(rr) != LDNS_RR_TYPE_SOA) {
+            continue;
+        }
+        const ldns_rdf *minimum = ldns_rr_rdf(rr, 6);
+        if (minimum == nullptr) {
+            return 0;
+        }
+        return std::min({ ldns_rr_ttl(rr), ldns_rdf2native_int32(minimum), MAX_NEGATIVE_TTL });
+    }
+    return 0;
+}
+
 // Checks cacheability and puts an eligible response to the cache
-void dns_forwarder::put_response_into_cache(std::string key, ldns_pkt_ptr response, std::optional<int32_t> upstream_id) {
+void dns_forwarder::put_response_into_cache(const cache_key &key, ldns_pkt_ptr response, std::optional<int32_t> upstream_id) {
     if (!this->settings->dns_cache_size) {
         // Caching disabled
         return;
     }
     if (ldns_pkt_tc(response.get()) // Truncated
         || ldns_pkt_qdcount(response.get()) != 1 // Invalid
-        || ldns_pkt_get_rcode(response.get()) != LDNS_RCODE_NOERROR // Error
         || has_unsupported_extensions(response.get())
         ) {
         // Not cacheable
@@ -860,50 +1153,116 @@ void dns_forwarder::put_response_into_cache(std::string key, ldns_pkt_ptr respon
 
     const auto *question = ldns_rr_list_rr(ldns_pkt_question(response.get()), 0);
     const auto type = ldns_rr_get_type(question);
-    if (type == LDNS_RR_TYPE_A || type == LDNS_RR_TYPE_AAAA) {
-        // Check contains at least one record of requested type
-        bool found = false;
-        for (int_fast32_t i = 0; i < ldns_pkt_ancount(response.get()); ++i) {
-            const ldns_rr *rr = ldns_rr_list_rr(ldns_pkt_answer(response.get()), i);
-            if (rr && ldns_rr_get_type(rr) == type) {
-                found = true;
-                break;
-            }
+    const auto rcode = ldns_pkt_get_rcode(response.get());
+    bool negative = this->settings->dns_cache_negative_size != 0
+            && (rcode == LDNS_RCODE_NXDOMAIN
+                || (rcode == LDNS_RCODE_NOERROR && !has_answer_of_type(response.get(), type)));
+
+    uint32_t min_rr_ttl = 0;
+    if (negative) {
+        // The TTL is bounded by the SOA record, and NXDOMAIN without one is not cacheable
+        min_rr_ttl = compute_negative_ttl(response.get());
+        // NODATA without one is cached as a positive response, as it is when negative caching is off
+        negative = min_rr_ttl != 0 || rcode != LDNS_RCODE_NOERROR;
+    }
+    if (!negative) {
+        if (rcode != LDNS_RCODE_NOERROR) {
+            // Not cacheable
+            return;
         }
-        if (!found) {
+        if ((type == LDNS_RR_TYPE_A || type == LDNS_RR_TYPE_AAAA) && !has_answer_of_type(response.get(), type)) {
             // Not cacheable
             return;
         }
+        // Compute the TTL of the cached response as the minimum of the response RR's TTLs
+        min_rr_ttl = compute_min_rr_ttl(response.get());
+    }
+    if (min_rr_ttl == 0) {
+        // Not cacheable
+        return;
     }
-
-    // Will be patched when returning the cached response
-    ldns_rr_list_deep_free(ldns_pkt_question(response.get()));
-    ldns_pkt_set_question(response.get(), nullptr);
-    ldns_pkt_set_qdcount(response.get(), 0);
 
     // This is NOT an authoritative answer
     ldns_pkt_set_aa(response.get(), false);
+    strip_cache_neutral_edns_options(response.get());
 
-    // Compute the TTL of the cached response as the minimum of the response RR's TTLs
-    uint32_t min_rr_ttl = compute_min_rr_ttl(response.get());
-    if (min_rr_ttl == 0) {
-        // Not cacheable
+    // The question, ID and TTLs will be patched when returning the cached response
+    std::optional<cached_response> cached_response = cached_response::create(
+            transform_response_to_raw_data(response.get()));
+    if (!cached_response.has_value()) {
+        dbglog_fid(log, response.get(), "Failed to parse serialized response");
         return;
     }
+    auto status = ag::allocated_ptr<char>(ldns_pkt_rcode2str(ldns_pkt_get_rcode(response.get())));
+    cached_response->status = status != nullptr ? status.get() : "";
+    cached_response->answer = dns_forwarder_utils::rr_list_to_string(ldns_pkt_answer(response.get()));
+    cached_response->expires_at = ag::steady_clock::now() + seconds(min_rr_ttl);
+    cached_response->ttl = min_rr_ttl;
+    cached_response->upstream_id = upstream_id;
+
+    // A response of the other kind for the same key is outdated now
+    if (negative) {
+        this->cache.erase(key);
+        this->negative_cache.insert(key, std::move(cached_response.value()));
+    } else {
+        if (this->settings->dns_cache_negative_size != 0) {
+            this->negative_cache.erase(key);
+        }
+        this->cache.insert(key, std::move(cached_response.value()));
+        if (this->settings->dns_cache_rrset_size != 0 && key.flags == 0) {
+            this->rrsets.insert(response.get(), upstream_id);
+        }
+    }
+}
 
-    cached_response cached_response{
-        .response = std::move(response),
-        .expires_at = ag::steady_clock::now() + seconds(min_rr_ttl),
-        .upstream_id = upstream_id,
-    };
+std::vector<uint8_t> dns_forwarder::handle_message(uint8_view message) {
+    request_context ctx;
+    if (std::optional<uint8_vector> response = process_request(message, ctx)) {
+        return std::move(response.value());
+    }
 
-    std::unique_lock l(this->response_cache.mtx);
-    auto &cache = this->response_cache.val;
-    cache.insert(std::move(key), std::move(cached_response));
+    upstream_exchange_result result = has_unsupported_extensions(ctx.request.get())
+            ? do_upstream_exchange(ctx.request.get())
+            : do_coalesced_upstream_exchange(ctx.cache_key, ctx.request.get(), ctx.is_follower);
+    return process_upstream_response(ctx, std::move(result));
 }
 
-std::vector<uint8_t> dns_forwarder::handle_message(uint8_view message) {
-    dns_request_processed_event event = {};
+void dns_forwarder::handle_message_async(uint8_view message, handle_message_callback callback) {
+    auto ctx = std::make_shared<request_context>();
+    if (std::optional<uint8_vector> response = process_request(message, *ctx)) {
+        callback(std::move(response.value()));
+        return;
+    }
+    ctx->callback = std::move(callback);
+
+    if (has_unsupported_extensions(ctx->request.get())) {
+        start_async_exchange(std::move(ctx));
+        return;
+    }
+
+    std::shared_ptr<inflight_request> inflight = join_inflight_request(ctx->cache_key, ctx->is_follower);
+    if (!ctx->is_follower) {
+        ctx->inflight = std::move(inflight);
+        start_async_exchange(std::move(ctx));
+        return;
+    }
+
+    std::unique_lock l(inflight->mtx);
+    if (!inflight->done) {
+        dbglog_id(log, ctx->request.get(), "Waiting for the identical request in flight: {}", ctx->cache_key.str());
+        inflight->async_followers.emplace_back(std::move(ctx));
+        return;
+    }
+    upstream_exchange_result result = make_follower_result(ctx->request.get(), inflight->response.get(),
+                                                           inflight->error, inflight->selected_upstream);
+    l.unlock();
+    ctx->callback(process_upstream_response(*ctx, std::move(result)));
+}
+
+// Handles the request up to the upstream exchange.
+// Returns the response if it's been found in the cache, or the request is blocked or malformed.
+std::optional<uint8_vector> dns_forwarder::process_request(uint8_view message, request_context &ctx) {
+    dns_request_processed_event &event = ctx.event;
     event.start_time = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
 
     ldns_pkt *request;
@@ -914,9 +1273,10 @@ std::vector<uint8_t> dns_forwarder::handle_message(uint8_view message) {
         dbglog(log, "{} {}", __func__, err);
         finalize_processed_event(event, nullptr, nullptr, nullptr, std::nullopt, std::move(err));
         // @todo: think out what to do in this case
-        return {};
+        return uint8_vector{};
     }
-    ldns_pkt_ptr req_holder = ldns_pkt_ptr(request);
+    ctx.request = ldns_pkt_ptr(request);
+    ctx.request_size = message.size();
     log_packet(log, request, "Client dns request");
 
     const ldns_rr *question = ldns_rr_list_rr(ldns_pkt_question(request), 0);
@@ -933,31 +1293,25 @@ std::vector<uint8_t> dns_forwarder::handle_message(uint8_view message) {
     auto domain = allocated_ptr<char>(ldns_rdf2str(ldns_rr_owner(question)));
     event.domain = domain.get();
 
-    std::string cache_key = get_cache_key(request);
-    cache_result cached = create_response_from_cache(cache_key, request);
+    ctx.cache_key = get_cache_key(request);
+    const ag::cache_key &cache_key = ctx.cache_key;
+    cache_result cached = create_response_from_cache(cache_key, request, message);
 
-    if (cached.response) {
+    if (!cached.response.empty()) {
         if (cached.expired) {
             if (!settings->optimistic_cache) {
                 goto cached_response_expired;
             }
-            std::unique_lock l(async_reqs_mtx);
-            auto [it, emplaced] = async_reqs.emplace(std::piecewise_construct,
-                                                     std::forward_as_tuple(cache_key),
-                                                     std::forward_as_tuple());
-            if (emplaced) {
-                async_request &task = it->second;
-                task.forwarder = this;
-                task.request = std::move(req_holder);
-                task.cache_key = std::move(cache_key);
-                uv_queue_work(nullptr, &task.work, async_request_worker, async_request_finalizer);
-            }
+            start_async_request(cache_key, request, false);
+        } else if (cached.prefetch) {
+            start_async_request(cache_key, request, true);
         }
-        log_packet(log, cached.response.get(), "Cached response");
+        log_packet(log, {cached.response.data(), cached.response.size()}, "Cached response");
         event.cache_hit = true;
-        std::vector<uint8_t> raw_response = transform_response_to_raw_data(cached.response.get());
-        finalize_processed_event(event, request, cached.response.get(), nullptr, cached.upstream_id, std::nullopt);
-        return raw_response;
+        event.status = std::move(cached.status);
+        event.answer = std::move(cached.answer);
+        finalize_processed_event(event, request, nullptr, nullptr, cached.upstream_id, std::nullopt);
+        return std::move(cached.response);
     }
 
 cached_response_expired:
@@ -979,7 +1333,7 @@ cached_response_expired:
     }
     tracelog_fid(log, request, "Query domain: {}", pure_domain);
 
-    std::vector<dnsfilter::rule> effective_rules;
+    std::vector<dnsfilter::rule> &effective_rules = ctx.effective_rules;
 
     // IPv6 blocking
     if (this->settings->block_ipv6 && LDNS_RR_TYPE_AAAA == type) {
@@ -991,20 +1345,39 @@ cached_response_expired:
             log_packet(log, response.get(), "IPv6 blocking response");
             return transform_response_to_raw_data(response.get());
         }
-        return *raw_blocking_response;
+        return raw_blocking_response;
+    }
+
+    if (auto raw_blocking_response = apply_request_filter(cache_key, pure_domain, request, message,
+                                                          event, effective_rules)) {
+        return raw_blocking_response;
     }
 
-    if (auto raw_blocking_response = apply_filter(pure_domain, request, nullptr, event, effective_rules)) {
-        return *raw_blocking_response;
+    // Unlike the whole responses, the RRsets are shared between the names, so the cached ones
+    // are only used after the question has passed the filter
+    if (cached.response.empty()) {
+        if (std::optional<uint8_vector> response = create_response_from_rrsets(ctx)) {
+            return response;
+        }
     }
 
-    auto [response, err_str, selected_upstream] = do_upstream_exchange(request);
+    return std::nullopt;
+}
+
+// Handles the outcome of the upstream exchange of the request passed by `process_request()`
+std::vector<uint8_t> dns_forwarder::process_upstream_response(request_context &ctx, upstream_exchange_result result) {
+    dns_request_processed_event &event = ctx.event;
+    std::vector<dnsfilter::rule> &effective_rules = ctx.effective_rules;
+    ldns_pkt *request = ctx.request.get();
+    const ldns_rr_type type = ldns_rr_get_type(ldns_rr_list_rr(ldns_pkt_question(request), 0));
+
+    auto &[response, err_str, selected_upstream] = result;
     if (!response) {
         response = ldns_pkt_ptr(create_servfail_response(request));
         log_packet(log, response.get(), "Server failure response");
         std::vector<uint8_t> raw_response = transform_response_to_raw_data(response.get());
         finalize_processed_event(event, request, response.get(), nullptr,
-                                 std::make_optional(selected_upstream->options().id),
+                                 selected_upstream ? std::make_optional(selected_upstream->options().id) : std::nullopt,
                                  std::move(err_str));
         return raw_response;
     }
@@ -1040,7 +1413,7 @@ cached_response_expired:
                 }
             }
             if (!has_aaaa) {
-                if (auto synth_response = try_dns64_aaaa_synthesis(selected_upstream, req_holder)) {
+                if (auto synth_response = try_dns64_aaaa_synthesis(selected_upstream, ctx.request)) {
                     response = std::move(synth_response);
                     log_packet(log, response.get(), "DNS64 synthesized response");
                 }
@@ -1049,11 +1422,13 @@ cached_response_expired:
     }
 
     std::vector<uint8_t> raw_response = transform_response_to_raw_data(response.get());
-    event.bytes_sent = message.size();
+    event.bytes_sent = ctx.request_size;
     event.bytes_received = raw_response.size();
     finalize_processed_event(event, request, response.get(), nullptr,
                              selected_upstream->options().id, std::nullopt);
-    put_response_into_cache(std::move(cache_key), std::move(response), selected_upstream->options().id);
+    if (!ctx.is_follower) { // the leader has already cached the same response
+        put_response_into_cache(ctx.cache_key, std::move(response), selected_upstream->options().id);
+    }
     return raw_response;
 }
 
@@ -1097,11 +1472,12 @@ std::optional<uint8_vector> dns_forwarder::apply_ip_filter(const ldns_rr *rr,
         return std::nullopt;
     }
     uint8_view addr{ldns_rdf_data(rdf), ldns_rdf_size(rdf)};
-    std::string addr_str = ag::utils::addr_to_str(addr);
 
-    tracelog_fid(log, response, "Response IP: {}", addr_str);
+    tracelog_fid(log, response, "Response IP: {}", ag::utils::addr_to_str(addr));
 
-    return apply_filter(addr_str, request, response, event, last_effective_rules);
+    // the address is matched in the raw form, so that it is not formatted for every answer record
+    return apply_rules(this->filter.match_ip(this->filter_handle, addr),
+                       request, response, event, last_effective_rules);
 }
 
 std::optional<uint8_vector> dns_forwarder::apply_filter(std::string_view hostname, const ldns_pkt *request,
@@ -1109,7 +1485,104 @@ std::optional<uint8_vector> dns_forwarder::apply_filter(std::string_view hostnam
                                                         dns_request_processed_event &event,
                                                         std::vector<dnsfilter::rule> &last_effective_rules,
                                                         bool fire_event, ldns_pkt_rcode *out_rcode) {
-    auto rules = this->filter.match(this->filter_handle, hostname);
+    return apply_rules(this->filter.match(this->filter_handle, hostname),
+                       request, original_response, event, last_effective_rules, fire_event, out_rcode);
+}
+
+size_t filtering_outcome::mem_usage() const {
+    // The blocking response accounts for the key and the bookkeeping data of the cache as well
+    size_t size = (this->response.has_value() ? this->response->mem_usage() : sizeof(*this) + sizeof(cache_key))
+            + this->effective_rules.capacity() * sizeof(dnsfilter::rule);
+    for (const dnsfilter::rule &rule : this->effective_rules) {
+        size += rule.text.capacity() + (rule.ip.has_value() ? rule.ip->capacity() : 0);
+    }
+    return size;
+}
+
+// Same as `apply_filter()`, but the outcome is taken from the cache if the same question
+// has been blocked or allowlisted before, and put there otherwise
+std::optional<uint8_vector> dns_forwarder::apply_request_filter(const cache_key &key, std::string_view hostname,
+                                                                const ldns_pkt *request, uint8_view request_wire,
+                                                                dns_request_processed_event &event,
+                                                                std::vector<dnsfilter::rule> &last_effective_rules) {
+    if (!this->settings->dns_cache_size) { // Caching disabled
+        return apply_filter(hostname, request, nullptr, event, last_effective_rules);
+    }
+
+    {
+        std::shared_lock l(this->filtering_cache_mtx);
+        if (auto outcome = this->filtering_cache.get(key); outcome) {
+            uint8_vector response;
+            if (!outcome->response.has_value()
+                    || outcome->response->make_response(request_wire, this->settings->blocked_response_ttl_secs,
+                                                        response)) {
+                dbglog_fid(log, request, "Filtering outcome found in cache for key {}", key.str());
+                std::vector<const dnsfilter::rule *> effective_rules;
+                effective_rules.reserve(outcome->effective_rules.size());
+                for (const dnsfilter::rule &rule : outcome->effective_rules) {
+                    effective_rules.push_back(&rule);
+                }
+                event_append_rules(event, effective_rules);
+                last_effective_rules = outcome->effective_rules;
+                if (!outcome->response.has_value()) {
+                    return std::nullopt;
+                }
+                event.cache_hit = true;
+                event.status = outcome->response->status;
+                event.answer = outcome->response->answer;
+                l.unlock();
+                log_packet(log, { response.data(), response.size() }, "Cached blocking response");
+                finalize_processed_event(event, request, nullptr, nullptr, std::nullopt, std::nullopt);
+                return response;
+            }
+        }
+    }
+
+    std::optional<uint8_vector> raw_blocking_response = apply_filter(hostname, request, nullptr, event,
+                                                                     last_effective_rules);
+    if (last_effective_rules.empty()) {
+        // Not cached, so that the outcomes of the most requests do not displace the others
+        return raw_blocking_response;
+    }
+    filtering_outcome outcome{ last_effective_rules };
+    if (raw_blocking_response.has_value()) {
+        outcome.response = cached_response::create(*raw_blocking_response);
+        if (!outcome.response.has_value()) {
+            return raw_blocking_response;
+        }
+        // Filled in by `apply_filter()`
+        outcome.response->status = event.status;
+        outcome.response->answer = event.answer;
+    }
+    size_t entry_size = outcome.mem_usage();
+    size_t memory_limit = this->filtering_cache_memory_limit;
+    std::unique_lock l(this->filtering_cache_mtx);
+    if (auto old = this->filtering_cache.get(key); old) {
+        this->filtering_cache_mem_usage -= old->mem_usage();
+        this->filtering_cache.erase(key);
+    }
+    if (memory_limit != 0 && entry_size > memory_limit) {
+        return raw_blocking_response;
+    }
+    // displace the entries here rather than in the cache itself to keep the memory usage up to date
+    while (this->filtering_cache.size() >= this->filtering_cache.max_size()
+            || (memory_limit != 0 && this->filtering_cache_mem_usage + entry_size > memory_limit)) {
+        auto displaced = this->filtering_cache.displace();
+        if (!displaced.has_value()) {
+            break;
+        }
+        this->filtering_cache_mem_usage -= displaced->second.mem_usage();
+    }
+    this->filtering_cache_mem_usage += entry_size;
+    this->filtering_cache.insert(key, std::move(outcome));
+    return raw_blocking_response;
+}
+
+std::optional<uint8_vector> dns_forwarder::apply_rules(std::vector<dnsfilter::rule> rules, const ldns_pkt *request,
+                                                       const ldns_pkt *original_response,
+                                                       dns_request_processed_event &event,
+                                                       std::vector<dnsfilter::rule> &last_effective_rules,
+                                                       bool fire_event, ldns_pkt_rcode *out_rcode) {
     for (const dnsfilter::rule &rule : rules) {
         tracelog_fid(log, request, "Matched rule: {}", rule.text);
     }
@@ -1141,34 +1614,109 @@ std::optional<uint8_vector> dns_forwarder::apply_filter(std::string_view hostnam
     return raw_response;
 }
 
+// Update the statistics of the upstream with the outcome of an exchange
+void dns_forwarder::update_upstream_stats(upstream *upstream, microseconds elapsed, bool failed) {
+    upstream->update_stats(elapsed, failed);
+    this->upstreams_ranking.on_stats_updated(upstream);
+    this->fallbacks_ranking.on_stats_updated(upstream);
+    if (auto it = this->response_times.find(upstream); !failed && it != this->response_times.end()) {
+        it->second->add(duration_cast<milliseconds>(elapsed));
+    }
+    if (this->circuit_breaker.on_exchange_result(upstream, failed)) {
+        warnlog(log, "Upstream ({}) is down after {} failed exchanges in a row", upstream->options().address,
+                this->settings->upstream_circuit_breaker->failures_threshold);
+        schedule_upstream_probe(upstream);
+    }
+}
+
+dns_forwarder::upstream_probe::~upstream_probe() {
+    if (timer != nullptr) {
+        event_free(timer);
+    }
+}
+
+void dns_forwarder::schedule_upstream_probe(const upstream *upstream) {
+    if (auto it = this->upstream_probes.find(upstream); it != this->upstream_probes.end()) {
+        timeval tv = utils::duration_to_timeval(this->settings->upstream_circuit_breaker->probe_interval);
+        evtimer_add(it->second->timer, &tv);
+    }
+}
+
+// Send a query to the down upstream to find out if it's back up.
+// The asynchronous upstreams wait for the response on their event loops, the rest occupy a worker thread.
+void dns_forwarder::on_upstream_probe_timer(evutil_socket_t, short, void *arg) {
+    auto *probe = (upstream_probe *) arg;
+    dns_forwarder *self = probe->forwarder;
+    {
+        std::scoped_lock l(self->async_reqs_mtx);
+        if (self->upstream_probing_stopped || !self->circuit_breaker.is_down(probe->target)) {
+            return;
+        }
+        ++self->async_exchanges_in_flight;
+    }
+
+    std::shared_ptr<ldns_pkt> request(ldns_pkt_query_new(ldns_dname_new_frm_str("."), LDNS_RR_TYPE_NS,
+                                                         LDNS_RR_CLASS_IN, LDNS_RD), ldns_pkt_free);
+    ldns_pkt_set_random_id(request.get());
+    dbglog(self->log, "Probing upstream ({})", probe->target->options().address);
+    self->start_upstream_exchange(probe->target, request.get(), [probe, request](upstream::exchange_result result) {
+        probe->forwarder->on_upstream_probe_result(*probe, std::move(result));
+    });
+}
+
+void dns_forwarder::on_upstream_probe_result(upstream_probe &probe, upstream::exchange_result result) {
+    // Any response means the upstream is reachable, even if it can't resolve the probe query
+    if (!result.error.has_value()) {
+        if (this->circuit_breaker.mark_up(probe.target)) {
+            infolog(log, "Upstream ({}) is up again", probe.target->options().address);
+        }
+    } else {
+        dbglog(log, "Upstream ({}) probe failed: {}", probe.target->options().address, result.error.value());
+    }
+
+    this->async_reqs_mtx.lock();
+    if (!this->upstream_probing_stopped && this->circuit_breaker.is_down(probe.target)) {
+        schedule_upstream_probe(probe.target);
+    }
+    --this->async_exchanges_in_flight;
+    this->async_reqs_mtx.unlock();
+    this->async_reqs_cv.notify_all();
+}
+
 upstream_exchange_result dns_forwarder::do_upstream_exchange(ldns_pkt *request) {
     assert(this->upstreams.size() + this->fallbacks.size());
-    upstream *cur_upstream;
+    upstream *cur_upstream = nullptr;
     std::string err_str;
-    for (auto *upstream_vector : { &this->upstreams, &this->fallbacks }) {
-        std::vector<upstream *> sorted_upstreams;
-        sorted_upstreams.reserve(upstream_vector->size());
-        for (auto &u : *upstream_vector) {
-            sorted_upstreams.push_back(u.get());
-        }
-        std::sort(sorted_upstreams.begin(), sorted_upstreams.end(), [](upstream *a, upstream *b) {
-            return (a->rtt() < b->rtt());
-        });
-
-        for (auto &sorted_upstream : sorted_upstreams) {
-            cur_upstream = sorted_upstream;
+    // The down upstreams are skipped, unless there is nothing else to try
+    bool skip_down = !this->circuit_breaker.are_all_down();
+    for (const upstream_ranking *ranking : { &this->upstreams_ranking, &this->fallbacks_ranking }) {
+        upstream_ranking::order sorted_upstreams = (ranking == &this->upstreams_ranking)
+                ? this->balancer.select(ranking->get())
+                : ranking->get();
+
+        for (size_t i = 0; i < sorted_upstreams.size(); ++i) {
+            if (skip_down && this->circuit_breaker.is_down(sorted_upstreams[i])) {
+                continue;
+            }
+            cur_upstream = sorted_upstreams[i];
 
             ag::utils::timer t;
             tracelog_id(log, request, "Upstream ({}) is starting an exchange", cur_upstream->options().address);
-            upstream::exchange_result result = cur_upstream->exchange(request);
+            upstream::exchange_result result = exchange_with_upstream(cur_upstream, request);
             tracelog_id(log, request, "Upstream's ({}) exchanging is done", cur_upstream->options().address);
-            cur_upstream->adjust_rtt(t.elapsed<std::chrono::milliseconds>());
+            // A failure other than timeout is retried, and it's the outcome of the retry which is counted
+            bool retry = result.error.has_value() && result.error.value() != TIMEOUT_STR;
+            if (!retry) {
+                update_upstream_stats(cur_upstream, t.elapsed<microseconds>(), result.error.has_value());
+            }
 
             if (!result.error.has_value()) {
                 return {std::move(result.packet), std::nullopt, cur_upstream};
-            } else if (result.error.value() != TIMEOUT_STR) {
+            } else if (retry) {
                 // https://github.com/AdguardTeam/DnsLibs/issues/86
-                upstream::exchange_result retry_result = cur_upstream->exchange(request);
+                t = ag::utils::timer{};
+                upstream::exchange_result retry_result = exchange_with_upstream(cur_upstream, request);
+                update_upstream_stats(cur_upstream, t.elapsed<microseconds>(), retry_result.error.has_value());
                 if (!retry_result.error.has_value()) {
                     return {std::move(retry_result.packet), std::nullopt, cur_upstream};
                 }
@@ -1181,22 +1729,427 @@ upstream_exchange_result dns_forwarder::do_upstream_exchange(ldns_pkt *request)
             }
         }
     }
+    if (cur_upstream == nullptr) {
+        // the rest of the upstreams have gone down while skipping the down ones
+        err_str = "All upstreams are down";
+    }
     return {nullptr, std::move(err_str), cur_upstream};
 }
 
+// Find the exchange of the identical request in flight, or register a new one led by the caller
+std::shared_ptr<dns_forwarder::inflight_request> dns_forwarder::join_inflight_request(const cache_key &key,
+                                                                                      bool &is_follower) {
+    std::scoped_lock l(this->inflight_reqs_mtx);
+    auto [it, emplaced] = this->inflight_reqs.try_emplace(key);
+    if (emplaced) {
+        it->second = std::make_shared<inflight_request>();
+    }
+    is_follower = !emplaced;
+    return it->second;
+}
+
+// Pass the result of the leader's exchange to the followers
+void dns_forwarder::complete_inflight_request(const cache_key &key, inflight_request &inflight,
+                                              const upstream_exchange_result &result) {
+    {
+        std::scoped_lock l(this->inflight_reqs_mtx);
+        this->inflight_reqs.erase(key);
+    }
+    std::vector<std::shared_ptr<request_context>> async_followers;
+    {
+        std::scoped_lock l(inflight.mtx);
+        inflight.done = true;
+        if (result.response != nullptr) {
+            inflight.response.reset(ldns_pkt_clone(result.response.get()));
+        }
+        inflight.error = result.error;
+        inflight.selected_upstream = result.upstream;
+        async_followers.swap(inflight.async_followers);
+    }
+    inflight.cv.notify_all();
+
+    for (std::shared_ptr<request_context> &ctx : async_followers) {
+        upstream_exchange_result follower_result = make_follower_result(ctx->request.get(), result.response.get(),
+                                                                        result.error, result.upstream);
+        ctx->callback(process_upstream_response(*ctx, std::move(follower_result)));
+    }
+}
+
+// Exchange the request with an upstream, or, if an identical request is already being exchanged,
+// wait for its result and get a copy of the response patched to answer this request
+upstream_exchange_result dns_forwarder::do_coalesced_upstream_exchange(const cache_key &key, ldns_pkt *request,
+                                                                       bool &is_follower) {
+    std::shared_ptr<inflight_request> inflight = join_inflight_request(key, is_follower);
+
+    if (!is_follower) {
+        upstream_exchange_result result = do_upstream_exchange(request);
+        complete_inflight_request(key, *inflight, result);
+        return result;
+    }
+
+    dbglog_id(log, request, "Waiting for the identical request in flight: {}", key.str());
+    std::unique_lock l(inflight->mtx);
+    if (!inflight->cv.wait_for(l, this->inflight_wait_timeout, [&inflight] { return inflight->done; })) {
+        return {nullptr, "Timed out waiting for the identical request in flight", nullptr};
+    }
+    return make_follower_result(request, inflight->response.get(), inflight->error, inflight->selected_upstream);
+}
+
+// Run the function on the thread pool
+static void queue_work(std::function<void()> func) {
+    struct work_task {
+        uv_work_t work{};
+        std::function<void()> func;
+    };
+    auto *task = new work_task{{}, std::move(func)};
+    task->work.data = task;
+    uv_queue_work(nullptr, &task->work,
+            [](uv_work_t *work) {
+                ((work_task *) work->data)->func();
+            },
+            [](uv_work_t *work, int) {
+                delete (work_task *) work->data;
+            });
+}
+
+// Exchange the request with the upstream, counting the exchange in flight for the balancer
+upstream::exchange_result dns_forwarder::exchange_with_upstream(upstream *upstream, ldns_pkt *request) {
+    this->balancer.on_exchange_started(upstream);
+    upstream::exchange_result result = upstream->exchange(request);
+    this->balancer.on_exchange_finished(upstream);
+    return result;
+}
+
+// Exchange the request with the upstream, and pass the result to the handler on the thread pool
+void dns_forwarder::start_upstream_exchange(upstream *upstream, ldns_pkt *request,
+                                            std::function<void(upstream::exchange_result)> handler) {
+    if (!upstream->is_exchange_async()) {
+        queue_work([this, upstream, request, handler = std::move(handler)] {
+            handler(exchange_with_upstream(upstream, request));
+        });
+        return;
+    }
+
+    this->balancer.on_exchange_started(upstream);
+    upstream->exchange_async(request, [this, upstream, handler = std::move(handler)](
+            upstream::exchange_result result) mutable {
+        this->balancer.on_exchange_finished(upstream);
+        // Don't occupy the upstream's event loop with handling the result
+        queue_work([handler = std::move(handler),
+                    result = std::make_shared<upstream::exchange_result>(std::move(result))] {
+            handler(std::move(*result));
+        });
+    });
+}
+
+dns_forwarder::async_exchange::~async_exchange() {
+    if (hedge_timer_event != nullptr) {
+        // waits for the timer callback if it's running
+        event_free(hedge_timer_event);
+    }
+    forwarder->async_reqs_mtx.lock();
+    --forwarder->async_exchanges_in_flight;
+    forwarder->async_reqs_mtx.unlock();
+    forwarder->async_reqs_cv.notify_all();
+}
+
+// Exchange the request of the asynchronously handled message, and pass the response to its callback.
+// No thread waits for the response of an upstream supporting asynchronous exchanges:
+// the next step is taken on the thread pool when the upstream reports the result.
+void dns_forwarder::start_async_exchange(std::shared_ptr<request_context> ctx) {
+    assert(this->upstreams.size() + this->fallbacks.size());
+    {
+        std::scoped_lock l(this->async_reqs_mtx);
+        ++this->async_exchanges_in_flight;
+    }
+    auto task = std::make_shared<async_exchange>();
+    task->forwarder = this;
+    task->ctx = std::move(ctx);
+    task->upstreams.reserve(this->upstreams.size() + this->fallbacks.size());
+    // The down upstreams are skipped, unless there is nothing else to try
+    bool skip_down = !this->circuit_breaker.are_all_down();
+    size_t main_upstreams_num = 0;
+    for (const upstream_ranking *ranking : { &this->upstreams_ranking, &this->fallbacks_ranking }) {
+        upstream_ranking::order sorted_upstreams = (ranking == &this->upstreams_ranking)
+                ? this->balancer.select(ranking->get())
+                : ranking->get();
+        for (size_t i = 0; i < sorted_upstreams.size(); ++i) {
+            if (!skip_down || !this->circuit_breaker.is_down(sorted_upstreams[i])) {
+                task->upstreams.push_back(sorted_upstreams[i]);
+            }
+        }
+        if (ranking == &this->upstreams_ranking) {
+            main_upstreams_num = task->upstreams.size();
+        }
+    }
+    if (task->upstreams.empty()) {
+        // the rest of the upstreams have gone down while skipping the down ones
+        finish_async_exchange(*task, {nullptr, "All upstreams are down", nullptr});
+        return;
+    }
+
+    // the hedged exchange goes to the second of the main upstreams, not to a fallback one
+    bool hedge = this->settings->upstream_hedging.has_value() && main_upstreams_num > 1;
+    if (hedge) {
+        this->hedge_budget.on_exchange();
+        // copied before the first upstream starts the exchange, since the upstreams may modify the request
+        task->hedged_request.reset(ldns_pkt_clone(task->ctx->request.get()));
+    }
+    continue_async_exchange(task);
+    if (hedge) {
+        schedule_hedged_exchange(std::move(task));
+    }
+}
+
+// Start an exchange with the current upstream of the task
+void dns_forwarder::continue_async_exchange(std::shared_ptr<async_exchange> task) {
+    // `next_upstream` is changed only by the thread handling the result of this exchange
+    upstream *cur_upstream = task->upstreams[task->next_upstream];
+    ldns_pkt *request = task->ctx->request.get();
+    task->timer = ag::utils::timer{};
+    if (!task->is_retry) {
+        tracelog_id(log, request, "Upstream ({}) is starting an exchange", cur_upstream->options().address);
+    }
+
+    start_upstream_exchange(cur_upstream, request, [task](upstream::exchange_result result) mutable {
+        dns_forwarder *self = task->forwarder;
+        self->on_async_exchange_result(std::move(task), std::move(result));
+    });
+}
+
+void dns_forwarder::on_async_exchange_result(std::shared_ptr<async_exchange> task, upstream::exchange_result result) {
+    upstream *cur_upstream = task->upstreams[task->next_upstream];
+    ldns_pkt *request = task->ctx->request.get();
+    if (!task->is_retry) {
+        tracelog_id(log, request, "Upstream's ({}) exchanging is done", cur_upstream->options().address);
+    }
+    // A failure other than timeout is retried, and it's the outcome of the retry which is counted
+    bool retry = !task->is_retry && result.error.has_value() && result.error.value() != TIMEOUT_STR;
+    if (!retry) {
+        update_upstream_stats(cur_upstream, task->timer.elapsed<microseconds>(), result.error.has_value());
+    }
+
+    if (!result.error.has_value()) {
+        finish_async_exchange(*task, {std::move(result.packet), std::nullopt, cur_upstream});
+        return;
+    }
+
+    if (retry) {
+        if (std::scoped_lock l(task->mtx); task->finished) {
+            // the hedged exchange has already succeeded, and the request may be in use for the response
+            return;
+        }
+        // https://github.com/AdguardTeam/DnsLibs/issues/86
+        task->is_retry = true;
+        task->first_error = std::move(result.error.value());
+        continue_async_exchange(std::move(task));
+        return;
+    }
+
+    if (task->is_retry) {
+        task->error = AG_FMT("Upstream ({}) exchange failed: first reason is {}, second is: {}",
+                             cur_upstream->options().address, task->first_error, result.error.value());
+        dbglog_id(log, request, "{}", task->error);
+    } else {
+        dbglog_id(log, request, "Upstream ({}) exchange failed: {}",
+                  cur_upstream->options().address, result.error.value());
+    }
+
+    task->is_retry = false;
+    std::unique_lock l(task->mtx);
+    if (task->finished) {
+        // the hedged exchange has already succeeded
+        return;
+    }
+    if (++task->next_upstream == 1 && task->hedge != async_exchange::HEDGE_NONE) {
+        // the second upstream is already used by the hedged exchange
+        ++task->next_upstream;
+    }
+    if (task->next_upstream == task->upstreams.size()) {
+        if (task->hedge == async_exchange::HEDGE_IN_FLIGHT) {
+            task->is_given_up = true;
+            task->failure = {nullptr, std::move(task->error), cur_upstream};
+            return;
+        }
+        l.unlock();
+        finish_async_exchange(*task, {nullptr, std::move(task->error), cur_upstream});
+        return;
+    }
+    l.unlock();
+    continue_async_exchange(std::move(task));
+}
+
+void dns_forwarder::finish_async_exchange(async_exchange &task, upstream_exchange_result result) {
+    event *hedge_timer_event = nullptr;
+    {
+        std::scoped_lock l(task.mtx);
+        if (task.finished) {
+            return;
+        }
+        task.finished = true;
+        hedge_timer_event = std::exchange(task.hedge_timer_event, nullptr);
+    }
+    if (hedge_timer_event != nullptr) {
+        // the hedged exchange is not needed anymore
+        event_free(hedge_timer_event);
+    }
+    request_context &ctx = *task.ctx;
+    if (std::shared_ptr<inflight_request> inflight = std::move(ctx.inflight)) {
+        complete_inflight_request(ctx.cache_key, *inflight, result);
+    }
+    ctx.callback(process_upstream_response(ctx, std::move(result)));
+}
+
+// Start the hedged exchange if the first upstream doesn't respond in time.
+// The delay follows the response times of the upstream, so that only the exchanges
+// which are unusually slow for it are hedged.
+void dns_forwarder::schedule_hedged_exchange(std::shared_ptr<async_exchange> task) {
+    const upstream_hedging_settings &hedging = this->settings->upstream_hedging.value();
+    milliseconds delay = hedging.max_delay;
+    if (auto it = this->response_times.find(task->upstreams[0]); it != this->response_times.end()) {
+        if (std::optional<milliseconds> percentile = it->second->percentile(hedging.delay_percentile)) {
+            delay = std::clamp(percentile.value(), hedging.min_delay, hedging.max_delay);
+        }
+    }
+
+    // The timer doesn't keep the task alive, and it's cancelled once the exchange is finished,
+    // so it doesn't delay the deinitialization of the forwarder
+    std::scoped_lock l(task->mtx);
+    if (task->finished) {
+        return;
+    }
+    task->hedge_timer_event = evtimer_new(this->timers_loop->c_base(), on_hedge_timer, task.get());
+    timeval tv = utils::duration_to_timeval(delay);
+    evtimer_add(task->hedge_timer_event, &tv);
+}
+
+void dns_forwarder::on_hedge_timer(evutil_socket_t, short, void *arg) {
+    // If the task is being destroyed, its destructor waits for this callback to return
+    std::shared_ptr<async_exchange> task = ((async_exchange *) arg)->weak_from_this().lock();
+    if (task == nullptr) {
+        return;
+    }
+    {
+        std::scoped_lock l(task->mtx);
+        if (task->finished || task->next_upstream != 0) {
+            return;
+        }
+    }
+    queue_work([task = std::move(task)] {
+        task->forwarder->start_hedged_exchange(task);
+    });
+}
+
+void dns_forwarder::start_hedged_exchange(std::shared_ptr<async_exchange> task) {
+    upstream *hedge_upstream = task->upstreams[1];
+    ldns_pkt *request = task->hedged_request.get();
+    {
+        std::scoped_lock l(task->mtx);
+        if (task->finished || task->next_upstream != 0) {
+            return;
+        }
+        if (!this->hedge_budget.try_spend()) {
+            dbglog_id(log, request, "Upstream ({}) is slow, but the hedged exchanges are limited",
+                      task->upstreams[0]->options().address);
+            return;
+        }
+        task->hedge = async_exchange::HEDGE_IN_FLIGHT;
+    }
+
+    dbglog_id(log, request, "Upstream ({}) is slow, hedging the exchange with upstream ({})",
+              task->upstreams[0]->options().address, hedge_upstream->options().address);
+    task->hedge_timer = ag::utils::timer{};
+    start_upstream_exchange(hedge_upstream, request, [task](upstream::exchange_result result) mutable {
+        dns_forwarder *self = task->forwarder;
+        self->on_hedged_exchange_result(std::move(task), std::move(result));
+    });
+}
+
+void dns_forwarder::on_hedged_exchange_result(std::shared_ptr<async_exchange> task, upstream::exchange_result result) {
+    upstream *hedge_upstream = task->upstreams[1];
+    ldns_pkt *request = task->hedged_request.get();
+    update_upstream_stats(hedge_upstream, task->hedge_timer.elapsed<microseconds>(), result.error.has_value());
+
+    if (!result.error.has_value()) {
+        tracelog_id(log, request, "Upstream's ({}) hedged exchanging is done", hedge_upstream->options().address);
+        finish_async_exchange(*task, {std::move(result.packet), std::nullopt, hedge_upstream});
+        return;
+    }
+
+    dbglog_id(log, request, "Upstream ({}) hedged exchange failed: {}",
+              hedge_upstream->options().address, result.error.value());
+    upstream_exchange_result failure;
+    {
+        std::scoped_lock l(task->mtx);
+        task->hedge = async_exchange::HEDGE_FAILED;
+        if (!task->is_given_up) {
+            return;
+        }
+        failure = std::move(task->failure);
+    }
+    finish_async_exchange(*task, std::move(failure));
+}
+
+// Refresh the cache entry in the background unless it is already being refreshed.
+// Prefetching is subject to the limits from the settings.
+void dns_forwarder::start_async_request(const cache_key &key, const ldns_pkt *request, bool prefetch) {
+    std::unique_lock l(this->async_reqs_mtx);
+    if (prefetch) {
+        if (this->async_reqs.count(key) != 0) {
+            return;
+        }
+        const dns_cache_prefetch_settings &limits = *this->settings->dns_cache_prefetch;
+        if (this->prefetches_in_flight >= limits.max_in_flight) {
+            dbglog(log, "{}: Too many prefetches in flight, skipping {}", __func__, key.str());
+            return;
+        }
+        auto now = ag::steady_clock::now();
+        if (now - this->prefetch_window_start >= seconds(1)) {
+            this->prefetch_window_start = now;
+            this->prefetch_window_count = 0;
+        }
+        if (this->prefetch_window_count >= limits.max_per_second) {
+            dbglog(log, "{}: Prefetch rate limit exceeded, skipping {}", __func__, key.str());
+            return;
+        }
+    }
+
+    auto [it, emplaced] = this->async_reqs.emplace(std::piecewise_construct,
+                                                   std::forward_as_tuple(key),
+                                                   std::forward_as_tuple());
+    if (!emplaced) {
+        return;
+    }
+    async_request &task = it->second;
+    task.forwarder = this;
+    // the request is copied, since the caller frees it regardless of the task lifetime
+    task.request = ldns_pkt_ptr(ldns_pkt_clone(request));
+    task.cache_key = key;
+    task.prefetch = prefetch;
+    if (prefetch) {
+        ++this->prefetches_in_flight;
+        ++this->prefetch_window_count;
+        dbglog(log, "{}: Prefetching {}", __func__, key.str());
+    }
+    uv_queue_work(nullptr, &task.work, async_request_worker, async_request_finalizer);
+}
+
 void dns_forwarder::async_request_worker(uv_work_t *work) {
     auto *task = (async_request *) work->data;
     auto *self = task->forwarder;
     auto *req = task->request.get();
-    const std::string &key = task->cache_key;
+    const cache_key &key = task->cache_key;
 
-    dbglog_id(self->log, req, "Starting async upstream exchange for {}", key);
+    dbglog_id(self->log, req, "Starting async upstream exchange for {}", key.str());
 
     auto [res, err, upstream] = self->do_upstream_exchange(req);
-    if (!res) {
+    if (!res && task->prefetch) {
+        // the entry has not expired yet, so it is still good
+        dbglog_id(self->log, req, "Prefetch failed: {}", *err);
+    } else if (!res) {
         dbglog_id(self->log, req, "Async upstream exchange failed: {}, removing entry from cache", *err);
-        std::unique_lock l(self->response_cache.mtx);
-        self->response_cache.val.erase(key);
+        self->cache.erase(key);
+        self->negative_cache.erase(key);
     } else {
         log_packet(self->log, res.get(), "Async upstream exchange result");
         self->put_response_into_cache(key, std::move(res), upstream->options().id);
@@ -1206,8 +2159,12 @@ void dns_forwarder::async_request_worker(uv_work_t *work) {
 void dns_forwarder::async_request_finalizer(uv_work_t *work, int) {
     auto *task = (async_request *) work->data;
     auto *self = task->forwarder;
-    std::string key = std::move(task->cache_key);
+    // copied, since the task containing the key is destroyed on erase
+    cache_key key = task->cache_key;
     self->async_reqs_mtx.lock();
+    if (task->prefetch) {
+        --self->prefetches_in_flight;
+    }
     self->async_reqs.erase(key);
     self->async_reqs_mtx.unlock();
     self->async_reqs_cv.notify_all();
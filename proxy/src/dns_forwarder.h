@@ -10,22 +10,40 @@
 #include <dnsfilter.h>
 #include <dns64.h>
 #include <upstream.h>
+#include <event_loop.h>
 #include <certificate_verifier.h>
-#include <shared_mutex>
 #include <uv.h>
+#include "response_cache.h"
+#include "rrset_cache.h"
+#include "upstream_hedging.h"
+#include "upstream_ranking.h"
+#include "upstream_balancer.h"
+#include "upstream_circuit_breaker.h"
 
-namespace ag {
+struct event;
 
-struct cached_response {
-    ldns_pkt_ptr response;
-    ag::steady_clock::time_point expires_at;
-    std::optional<int32_t> upstream_id;
-};
+namespace ag {
 
 struct cache_result {
-    ldns_pkt_ptr response;
+    uint8_vector response; // response in the wire format (empty if there is no suitable entry)
+    std::string status; // see `cached_response::status`
+    std::string answer; // see `cached_response::answer`
     std::optional<int32_t> upstream_id;
     bool expired;
+    bool prefetch; // the response is popular and expires soon, so it should be refreshed
+};
+
+/**
+ * Outcome of filtering a request which matched some rules
+ */
+struct filtering_outcome {
+    std::vector<dnsfilter::rule> effective_rules; // see `dnsfilter::get_effective_rules()`
+    std::optional<cached_response> response; // the blocking response (nullopt if the request is allowlisted)
+
+    /**
+     * Get the approximate number of bytes occupied by the outcome in the cache
+     */
+    size_t mem_usage() const;
 };
 
 struct upstream_exchange_result {
@@ -56,15 +74,84 @@ public:
 
     std::vector<uint8_t> handle_message(uint8_view message);
 
+    using handle_message_callback = std::function<void(std::vector<uint8_t>)>;
+
+    void handle_message_async(uint8_view message, handle_message_callback callback);
+
+    size_t get_cache_memory_usage() const;
+
 private:
+    struct inflight_request;
+
+    // State of a request which needs an upstream exchange, passed on to processing the upstream response
+    struct request_context {
+        dns_request_processed_event event;
+        ldns_pkt_ptr request;
+        ag::cache_key cache_key;
+        size_t request_size = 0;
+        std::vector<dnsfilter::rule> effective_rules;
+        std::shared_ptr<inflight_request> inflight; // set if the exchange is shared with the identical requests
+        bool is_follower = false; // the exchange is performed by the identical request in flight
+        handle_message_callback callback; // set for the requests handled asynchronously
+    };
+
+    std::optional<uint8_vector> process_request(uint8_view message, request_context &ctx);
+
+    std::vector<uint8_t> process_upstream_response(request_context &ctx, upstream_exchange_result result);
+
     static void async_request_worker(uv_work_t *);
     static void async_request_finalizer(uv_work_t *, int);
 
+    void start_async_request(const cache_key &key, const ldns_pkt *request, bool prefetch);
+
+    void update_upstream_stats(upstream *upstream, std::chrono::microseconds elapsed, bool failed);
+
+    struct upstream_probe;
+
+    void schedule_upstream_probe(const upstream *upstream);
+
+    static void on_upstream_probe_timer(evutil_socket_t, short, void *arg);
+
+    void on_upstream_probe_result(upstream_probe &probe, upstream::exchange_result result);
+
     upstream_exchange_result do_upstream_exchange(ldns_pkt *request);
 
-    cache_result create_response_from_cache(const std::string &key, const ldns_pkt *request);
+    upstream_exchange_result do_coalesced_upstream_exchange(const cache_key &key, ldns_pkt *request,
+                                                            bool &is_follower);
+
+    std::shared_ptr<inflight_request> join_inflight_request(const cache_key &key, bool &is_follower);
+
+    void complete_inflight_request(const cache_key &key, inflight_request &inflight,
+                                   const upstream_exchange_result &result);
+
+    struct async_exchange;
+
+    void start_async_exchange(std::shared_ptr<request_context> ctx);
 
-    void put_response_into_cache(std::string key, ldns_pkt_ptr response, std::optional<int32_t> upstream_id);
+    void continue_async_exchange(std::shared_ptr<async_exchange> task);
+
+    void on_async_exchange_result(std::shared_ptr<async_exchange> task, upstream::exchange_result result);
+
+    void finish_async_exchange(async_exchange &task, upstream_exchange_result result);
+
+    void schedule_hedged_exchange(std::shared_ptr<async_exchange> task);
+
+    static void on_hedge_timer(evutil_socket_t, short, void *arg);
+
+    void start_hedged_exchange(std::shared_ptr<async_exchange> task);
+
+    void on_hedged_exchange_result(std::shared_ptr<async_exchange> task, upstream::exchange_result result);
+
+    upstream::exchange_result exchange_with_upstream(upstream *upstream, ldns_pkt *request);
+
+    void start_upstream_exchange(upstream *upstream, ldns_pkt *request,
+                                 std::function<void(upstream::exchange_result)> handler);
+
+    cache_result create_response_from_cache(const cache_key &key, const ldns_pkt *request, uint8_view request_wire);
+
+    std::optional<uint8_vector> create_response_from_rrsets(request_context &ctx);
+
+    void put_response_into_cache(const cache_key &key, ldns_pkt_ptr response, std::optional<int32_t> upstream_id);
 
     std::optional<uint8_vector> apply_filter(std::string_view hostname,
                                              const ldns_pkt *request,
@@ -73,6 +160,20 @@ private:
                                              std::vector<dnsfilter::rule> &last_effective_rules,
                                              bool fire_event = true, ldns_pkt_rcode *out_rcode = nullptr);
 
+    std::optional<uint8_vector> apply_request_filter(const cache_key &key,
+                                                     std::string_view hostname,
+                                                     const ldns_pkt *request,
+                                                     uint8_view request_wire,
+                                                     dns_request_processed_event &event,
+                                                     std::vector<dnsfilter::rule> &last_effective_rules);
+
+    std::optional<uint8_vector> apply_rules(std::vector<dnsfilter::rule> rules,
+                                            const ldns_pkt *request,
+                                            const ldns_pkt *original_response,
+                                            dns_request_processed_event &event,
+                                            std::vector<dnsfilter::rule> &last_effective_rules,
+                                            bool fire_event = true, ldns_pkt_rcode *out_rcode = nullptr);
+
     std::optional<uint8_vector> apply_cname_filter(const ldns_rr *cname_rr, const ldns_pkt *request,
                                                    const ldns_pkt *response, dns_request_processed_event &event,
                                                    std::vector<dnsfilter::rule> &last_effective_rules);
@@ -92,19 +193,33 @@ private:
     const dnsproxy_events *events = nullptr;
     std::vector<upstream_ptr> upstreams;
     std::vector<upstream_ptr> fallbacks;
+    upstream_ranking upstreams_ranking;
+    upstream_ranking fallbacks_ranking;
+    upstream_balancer balancer; // see `dnsproxy_settings::upstream_balancing`
+    upstream_circuit_breaker circuit_breaker; // see `dnsproxy_settings::upstream_circuit_breaker`
     dnsfilter filter;
     dnsfilter::handle filter_handle = nullptr;
     dns64::prefixes dns64_prefixes;
     std::shared_ptr<certificate_verifier> cert_verifier;
     std::shared_ptr<route_resolver> router;
 
-    with_mtx<lru_cache<std::string, cached_response>, std::shared_mutex> response_cache;
+    response_cache cache;
+    response_cache negative_cache; // see `dnsproxy_settings::dns_cache_negative_size`
+    rrset_cache rrsets; // see `dnsproxy_settings::dns_cache_rrset_size`
+    // Outcomes of filtering the blocked and allowlisted requests. The filter and the blocking mode
+    // do not change until the forwarder is reinitialized, so the cache is dropped along with them.
+    // Its memory is counted in `get_cache_memory_usage()` and limited with a share of `dns_cache_memory_limit`.
+    lru_cache<cache_key, filtering_outcome> filtering_cache;
+    size_t filtering_cache_mem_usage = 0; // guarded by `filtering_cache_mtx`
+    size_t filtering_cache_memory_limit = 0; // 0 means no limit
+    mutable std::shared_mutex filtering_cache_mtx;
 
     struct async_request {
         uv_work_t work{};
         dns_forwarder *forwarder{};
         ldns_pkt_ptr request;
-        std::string cache_key;
+        ag::cache_key cache_key;
+        bool prefetch = false; // refreshing an unexpired entry (see `dnsproxy_settings::dns_cache_prefetch`)
 
         async_request() {
             work.data = this;
@@ -112,9 +227,85 @@ private:
     };
 
     // Map of async requests in flight (cache key -> uv work handle)
-    std::unordered_map<std::string, async_request> async_reqs;
+    std::unordered_map<cache_key, async_request> async_reqs;
     std::mutex async_reqs_mtx;
     std::condition_variable async_reqs_cv;
+    // Upstream exchange shared by the identical requests arriving while it is in flight
+    struct inflight_request {
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool done = false;
+        ldns_pkt_ptr response; // the followers get copies of this (guarded by `mtx`)
+        err_string error;
+        upstream *selected_upstream = nullptr;
+        // The followers handled asynchronously, completed by the leader instead of waiting on `cv`
+        std::vector<std::shared_ptr<request_context>> async_followers;
+    };
+
+    // Map of foreground upstream exchanges in flight (cache key -> exchange)
+    std::unordered_map<cache_key, std::shared_ptr<inflight_request>> inflight_reqs;
+    std::mutex inflight_reqs_mtx;
+    // How long a request waits for the identical one in flight
+    std::chrono::milliseconds inflight_wait_timeout{0};
+
+    // Upstream exchange of a request handled asynchronously.
+    // Tries the upstreams in the same order and with the same retries as `do_upstream_exchange()`.
+    // If the exchange is hedged (see `dnsproxy_settings::upstream_hedging`), the second upstream
+    // exchanges a copy of the request in parallel with the first one, and the first response wins.
+    // Destroyed when both of the exchanges are done.
+    struct async_exchange : std::enable_shared_from_this<async_exchange> {
+        enum hedge_state {
+            HEDGE_NONE,
+            HEDGE_IN_FLIGHT,
+            HEDGE_FAILED,
+        };
+
+        dns_forwarder *forwarder{};
+        std::shared_ptr<request_context> ctx;
+        std::vector<upstream *> upstreams; // the ranked upstreams and then fallbacks, except the down ones
+        bool is_retry = false;
+        ag::utils::timer timer;
+        std::string first_error; // the error of the first attempt if retrying
+        std::string error; // the last failure for the response
+        ldns_pkt_ptr hedged_request; // copy of the request for the hedged exchange (null if it's not hedged)
+        ag::utils::timer hedge_timer;
+
+        std::mutex mtx; // guards the fields below
+        size_t next_upstream = 0; // the upstream currently exchanging the request
+        bool finished = false; // the response has been passed to the callback
+        hedge_state hedge = HEDGE_NONE;
+        bool is_given_up = false; // all the upstreams failed, waiting for the hedged exchange
+        upstream_exchange_result failure; // the result to report if the hedged exchange fails too
+        event *hedge_timer_event{}; // fires on `timers_loop` to start the hedged exchange, freed once it's finished
+
+        ~async_exchange();
+    };
+
+    // Number of asynchronous exchanges and upstream probes in flight (guarded by `async_reqs_mtx`)
+    size_t async_exchanges_in_flight = 0;
+
+    // Response times of the successful exchanges (filled only if the exchanges are hedged)
+    std::unordered_map<const upstream *, std::unique_ptr<response_time_histogram>> response_times;
+    hedging_budget hedge_budget;
+    event_loop_ptr timers_loop; // runs the timers starting the hedged exchanges and the upstream probes
+
+    // Background probing of a down upstream
+    struct upstream_probe {
+        dns_forwarder *forwarder{};
+        upstream *target{};
+        event *timer{}; // fires on `timers_loop` when it's time to probe the upstream
+
+        ~upstream_probe();
+    };
+
+    // Probes of the upstreams, if the circuit breaker is enabled (upstream -> probe)
+    std::unordered_map<const upstream *, std::unique_ptr<upstream_probe>> upstream_probes;
+    bool upstream_probing_stopped = false; // guarded by `async_reqs_mtx`
+
+    // Prefetch limits state (guarded by `async_reqs_mtx`)
+    size_t prefetches_in_flight = 0;
+    ag::steady_clock::time_point prefetch_window_start;
+    size_t prefetch_window_count = 0; // number of prefetches started since `prefetch_window_start`
 };
 
 } // namespace ag
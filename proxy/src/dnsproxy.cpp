@@ -24,7 +24,17 @@ static const dnsproxy_settings DEFAULT_PROXY_SETTINGS = {
     .ipv6_available = true,
     .blocking_mode = dnsproxy_blocking_mode::DEFAULT,
     .dns_cache_size = 1000,
+    .dns_cache_negative_size = 1000,
+    .dns_cache_rrset_size = 0,
+    .dns_cache_memory_limit = 0,
+    .dns_cache_shards_num = 0,
+    .dns_cache_policy = dnsproxy_cache_policy::LRU,
+    .dns_cache_snapshot_path = {},
     .optimistic_cache = true,
+    .dns_cache_prefetch = std::nullopt,
+    .upstream_hedging = std::nullopt,
+    .upstream_balancing = dnsproxy_upstream_balancing::LOWEST_SCORE,
+    .upstream_circuit_breaker = std::nullopt,
 };
 
 const dnsproxy_settings &dnsproxy_settings::get_default() {
@@ -116,6 +126,14 @@ std::vector<uint8_t> dnsproxy::handle_message(ag::uint8_view message) {
     return response;
 }
 
+void dnsproxy::handle_message_async(ag::uint8_view message, handle_message_callback callback) {
+    this->pimpl->forwarder.handle_message_async(message, std::move(callback));
+}
+
+size_t dnsproxy::get_cache_memory_usage() const {
+    return this->pimpl->forwarder.get_cache_memory_usage();
+}
+
 const char *ag::dnsproxy::version() {
     return AG_DNSLIBS_VERSION;
 }
@@ -5,6 +5,7 @@
 #include <uv.h>
 #include <thread>
 #include <atomic>
+#include <mutex>
 #include <magic_enum.hpp>
 #include <algorithm>
 #include <cassert>
@@ -29,6 +30,67 @@ static void dealloc_buf(const uv_buf_t *buf) {
     delete[] buf->base;
 }
 
+// Passes the responses completed on the other threads to the event loop thread
+class response_queue {
+public:
+    using handler = std::function<void(ag::uint8_vector)>;
+
+    // Called on event loop's thread
+    int init(uv_loop_t *loop) {
+        int err = uv_async_init(loop, &m_async, async_cb);
+        m_async.data = this;
+        return err;
+    }
+
+    // Drops the queued responses and the ones completed from now on
+    // Called on event loop's thread
+    void close() {
+        {
+            std::scoped_lock l(m_mtx);
+            m_closed = true;
+            m_queue.clear();
+        }
+        uv_close((uv_handle_t *) &m_async, nullptr);
+    }
+
+    // Make a callback for `dnsproxy::handle_message_async()` which runs `h` on the event loop thread.
+    // `h` is not called if the queue has been closed by then.
+    // Called on event loop's thread
+    static ag::dnsproxy::handle_message_callback wrap(std::shared_ptr<response_queue> queue, handler h) {
+        return [queue = std::move(queue), h = std::move(h), loop_thread = std::this_thread::get_id()]
+                (ag::uint8_vector response) mutable {
+            if (std::this_thread::get_id() == loop_thread) { // Completed before `handle_message_async()` returned
+                h(std::move(response));
+                return;
+            }
+            std::scoped_lock l(queue->m_mtx);
+            if (queue->m_closed) {
+                return;
+            }
+            queue->m_queue.emplace_back(std::move(h), std::move(response));
+            uv_async_send(&queue->m_async);
+        };
+    }
+
+private:
+    uv_async_t m_async{};
+    std::mutex m_mtx;
+    bool m_closed{false};
+    std::vector<std::pair<handler, ag::uint8_vector>> m_queue;
+
+    static void async_cb(uv_async_t *handle) {
+        auto *self = (response_queue *) handle->data;
+        std::vector<std::pair<handler, ag::uint8_vector>> queue;
+        {
+            std::scoped_lock l(self->m_mtx);
+            queue.swap(self->m_queue);
+        }
+        for (auto &[h, response] : queue) {
+            h(std::move(response));
+        }
+    }
+};
+
 // Abstract base for listeners, does uv initialization/stopping
 class listener_base : public ag::dnsproxy_listener {
 protected:
@@ -38,6 +100,8 @@ protected:
     using uv_loop_ptr = std::unique_ptr<uv_loop_t, ag::ftor<&uv_loop_delete>>;
     uv_loop_ptr m_loop;
     uv_async_t m_escape_hatch{};
+    // Shared with the callbacks of the messages in process, which may complete after the listener is destroyed
+    std::shared_ptr<response_queue> m_responses = std::make_shared<response_queue>();
     ag::socket_address m_address;
     ag::listener_settings m_settings;
 
@@ -56,6 +120,7 @@ protected:
 private:
     static void escape_hatch_cb(uv_async_t *handle) {
         auto *self = (listener_base *) handle->data;
+        self->m_responses->close();
         self->before_stop();
         uv_close((uv_handle_t *) &self->m_escape_hatch, nullptr);
     }
@@ -121,8 +186,16 @@ public:
         }
         m_escape_hatch.data = this;
 
+        // Init the response queue
+        if ((err = m_responses->init(m_loop.get()))) {
+            uv_close((uv_handle_t *) &m_escape_hatch, nullptr);
+            run_loop(m_loop.get(), UV_RUN_DEFAULT);
+            return fmt::format("uv_async_init failed: {}", uv_strerror(err));
+        }
+
         const auto err_str = before_run();
         if (err_str.has_value()) {
+            m_responses->close();
             uv_close((uv_handle_t *) &m_escape_hatch, nullptr);
 
             // Run the loop once to let libuv close the handles cleanly
@@ -161,62 +234,36 @@ public:
 
 class listener_udp : public listener_base {
 private:
-    struct task {
-        uv_work_t work_req{};
+    struct send_req {
+        uv_udp_send_t req{};
         listener_udp *self;
-        ag::socket_address peer;
-        uv_buf_t request;
-        ag::uint8_vector response; // Filled in work_cb
+        ag::uint8_vector response;
 
-        // Takes ownership of request buffer
-        task(listener_udp *self, const sockaddr *addr, uv_buf_t request)
-                : self(self), peer(addr), request(request) {
+        send_req(listener_udp *self, ag::uint8_vector response)
+                : self(self), response(std::move(response)) {
 
-            work_req.data = this;
-        }
-
-        ~task() {
-            dealloc_buf(&request);
+            req.data = this;
         }
     };
 
     uv_udp_t m_udp_handle{};
-    ag::hash_set<task *> m_pending; // Messages not yet processed by the proxy
-
-    static void work_cb(uv_work_t *req) {
-        auto *m = (task *) req->data;
-        m->response = m->self->m_proxy->handle_message({(uint8_t *) m->request.base, m->request.len});
-    }
 
     static void send_cb(uv_udp_send_t *req, int status) {
-        auto *m = (task *) req->data;
+        auto *r = (send_req *) req->data;
         if (status != 0) {
-            dbglog(m->self->m_log, "{} error: {}", __func__, uv_strerror(status));
+            dbglog(r->self->m_log, "{} error: {}", __func__, uv_strerror(status));
         }
-        delete req;
-        delete m;
+        delete r;
     }
 
-    static void after_work_cb(uv_work_t *req, int status) {
-        auto *m = (task *) req->data;
-
-        m->self->m_pending.erase(m);
-
-        if (status == UV_ECANCELED) {
-            delete m;
-            return;
-        }
-
-        auto resp_buf = uv_buf_init((char *) m->response.data(), m->response.size());
-
-        auto *send_req = new uv_udp_send_t;
-        send_req->data = m;
+    void send_response(const ag::socket_address &peer, ag::uint8_vector response) {
+        auto *r = new send_req(this, std::move(response));
+        auto resp_buf = uv_buf_init((char *) r->response.data(), r->response.size());
 
-        const int err = uv_udp_send(send_req, &m->self->m_udp_handle, &resp_buf, 1, m->peer.c_sockaddr(), send_cb);
+        const int err = uv_udp_send(&r->req, &m_udp_handle, &resp_buf, 1, peer.c_sockaddr(), send_cb);
         if (err < 0) {
-            dbglog(m->self->m_log, "uv_udp_send failed: {}", uv_strerror(err));
-            delete send_req;
-            delete m;
+            dbglog(m_log, "uv_udp_send failed: {}", uv_strerror(err));
+            delete r;
         }
     }
 
@@ -240,9 +287,13 @@ private:
             return;
         }
 
-        auto *m = new task(self, addr, *buf);
-        uv_queue_work(self->m_loop.get(), &m->work_req, work_cb, after_work_cb);
-        self->m_pending.insert(m);
+        // The response is sent from the event loop thread, after the listener has checked it's still running
+        self->m_proxy->handle_message_async({(uint8_t *) buf->base, (size_t) nread},
+                response_queue::wrap(self->m_responses, [self, peer = ag::socket_address(addr)]
+                        (ag::uint8_vector response) {
+                    self->send_response(peer, std::move(response));
+                }));
+        dealloc_buf(buf);
     }
 
 protected:
@@ -283,10 +334,6 @@ protected:
 
     void before_stop() override {
         uv_close((uv_handle_t *) &m_udp_handle, nullptr);
-
-        for (auto *m : m_pending) {
-            uv_cancel((uv_req_t *) &m->work_req);
-        }
     }
 };
 
@@ -346,6 +393,7 @@ public:
     // Call after *handle() is properly initialized
     void start(uv_loop_t *loop,
                ag::dnsproxy *proxy,
+               std::shared_ptr<response_queue> responses,
                bool persistent,
                std::chrono::milliseconds idle_timeout,
                std::function<void(uint64_t)> close_callback) {
@@ -357,6 +405,7 @@ public:
         uv_timer_init(loop, m_idle_timer);
 
         m_proxy = proxy;
+        m_responses = std::move(responses);
         m_persistent = persistent;
         m_idle_timeout = idle_timeout;
         m_close_callback = std::move(close_callback);
@@ -376,21 +425,6 @@ public:
     }
 
 private:
-    struct work {
-        uv_work_t req{};
-        tcp_dns_connection *c;
-        ag::uint8_vector payload;
-        bool canceled;
-        std::mutex mtx;
-
-        work(tcp_dns_connection *c, ag::uint8_vector &&payload)
-                : c{c},
-                  payload{std::move(payload)},
-                  canceled{false} {
-            this->req.data = this;
-        }
-    };
-
     struct write {
         uv_write_t req{};
         ag::uint8_vector payload;
@@ -409,6 +443,10 @@ private:
     const uint64_t m_id;
     ag::logger m_log;
     ag::dnsproxy *m_proxy{};
+    std::shared_ptr<response_queue> m_responses;
+    // Points to this connection until it's closed, checked by the handlers of the responses
+    // (accessed on event loop's thread only)
+    std::shared_ptr<tcp_dns_connection *> m_self_ref = std::make_shared<tcp_dns_connection *>(this);
     bool m_persistent{false};
     uint8_t m_incoming_buf[TCP_RECV_BUF_SIZE]{};
     uv_tcp_t *m_tcp{};
@@ -417,7 +455,6 @@ private:
     std::function<void(uint64_t)> m_close_callback;
     bool m_closed{false};
     tcp_dns_payload_parser m_parser;
-    ag::hash_set<work *> m_pending_works;
 
     static void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
         auto *c = (tcp_dns_connection *) handle->data;
@@ -438,13 +475,20 @@ private:
         c->m_parser.push_data({c->m_incoming_buf, (size_t) nread});
 
         ag::uint8_vector payload;
+        std::shared_ptr<tcp_dns_connection *> ref = c->m_self_ref;
         while (c->m_parser.next_payload(payload)) {
             uv_timer_again(c->m_idle_timer);
 
-            auto *w = new work(c, std::move(payload));
-
-            uv_queue_work(stream->loop, &w->req, work_cb, after_work_cb);
-            c->m_pending_works.insert(w);
+            // The connection may be closed, and even destroyed, by the time the response is ready
+            c->m_proxy->handle_message_async({payload.data(), payload.size()},
+                    response_queue::wrap(c->m_responses, [ref](ag::uint8_vector response) {
+                        if (tcp_dns_connection *c = *ref) {
+                            c->do_write(std::move(response));
+                        }
+                    }));
+            if (*ref == nullptr) { // Closed on a failure to write the immediate response
+                return;
+            }
 
             if (!c->m_persistent) { // Stop after the first request
                 uv_read_stop(stream);
@@ -453,29 +497,6 @@ private:
         }
     }
 
-    static void work_cb(uv_work_t *w_req) {
-        auto *w = (work *) w_req->data;
-        std::scoped_lock l{w->mtx};
-        if (w->canceled) {
-            return;
-        }
-        auto *c = w->c;
-        w->payload = c->m_proxy->handle_message({w->payload.data(), w->payload.size()});
-    }
-
-    static void after_work_cb(uv_work_t *w_req, int status) {
-        auto *w = (work *) w_req->data;
-        {
-            std::scoped_lock l{w->mtx};
-            if (status == 0 && !w->canceled) {
-                auto *c = w->c;
-                c->m_pending_works.erase(w);
-                c->do_write(std::move(w->payload));
-            }
-        }
-        delete w;
-    }
-
     static void write_cb(uv_write_t *w_req, int status) {
         auto *w = (write *) w_req->data;
         auto *h = (uv_handle_t *) w_req->handle;
@@ -528,11 +549,7 @@ private:
         m_idle_timer->data = nullptr;
         uv_close((uv_handle_t *) m_idle_timer, close_cb);
 
-        std::for_each(m_pending_works.begin(), m_pending_works.end(), [](work *w) {
-            std::scoped_lock l{w->mtx};
-            uv_cancel((uv_req_t *) &w->req);
-            w->canceled = true;
-        });
+        *m_self_ref = nullptr;
 
         m_tcp->data = nullptr;
         uv_close((uv_handle_t *) m_tcp, close_cb);
@@ -574,6 +591,7 @@ private:
 
         conn->start(self->m_loop.get(),
                     self->m_proxy,
+                    self->m_responses,
                     self->m_settings.persistent,
                     self->m_settings.idle_timeout,
                     [self](uint64_t id) {
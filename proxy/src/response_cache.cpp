@@ -0,0 +1,499 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <ag_file.h>
+#include <ag_net_consts.h>
+#include <ag_sys.h>
+#include <ag_utils.h>
+#include "response_cache.h"
+
+
+using namespace ag;
+using namespace std::chrono;
+
+
+static constexpr size_t DNS_HEADER_SIZE = 12;
+static constexpr size_t DNS_ID_OFFSET = 0;
+static constexpr size_t DNS_QDCOUNT_OFFSET = 4;
+// Size of the record type, class, TTL and data length fields
+static constexpr size_t RR_FIXED_FIELDS_SIZE = 10;
+static constexpr uint16_t OPT_RR_TYPE = 41;
+// Size of the option code and option length fields
+static constexpr size_t EDNS_OPTION_HEADER_SIZE = 4;
+static constexpr uint8_t COMPRESSION_POINTER_MASK = 0xc0;
+
+// Approximate size of the key and the bookkeeping data of the eviction queue and map per entry
+static constexpr size_t ENTRY_OVERHEAD = sizeof(cache_key) + 6 * sizeof(void *);
+// Shards are not made smaller than this in case of memory limit, so that
+// the large responses are still cacheable
+static constexpr size_t MIN_SHARD_MEMORY_LIMIT = 64 * 1024;
+
+// Snapshot file: magic, version, wall clock time of saving (seconds since epoch), then the entries.
+// Entry: question type, class, key flags, name size, name, remaining TTL, upstream ID presence flag,
+// upstream ID (if present), status size, status, answer size, answer, response size, response.
+// The integers are in the network byte order.
+static constexpr uint8_t SNAPSHOT_MAGIC[] = { 'A', 'G', 'R', 'C' };
+static constexpr uint8_t SNAPSHOT_VERSION = 1;
+
+
+static inline uint16_t read_u16(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
+
+static inline void write_u16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline uint32_t read_u32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void write_u32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void append_u16(uint8_vector &buf, uint16_t v) {
+    buf.resize(buf.size() + 2);
+    write_u16(&buf[buf.size() - 2], v);
+}
+
+static void append_u32(uint8_vector &buf, uint32_t v) {
+    buf.resize(buf.size() + 4);
+    write_u32(&buf[buf.size() - 4], v);
+}
+
+static void append_bytes(uint8_vector &buf, const void *data, size_t size) {
+    buf.insert(buf.end(), (const uint8_t *)data, (const uint8_t *)data + size);
+}
+
+// Cut `n` bytes off the front of `data` (nullptr if there are not enough)
+static const uint8_t *take(uint8_view &data, size_t n) {
+    if (data.size() < n) {
+        return nullptr;
+    }
+    const uint8_t *p = data.data();
+    data.remove_prefix(n);
+    return p;
+}
+
+// Get the position next to the domain name starting at `pos` (0 in case of error)
+static size_t skip_name(uint8_view wire, size_t pos, bool allow_compression) {
+    while (pos < wire.size()) {
+        uint8_t len = wire[pos];
+        if ((len & COMPRESSION_POINTER_MASK) == COMPRESSION_POINTER_MASK) {
+            return (allow_compression && pos + 2 <= wire.size()) ? pos + 2 : 0;
+        }
+        if (len & COMPRESSION_POINTER_MASK) {
+            // extended label types are obsolete
+            return 0;
+        }
+        pos += 1 + len;
+        if (len == 0) {
+            return pos;
+        }
+    }
+    return 0;
+}
+
+// Get the end of the question section of a message having a single question (0 in case of error)
+static size_t get_question_end(uint8_view wire, bool allow_compression) {
+    if (wire.size() < DNS_HEADER_SIZE || read_u16(&wire[DNS_QDCOUNT_OFFSET]) != 1) {
+        return 0;
+    }
+    size_t pos = skip_name(wire, DNS_HEADER_SIZE, allow_compression);
+    if (pos == 0 || pos + 4 > wire.size()) {
+        return 0;
+    }
+    return pos + 4; // type and class
+}
+
+
+cache_key::cache_key(uint8_view name, uint16_t type, uint16_t cls, uint8_t flags)
+    : type(type)
+    , cls(cls)
+    , flags(flags)
+    , name_size(std::min(name.size(), MAX_NAME_SIZE))
+{
+    // FNV-1a over the lower-cased name (the label lengths are never in the upper-case range)
+    uint64_t h = UINT64_C(0xcbf29ce484222325);
+    for (size_t i = 0; i < this->name_size; ++i) {
+        uint8_t c = name[i];
+        c = (c >= 'A' && c <= 'Z') ? (c | 0x20) : c;
+        this->name[i] = c;
+        h = (h ^ c) * UINT64_C(0x100000001b3);
+    }
+    for (uint32_t v : { (uint32_t)type, (uint32_t)cls, (uint32_t)flags }) {
+        h = (h ^ v) * UINT64_C(0x100000001b3);
+    }
+    this->hash = h;
+}
+
+bool cache_key::operator==(const cache_key &other) const {
+    return this->hash == other.hash
+            && this->type == other.type
+            && this->cls == other.cls
+            && this->flags == other.flags
+            && this->name_size == other.name_size
+            && 0 == std::memcmp(this->name.data(), other.name.data(), this->name_size);
+}
+
+std::string cache_key::str() const {
+    std::string name;
+    name.reserve(this->name_size);
+    for (size_t i = 0; i < this->name_size && this->name[i] != 0;) {
+        size_t len = this->name[i++];
+        name.append((const char *)&this->name[i], std::min(len, this->name_size - i));
+        name.push_back('.');
+        i += len;
+    }
+    if (name.empty()) {
+        name.push_back('.');
+    } else {
+        name.pop_back();
+    }
+    return AG_FMT("{}|{}|{}{}|{}", this->type, this->cls,
+                  (this->flags & DNSSEC_OK) ? 1 : 0, (this->flags & CHECKING_DISABLED) ? 1 : 0, name);
+}
+
+std::optional<cached_response> cached_response::create(uint8_vector wire) {
+    if (wire.size() > UINT16_MAX) {
+        return std::nullopt;
+    }
+
+    cached_response r;
+    size_t pos = get_question_end({ wire.data(), wire.size() }, true);
+    if (pos == 0) {
+        return std::nullopt;
+    }
+    r.question_end = pos;
+
+    size_t records_num = 0;
+    for (size_t i = 0; i < 3; ++i) { // answer, authority and additional sections
+        records_num += read_u16(&wire[DNS_QDCOUNT_OFFSET + 2 * (i + 1)]);
+    }
+    r.ttl_offsets.reserve(records_num);
+    for (size_t i = 0; i < records_num; ++i) {
+        pos = skip_name({ wire.data(), wire.size() }, pos, true);
+        if (pos == 0 || pos + RR_FIXED_FIELDS_SIZE > wire.size()) {
+            return std::nullopt;
+        }
+        if (read_u16(&wire[pos]) == OPT_RR_TYPE) {
+            // the class field contains the UDP payload size, and the TTL field contains the EDNS flags
+            r.udp_size_offset = pos + 2;
+        } else {
+            r.ttl_offsets.push_back(pos + 4);
+        }
+        pos += RR_FIXED_FIELDS_SIZE + read_u16(&wire[pos + 8]);
+        if (pos > wire.size()) {
+            return std::nullopt;
+        }
+    }
+
+    r.wire = std::move(wire);
+    return r;
+}
+
+bool cached_response::make_response(uint8_view request, uint32_t ttl, uint8_vector &out) const {
+    // the question is copied as is to preserve the name case, so it must not differ in size
+    size_t question_end = get_question_end(request, false);
+    if (question_end != this->question_end) {
+        return false;
+    }
+
+    out.assign(this->wire.begin(), this->wire.end());
+    std::memcpy(&out[DNS_ID_OFFSET], &request[DNS_ID_OFFSET], 2);
+    std::memcpy(&out[DNS_HEADER_SIZE], &request[DNS_HEADER_SIZE], question_end - DNS_HEADER_SIZE);
+    for (uint16_t offset : this->ttl_offsets) {
+        write_u32(&out[offset], ttl);
+    }
+    if (this->udp_size_offset != 0) {
+        write_u16(&out[this->udp_size_offset], UDP_RECV_BUF_SIZE);
+    }
+    return true;
+}
+
+bool cached_response::add_padding(uint8_vector &response, size_t block_size, size_t max_size) const {
+    if (this->udp_size_offset == 0 || block_size == 0) {
+        return false;
+    }
+    size_t rdlength_offset = this->udp_size_offset + 6;
+    uint16_t rdlength = read_u16(&response[rdlength_offset]);
+    size_t unpadded_size = response.size() + EDNS_OPTION_HEADER_SIZE;
+    size_t padding_size = (block_size - unpadded_size % block_size) % block_size;
+    size_t option_size = EDNS_OPTION_HEADER_SIZE + padding_size;
+    if (unpadded_size + padding_size > std::min(max_size, (size_t) UINT16_MAX)
+            || rdlength + option_size > UINT16_MAX) {
+        return false;
+    }
+
+    uint8_t option[EDNS_OPTION_HEADER_SIZE];
+    write_u16(&option[0], EDNS_PADDING_OPTION_CODE);
+    write_u16(&option[2], padding_size);
+    auto rdata_end = response.begin() + rdlength_offset + 2 + rdlength;
+    rdata_end = response.insert(rdata_end, std::begin(option), std::end(option));
+    response.insert(rdata_end + EDNS_OPTION_HEADER_SIZE, padding_size, 0);
+    write_u16(&response[rdlength_offset], rdlength + option_size);
+    return true;
+}
+
+size_t cached_response::mem_usage() const {
+    return sizeof(*this) + ENTRY_OVERHEAD
+            + this->wire.capacity()
+            + this->ttl_offsets.capacity() * sizeof(uint16_t)
+            + this->status.capacity()
+            + this->answer.capacity();
+}
+
+
+response_cache::response_cache() {
+    this->shards.emplace_back(std::make_unique<shard>());
+}
+
+void response_cache::init(size_t capacity, size_t memory_limit, size_t shards_num, dnsproxy_cache_policy policy) {
+    if (shards_num == 0) {
+        shards_num = std::max(1u, std::thread::hardware_concurrency());
+    }
+    // a shard of zero capacity would fall back to the default one
+    shards_num = std::clamp(shards_num, (size_t)1, std::max(capacity, (size_t)1));
+    if (memory_limit != 0) {
+        shards_num = std::clamp(memory_limit / MIN_SHARD_MEMORY_LIMIT, (size_t)1, shards_num);
+    }
+    size_t shard_capacity = (capacity + shards_num - 1) / shards_num;
+    this->shard_memory_limit = memory_limit / shards_num;
+
+    this->shards.clear();
+    this->shards.reserve(shards_num);
+    for (size_t i = 0; i < shards_num; ++i) {
+        std::unique_ptr<shard> &s = this->shards.emplace_back(std::make_unique<shard>());
+        switch (policy) {
+        case dnsproxy_cache_policy::LRU:
+            s->val.emplace<0>(shard_capacity);
+            break;
+        case dnsproxy_cache_policy::S3_FIFO:
+            s->val.emplace<1>(shard_capacity);
+            break;
+        }
+    }
+}
+
+void response_cache::insert(const cache_key &key, cached_response response) {
+    size_t entry_size = response.mem_usage();
+    shard &s = this->get_shard(key);
+    std::unique_lock l(s.mtx);
+
+    visit(s, [&] (auto &cache) {
+        if (this->shard_memory_limit != 0 && entry_size > this->shard_memory_limit) {
+            if (auto acc = cache.get(key); acc) {
+                s.mem_usage -= acc->mem_usage();
+                cache.erase(key);
+            }
+            return;
+        }
+
+        // A refreshed entry is updated in place rather than reinserted, so that it keeps its place
+        // in the eviction order (e.g. a popular entry is not put back to the S3-FIFO probationary queue)
+        bool updated = cache.update(key, [&] (cached_response &entry) {
+            s.mem_usage = s.mem_usage - entry.mem_usage() + entry_size;
+            entry = std::move(response);
+        });
+        size_t pending_size = updated ? 0 : entry_size;
+
+        // displace the entries here rather than in the cache itself to keep the memory usage up to date
+        while ((!updated && cache.size() >= cache.max_size())
+                || (this->shard_memory_limit != 0 && s.mem_usage + pending_size > this->shard_memory_limit)) {
+            auto displaced = cache.displace();
+            if (!displaced.has_value()) {
+                break;
+            }
+            s.mem_usage -= displaced->second.mem_usage();
+        }
+
+        if (!updated) {
+            s.mem_usage += entry_size;
+            cache.insert(key, std::move(response));
+        }
+    });
+}
+
+void response_cache::erase(const cache_key &key) {
+    shard &s = this->get_shard(key);
+    std::unique_lock l(s.mtx);
+    visit(s, [&] (auto &cache) {
+        if (auto acc = cache.get(key); acc) {
+            s.mem_usage -= acc->mem_usage();
+            cache.erase(key);
+        }
+    });
+}
+
+void response_cache::clear() {
+    for (std::unique_ptr<shard> &s : this->shards) {
+        std::scoped_lock l(s->mtx);
+        visit(*s, [] (auto &cache) { cache.clear(); });
+        s->mem_usage = 0;
+    }
+}
+
+size_t response_cache::size() const {
+    size_t size = 0;
+    for (const std::unique_ptr<shard> &s : this->shards) {
+        std::shared_lock l(s->mtx);
+        size += visit(*s, [] (const auto &cache) { return cache.size(); });
+    }
+    return size;
+}
+
+size_t response_cache::mem_usage() const {
+    size_t size = 0;
+    for (const std::unique_ptr<shard> &s : this->shards) {
+        std::shared_lock l(s->mtx);
+        size += s->mem_usage;
+    }
+    return size;
+}
+
+err_string response_cache::save(const std::string &path) const {
+    uint8_vector buf;
+    append_bytes(buf, SNAPSHOT_MAGIC, std::size(SNAPSHOT_MAGIC));
+    buf.push_back(SNAPSHOT_VERSION);
+    uint64_t saved_at = duration_cast<seconds>(system_clock::now().time_since_epoch()).count();
+    append_u32(buf, saved_at >> 32);
+    append_u32(buf, saved_at);
+
+    auto now = ag::steady_clock::now();
+    for (const std::unique_ptr<shard> &s : this->shards) {
+        std::shared_lock l(s->mtx);
+        visit(*s, [&] (const auto &cache) {
+            // the entries to be displaced first go first, so the order is kept on loading
+            cache.for_each([&] (const auto &node) {
+                const cache_key &key = node.first;
+                const cached_response &entry = node.second;
+                auto ttl = ceil<seconds>(entry.expires_at - now).count();
+                if (ttl <= 0) {
+                    return;
+                }
+                append_u16(buf, key.type);
+                append_u16(buf, key.cls);
+                buf.push_back(key.flags);
+                buf.push_back(key.name_size);
+                append_bytes(buf, key.name.data(), key.name_size);
+                append_u32(buf, std::min(ttl, (decltype(ttl)) UINT32_MAX));
+                buf.push_back(entry.upstream_id.has_value());
+                if (entry.upstream_id.has_value()) {
+                    append_u32(buf, *entry.upstream_id);
+                }
+                append_u16(buf, std::min(entry.status.size(), (size_t) UINT16_MAX));
+                append_bytes(buf, entry.status.data(), std::min(entry.status.size(), (size_t) UINT16_MAX));
+                append_u32(buf, entry.answer.size());
+                append_bytes(buf, entry.answer.data(), entry.answer.size());
+                append_u16(buf, entry.wire.size());
+                append_bytes(buf, entry.wire.data(), entry.wire.size());
+            });
+        });
+    }
+
+    // The snapshot is written aside and then put in place, so that a failure in the middle
+    // does not leave a truncated snapshot instead of the previous one.
+    // The responses may reveal the user's browsing history, so the file is only accessible by its owner.
+    std::string tmp_path = path + ".tmp";
+    file::handle f = file::open(tmp_path, file::WRONLY | file::CREAT | file::TRUNC, 0600);
+    if (!file::is_valid(f)) {
+        return AG_FMT("Failed to open file: {}", sys::error_string(sys::error_code()));
+    }
+    int written = file::write(f, buf.data(), buf.size());
+    err_string err;
+    if (written < 0 || (size_t) written != buf.size()) {
+        err = AG_FMT("Failed to write file: {}", sys::error_string(sys::error_code()));
+    }
+    file::close(f);
+    if (!err.has_value() && 0 != file::rename(tmp_path, path)) {
+        err = AG_FMT("Failed to rename file: {}", sys::error_string(sys::error_code()));
+    }
+    if (err.has_value()) {
+        file::remove(tmp_path);
+    }
+    return err;
+}
+
+err_string response_cache::load(const std::string &path) {
+    file::handle f = file::open(path, file::RDONLY);
+    if (!file::is_valid(f)) {
+        return AG_FMT("Failed to open file: {}", sys::error_string(sys::error_code()));
+    }
+    int size = file::get_size(f);
+    uint8_vector buf(std::max(size, 0));
+    int bytes_read = (size > 0) ? file::read(f, (char *)buf.data(), buf.size()) : size;
+    file::close(f);
+    if (bytes_read < 0 || bytes_read != size) {
+        return AG_FMT("Failed to read file: {}", sys::error_string(sys::error_code()));
+    }
+
+    uint8_view data = { buf.data(), buf.size() };
+    const uint8_t *p = take(data, std::size(SNAPSHOT_MAGIC) + 1 + 8);
+    if (p == nullptr || 0 != std::memcmp(p, SNAPSHOT_MAGIC, std::size(SNAPSHOT_MAGIC))) {
+        return "Not a cache snapshot";
+    }
+    p += std::size(SNAPSHOT_MAGIC);
+    if (*p++ != SNAPSHOT_VERSION) {
+        return AG_FMT("Unsupported snapshot version: {}", p[-1]);
+    }
+    uint64_t saved_at = ((uint64_t) read_u32(p) << 32) | read_u32(p + 4);
+    int64_t now = duration_cast<seconds>(system_clock::now().time_since_epoch()).count();
+    int64_t elapsed = std::max(now - (int64_t) saved_at, (int64_t) 0);
+
+    auto steady_now = ag::steady_clock::now();
+    while (!data.empty()) {
+        p = take(data, 6);
+        if (p == nullptr) {
+            return "Truncated snapshot";
+        }
+        uint16_t type = read_u16(p);
+        uint16_t cls = read_u16(p + 2);
+        uint8_t flags = p[4];
+        uint8_t name_size = p[5];
+        const uint8_t *name = take(data, name_size);
+        const uint8_t *ttl_and_upstream = take(data, 5);
+        if (name == nullptr || ttl_and_upstream == nullptr) {
+            return "Truncated snapshot";
+        }
+        int64_t ttl = (int64_t) read_u32(ttl_and_upstream) - elapsed;
+        std::optional<int32_t> upstream_id;
+        if (ttl_and_upstream[4]) {
+            if (p = take(data, 4); p == nullptr) {
+                return "Truncated snapshot";
+            }
+            upstream_id = (int32_t) read_u32(p);
+        }
+        const uint8_t *status_size = take(data, 2);
+        const uint8_t *status = status_size ? take(data, read_u16(status_size)) : nullptr;
+        const uint8_t *answer_size = status ? take(data, 4) : nullptr;
+        const uint8_t *answer = answer_size ? take(data, read_u32(answer_size)) : nullptr;
+        const uint8_t *wire_size = answer ? take(data, 2) : nullptr;
+        const uint8_t *wire = wire_size ? take(data, read_u16(wire_size)) : nullptr;
+        if (wire == nullptr) {
+            return "Truncated snapshot";
+        }
+        if (ttl <= 0) {
+            continue;
+        }
+
+        std::optional<cached_response> entry = cached_response::create(uint8_vector(wire, wire + read_u16(wire_size)));
+        if (!entry.has_value()) {
+            return "Malformed response in snapshot";
+        }
+        entry->status.assign((const char *)status, read_u16(status_size));
+        entry->answer.assign((const char *)answer, read_u32(answer_size));
+        entry->expires_at = steady_now + seconds(ttl);
+        // the original TTL is not saved, the remaining one is the best guess
+        entry->ttl = ttl;
+        entry->upstream_id = upstream_id;
+        this->insert(cache_key({ name, name_size }, type, cls, flags), std::move(entry.value()));
+    }
+    return std::nullopt;
+}
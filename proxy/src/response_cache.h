@@ -0,0 +1,280 @@
+#pragma once
+
+
+#include <array>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+#include <ag_cache.h>
+#include <ag_clock.h>
+#include <ag_defs.h>
+#include "dnsproxy_settings.h"
+
+namespace ag {
+
+/**
+ * Response cache key: question type and class, DNSSEC-related flags and lower-cased
+ * domain name in the wire format.
+ * The key is of a fixed size and carries its hash, so building it for a lookup
+ * never allocates memory and the map does not rehash the name.
+ */
+struct cache_key {
+    static constexpr size_t MAX_NAME_SIZE = 255;
+
+    uint16_t type;
+    uint16_t cls;
+    uint8_t flags; // see `cache_key::flag`
+    uint8_t name_size;
+    size_t hash;
+    std::array<uint8_t, MAX_NAME_SIZE> name;
+
+    enum flag : uint8_t {
+        DNSSEC_OK = 1 << 0, // DO bit is set in the request
+        CHECKING_DISABLED = 1 << 1, // CD bit is set in the request
+    };
+
+    cache_key() = default;
+
+    /**
+     * @param name   domain name in the uncompressed wire format
+     * @param type   question type
+     * @param cls    question class
+     * @param flags  see `cache_key::flag`
+     */
+    cache_key(uint8_view name, uint16_t type, uint16_t cls, uint8_t flags);
+
+    bool operator==(const cache_key &other) const;
+    bool operator!=(const cache_key &other) const { return !(*this == other); }
+
+    /**
+     * Get the text representation of the key (e.g. for logging)
+     */
+    std::string str() const;
+};
+
+} // namespace ag
+
+namespace std {
+template<>
+struct hash<ag::cache_key> {
+    size_t operator()(const ag::cache_key &key) const {
+        return key.hash;
+    }
+};
+} // namespace std
+
+namespace ag {
+
+/**
+ * Counter which may be incremented concurrently by the readers of a cache entry.
+ * Copying is not atomic with respect to the increments, which is fine for statistics.
+ */
+class relaxed_counter {
+public:
+    relaxed_counter() = default;
+    relaxed_counter(const relaxed_counter &other) : val(other.get()) {}
+
+    relaxed_counter &operator=(const relaxed_counter &other) {
+        this->val.store(other.get(), std::memory_order_relaxed);
+        return *this;
+    }
+
+    /**
+     * Increment the counter
+     * @return the new value
+     */
+    uint32_t increment() const {
+        return this->val.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    uint32_t get() const {
+        return this->val.load(std::memory_order_relaxed);
+    }
+
+private:
+    mutable std::atomic<uint32_t> val{0};
+};
+
+/**
+ * Cached response stored in the wire format along with the positions of the fields
+ * which differ from request to request, so that serving a response from the cache
+ * is just a copy with a few fields patched in place
+ */
+struct cached_response {
+    uint8_vector wire; // the response in the wire format
+    std::vector<uint16_t> ttl_offsets; // offsets of the TTL fields of all the records (except OPT) in `wire`
+    uint16_t question_end = 0; // offset of the end of the question section in `wire`
+    uint16_t udp_size_offset = 0; // offset of the UDP payload size field of the OPT record (0 if there is none)
+    std::string status; // response code string for the request processed event
+    std::string answer; // answer section string for the request processed event
+    ag::steady_clock::time_point expires_at;
+    uint32_t ttl = 0; // TTL of the response when it was cached (in seconds)
+    relaxed_counter hits; // number of times the response was served from the cache
+    std::optional<int32_t> upstream_id;
+
+    /**
+     * Create a cache entry from a response
+     * @param wire  response in the wire format (must contain exactly one question)
+     * @return      the entry with the fields offsets filled in, or nullopt if the response is malformed
+     */
+    static std::optional<cached_response> create(uint8_vector wire);
+
+    /**
+     * Make the response for a request
+     * @param request  request in the wire format (its ID and question are copied into the response)
+     * @param ttl      TTL to set for all the records
+     * @param out      response in the wire format
+     * @return         true if successful, false if the request question does not fit the cached response
+     */
+    bool make_response(uint8_view request, uint32_t ttl, uint8_vector &out) const;
+
+    /**
+     * Add the padding option (RFC 7830) to the OPT record of a response made with `make_response()`
+     * @param response    the response
+     * @param block_size  the padded response size is a multiple of this
+     * @param max_size    maximum size of the padded response
+     * @return            true if padded, false if the response has no OPT record or the padded one
+     *                    would exceed the maximum size
+     */
+    bool add_padding(uint8_vector &response, size_t block_size, size_t max_size) const;
+
+    /**
+     * Get the approximate number of bytes occupied by the entry
+     */
+    size_t mem_usage() const;
+};
+
+/**
+ * DNS response cache split into a number of independently locked shards.
+ * A key always goes to the same shard selected by the key hash, so the lookups
+ * of different keys from different threads mostly do not contend on the same locks.
+ * Besides the number of entries, the cache may be limited with the number of bytes
+ * occupied by the entries, in which case the entries are displaced until a new one fits.
+ * Which entries are displaced first is determined by the eviction policy.
+ */
+class response_cache {
+public:
+    response_cache();
+
+    /**
+     * Set up the cache dropping all the cached responses.
+     * Must not be called concurrently with the other methods.
+     * The limits are split evenly between the shards.
+     * @param capacity      maximum number of cached responses (the actual limit may be
+     *                      slightly greater due to the rounding)
+     * @param memory_limit  maximum number of bytes occupied by the cached responses (0 means no limit)
+     * @param shards_num    number of shards (0 means the number of hardware threads)
+     * @param policy        eviction policy
+     */
+    void init(size_t capacity, size_t memory_limit, size_t shards_num,
+              dnsproxy_cache_policy policy = dnsproxy_cache_policy::LRU);
+
+    /**
+     * Find an entry and call a function on it under the lock of its shard
+     * @param key  the key
+     * @param f    function taking `const cached_response &` and returning true if the entry
+     *             should be displaced first (e.g. it has expired)
+     * @return     true if the entry was found
+     */
+    template <typename F>
+    bool find(const cache_key &key, F &&f) {
+        shard &s = this->get_shard(key);
+        std::shared_lock l(s.mtx);
+        return visit(s, [&] (auto &cache) {
+            auto acc = cache.get(key);
+            if (!acc) {
+                return false;
+            }
+            if (f(*acc)) {
+                cache.make_lru(acc);
+            }
+            return true;
+        });
+    }
+
+    /**
+     * Insert or update an entry displacing the others if the limits are exceeded.
+     * The entry is not inserted if it alone exceeds the memory limit of its shard.
+     * @param key       the key
+     * @param response  the entry
+     */
+    void insert(const cache_key &key, cached_response response);
+
+    /**
+     * Delete an entry
+     * @param key  the key
+     */
+    void erase(const cache_key &key);
+
+    /**
+     * Clear the cache
+     */
+    void clear();
+
+    /**
+     * Get the number of cached responses
+     */
+    size_t size() const;
+
+    /**
+     * Get the approximate number of bytes occupied by the cached responses
+     */
+    size_t mem_usage() const;
+
+    /**
+     * Save the cached responses to a file, so that they can be loaded after a restart.
+     * The expired responses are not saved.
+     * @param path  file path
+     * @return      error string in case of failure
+     */
+    err_string save(const std::string &path) const;
+
+    /**
+     * Load the responses saved with `save()`. The TTLs are reduced by the time elapsed
+     * since saving according to the wall clock, and the expired responses are skipped.
+     * The loaded responses are subject to the cache limits.
+     * @param path  file path
+     * @return      error string in case of failure (the responses loaded before the error are kept)
+     */
+    err_string load(const std::string &path);
+
+    /**
+     * Get the number of shards
+     */
+    size_t shards_num() const { return this->shards.size(); }
+
+private:
+    struct shard {
+        std::variant<lru_cache<cache_key, cached_response>,
+                lru_cache<cache_key, cached_response, s3fifo_policy>> val;
+        std::shared_mutex mtx;
+        size_t mem_usage = 0; // number of bytes occupied by the entries (guarded by `mtx`)
+    };
+
+    shard &get_shard(const cache_key &key) {
+        return *this->shards[key.hash % this->shards.size()];
+    }
+
+    // Call a function on the cache of a shard whichever eviction policy it has
+    template <typename S, typename F>
+    static auto visit(S &s, F &&f) {
+        if (auto *cache = std::get_if<1>(&s.val)) {
+            return f(*cache);
+        }
+        return f(*std::get_if<0>(&s.val));
+    }
+
+    // Memory limit of a single shard (0 means no limit)
+    size_t shard_memory_limit = 0;
+    // Each shard is allocated separately, so that the locks of different shards
+    // do not share a cache line
+    std::vector<std::unique_ptr<shard>> shards;
+};
+
+} // namespace ag
@@ -0,0 +1,180 @@
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include "rrset_cache.h"
+
+
+using namespace ag;
+using namespace std::chrono;
+
+using ldns_rdf_holder = std::unique_ptr<ldns_rdf, ftor<&ldns_rdf_deep_free>>;
+
+
+static cache_key make_key(const ldns_rdf *owner, ldns_rr_type type, ldns_rr_class cls) {
+    // The owner data is the name in the uncompressed wire format, it's lower-cased by the key itself
+    return cache_key({ ldns_rdf_data(owner), ldns_rdf_size(owner) }, type, cls, 0);
+}
+
+// Get copies of the records of the section with the given owner, type and class
+static ldns_rr_list_ptr get_rrset(const ldns_rr_list *section, const ldns_rdf *owner,
+                                  ldns_rr_type type, ldns_rr_class cls) {
+    ldns_rr_list_ptr rrset(ldns_rr_list_new());
+    for (size_t i = 0; i < ldns_rr_list_rr_count(section); ++i) {
+        const ldns_rr *rr = ldns_rr_list_rr(section, i);
+        if (ldns_rr_get_type(rr) == type && ldns_rr_get_class(rr) == cls
+                && ldns_dname_compare(ldns_rr_owner(rr), owner) == 0) {
+            ldns_rr_list_push_rr(rrset.get(), ldns_rr_clone(rr));
+        }
+    }
+    return rrset;
+}
+
+// Get the approximate number of bytes occupied by the records and their key in the cache
+static size_t rrset_mem_usage(const ldns_rr_list *rrset) {
+    // The key and the bookkeeping data of the eviction queue and map, as in the response cache
+    size_t size = sizeof(cache_key) + 6 * sizeof(void *) + sizeof(ldns_rr_list)
+            + ldns_rr_list_rr_count(rrset) * sizeof(ldns_rr *);
+    for (size_t i = 0; i < ldns_rr_list_rr_count(rrset); ++i) {
+        const ldns_rr *rr = ldns_rr_list_rr(rrset, i);
+        size += sizeof(ldns_rr) + sizeof(ldns_rdf) + ldns_rdf_size(ldns_rr_owner(rr));
+        for (size_t j = 0; j < ldns_rr_rd_count(rr); ++j) {
+            size += sizeof(ldns_rdf *) + sizeof(ldns_rdf) + ldns_rdf_size(ldns_rr_rdf(rr, j));
+        }
+    }
+    return size;
+}
+
+void rrset_cache::init(size_t capacity, size_t memory_limit) {
+    this->cache.clear();
+    this->cache.set_capacity(capacity);
+    this->memory_limit = memory_limit;
+    this->used_memory = 0;
+}
+
+void rrset_cache::put(const cache_key &key, entry e) {
+    if (auto acc = this->cache.get(key); acc) {
+        this->used_memory -= acc->mem_usage;
+        this->cache.erase(key);
+    }
+    if (this->memory_limit != 0 && e.mem_usage > this->memory_limit) {
+        return;
+    }
+
+    // displace the entries here rather than in the cache itself to keep the memory usage up to date
+    while (this->cache.size() >= this->cache.max_size()
+            || (this->memory_limit != 0 && this->used_memory + e.mem_usage > this->memory_limit)) {
+        auto displaced = this->cache.displace();
+        if (!displaced.has_value()) {
+            break;
+        }
+        this->used_memory -= displaced->second.mem_usage;
+    }
+
+    this->used_memory += e.mem_usage;
+    this->cache.insert(key, std::move(e));
+}
+
+void rrset_cache::insert(const ldns_pkt *response, std::optional<int32_t> upstream_id) {
+    const ldns_rr *question = ldns_rr_list_rr(ldns_pkt_question(response), 0);
+    const ldns_rr_type type = ldns_rr_get_type(question);
+    const ldns_rr_class cls = ldns_rr_get_class(question);
+    if (type == LDNS_RR_TYPE_ANY) {
+        // The answer is not a single RRset
+        return;
+    }
+
+    const ldns_rr_list *answer = ldns_pkt_answer(response);
+    const auto now = ag::steady_clock::now();
+    ldns_rdf_holder name(ldns_rdf_clone(ldns_rr_owner(question)));
+    std::unique_lock l(this->mtx);
+    for (size_t i = 0; i <= MAX_CNAME_CHAIN_LENGTH; ++i) {
+        ldns_rr_type rrset_type = type;
+        ldns_rr_list_ptr rrset = get_rrset(answer, name.get(), type, cls);
+        if (ldns_rr_list_rr_count(rrset.get()) == 0) {
+            rrset_type = LDNS_RR_TYPE_CNAME;
+            rrset = get_rrset(answer, name.get(), rrset_type, cls);
+            if (ldns_rr_list_rr_count(rrset.get()) != 1) {
+                // The chain ends without the requested records, or the alias is ambiguous
+                return;
+            }
+        }
+
+        uint32_t ttl = UINT32_MAX;
+        for (size_t j = 0; j < ldns_rr_list_rr_count(rrset.get()); ++j) {
+            ttl = std::min(ttl, ldns_rr_ttl(ldns_rr_list_rr(rrset.get(), j)));
+        }
+        if (ttl == 0) {
+            return;
+        }
+
+        ldns_rdf_holder next;
+        if (rrset_type != type) {
+            const ldns_rdf *target = ldns_rr_rdf(ldns_rr_list_rr(rrset.get(), 0), 0);
+            if (target == nullptr) {
+                return;
+            }
+            next.reset(ldns_rdf_clone(target));
+        }
+        size_t mem_usage = sizeof(entry) + rrset_mem_usage(rrset.get());
+        this->put(make_key(name.get(), rrset_type, cls),
+                  entry{ std::move(rrset), now + seconds(ttl), upstream_id, mem_usage });
+        if (next == nullptr) {
+            return;
+        }
+        name = std::move(next);
+    }
+}
+
+std::optional<rrset_cache::answer> rrset_cache::find(const ldns_rr *question) const {
+    const ldns_rr_type type = ldns_rr_get_type(question);
+    const ldns_rr_class cls = ldns_rr_get_class(question);
+    if (type == LDNS_RR_TYPE_ANY) {
+        return std::nullopt;
+    }
+
+    answer r{ ldns_rr_list_ptr(ldns_rr_list_new()), std::nullopt };
+    const auto now = ag::steady_clock::now();
+    const ldns_rdf *name = ldns_rr_owner(question);
+    std::shared_lock l(this->mtx);
+    for (size_t i = 0; i <= MAX_CNAME_CHAIN_LENGTH; ++i) {
+        auto acc = this->cache.get(make_key(name, type, cls));
+        if (!acc && type != LDNS_RR_TYPE_CNAME) {
+            acc = this->cache.get(make_key(name, LDNS_RR_TYPE_CNAME, cls));
+        }
+        if (!acc || acc->expires_at <= now) {
+            return std::nullopt;
+        }
+
+        auto ttl = (uint32_t) ceil<seconds>(acc->expires_at - now).count();
+        for (size_t j = 0; j < ldns_rr_list_rr_count(acc->records.get()); ++j) {
+            ldns_rr *rr = ldns_rr_clone(ldns_rr_list_rr(acc->records.get(), j));
+            ldns_rr_set_ttl(rr, ttl);
+            ldns_rr_list_push_rr(r.records.get(), rr);
+        }
+
+        const ldns_rr *first = ldns_rr_list_rr(acc->records.get(), 0);
+        if (ldns_rr_get_type(first) == type) {
+            r.upstream_id = acc->upstream_id;
+            return r;
+        }
+        // The records are owned by the result, so the name stays valid after the entry is displaced
+        name = ldns_rr_rdf(ldns_rr_list_rr(r.records.get(), ldns_rr_list_rr_count(r.records.get()) - 1), 0);
+    }
+    return std::nullopt;
+}
+
+void rrset_cache::clear() {
+    std::unique_lock l(this->mtx);
+    this->cache.clear();
+    this->used_memory = 0;
+}
+
+size_t rrset_cache::size() const {
+    std::shared_lock l(this->mtx);
+    return this->cache.size();
+}
+
+size_t rrset_cache::mem_usage() const {
+    std::shared_lock l(this->mtx);
+    return this->used_memory;
+}
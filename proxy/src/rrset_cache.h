@@ -0,0 +1,90 @@
+#pragma once
+
+
+#include <memory>
+#include <optional>
+#include <shared_mutex>
+#include <ldns/ldns.h>
+#include <ag_cache.h>
+#include <ag_clock.h>
+#include <ag_defs.h>
+#include "response_cache.h"
+
+namespace ag {
+
+using ldns_rr_list_ptr = std::unique_ptr<ldns_rr_list, ftor<&ldns_rr_list_deep_free>>;
+
+/**
+ * Cache of resource record sets keyed by owner name, type and class, each with its own TTL.
+ * An answer is synthesized from a chain of the cached CNAME records ending with the RRset
+ * of the requested type, so the names sharing a CNAME chain share its records, and so do
+ * the requests of different types for a name which is an alias.
+ * Only the answer section is cached, and the caller is expected to bypass the cache
+ * for the requests with the DNSSEC-related flags.
+ */
+class rrset_cache {
+public:
+    // Maximum number of CNAME records followed from the question name
+    static constexpr size_t MAX_CNAME_CHAIN_LENGTH = 8;
+
+    struct answer {
+        ldns_rr_list_ptr records; // the answer section with the remaining TTLs
+        std::optional<int32_t> upstream_id; // ID of the upstream which provided the last RRset
+    };
+
+    /**
+     * Set up the cache dropping all the cached records.
+     * Must not be called concurrently with the other methods.
+     * @param capacity      maximum number of cached RRsets
+     * @param memory_limit  maximum number of bytes occupied by the cached RRsets (0 means no limit)
+     */
+    void init(size_t capacity, size_t memory_limit = 0);
+
+    /**
+     * Put the RRsets of the answer section which form the CNAME chain of the question.
+     * The other records are ignored, so that a response cannot replace the records of an unrelated name.
+     * @param response     the response (must contain exactly one question)
+     * @param upstream_id  ID of the upstream which provided the response
+     */
+    void insert(const ldns_pkt *response, std::optional<int32_t> upstream_id);
+
+    /**
+     * Synthesize the answer section for a question
+     * @param question  the question
+     * @return          the answer, or nullopt if some RRset of the chain is not cached or has expired
+     */
+    std::optional<answer> find(const ldns_rr *question) const;
+
+    /**
+     * Clear the cache
+     */
+    void clear();
+
+    /**
+     * Get the number of cached RRsets
+     */
+    size_t size() const;
+
+    /**
+     * Get the approximate number of bytes occupied by the cached RRsets
+     */
+    size_t mem_usage() const;
+
+private:
+    struct entry {
+        ldns_rr_list_ptr records;
+        ag::steady_clock::time_point expires_at;
+        std::optional<int32_t> upstream_id;
+        size_t mem_usage = 0; // approximate number of bytes occupied by the entry
+    };
+
+    // Insert or update an entry displacing the others if the limits are exceeded (under the lock)
+    void put(const cache_key &key, entry e);
+
+    lru_cache<cache_key, entry> cache;
+    size_t memory_limit = 0; // 0 means no limit
+    size_t used_memory = 0; // guarded by `mtx`
+    mutable std::shared_mutex mtx;
+};
+
+} // namespace ag
@@ -0,0 +1,106 @@
+#include <algorithm>
+#include <limits>
+#include "upstream_balancer.h"
+
+
+using namespace ag;
+
+
+void upstream_balancer::init(dnsproxy_upstream_balancing strategy, const std::vector<upstream *> &upstreams) {
+    m_strategy = strategy;
+    m_indices.clear();
+    m_schedule.clear();
+    m_turn.store(0, std::memory_order_relaxed);
+
+    size_t balanced_num = std::min(upstreams.size(), upstream_ranking::MAX_RANKED);
+    for (size_t i = 0; i < balanced_num; ++i) {
+        m_indices.emplace(upstreams[i], i);
+    }
+    m_in_flight = std::vector<std::atomic<uint32_t>>(balanced_num);
+
+    if (strategy != dnsproxy_upstream_balancing::WEIGHTED_ROUND_ROBIN) {
+        return;
+    }
+    std::vector<uint64_t> weights(balanced_num);
+    uint64_t total = 0;
+    for (size_t i = 0; i < balanced_num; ++i) {
+        weights[i] = std::max<uint64_t>(upstreams[i]->options().weight, 1);
+        total += weights[i];
+    }
+    if (total > MAX_SCHEDULE_SIZE) {
+        uint64_t scaled_total = 0;
+        for (uint64_t &w : weights) {
+            w = std::max<uint64_t>(w * MAX_SCHEDULE_SIZE / total, 1);
+            scaled_total += w;
+        }
+        total = scaled_total;
+    }
+
+    // Smooth weighted round-robin: the turns of each upstream are spread evenly over the schedule,
+    // rather than going in a row
+    std::vector<int64_t> current(balanced_num, 0);
+    m_schedule.reserve(total);
+    for (uint64_t turn = 0; turn < total; ++turn) {
+        size_t best = 0;
+        for (size_t i = 0; i < balanced_num; ++i) {
+            current[i] += (int64_t) weights[i];
+            if (current[i] > current[best]) {
+                best = i;
+            }
+        }
+        current[best] -= (int64_t) total;
+        m_schedule.push_back((uint32_t) best);
+    }
+}
+
+upstream_ranking::order upstream_balancer::select(const upstream_ranking::order &order) {
+    size_t balanced_num = m_in_flight.size();
+    switch (m_strategy) {
+    case dnsproxy_upstream_balancing::LOWEST_SCORE:
+        break;
+    case dnsproxy_upstream_balancing::WEIGHTED_ROUND_ROBIN: {
+        if (m_schedule.empty()) {
+            break;
+        }
+        size_t index = m_schedule[m_turn.fetch_add(1, std::memory_order_relaxed) % m_schedule.size()];
+        for (size_t pos = 0; pos < balanced_num; ++pos) {
+            if (order.index(pos) == index) {
+                return order.promoted(pos);
+            }
+        }
+        break;
+    }
+    case dnsproxy_upstream_balancing::LEAST_OUTSTANDING_REQUESTS: {
+        // The ties go to the upstream with the better score
+        size_t best_pos = 0;
+        uint32_t best_in_flight = std::numeric_limits<uint32_t>::max();
+        for (size_t pos = 0; pos < balanced_num; ++pos) {
+            uint32_t in_flight = m_in_flight[order.index(pos)].load(std::memory_order_relaxed);
+            if (in_flight < best_in_flight) {
+                best_pos = pos;
+                best_in_flight = in_flight;
+            }
+        }
+        return order.promoted(best_pos);
+    }
+    }
+    return order;
+}
+
+void upstream_balancer::on_exchange_started(const upstream *u) {
+    if (m_strategy != dnsproxy_upstream_balancing::LEAST_OUTSTANDING_REQUESTS) {
+        return;
+    }
+    if (auto it = m_indices.find(u); it != m_indices.end()) {
+        m_in_flight[it->second].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void upstream_balancer::on_exchange_finished(const upstream *u) {
+    if (m_strategy != dnsproxy_upstream_balancing::LEAST_OUTSTANDING_REQUESTS) {
+        return;
+    }
+    if (auto it = m_indices.find(u); it != m_indices.end()) {
+        m_in_flight[it->second].fetch_sub(1, std::memory_order_relaxed);
+    }
+}
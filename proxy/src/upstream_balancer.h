@@ -0,0 +1,61 @@
+#pragma once
+
+
+#include <atomic>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include <upstream.h>
+#include <dnsproxy_settings.h>
+#include "upstream_ranking.h"
+
+namespace ag {
+
+/**
+ * Chooses the upstream which a request is sent to first, so that the requests are spread
+ * between the upstreams (see `dnsproxy_settings::upstream_balancing`). The choice is made
+ * without locking. Only the ranked upstreams are balanced (see `upstream_ranking::MAX_RANKED`).
+ */
+class upstream_balancer {
+public:
+    /**
+     * Set the upstreams to balance. Not thread-safe.
+     * @param strategy   how to choose an upstream
+     * @param upstreams  the upstreams in the original order (the one of the `upstream_ranking` they are ranked by)
+     */
+    void init(dnsproxy_upstream_balancing strategy, const std::vector<upstream *> &upstreams);
+
+    /**
+     * Get the order in which the upstreams are tried for a request
+     * @param order  the upstreams ranked by their health scores
+     * @return       the same order with the chosen upstream moved to the front
+     */
+    upstream_ranking::order select(const upstream_ranking::order &order);
+
+    /**
+     * Count an exchange with the upstream in flight
+     * @param u  the upstream, ignored if it's not one of the balanced upstreams
+     */
+    void on_exchange_started(const upstream *u);
+
+    /**
+     * Count the exchange with the upstream completed
+     * @param u  the upstream, ignored if it's not one of the balanced upstreams
+     */
+    void on_exchange_finished(const upstream *u);
+
+private:
+    // The round-robin schedule is limited to this many turns, so the weights are scaled down if needed
+    static constexpr size_t MAX_SCHEDULE_SIZE = 1024;
+
+    dnsproxy_upstream_balancing m_strategy = dnsproxy_upstream_balancing::LOWEST_SCORE;
+    // Upstream -> its index in the original order
+    std::unordered_map<const upstream *, size_t> m_indices;
+    // The indices of the upstreams in the order they take turns (WEIGHTED_ROUND_ROBIN)
+    std::vector<uint32_t> m_schedule;
+    std::atomic<uint64_t> m_turn{0};
+    // Number of exchanges in flight per upstream (LEAST_OUTSTANDING_REQUESTS)
+    std::vector<std::atomic<uint32_t>> m_in_flight;
+};
+
+} // namespace ag
@@ -0,0 +1,67 @@
+#include "upstream_circuit_breaker.h"
+
+
+using namespace ag;
+
+
+void upstream_circuit_breaker::init(uint32_t failures_threshold, const std::vector<upstream *> &upstreams) {
+    m_failures_threshold = failures_threshold;
+    m_states.clear();
+    for (upstream *u : upstreams) {
+        m_states.emplace(u, std::make_unique<upstream_state>());
+    }
+    m_down_num.store(0, std::memory_order_relaxed);
+}
+
+bool upstream_circuit_breaker::is_down(const upstream *u) const {
+    if (m_states.empty()) {
+        return false;
+    }
+    auto it = m_states.find(u);
+    return it != m_states.end() && it->second->down.load(std::memory_order_relaxed);
+}
+
+bool upstream_circuit_breaker::are_all_down() const {
+    return !m_states.empty() && m_down_num.load(std::memory_order_relaxed) == m_states.size();
+}
+
+bool upstream_circuit_breaker::on_exchange_result(const upstream *u, bool failed) {
+    auto it = m_states.find(u);
+    if (it == m_states.end()) {
+        return false;
+    }
+    upstream_state &state = *it->second;
+
+    if (!failed) {
+        // The state is mostly unchanged, so it's checked first to not make the cache line bounce between the threads
+        if (state.consecutive_failures.load(std::memory_order_relaxed) != 0) {
+            state.consecutive_failures.store(0, std::memory_order_relaxed);
+        }
+        if (state.down.load(std::memory_order_relaxed)) {
+            mark_up(u);
+        }
+        return false;
+    }
+
+    uint32_t failures = state.consecutive_failures.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (failures < m_failures_threshold || state.down.load(std::memory_order_relaxed)
+            || state.down.exchange(true, std::memory_order_relaxed)) {
+        return false;
+    }
+    m_down_num.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool upstream_circuit_breaker::mark_up(const upstream *u) {
+    auto it = m_states.find(u);
+    if (it == m_states.end()) {
+        return false;
+    }
+    upstream_state &state = *it->second;
+    state.consecutive_failures.store(0, std::memory_order_relaxed);
+    if (!state.down.exchange(false, std::memory_order_relaxed)) {
+        return false;
+    }
+    m_down_num.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <upstream.h>
+
+namespace ag {
+
+/**
+ * Tracks which upstreams are down, so that the requests are not sent to them
+ * (see `dnsproxy_settings::upstream_circuit_breaker`). An upstream is considered down after
+ * a number of failed exchanges in a row, and up again after a successful one.
+ * The state is read and updated without locking.
+ */
+class upstream_circuit_breaker {
+public:
+    /**
+     * Set the upstreams to track. Not thread-safe.
+     * @param failures_threshold  number of failed exchanges in a row after which an upstream is down
+     * @param upstreams           the upstreams
+     */
+    void init(uint32_t failures_threshold, const std::vector<upstream *> &upstreams);
+
+    /**
+     * @return true if the upstream is down
+     */
+    bool is_down(const upstream *u) const;
+
+    /**
+     * @return true if all of the upstreams are down, so there is nothing to skip them in favour of
+     */
+    bool are_all_down() const;
+
+    /**
+     * Count the outcome of an exchange with the upstream
+     * @param u       the upstream, ignored if it's not tracked
+     * @param failed  true if the exchange failed
+     * @return        true if the upstream has just gone down
+     */
+    bool on_exchange_result(const upstream *u, bool failed);
+
+    /**
+     * Mark the upstream up, e.g. after it's responded to a probe
+     * @param u  the upstream, ignored if it's not tracked
+     * @return   true if the upstream was down
+     */
+    bool mark_up(const upstream *u);
+
+private:
+    struct upstream_state {
+        std::atomic<uint32_t> consecutive_failures{0};
+        std::atomic<bool> down{false};
+    };
+
+    uint32_t m_failures_threshold = 0;
+    std::unordered_map<const upstream *, std::unique_ptr<upstream_state>> m_states;
+    std::atomic<size_t> m_down_num{0};
+};
+
+} // namespace ag
@@ -0,0 +1,70 @@
+#include <algorithm>
+#include <cmath>
+#include "upstream_hedging.h"
+
+
+using namespace ag;
+using namespace std::chrono;
+
+
+void response_time_histogram::add(milliseconds elapsed) {
+    size_t idx = 0;
+    if (elapsed.count() > 1) {
+        idx = (size_t) std::ceil(std::log2((double) elapsed.count()) * BUCKETS_PER_DOUBLING);
+        idx = std::min(idx, BUCKETS_NUM - 1);
+    }
+    m_buckets[idx].fetch_add(1, std::memory_order_relaxed);
+
+    // The concurrent samples may be counted either before or after halving, it's fine for an estimate
+    if (1 == m_samples_till_decay.fetch_sub(1, std::memory_order_relaxed)) {
+        for (std::atomic<uint32_t> &bucket : m_buckets) {
+            bucket.fetch_sub(bucket.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+        }
+        m_samples_till_decay.store(DECAY_PERIOD, std::memory_order_relaxed);
+    }
+}
+
+std::optional<milliseconds> response_time_histogram::percentile(uint32_t percent) const {
+    std::array<uint32_t, BUCKETS_NUM> counts;
+    uint64_t total = 0;
+    for (size_t i = 0; i < BUCKETS_NUM; ++i) {
+        counts[i] = m_buckets[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+    if (total < MIN_SAMPLES) {
+        return std::nullopt;
+    }
+
+    uint64_t rank = (total * std::clamp(percent, 1u, 100u) + 99) / 100;
+    size_t idx = 0;
+    uint64_t seen = counts[0];
+    while (seen < rank) {
+        seen += counts[++idx];
+    }
+    return milliseconds((int64_t) std::ceil(std::exp2((double) idx / BUCKETS_PER_DOUBLING)));
+}
+
+void hedging_budget::reset(uint32_t max_ratio_percent) {
+    m_ratio_percent = std::min<int64_t>(max_ratio_percent, TOKEN);
+    m_units.store(0, std::memory_order_relaxed);
+}
+
+void hedging_budget::on_exchange() {
+    int64_t units = m_units.load(std::memory_order_relaxed);
+    while (units < MAX_TOKENS) {
+        if (m_units.compare_exchange_weak(units, std::min(units + m_ratio_percent, MAX_TOKENS),
+                                          std::memory_order_relaxed)) {
+            break;
+        }
+    }
+}
+
+bool hedging_budget::try_spend() {
+    int64_t units = m_units.load(std::memory_order_relaxed);
+    while (units >= TOKEN) {
+        if (m_units.compare_exchange_weak(units, units - TOKEN, std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
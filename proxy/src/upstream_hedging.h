@@ -0,0 +1,80 @@
+#pragma once
+
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+
+namespace ag {
+
+/**
+ * Distribution of the response times of an upstream, used to choose the delay before hedging
+ * an exchange with it. The samples are counted in exponentially growing buckets without locking,
+ * and the counts are halved once in a while, so that the distribution follows the recent response times.
+ */
+class response_time_histogram {
+public:
+    /**
+     * Count a response time
+     * @param elapsed  time spent in the exchange
+     */
+    void add(std::chrono::milliseconds elapsed);
+
+    /**
+     * Get an upper estimate of the percentile of the counted response times
+     * @param percent  the percentile (1-100)
+     * @return         the estimate, or nullopt if too few response times have been counted yet
+     */
+    std::optional<std::chrono::milliseconds> percentile(uint32_t percent) const;
+
+private:
+    // Each bucket covers response times up to 2^(i/BUCKETS_PER_DOUBLING) milliseconds
+    static constexpr size_t BUCKETS_PER_DOUBLING = 4;
+    static constexpr size_t BUCKETS_NUM = 17 * BUCKETS_PER_DOUBLING; // up to ~2 minutes
+    // The estimate is unreliable until this many samples are counted
+    static constexpr uint32_t MIN_SAMPLES = 16;
+    // The counts are halved each time this many samples are counted
+    static constexpr uint32_t DECAY_PERIOD = 1024;
+
+    std::array<std::atomic<uint32_t>, BUCKETS_NUM> m_buckets{};
+    std::atomic<uint32_t> m_samples_till_decay{DECAY_PERIOD};
+};
+
+/**
+ * Limits the share of the hedged exchanges without locking.
+ * Each exchange earns a fraction of a token, and each hedged exchange spends a whole one,
+ * so the hedged exchanges are allowed in bursts of limited size while their long-run
+ * share stays under the ratio.
+ */
+class hedging_budget {
+public:
+    /**
+     * Set the ratio and drop the earned tokens
+     * @param max_ratio_percent  maximum number of hedged exchanges per 100 exchanges
+     */
+    void reset(uint32_t max_ratio_percent);
+
+    /**
+     * Earn the share of a token for an exchange
+     */
+    void on_exchange();
+
+    /**
+     * Spend a token for a hedged exchange
+     * @return false if there is not enough tokens
+     */
+    bool try_spend();
+
+private:
+    // A token is worth this many units, an exchange earns `m_ratio_percent` units
+    static constexpr int64_t TOKEN = 100;
+    // Maximum number of the hedged exchanges in a burst
+    static constexpr int64_t MAX_TOKENS = 10 * TOKEN;
+
+    int64_t m_ratio_percent = 0;
+    std::atomic<int64_t> m_units{0};
+};
+
+} // namespace ag
@@ -0,0 +1,73 @@
+#include <algorithm>
+#include <array>
+#include <numeric>
+#include "upstream_ranking.h"
+
+
+using namespace ag;
+using namespace std::chrono;
+
+
+void upstream_ranking::init(std::vector<upstream *> upstreams) {
+    m_upstreams = std::move(upstreams);
+    uint64_t packed = 0;
+    for (size_t i = 0; i < std::min(m_upstreams.size(), MAX_RANKED); ++i) {
+        packed |= (uint64_t) i << (BITS_PER_INDEX * i);
+    }
+    m_order.store(packed, std::memory_order_release);
+}
+
+upstream_ranking::order upstream_ranking::get() const {
+    return {&m_upstreams, m_order.load(std::memory_order_acquire)};
+}
+
+upstream_ranking::order upstream_ranking::order::promoted(size_t pos) const {
+    if (pos == 0 || pos >= std::min(size(), MAX_RANKED)) {
+        return *this;
+    }
+    uint64_t preceding = m_packed & ((uint64_t(1) << (BITS_PER_INDEX * pos)) - 1);
+    uint64_t following = (pos + 1 < MAX_RANKED) ? (m_packed >> (BITS_PER_INDEX * (pos + 1))) : 0;
+    uint64_t packed = (following << (BITS_PER_INDEX * (pos + 1))) | (preceding << BITS_PER_INDEX) | index(pos);
+    return {m_upstreams, packed};
+}
+
+void upstream_ranking::on_stats_updated(const upstream *u) {
+    uint64_t packed = m_order.load(std::memory_order_acquire);
+    order cur{&m_upstreams, packed};
+    size_t ranked_num = std::min(m_upstreams.size(), MAX_RANKED);
+    size_t pos = 0;
+    while (pos < ranked_num && cur[pos] != u) {
+        ++pos;
+    }
+    if (pos == ranked_num) {
+        return;
+    }
+
+    // The neighbours are still in order, so is the rest of the upstreams
+    microseconds u_score = score(u);
+    if ((pos == 0 || score(cur[pos - 1]) <= u_score) && (pos + 1 == ranked_num || u_score <= score(cur[pos + 1]))) {
+        return;
+    }
+
+    std::array<microseconds, MAX_RANKED> scores;
+    std::array<uint64_t, MAX_RANKED> indices;
+    for (size_t i = 0; i < ranked_num; ++i) {
+        scores[i] = score(m_upstreams[i]);
+    }
+    std::iota(indices.begin(), indices.begin() + ranked_num, 0);
+    // The ties are kept in the original order, so that the equally good upstreams are not shuffled
+    std::stable_sort(indices.begin(), indices.begin() + ranked_num, [&scores](uint64_t a, uint64_t b) {
+        return scores[a] < scores[b];
+    });
+    uint64_t new_packed = 0;
+    for (size_t i = 0; i < ranked_num; ++i) {
+        new_packed |= indices[i] << (BITS_PER_INDEX * i);
+    }
+    // If someone has reordered the upstreams meanwhile, their order is at least as fresh as this one
+    m_order.compare_exchange_strong(packed, new_packed, std::memory_order_acq_rel);
+}
+
+microseconds upstream_ranking::score(const upstream *u) {
+    microseconds timeout = u->options().timeout;
+    return u->rtt() + 4 * u->rtt_variance() + duration_cast<microseconds>(u->failure_rate() * timeout);
+}
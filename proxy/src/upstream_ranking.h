@@ -0,0 +1,86 @@
+#pragma once
+
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include <upstream.h>
+
+namespace ag {
+
+/**
+ * Order in which a set of upstreams is tried, by their health scores.
+ * The order is kept up to date as the statistics of the upstreams change, rather than sorted
+ * for each request, and is read and updated without locking.
+ */
+class upstream_ranking {
+public:
+    // The order is packed into a single atomic word, so only this many of the first upstreams are ranked,
+    // and the rest follow them in the original order
+    static constexpr size_t MAX_RANKED = 16;
+
+    /**
+     * Snapshot of the order
+     */
+    class order {
+    public:
+        size_t size() const { return m_upstreams->size(); }
+
+        upstream *operator[](size_t i) const { return (*m_upstreams)[index(i)]; }
+
+        /**
+         * @return the position of the upstream at the position `i` of the order in the original list
+         */
+        size_t index(size_t i) const {
+            return (i < MAX_RANKED) ? ((m_packed >> (BITS_PER_INDEX * i)) & INDEX_MASK) : i;
+        }
+
+        /**
+         * @return the order with the upstream at the position `pos` moved to the front
+         *         (unchanged if the upstream is not one of the ranked ones)
+         */
+        order promoted(size_t pos) const;
+
+    private:
+        friend class upstream_ranking;
+
+        const std::vector<upstream *> *m_upstreams;
+        uint64_t m_packed;
+
+        order(const std::vector<upstream *> *upstreams, uint64_t packed) : m_upstreams(upstreams), m_packed(packed) {}
+    };
+
+    /**
+     * Set the upstreams to rank. Not thread-safe.
+     * @param upstreams  the upstreams in the original order, which is used until their statistics are updated
+     */
+    void init(std::vector<upstream *> upstreams);
+
+    /**
+     * @return the current order
+     */
+    order get() const;
+
+    /**
+     * Move the upstream to its place in the order if its score has changed enough.
+     * Called after updating the statistics of the upstream.
+     * @param u  the upstream, ignored if it's not one of the ranked upstreams
+     */
+    void on_stats_updated(const upstream *u);
+
+    /**
+     * Get the expected time spent exchanging a request with the upstream, considering its health statistics.
+     * That's the RTT with a margin for its variance, plus the timeout weighted by the chance of failure.
+     * @return the score (the lower, the better)
+     */
+    static std::chrono::microseconds score(const upstream *u);
+
+private:
+    static constexpr size_t BITS_PER_INDEX = 4;
+    static constexpr uint64_t INDEX_MASK = (1 << BITS_PER_INDEX) - 1;
+
+    std::vector<upstream *> m_upstreams;
+    std::atomic<uint64_t> m_order{0};
+};
+
+} // namespace ag
@@ -3,14 +3,21 @@
 #include <dnsproxy.h>
 #include <ldns/ldns.h>
 #include <thread>
+#include <future>
+#include <atomic>
 #include <memory>
 #include <ag_utils.h>
 #include <ag_net_consts.h>
 #include <cstring>
+#include <cstdio>
+#include <algorithm>
 #include <dns_forwarder.h>
 #include <upstream_utils.h>
 #include <ag_logger.h>
 #include <ag_file.h>
+#include <ag_socket_address.h>
+#include <map>
+#include <mutex>
 
 static constexpr auto DNS64_SERVER_ADDR = "2001:4860:4860::6464";
 static constexpr auto IPV4_ONLY_HOST = "ipv4only.arpa.";
@@ -62,6 +69,126 @@ static ag::allocated_ptr<char> make_rr_answer_string(ldns_pkt *pkt) {
     return ag::allocated_ptr<char>{ ldns_rdf2str(ldns_rr_rdf(ldns_rr_list_rr(ldns_pkt_answer(pkt), 0), 0)) };
 }
 
+/**
+ * Plain DNS server on the loopback which counts the queries it gets.
+ * It answers the A queries with 1.2.3.4 and the rest with empty responses, or drops the queries if it's not responding.
+ */
+class test_dns_server {
+public:
+    /**
+     * @param delay  time to wait before responding
+     */
+    explicit test_dns_server(std::chrono::milliseconds delay = {})
+            : m_delay(delay) {
+        m_fd = socket(AF_INET, SOCK_DGRAM, 0);
+        ag::socket_address addr("127.0.0.1", 0);
+        EXPECT_EQ(0, bind(m_fd, addr.c_sockaddr(), addr.c_socklen()));
+        sockaddr_storage bound{};
+        ev_socklen_t bound_len = sizeof(bound);
+        EXPECT_EQ(0, getsockname(m_fd, (sockaddr *) &bound, &bound_len));
+        m_address = ag::socket_address((sockaddr *) &bound).str();
+        m_thread = std::thread([this] { run(); });
+    }
+
+    ~test_dns_server() {
+        m_stop = true;
+        m_thread.join();
+        evutil_closesocket(m_fd);
+    }
+
+    test_dns_server(const test_dns_server &) = delete;
+    test_dns_server &operator=(const test_dns_server &) = delete;
+
+    const std::string &address() const {
+        return m_address;
+    }
+
+    void set_responding(bool responding) {
+        m_responding = responding;
+    }
+
+    /**
+     * @param malformed  if true, the server responds with a few bytes which are not a DNS message
+     */
+    void set_malformed(bool malformed) {
+        m_malformed = malformed;
+    }
+
+    /**
+     * @param domain  fully qualified domain name, e.g. "example.org."
+     * @return        number of the queries for the domain in any letter case
+     */
+    size_t queries_num(const std::string &domain) const {
+        std::scoped_lock l(m_mtx);
+        auto it = m_queries.find(ag::utils::to_lower(domain));
+        return (it != m_queries.end()) ? it->second : 0;
+    }
+
+private:
+    void run() {
+        while (!m_stop) {
+            fd_set fds;
+            FD_ZERO(&fds);
+            FD_SET(m_fd, &fds);
+            timeval tv{0, 50000};
+            if (select((int) m_fd + 1, &fds, nullptr, nullptr, &tv) <= 0) {
+                continue;
+            }
+            uint8_t buf[ag::UDP_RECV_BUF_SIZE];
+            sockaddr_storage peer{};
+            ev_socklen_t peer_len = sizeof(peer);
+            auto n = recvfrom(m_fd, (char *) buf, sizeof(buf), 0, (sockaddr *) &peer, &peer_len);
+            ldns_pkt *query = nullptr;
+            if (n <= 0 || LDNS_STATUS_OK != ldns_wire2pkt(&query, buf, n)) {
+                continue;
+            }
+            ag::ldns_pkt_ptr request(query);
+            const ldns_rr *question = ldns_rr_list_rr(ldns_pkt_question(query), 0);
+            if (question == nullptr) {
+                continue;
+            }
+            ag::allocated_ptr<char> name(ldns_rdf2str(ldns_rr_owner(question)));
+            {
+                std::scoped_lock l(m_mtx);
+                ++m_queries[ag::utils::to_lower(name.get())];
+            }
+            if (!m_responding) {
+                continue;
+            }
+
+            std::this_thread::sleep_for(m_delay);
+            if (m_malformed) {
+                sendto(m_fd, (const char *) buf, 3, 0, (sockaddr *) &peer, peer_len);
+                continue;
+            }
+            ag::ldns_pkt_ptr response(ldns_pkt_clone(query));
+            ldns_pkt_set_qr(response.get(), true);
+            ldns_pkt_set_ra(response.get(), true);
+            if (ldns_rr_get_type(question) == LDNS_RR_TYPE_A) {
+                ldns_rr *rr = nullptr;
+                ldns_rr_new_frm_str(&rr, AG_FMT("{} 60 IN A 1.2.3.4", name.get()).c_str(), 0, nullptr, nullptr);
+                ldns_pkt_push_rr(response.get(), LDNS_SECTION_ANSWER, rr);
+            }
+            uint8_t *wire = nullptr;
+            size_t wire_size = 0;
+            if (LDNS_STATUS_OK == ldns_pkt2wire(&wire, response.get(), &wire_size)) {
+                sendto(m_fd, (const char *) wire, wire_size, 0, (sockaddr *) &peer, peer_len);
+            }
+            free(wire);
+        }
+    }
+
+    std::chrono::milliseconds m_delay;
+    evutil_socket_t m_fd = -1;
+    std::string m_address;
+    std::atomic_bool m_responding = true;
+    std::atomic_bool m_malformed = false;
+    std::atomic_bool m_stop = false;
+    mutable std::mutex m_mtx;
+    std::map<std::string, size_t> m_queries;
+    std::thread m_thread;
+};
+
 TEST_F(dnsproxy_test, test_dns64) {
     using namespace std::chrono_literals;
 
@@ -289,6 +416,78 @@ TEST_F(dnsproxy_cache_test, cache_key_test) {
     ASSERT_FALSE(last_event.cache_hit);
 }
 
+TEST_F(dnsproxy_cache_test, cache_neutral_edns_options) {
+    const uint8_t COOKIE[] = { 0x00, 0x0a, 0x00, 0x08, 1, 2, 3, 4, 5, 6, 7, 8 };
+    const uint8_t PADDING[] = { 0x00, 0x0c, 0x00, 0x04, 0, 0, 0, 0 };
+    auto make_request = [] (const uint8_t *options, size_t size) {
+        ag::ldns_pkt_ptr req = create_request("google.com.", LDNS_RR_TYPE_A, LDNS_RD);
+        ldns_pkt_set_edns_udp_size(req.get(), 4096);
+        ldns_pkt_set_edns_data(req.get(), ldns_rdf_new_frm_data(LDNS_RDF_TYPE_UNKNOWN, size, options));
+        return req;
+    };
+
+    ag::ldns_pkt_ptr res;
+    ASSERT_NO_FATAL_FAILURE(perform_request(proxy, make_request(COOKIE, std::size(COOKIE)), res));
+    ASSERT_FALSE(last_event.cache_hit);
+
+    // The cookie of the upstream is not given to the other clients
+    ASSERT_NO_FATAL_FAILURE(perform_request(proxy, make_request(COOKIE, std::size(COOKIE)), res));
+    ASSERT_TRUE(last_event.cache_hit);
+    ASSERT_EQ(nullptr, ldns_pkt_edns_data(res.get()));
+
+    // The padding is restored
+    ASSERT_NO_FATAL_FAILURE(perform_request(proxy, make_request(PADDING, std::size(PADDING)), res));
+    ASSERT_TRUE(last_event.cache_hit);
+    ASSERT_NE(nullptr, ldns_pkt_edns_data(res.get()));
+    ASSERT_EQ(0x0c, ldns_rdf_data(ldns_pkt_edns_data(res.get()))[1]);
+
+    // The client subnet affects the answer
+    const uint8_t CLIENT_SUBNET[] = { 0x00, 0x08, 0x00, 0x07, 0x00, 0x01, 24, 0, 1, 2, 3 };
+    ASSERT_NO_FATAL_FAILURE(perform_request(proxy, make_request(CLIENT_SUBNET, std::size(CLIENT_SUBNET)), res));
+    ASSERT_FALSE(last_event.cache_hit);
+}
+
+TEST_F(dnsproxy_cache_test, negative_response_is_cached) {
+    ag::ldns_pkt_ptr pkt = create_request("nonexistent.example.org.", LDNS_RR_TYPE_A, LDNS_RD);
+    ag::ldns_pkt_ptr res;
+    ASSERT_NO_FATAL_FAILURE(perform_request(proxy, pkt, res));
+    ASSERT_FALSE(last_event.cache_hit);
+    ASSERT_EQ(LDNS_RCODE_NXDOMAIN, ldns_pkt_get_rcode(res.get()));
+    ASSERT_GT(ldns_pkt_nscount(res.get()), 0);
+
+    // The TTL is bounded by the SOA record's own TTL and its MINIMUM field
+    const ldns_rr *soa = ldns_rr_list_rr(ldns_pkt_authority(res.get()), 0);
+    ASSERT_EQ(LDNS_RR_TYPE_SOA, ldns_rr_get_type(soa));
+    const uint32_t ttl = std::min(ldns_rr_ttl(soa), ldns_rdf2native_int32(ldns_rr_rdf(soa, 6)));
+    ASSERT_GT(ttl, 1);
+
+    // The negative response does not displace the positive one from the cache of size 1
+    ASSERT_NO_FATAL_FAILURE(perform_request(proxy, create_request("example.org.", LDNS_RR_TYPE_A, LDNS_RD), res));
+    ASSERT_FALSE(last_event.cache_hit);
+    ASSERT_NO_FATAL_FAILURE(perform_request(proxy, pkt, res));
+    ASSERT_TRUE(last_event.cache_hit);
+    ASSERT_EQ(LDNS_RCODE_NXDOMAIN, ldns_pkt_get_rcode(res.get()));
+    ASSERT_NO_FATAL_FAILURE(perform_request(proxy, create_request("example.org.", LDNS_RR_TYPE_A, LDNS_RD), res));
+    ASSERT_TRUE(last_event.cache_hit);
+
+    ag::steady_clock::add_time_shift(std::chrono::seconds(ttl + 1));
+    ASSERT_NO_FATAL_FAILURE(perform_request(proxy, pkt, res));
+    ASSERT_FALSE(last_event.cache_hit);
+}
+
+TEST_F(dnsproxy_cache_test, nodata_response_is_cached) {
+    // example.org has no SRV records
+    ag::ldns_pkt_ptr pkt = create_request("example.org.", LDNS_RR_TYPE_SRV, LDNS_RD);
+    ag::ldns_pkt_ptr res;
+    ASSERT_NO_FATAL_FAILURE(perform_request(proxy, pkt, res));
+    ASSERT_FALSE(last_event.cache_hit);
+    ASSERT_EQ(LDNS_RCODE_NOERROR, ldns_pkt_get_rcode(res.get()));
+    ASSERT_EQ(0, ldns_pkt_ancount(res.get()));
+    ASSERT_NO_FATAL_FAILURE(perform_request(proxy, pkt, res));
+    ASSERT_TRUE(last_event.cache_hit);
+    ASSERT_EQ(0, ldns_pkt_ancount(res.get()));
+}
+
 TEST_F(dnsproxy_test, blocking_mode_default) {
     ag::dnsproxy_settings settings = make_dnsproxy_settings();
     settings.filter_params = {{{1, "blocking_modes_test_filter.txt"}}};
@@ -718,6 +917,41 @@ TEST_F(dnsproxy_test, whitelisting) {
     ASSERT_TRUE(last_event.whitelist);
 }
 
+TEST_F(dnsproxy_test, filtering_outcome_is_cached) {
+    ag::dnsproxy_settings settings = make_dnsproxy_settings();
+    settings.filter_params = {{
+        {-3, "blocking_modes_test_filter.txt"},
+    }};
+
+    ag::dns_request_processed_event last_event{};
+    ag::dnsproxy_events events{
+        .on_request_processed = [&last_event](const ag::dns_request_processed_event &event) {
+            last_event = event;
+        }
+    };
+
+    auto [ret, err] = proxy.init(settings, events);
+    ASSERT_TRUE(ret) << *err;
+
+    ag::ldns_pkt_ptr res;
+    ASSERT_NO_FATAL_FAILURE(perform_request(proxy, create_request("adb-style.com", LDNS_RR_TYPE_A, LDNS_RD), res));
+    ASSERT_FALSE(last_event.cache_hit);
+    ag::dns_request_processed_event first_event = last_event;
+    ag::ldns_pkt_ptr first_res = std::move(res);
+
+    ag::ldns_pkt_ptr req = create_request("ADB-style.com", LDNS_RR_TYPE_A, LDNS_RD);
+    ASSERT_NO_FATAL_FAILURE(perform_request(proxy, req, res));
+    ASSERT_TRUE(last_event.cache_hit);
+    ASSERT_EQ(first_event.rules, last_event.rules);
+    ASSERT_EQ(first_event.filter_list_ids, last_event.filter_list_ids);
+    ASSERT_EQ(first_event.status, last_event.status);
+    ASSERT_EQ(first_event.answer, last_event.answer);
+    ASSERT_EQ(ldns_pkt_id(req.get()), ldns_pkt_id(res.get()));
+    ASSERT_EQ(ldns_pkt_get_rcode(first_res.get()), ldns_pkt_get_rcode(res.get()));
+    ASSERT_EQ(ldns_pkt_ancount(first_res.get()), ldns_pkt_ancount(res.get()));
+    ASSERT_EQ(ldns_pkt_nscount(first_res.get()), ldns_pkt_nscount(res.get()));
+}
+
 TEST_F(dnsproxy_test, bad_filter_file_does_not_crash) {
     ag::dnsproxy_settings settings = make_dnsproxy_settings();
     settings.filter_params = {{ {111, "bad_test_filter.txt"}, }};
@@ -825,3 +1059,898 @@ TEST_F(dnsproxy_test, optimistic_cache) {
         ASSERT_EQ(1, ldns_rr_ttl(ldns_rr_list_rr(ldns_pkt_answer(res.get()), i)));
     }
 }
+
+TEST_F(dnsproxy_test, cache_prefetch) {
+    ag::dnsproxy_settings settings = make_dnsproxy_settings();
+    settings.optimistic_cache = false;
+    settings.dns_cache_size = 100;
+    settings.dns_cache_prefetch = ag::dns_cache_prefetch_settings{ .min_hits = 1, .remaining_ttl_percent = 50 };
+
+    ag::dns_request_processed_event last_event{};
+    ag::dnsproxy_events events{
+            .on_request_processed = [&last_event](const ag::dns_request_processed_event &event) {
+                last_event = event;
+            }
+    };
+
+    auto [ret, err] = proxy.init(settings, events);
+    ASSERT_TRUE(ret) << *err;
+
+    ag::ldns_pkt_ptr res;
+    ASSERT_NO_FATAL_FAILURE(perform_request(proxy, create_request("example.org", LDNS_RR_TYPE_A, LDNS_RD), res));
+    ASSERT_FALSE(last_event.cache_hit);
+    ASSERT_GT(ldns_pkt_ancount(res.get()), 0);
+    uint32_t ttl = ldns_rr_ttl(ldns_rr_list_rr(ldns_pkt_answer(res.get()), 0));
+    ASSERT_GT(ttl, 10);
+
+    // less than a half of the TTL remains, so the hit triggers prefetching
+    ag::steady_clock::add_time_shift(std::chrono::seconds(ttl / 2 + 1));
+    ASSERT_NO_FATAL_FAILURE(perform_request(proxy, create_request("example.org", LDNS_RR_TYPE_A, LDNS_RD), res));
+    ASSERT_TRUE(last_event.cache_hit);
+    uint32_t cached_ttl = ldns_rr_ttl(ldns_rr_list_rr(ldns_pkt_answer(res.get()), 0));
+    ASSERT_LT(cached_ttl, ttl / 2);
+
+    // the refreshed response replaces the old one without a cache miss
+    for (int i = 0; i < 50 && cached_ttl < ttl / 2; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        ASSERT_NO_FATAL_FAILURE(perform_request(proxy, create_request("example.org", LDNS_RR_TYPE_A, LDNS_RD), res));
+        ASSERT_TRUE(last_event.cache_hit);
+        cached_ttl = ldns_rr_ttl(ldns_rr_list_rr(ldns_pkt_answer(res.get()), 0));
+    }
+    ASSERT_GE(cached_ttl, ttl / 2);
+}
+
+TEST_F(dnsproxy_test, coalesced_requests) {
+    // the upstream is slow to respond, so the requests are in flight at the same time
+    test_dns_server server(std::chrono::milliseconds(300));
+    ag::dnsproxy_settings settings = make_dnsproxy_settings();
+    settings.upstreams = {{ .address = server.address() }};
+    settings.dns_cache_size = 100;
+    settings.optimistic_cache = false;
+
+    std::mutex events_mtx;
+    std::vector<ag::dns_request_processed_event> events_list;
+    ag::dnsproxy_events events{
+            .on_request_processed = [&](const ag::dns_request_processed_event &event) {
+                std::scoped_lock l(events_mtx);
+                events_list.push_back(event);
+            }
+    };
+
+    auto [ret, err] = proxy.init(settings, events);
+    ASSERT_TRUE(ret) << *err;
+
+    // simultaneous requests for the same uncached name get the responses to themselves
+    static constexpr size_t REQUESTS_NUM = 8;
+    std::vector<ag::ldns_pkt_ptr> requests;
+    std::vector<ag::ldns_pkt_ptr> responses(REQUESTS_NUM);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < REQUESTS_NUM; ++i) {
+        requests.emplace_back(create_request((i % 2) ? "ExAmPlE.oRg" : "example.org", LDNS_RR_TYPE_A, LDNS_RD));
+        ldns_pkt_set_id(requests.back().get(), 1000 + i);
+    }
+    for (size_t i = 0; i < REQUESTS_NUM; ++i) {
+        threads.emplace_back([&, i] {
+            perform_request(proxy, requests[i], responses[i]);
+        });
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+
+    for (size_t i = 0; i < REQUESTS_NUM; ++i) {
+        ASSERT_NE(responses[i], nullptr);
+        ASSERT_EQ(ldns_pkt_id(requests[i].get()), ldns_pkt_id(responses[i].get()));
+        ASSERT_EQ(LDNS_RCODE_NOERROR, ldns_pkt_get_rcode(responses[i].get()));
+        ASSERT_GT(ldns_pkt_ancount(responses[i].get()), 0);
+        ag::allocated_ptr<char> question(ldns_rdf2str(
+                ldns_rr_owner(ldns_rr_list_rr(ldns_pkt_question(responses[i].get()), 0))));
+        ASSERT_STREQ((i % 2) ? "ExAmPlE.oRg." : "example.org.", question.get());
+    }
+    ASSERT_EQ(REQUESTS_NUM, events_list.size());
+    for (const ag::dns_request_processed_event &event : events_list) {
+        ASSERT_TRUE(event.error.empty()) << event.error;
+    }
+    // only one of the requests has gone to the upstream
+    ASSERT_EQ(1u, server.queries_num("example.org."));
+}
+
+TEST_F(dnsproxy_test, handle_message_async) {
+    ag::dnsproxy_settings settings = make_dnsproxy_settings();
+    settings.dns_cache_size = 100;
+    settings.filter_params = {{{1, "blocking_modes_test_filter.txt"}}};
+
+    auto [ret, err] = proxy.init(settings, {});
+    ASSERT_TRUE(ret) << *err;
+
+    auto handle_message_async = [&](const ag::ldns_pkt_ptr &request, bool &completed_inline) {
+        const std::unique_ptr<ldns_buffer, ag::ftor<ldns_buffer_free>> buffer(
+                ldns_buffer_new(ag::REQUEST_BUFFER_INITIAL_CAPACITY));
+        EXPECT_EQ(LDNS_STATUS_OK, ldns_pkt2buffer_wire(buffer.get(), request.get()));
+
+        std::promise<std::vector<uint8_t>> promise;
+        std::atomic_bool returned = false;
+        completed_inline = false;
+        proxy.handle_message_async({ldns_buffer_at(buffer.get(), 0), ldns_buffer_position(buffer.get())},
+                                   [&](std::vector<uint8_t> response) {
+                                       completed_inline = !returned;
+                                       promise.set_value(std::move(response));
+                                   });
+        returned = true;
+        std::vector<uint8_t> resp_data = promise.get_future().get();
+
+        ldns_pkt *resp = nullptr;
+        EXPECT_EQ(LDNS_STATUS_OK, ldns_wire2pkt(&resp, resp_data.data(), resp_data.size()));
+        return ag::ldns_pkt_ptr(resp);
+    };
+
+    bool completed_inline = false;
+    ag::ldns_pkt_ptr response = handle_message_async(
+            create_request("google.com", LDNS_RR_TYPE_A, LDNS_RD), completed_inline);
+    ASSERT_NE(response, nullptr);
+    ASSERT_EQ(LDNS_RCODE_NOERROR, ldns_pkt_get_rcode(response.get()));
+    ASSERT_GT(ldns_pkt_ancount(response.get()), 0);
+    ASSERT_FALSE(completed_inline);
+
+    // the cached response is passed to the callback right away
+    response = handle_message_async(create_request("google.com", LDNS_RR_TYPE_A, LDNS_RD), completed_inline);
+    ASSERT_NE(response, nullptr);
+    ASSERT_GT(ldns_pkt_ancount(response.get()), 0);
+    ASSERT_TRUE(completed_inline);
+
+    // as well as the blocking one
+    response = handle_message_async(create_request("adb-style.com", LDNS_RR_TYPE_A, LDNS_RD), completed_inline);
+    ASSERT_NE(response, nullptr);
+    ASSERT_EQ(LDNS_RCODE_REFUSED, ldns_pkt_get_rcode(response.get()));
+    ASSERT_TRUE(completed_inline);
+}
+
+TEST_F(dnsproxy_test, upstream_hedging) {
+    ag::dnsproxy_settings settings = make_dnsproxy_settings();
+    settings.upstreams = {
+            // nothing responds there
+            { .address = "240.0.0.1", .timeout = std::chrono::seconds(5), .id = 1 },
+            { .address = "94.140.14.140", .timeout = std::chrono::seconds(5), .id = 2 },
+    };
+    settings.upstream_hedging = ag::upstream_hedging_settings{
+            .min_delay = std::chrono::milliseconds(10),
+            .max_delay = std::chrono::milliseconds(100),
+            .max_ratio_percent = 100,
+    };
+
+    std::promise<ag::dns_request_processed_event> event_promise;
+    ag::dnsproxy_events events{
+            .on_request_processed = [&](const ag::dns_request_processed_event &event) {
+                event_promise.set_value(event);
+            }
+    };
+    auto [ret, err] = proxy.init(settings, events);
+    ASSERT_TRUE(ret) << *err;
+
+    ag::ldns_pkt_ptr request = create_request("google.com", LDNS_RR_TYPE_A, LDNS_RD);
+    const std::unique_ptr<ldns_buffer, ag::ftor<ldns_buffer_free>> buffer(
+            ldns_buffer_new(ag::REQUEST_BUFFER_INITIAL_CAPACITY));
+    ASSERT_EQ(LDNS_STATUS_OK, ldns_pkt2buffer_wire(buffer.get(), request.get()));
+
+    // whichever of the upstreams is tried first, the response comes before the silent one times out
+    ag::utils::timer timer;
+    std::promise<std::vector<uint8_t>> promise;
+    proxy.handle_message_async({ldns_buffer_at(buffer.get(), 0), ldns_buffer_position(buffer.get())},
+                               [&](std::vector<uint8_t> response) {
+                                   promise.set_value(std::move(response));
+                               });
+    std::vector<uint8_t> resp_data = promise.get_future().get();
+    ASSERT_LT(timer.elapsed<std::chrono::milliseconds>(), std::chrono::seconds(5));
+
+    ldns_pkt *resp = nullptr;
+    ASSERT_EQ(LDNS_STATUS_OK, ldns_wire2pkt(&resp, resp_data.data(), resp_data.size()));
+    ag::ldns_pkt_ptr response(resp);
+    ASSERT_EQ(LDNS_RCODE_NOERROR, ldns_pkt_get_rcode(response.get()));
+    ASSERT_GT(ldns_pkt_ancount(response.get()), 0);
+
+    ag::dns_request_processed_event event = event_promise.get_future().get();
+    ASSERT_TRUE(event.error.empty()) << event.error;
+    ASSERT_EQ(2, event.upstream_id);
+}
+
+TEST_F(dnsproxy_test, upstream_hedging_no_retry_after_hedge) {
+    using namespace std::chrono_literals;
+
+    // the first upstream fails slowly with an error other than timeout, which is retried unless the hedge has won
+    test_dns_server first(300ms);
+    first.set_malformed(true);
+    test_dns_server second;
+
+    ag::dnsproxy_settings settings = make_dnsproxy_settings();
+    settings.upstreams = {
+            { .address = first.address(), .timeout = 2000ms, .id = 1 },
+            { .address = second.address(), .timeout = 2000ms, .id = 2 },
+    };
+    settings.upstream_hedging = ag::upstream_hedging_settings{
+            .min_delay = 10ms,
+            .max_delay = 100ms,
+            .max_ratio_percent = 100,
+    };
+    auto [ret, err] = proxy.init(settings, {});
+    ASSERT_TRUE(ret) << *err;
+
+    ag::ldns_pkt_ptr request = create_request("example.org", LDNS_RR_TYPE_A, LDNS_RD);
+    const std::unique_ptr<ldns_buffer, ag::ftor<ldns_buffer_free>> buffer(
+            ldns_buffer_new(ag::REQUEST_BUFFER_INITIAL_CAPACITY));
+    ASSERT_EQ(LDNS_STATUS_OK, ldns_pkt2buffer_wire(buffer.get(), request.get()));
+
+    std::promise<std::vector<uint8_t>> promise;
+    proxy.handle_message_async({ldns_buffer_at(buffer.get(), 0), ldns_buffer_position(buffer.get())},
+                               [&](std::vector<uint8_t> response) {
+                                   promise.set_value(std::move(response));
+                               });
+    std::vector<uint8_t> resp_data = promise.get_future().get();
+    ldns_pkt *resp = nullptr;
+    ASSERT_EQ(LDNS_STATUS_OK, ldns_wire2pkt(&resp, resp_data.data(), resp_data.size()));
+    ag::ldns_pkt_ptr response(resp);
+    ASSERT_EQ(LDNS_RCODE_NOERROR, ldns_pkt_get_rcode(response.get()));
+    ASSERT_EQ(1u, second.queries_num("example.org."));
+
+    // let the first upstream fail, it's not queried again since the response has been sent already
+    std::this_thread::sleep_for(600ms);
+    ASSERT_EQ(1u, first.queries_num("example.org."));
+}
+
+TEST_F(dnsproxy_test, upstream_hedging_settings_validation) {
+    ag::dnsproxy_settings settings = make_dnsproxy_settings();
+    settings.upstream_hedging = ag::upstream_hedging_settings{
+            .min_delay = std::chrono::milliseconds(100),
+            .max_delay = std::chrono::milliseconds(10),
+    };
+    auto [ret, err] = proxy.init(settings, {});
+    ASSERT_FALSE(ret);
+}
+
+TEST(upstream_hedging_test, response_time_histogram) {
+    ag::response_time_histogram histogram;
+    ASSERT_FALSE(histogram.percentile(90).has_value());
+
+    for (int i = 0; i < 90; ++i) {
+        histogram.add(std::chrono::milliseconds(20));
+    }
+    for (int i = 0; i < 10; ++i) {
+        histogram.add(std::chrono::milliseconds(500));
+    }
+    std::optional<std::chrono::milliseconds> p90 = histogram.percentile(90);
+    ASSERT_TRUE(p90.has_value());
+    // the estimate is rounded up to the bucket bound, which is less than 20% off
+    ASSERT_GE(*p90, std::chrono::milliseconds(20));
+    ASSERT_LE(*p90, std::chrono::milliseconds(24));
+    std::optional<std::chrono::milliseconds> p99 = histogram.percentile(99);
+    ASSERT_GE(*p99, std::chrono::milliseconds(500));
+    ASSERT_LE(*p99, std::chrono::milliseconds(600));
+
+    // the old response times fade away
+    for (int i = 0; i < 4096; ++i) {
+        histogram.add(std::chrono::milliseconds(100));
+    }
+    p99 = histogram.percentile(99);
+    ASSERT_GE(*p99, std::chrono::milliseconds(100));
+    ASSERT_LE(*p99, std::chrono::milliseconds(120));
+}
+
+TEST(upstream_hedging_test, budget) {
+    ag::hedging_budget budget;
+    budget.reset(10);
+    ASSERT_FALSE(budget.try_spend());
+
+    for (int i = 0; i < 100; ++i) {
+        budget.on_exchange();
+    }
+    size_t spent = 0;
+    while (budget.try_spend()) {
+        ++spent;
+    }
+    ASSERT_EQ(10, spent);
+
+    // the unused tokens are accumulated up to a limit
+    for (int i = 0; i < 100000; ++i) {
+        budget.on_exchange();
+    }
+    spent = 0;
+    while (budget.try_spend()) {
+        ++spent;
+    }
+    ASSERT_GT(spent, 0);
+    ASSERT_LT(spent, 100);
+}
+
+TEST(upstream_ranking_test, order) {
+    ag::upstream_factory factory({});
+    std::vector<ag::upstream_ptr> upstreams;
+    for (const char *address : {"1.1.1.1", "8.8.8.8", "9.9.9.9"}) {
+        auto [u, err] = factory.create_upstream({ .address = address });
+        ASSERT_FALSE(err.has_value()) << *err;
+        upstreams.emplace_back(std::move(u));
+    }
+    ag::upstream_ranking ranking;
+    ranking.init({upstreams[0].get(), upstreams[1].get(), upstreams[2].get()});
+
+    // the upstreams are tried in the original order until their statistics are known
+    ag::upstream_ranking::order order = ranking.get();
+    ASSERT_EQ(3, order.size());
+    ASSERT_EQ(upstreams[0].get(), order[0]);
+    ASSERT_EQ(upstreams[1].get(), order[1]);
+    ASSERT_EQ(upstreams[2].get(), order[2]);
+
+    auto update_stats = [&ranking] (const ag::upstream_ptr &u, std::chrono::milliseconds elapsed, bool failed) {
+        u->update_stats(elapsed, failed);
+        ranking.on_stats_updated(u.get());
+    };
+    update_stats(upstreams[0], std::chrono::milliseconds(100), false);
+    update_stats(upstreams[2], std::chrono::milliseconds(10), false);
+    for (int i = 0; i < 3; ++i) {
+        update_stats(upstreams[1], std::chrono::milliseconds(1), true);
+    }
+
+    // the failing upstream is the last one despite responding quickly
+    order = ranking.get();
+    ASSERT_EQ(upstreams[2].get(), order[0]);
+    ASSERT_EQ(upstreams[0].get(), order[1]);
+    ASSERT_EQ(upstreams[1].get(), order[2]);
+
+    // the snapshot taken earlier is not affected by the following updates
+    for (int i = 0; i < 10; ++i) {
+        update_stats(upstreams[2], std::chrono::milliseconds(1000), false);
+    }
+    ASSERT_EQ(upstreams[2].get(), order[0]);
+    ASSERT_EQ(upstreams[2].get(), ranking.get()[2]);
+}
+
+TEST(upstream_balancer_test, weighted_round_robin) {
+    ag::upstream_factory factory({});
+    std::vector<ag::upstream_ptr> upstreams;
+    for (auto [address, weight] : {std::pair{"1.1.1.1", 3u}, std::pair{"8.8.8.8", 0u}}) {
+        auto [u, err] = factory.create_upstream({ .address = address, .weight = weight });
+        ASSERT_FALSE(err.has_value()) << *err;
+        upstreams.emplace_back(std::move(u));
+    }
+    std::vector<ag::upstream *> pointers = {upstreams[0].get(), upstreams[1].get()};
+    ag::upstream_ranking ranking;
+    ranking.init(pointers);
+    ag::upstream_balancer balancer;
+    balancer.init(ag::dnsproxy_upstream_balancing::WEIGHTED_ROUND_ROBIN, pointers);
+
+    std::vector<ag::upstream *> selected;
+    for (int i = 0; i < 8; ++i) {
+        ag::upstream_ranking::order order = balancer.select(ranking.get());
+        ASSERT_EQ(2, order.size());
+        // the rest of the upstreams are still there for the failover
+        ASSERT_NE(order[0], order[1]);
+        selected.push_back(order[0]);
+    }
+    ASSERT_EQ(6, std::count(selected.begin(), selected.end(), upstreams[0].get()));
+    // the turns of the lighter upstream are not bunched together
+    for (size_t i = 1; i < selected.size(); ++i) {
+        ASSERT_FALSE(selected[i] == upstreams[1].get() && selected[i - 1] == upstreams[1].get());
+    }
+}
+
+TEST(upstream_balancer_test, least_outstanding_requests) {
+    ag::upstream_factory factory({});
+    std::vector<ag::upstream_ptr> upstreams;
+    for (const char *address : {"1.1.1.1", "8.8.8.8", "9.9.9.9"}) {
+        auto [u, err] = factory.create_upstream({ .address = address });
+        ASSERT_FALSE(err.has_value()) << *err;
+        upstreams.emplace_back(std::move(u));
+    }
+    std::vector<ag::upstream *> pointers = {upstreams[0].get(), upstreams[1].get(), upstreams[2].get()};
+    ag::upstream_ranking ranking;
+    ranking.init(pointers);
+    ag::upstream_balancer balancer;
+    balancer.init(ag::dnsproxy_upstream_balancing::LEAST_OUTSTANDING_REQUESTS, pointers);
+
+    // the ties go to the better ranked upstream
+    ASSERT_EQ(upstreams[0].get(), balancer.select(ranking.get())[0]);
+
+    balancer.on_exchange_started(upstreams[0].get());
+    balancer.on_exchange_started(upstreams[1].get());
+    ag::upstream_ranking::order order = balancer.select(ranking.get());
+    ASSERT_EQ(upstreams[2].get(), order[0]);
+    // the failover follows the ranking
+    ASSERT_EQ(upstreams[0].get(), order[1]);
+    ASSERT_EQ(upstreams[1].get(), order[2]);
+
+    balancer.on_exchange_finished(upstreams[1].get());
+    balancer.on_exchange_started(upstreams[2].get());
+    ASSERT_EQ(upstreams[1].get(), balancer.select(ranking.get())[0]);
+}
+
+TEST(upstream_circuit_breaker_test, down_and_up) {
+    ag::upstream_factory factory({});
+    std::vector<ag::upstream_ptr> upstreams;
+    for (const char *address : {"1.1.1.1", "8.8.8.8"}) {
+        auto [u, err] = factory.create_upstream({ .address = address });
+        ASSERT_FALSE(err.has_value()) << *err;
+        upstreams.emplace_back(std::move(u));
+    }
+    const ag::upstream *first = upstreams[0].get();
+    const ag::upstream *second = upstreams[1].get();
+    ag::upstream_circuit_breaker breaker;
+    breaker.init(3, {upstreams[0].get(), upstreams[1].get()});
+
+    // only the failures in a row count
+    ASSERT_FALSE(breaker.on_exchange_result(first, true));
+    ASSERT_FALSE(breaker.on_exchange_result(first, true));
+    ASSERT_FALSE(breaker.on_exchange_result(first, false));
+    ASSERT_FALSE(breaker.on_exchange_result(first, true));
+    ASSERT_FALSE(breaker.on_exchange_result(first, true));
+    ASSERT_FALSE(breaker.is_down(first));
+    ASSERT_TRUE(breaker.on_exchange_result(first, true));
+    ASSERT_TRUE(breaker.is_down(first));
+    // the upstream goes down once
+    ASSERT_FALSE(breaker.on_exchange_result(first, true));
+    ASSERT_FALSE(breaker.are_all_down());
+
+    for (int i = 0; i < 3; ++i) {
+        breaker.on_exchange_result(second, true);
+    }
+    ASSERT_TRUE(breaker.are_all_down());
+
+    // a successful exchange brings the upstream back, as well as a response to a probe
+    breaker.on_exchange_result(second, false);
+    ASSERT_FALSE(breaker.is_down(second));
+    ASSERT_TRUE(breaker.mark_up(first));
+    ASSERT_FALSE(breaker.mark_up(first));
+    ASSERT_FALSE(breaker.is_down(first));
+    ASSERT_FALSE(breaker.are_all_down());
+
+    // the untracked upstreams are never down
+    ag::upstream_circuit_breaker disabled;
+    ASSERT_FALSE(disabled.on_exchange_result(first, true));
+    ASSERT_FALSE(disabled.is_down(first));
+    ASSERT_FALSE(disabled.are_all_down());
+}
+
+TEST_F(dnsproxy_test, upstream_circuit_breaker) {
+    using namespace std::chrono_literals;
+
+    test_dns_server first;
+    test_dns_server second;
+    first.set_responding(false);
+
+    ag::dnsproxy_settings settings = make_dnsproxy_settings();
+    settings.upstreams = {
+            { .address = first.address(), .timeout = 200ms, .id = 1 },
+            { .address = second.address(), .timeout = 200ms, .id = 2 },
+    };
+    settings.upstream_circuit_breaker = ag::upstream_circuit_breaker_settings{
+            .failures_threshold = 1,
+            .probe_interval = 100ms,
+    };
+
+    std::mutex events_mtx;
+    ag::dns_request_processed_event last_event{};
+    ag::dnsproxy_events events{
+            .on_request_processed = [&](const ag::dns_request_processed_event &event) {
+                std::scoped_lock l(events_mtx);
+                last_event = event;
+            }
+    };
+    auto [ret, err] = proxy.init(settings, events);
+    ASSERT_TRUE(ret) << *err;
+
+    auto resolve = [&](const std::string &name) {
+        ag::ldns_pkt_ptr response;
+        ASSERT_NO_FATAL_FAILURE(perform_request(proxy, create_request(name, LDNS_RR_TYPE_A, LDNS_RD), response));
+        ASSERT_EQ(LDNS_RCODE_NOERROR, ldns_pkt_get_rcode(response.get()));
+    };
+
+    // the first upstream times out and goes down, the second one answers instead
+    ASSERT_NO_FATAL_FAILURE(resolve("example.org"));
+    ASSERT_EQ(1u, first.queries_num("example.org."));
+    ASSERT_EQ(2, last_event.upstream_id);
+
+    // the down upstream is skipped
+    ASSERT_NO_FATAL_FAILURE(resolve("example.com"));
+    ASSERT_EQ(0u, first.queries_num("example.com."));
+    ASSERT_EQ(1u, second.queries_num("example.com."));
+    ASSERT_EQ(2, last_event.upstream_id);
+
+    // it's probed meanwhile, and the probe which gets a response brings it back
+    for (int i = 0; i < 20 && first.queries_num(".") == 0; ++i) {
+        std::this_thread::sleep_for(100ms);
+    }
+    ASSERT_GT(first.queries_num("."), 0u);
+    first.set_responding(true);
+    size_t probes_num = first.queries_num(".");
+    for (int i = 0; i < 20 && first.queries_num(".") == probes_num; ++i) {
+        std::this_thread::sleep_for(50ms);
+    }
+    std::this_thread::sleep_for(300ms);
+    // no more probes once it's up
+    probes_num = first.queries_num(".");
+    std::this_thread::sleep_for(300ms);
+    ASSERT_EQ(probes_num, first.queries_num("."));
+
+    // the second upstream is now ranked first, and the first one answers when it fails
+    second.set_responding(false);
+    ASSERT_NO_FATAL_FAILURE(resolve("example.net"));
+    ASSERT_EQ(1u, second.queries_num("example.net."));
+    ASSERT_EQ(1u, first.queries_num("example.net."));
+    ASSERT_EQ(1, last_event.upstream_id);
+}
+
+TEST(response_cache_test, shards) {
+    ag::response_cache cache;
+    cache.init(100, 0, 4);
+    ASSERT_EQ(4u, cache.shards_num());
+
+    // the shards number is limited with the capacity
+    cache.init(2, 0, 8);
+    ASSERT_EQ(2u, cache.shards_num());
+    cache.init(0, 0, 0);
+    ASSERT_EQ(1u, cache.shards_num());
+
+    cache.init(100, 0, 4);
+    std::vector<ag::cache_key> keys;
+    for (int i = 0; i < 50; ++i) {
+        std::string name = AG_FMT("{}domain{}{}com", char(6 + std::to_string(i).size()), i, char(3));
+        keys.emplace_back(ag::uint8_view{ (const uint8_t *)name.data(), name.size() + 1 }, LDNS_RR_TYPE_A, LDNS_RR_CLASS_IN, 0);
+        cache.insert(keys.back(), {});
+    }
+    ASSERT_EQ(keys.size(), cache.size());
+
+    for (const ag::cache_key &key : keys) {
+        ASSERT_TRUE(cache.find(key, [] (const ag::cached_response &) { return false; })) << key.str();
+    }
+
+    cache.clear();
+    ASSERT_EQ(0u, cache.size());
+}
+
+TEST_F(dnsproxy_test, sharded_cache) {
+    ag::dnsproxy_settings settings = make_dnsproxy_settings();
+    settings.dns_cache_size = 100;
+    settings.dns_cache_shards_num = 8;
+    settings.optimistic_cache = false;
+
+    ag::dns_request_processed_event last_event{};
+    ag::dnsproxy_events events{
+            .on_request_processed = [&last_event](const ag::dns_request_processed_event &event) {
+                last_event = event;
+            }
+    };
+
+    auto [ret, err] = proxy.init(settings, events);
+    ASSERT_TRUE(ret) << *err;
+
+    ag::ldns_pkt_ptr res;
+    for (const char *domain : { "example.org", "example.com", "google.com", "yandex.ru" }) {
+        ASSERT_NO_FATAL_FAILURE(perform_request(proxy, create_request(domain, LDNS_RR_TYPE_A, LDNS_RD), res));
+        ASSERT_FALSE(last_event.cache_hit) << domain;
+    }
+    for (const char *domain : { "example.org", "example.com", "google.com", "yandex.ru" }) {
+        ASSERT_NO_FATAL_FAILURE(perform_request(proxy, create_request(domain, LDNS_RR_TYPE_A, LDNS_RD), res));
+        ASSERT_TRUE(last_event.cache_hit) << domain;
+    }
+    ASSERT_GT(proxy.get_cache_memory_usage(), 0u);
+}
+
+TEST(response_cache_test, wire_format_entry) {
+    // example.com A response with an OPT record
+    const ag::uint8_vector RESPONSE = {
+        0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01,
+        0x07, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 0x03, 'c', 'o', 'm', 0x00, 0x00, 0x01, 0x00, 0x01,
+        0xc0, 0x0c, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x04, 1, 2, 3, 4,
+        0x00, 0x00, 0x29, 0x04, 0xd0, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00,
+    };
+    const ag::uint8_vector REQUEST = {
+        0xab, 0xcd, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x07, 'E', 'x', 'A', 'm', 'P', 'l', 'E', 0x03, 'C', 'o', 'M', 0x00, 0x00, 0x01, 0x00, 0x01,
+    };
+
+    std::optional<ag::cached_response> entry = ag::cached_response::create(RESPONSE);
+    ASSERT_TRUE(entry.has_value());
+    ASSERT_EQ(1u, entry->ttl_offsets.size());
+
+    ag::uint8_vector response;
+    ASSERT_TRUE(entry->make_response({ REQUEST.data(), REQUEST.size() }, 42, response));
+    ag::uint8_vector expected = RESPONSE;
+    std::copy(REQUEST.begin(), REQUEST.begin() + 2, expected.begin()); // ID
+    std::copy(REQUEST.begin() + 12, REQUEST.end(), expected.begin() + 12); // question
+    expected[37] = 0; // answer TTL
+    expected[38] = 42;
+    expected[48] = 0x10; // UDP payload size
+    expected[49] = 0x00;
+    ASSERT_EQ(expected, response);
+
+    // the question of another size does not fit
+    ag::uint8_vector other_request = REQUEST;
+    other_request.insert(other_request.begin() + 13, 'x');
+    ++other_request[12];
+    ASSERT_FALSE(entry->make_response({ other_request.data(), other_request.size() }, 42, response));
+
+    // truncated
+    ASSERT_FALSE(ag::cached_response::create({ RESPONSE.begin(), RESPONSE.end() - 1 }).has_value());
+}
+
+TEST(response_cache_test, padding) {
+    // example.com A response with an OPT record
+    const ag::uint8_vector RESPONSE = {
+        0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01,
+        0x07, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 0x03, 'c', 'o', 'm', 0x00, 0x00, 0x01, 0x00, 0x01,
+        0xc0, 0x0c, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x04, 1, 2, 3, 4,
+        0x00, 0x00, 0x29, 0x04, 0xd0, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00,
+    };
+    std::optional<ag::cached_response> entry = ag::cached_response::create(RESPONSE);
+    ASSERT_TRUE(entry.has_value());
+
+    ag::uint8_vector response = RESPONSE;
+    ASSERT_FALSE(entry->add_padding(response, 128, 127));
+    ASSERT_EQ(RESPONSE, response);
+
+    ASSERT_TRUE(entry->add_padding(response, 128, 128));
+    ASSERT_EQ(128u, response.size());
+    ASSERT_EQ(0, std::memcmp(RESPONSE.data(), response.data(), RESPONSE.size() - 2));
+    const uint8_t OPT_RDATA[] = { 0x00, 72, 0x00, 0x0c, 0x00, 68 }; // RDLENGTH, option code and length
+    ASSERT_EQ(0, std::memcmp(OPT_RDATA, &response[RESPONSE.size() - 2], std::size(OPT_RDATA)));
+    ASSERT_TRUE(std::all_of(response.begin() + RESPONSE.size() + 4, response.end(), [] (uint8_t b) { return b == 0; }));
+
+    // no OPT record
+    ag::uint8_vector no_opt_response(RESPONSE.begin(), RESPONSE.end() - 11);
+    no_opt_response[11] = 0;
+    entry = ag::cached_response::create(no_opt_response);
+    ASSERT_TRUE(entry.has_value());
+    ASSERT_FALSE(entry->add_padding(no_opt_response, 128, 128));
+}
+
+TEST(response_cache_test, cache_key) {
+    const uint8_t NAME[] = { 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0 };
+    const uint8_t MIXED_CASE_NAME[] = { 7, 'E', 'x', 'A', 'm', 'P', 'l', 'E', 3, 'C', 'O', 'M', 0 };
+    const uint8_t ROOT_NAME[] = { 0 };
+
+    ag::cache_key key({ NAME, std::size(NAME) }, LDNS_RR_TYPE_A, LDNS_RR_CLASS_IN, 0);
+    ASSERT_EQ("1|1|00|example.com", key.str());
+    ASSERT_EQ("28|1|11|.", ag::cache_key({ ROOT_NAME, std::size(ROOT_NAME) }, LDNS_RR_TYPE_AAAA, LDNS_RR_CLASS_IN,
+            ag::cache_key::DNSSEC_OK | ag::cache_key::CHECKING_DISABLED).str());
+
+    // case doesn't matter
+    ag::cache_key other({ MIXED_CASE_NAME, std::size(MIXED_CASE_NAME) }, LDNS_RR_TYPE_A, LDNS_RR_CLASS_IN, 0);
+    ASSERT_EQ(key, other);
+    ASSERT_EQ(std::hash<ag::cache_key>{}(key), std::hash<ag::cache_key>{}(other));
+
+    // type, class and flags matter
+    ASSERT_NE(key, ag::cache_key({ NAME, std::size(NAME) }, LDNS_RR_TYPE_AAAA, LDNS_RR_CLASS_IN, 0));
+    ASSERT_NE(key, ag::cache_key({ NAME, std::size(NAME) }, LDNS_RR_TYPE_A, LDNS_RR_CLASS_CH, 0));
+    ASSERT_NE(key, ag::cache_key({ NAME, std::size(NAME) }, LDNS_RR_TYPE_A, LDNS_RR_CLASS_IN, ag::cache_key::DNSSEC_OK));
+    ASSERT_NE(key, ag::cache_key({ NAME, std::size(NAME) }, LDNS_RR_TYPE_A, LDNS_RR_CLASS_IN,
+            ag::cache_key::CHECKING_DISABLED));
+}
+
+TEST(response_cache_test, memory_limit) {
+    static constexpr size_t MEMORY_LIMIT = 128 * 1024;
+    static constexpr size_t RESPONSE_SIZE = 1000;
+
+    ag::response_cache cache;
+    cache.init(1000, MEMORY_LIMIT, 1);
+
+    auto make_key = [] (int i) {
+        std::string name = AG_FMT("{}domain{}{}com", char(6 + std::to_string(i).size()), i, char(3));
+        return ag::cache_key({ (const uint8_t *)name.data(), name.size() + 1 }, LDNS_RR_TYPE_TXT, LDNS_RR_CLASS_IN, 0);
+    };
+    auto make_response = [] (size_t size) {
+        ag::cached_response r;
+        r.wire.resize(size);
+        return r;
+    };
+
+    size_t entry_size = make_response(RESPONSE_SIZE).mem_usage();
+    size_t max_entries = MEMORY_LIMIT / entry_size;
+    for (size_t i = 0; i < 2 * max_entries; ++i) {
+        cache.insert(make_key(i), make_response(RESPONSE_SIZE));
+        ASSERT_LE(cache.mem_usage(), MEMORY_LIMIT);
+    }
+    ASSERT_EQ(max_entries, cache.size());
+    ASSERT_EQ(max_entries * entry_size, cache.mem_usage());
+
+    // the least recently used entries are displaced
+    auto contains = [&cache] (const ag::cache_key &key) {
+        return cache.find(key, [] (const ag::cached_response &) { return false; });
+    };
+    for (size_t i = 0; i < 2 * max_entries; ++i) {
+        ASSERT_EQ(i >= max_entries, contains(make_key(i))) << i;
+    }
+
+    // a large entry displaces several small ones
+    cache.insert(make_key(-1), make_response(10 * RESPONSE_SIZE));
+    ASSERT_LT(cache.size(), max_entries);
+    ASSERT_LE(cache.mem_usage(), MEMORY_LIMIT);
+
+    // an entry exceeding the limit is not cached
+    cache.insert(make_key(-2), make_response(MEMORY_LIMIT));
+    ASSERT_FALSE(contains(make_key(-2)));
+
+    // updating an entry keeps the accounting precise
+    size_t usage = cache.mem_usage();
+    cache.insert(make_key(-1), make_response(RESPONSE_SIZE));
+    ASSERT_EQ(usage - 9 * RESPONSE_SIZE, cache.mem_usage());
+
+    cache.erase(make_key(-1));
+    ASSERT_EQ(usage - make_response(10 * RESPONSE_SIZE).mem_usage(), cache.mem_usage());
+
+    cache.clear();
+    ASSERT_EQ(0u, cache.mem_usage());
+}
+
+TEST(response_cache_test, s3fifo_policy) {
+    static constexpr size_t CAPACITY = 100;
+
+    ag::response_cache cache;
+    cache.init(CAPACITY, 0, 1, ag::dnsproxy_cache_policy::S3_FIFO);
+
+    auto make_key = [] (int i) {
+        std::string name = AG_FMT("{}domain{}{}com", char(6 + std::to_string(i).size()), i, char(3));
+        return ag::cache_key({ (const uint8_t *)name.data(), name.size() + 1 }, LDNS_RR_TYPE_A, LDNS_RR_CLASS_IN, 0);
+    };
+    auto contains = [&cache] (const ag::cache_key &key) {
+        return cache.find(key, [] (const ag::cached_response &) { return false; });
+    };
+
+    // the responses requested again survive a burst of the ones requested once,
+    // even if they have been refreshed meanwhile
+    for (int i = 0; i < 10; ++i) {
+        cache.insert(make_key(i), {});
+        ASSERT_TRUE(contains(make_key(i)));
+        cache.insert(make_key(i), {});
+    }
+    for (int i = 10; i < 10 * (int) CAPACITY; ++i) {
+        cache.insert(make_key(i), {});
+    }
+    ASSERT_EQ(CAPACITY, cache.size());
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_TRUE(contains(make_key(i))) << i;
+    }
+
+    // an expired entry is displaced first
+    ASSERT_TRUE(cache.find(make_key(0), [] (const ag::cached_response &) { return true; }));
+    cache.insert(make_key(-1), {});
+    ASSERT_FALSE(contains(make_key(0)));
+}
+
+TEST(response_cache_test, snapshot) {
+    static constexpr const char *SNAPSHOT_PATH = "response_cache_snapshot.bin";
+    // example.com A response
+    const ag::uint8_vector RESPONSE = {
+        0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+        0x07, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 0x03, 'c', 'o', 'm', 0x00, 0x00, 0x01, 0x00, 0x01,
+        0xc0, 0x0c, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x04, 1, 2, 3, 4,
+    };
+    const ag::cache_key KEY({ &RESPONSE[12], 13 }, LDNS_RR_TYPE_A, LDNS_RR_CLASS_IN, ag::cache_key::DNSSEC_OK);
+    const ag::cache_key EXPIRED_KEY({ &RESPONSE[12], 13 }, LDNS_RR_TYPE_A, LDNS_RR_CLASS_IN, 0);
+
+    ag::response_cache cache;
+    cache.init(100, 0, 4);
+    std::optional<ag::cached_response> entry = ag::cached_response::create(RESPONSE);
+    ASSERT_TRUE(entry.has_value());
+    entry->status = "NOERROR";
+    entry->answer = "example.com. 300 IN A 1.2.3.4";
+    entry->upstream_id = -42;
+    entry->expires_at = ag::steady_clock::now() + std::chrono::seconds(300);
+    cache.insert(KEY, *entry);
+    entry->expires_at = ag::steady_clock::now() - std::chrono::seconds(1);
+    cache.insert(EXPIRED_KEY, *entry);
+
+    ag::err_string err = cache.save(SNAPSHOT_PATH);
+    ASSERT_FALSE(err) << *err;
+    // the snapshot is written to a temporary file which is then renamed
+    ASSERT_FALSE(ag::file::is_valid(ag::file::open(std::string(SNAPSHOT_PATH) + ".tmp", ag::file::RDONLY)));
+#ifndef _WIN32
+    struct stat st;
+    ASSERT_EQ(0, stat(SNAPSHOT_PATH, &st));
+    ASSERT_EQ(0600, st.st_mode & 0777);
+#endif
+
+    // only the unexpired entries are loaded
+    ag::response_cache loaded;
+    loaded.init(100, 0, 2);
+    err = loaded.load(SNAPSHOT_PATH);
+    ASSERT_FALSE(err) << *err;
+    ASSERT_EQ(1u, loaded.size());
+    ASSERT_TRUE(loaded.find(KEY, [&] (const ag::cached_response &e) {
+        EXPECT_EQ(RESPONSE, e.wire);
+        EXPECT_EQ(entry->ttl_offsets, e.ttl_offsets);
+        EXPECT_EQ(entry->status, e.status);
+        EXPECT_EQ(entry->answer, e.answer);
+        EXPECT_EQ(entry->upstream_id, e.upstream_id);
+        auto ttl = std::chrono::ceil<std::chrono::seconds>(e.expires_at - ag::steady_clock::now()).count();
+        EXPECT_GT(ttl, 290);
+        EXPECT_LE(ttl, 300);
+        return false;
+    }));
+
+    // not a snapshot
+    ag::file::handle f = ag::file::open(SNAPSHOT_PATH, ag::file::WRONLY | ag::file::TRUNC);
+    ASSERT_TRUE(ag::file::is_valid(f));
+    ASSERT_EQ(3, ag::file::write(f, "foo", 3));
+    ag::file::close(f);
+    ASSERT_TRUE(loaded.load(SNAPSHOT_PATH));
+
+    std::remove(SNAPSHOT_PATH);
+    ASSERT_TRUE(loaded.load(SNAPSHOT_PATH));
+}
+
+TEST(rrset_cache_test, cname_chain) {
+    ag::ldns_pkt_ptr response = create_request("www.example.com.", LDNS_RR_TYPE_A, LDNS_RD);
+    for (const char *record : {
+            "www.example.com. 300 IN CNAME cdn.example.net.",
+            "cdn.example.net. 60 IN A 1.2.3.4",
+            "cdn.example.net. 120 IN A 1.2.3.5",
+            "unrelated.com. 300 IN A 6.6.6.6",
+    }) {
+        ldns_rr *rr = nullptr;
+        ASSERT_EQ(LDNS_STATUS_OK, ldns_rr_new_frm_str(&rr, record, 0, nullptr, nullptr));
+        ldns_pkt_push_rr(response.get(), LDNS_SECTION_ANSWER, rr);
+    }
+
+    ag::rrset_cache cache;
+    cache.init(10);
+    cache.insert(response.get(), 42);
+    ASSERT_EQ(2, cache.size()); // the unrelated record is not cached
+
+    auto find = [&cache] (const char *name, ldns_rr_type type) {
+        ag::ldns_pkt_ptr request = create_request(name, type, LDNS_RD);
+        return cache.find(ldns_rr_list_rr(ldns_pkt_question(request.get()), 0));
+    };
+
+    std::optional<ag::rrset_cache::answer> answer = find("WWW.example.com.", LDNS_RR_TYPE_A);
+    ASSERT_TRUE(answer.has_value());
+    ASSERT_EQ(3, ldns_rr_list_rr_count(answer->records.get()));
+    ASSERT_EQ(LDNS_RR_TYPE_CNAME, ldns_rr_get_type(ldns_rr_list_rr(answer->records.get(), 0)));
+    ASSERT_EQ(42, answer->upstream_id);
+
+    // The records of the alias target are shared by the other names
+    answer = find("cdn.example.net.", LDNS_RR_TYPE_A);
+    ASSERT_TRUE(answer.has_value());
+    ASSERT_EQ(2, ldns_rr_list_rr_count(answer->records.get()));
+    ASSERT_LE(ldns_rr_ttl(ldns_rr_list_rr(answer->records.get(), 0)), 60);
+
+    answer = find("www.example.com.", LDNS_RR_TYPE_CNAME);
+    ASSERT_TRUE(answer.has_value());
+    ASSERT_EQ(1, ldns_rr_list_rr_count(answer->records.get()));
+
+    // The chain is followed, but the records of the requested type are missing
+    ASSERT_FALSE(find("www.example.com.", LDNS_RR_TYPE_AAAA).has_value());
+    ASSERT_FALSE(find("unrelated.com.", LDNS_RR_TYPE_A).has_value());
+
+    // Each RRset expires on its own
+    ag::steady_clock::add_time_shift(std::chrono::seconds(61));
+    ASSERT_FALSE(find("www.example.com.", LDNS_RR_TYPE_A).has_value());
+    answer = find("www.example.com.", LDNS_RR_TYPE_CNAME);
+    ASSERT_TRUE(answer.has_value());
+    ASSERT_LE(ldns_rr_ttl(ldns_rr_list_rr(answer->records.get(), 0)), 300 - 61);
+}
+
+TEST(rrset_cache_test, memory_limit) {
+    auto make_response = [] (int i) {
+        std::string name = AG_FMT("host{:02}.example.com.", i); // the entries are of the same size
+        ag::ldns_pkt_ptr response = create_request(name, LDNS_RR_TYPE_A, LDNS_RD);
+        ldns_rr *rr = nullptr;
+        EXPECT_EQ(LDNS_STATUS_OK, ldns_rr_new_frm_str(&rr, AG_FMT("{} 300 IN A 1.2.3.4", name).c_str(),
+                                                      0, nullptr, nullptr));
+        ldns_pkt_push_rr(response.get(), LDNS_SECTION_ANSWER, rr);
+        return response;
+    };
+
+    ag::rrset_cache cache;
+    cache.init(1000);
+    cache.insert(make_response(0).get(), std::nullopt);
+    size_t entry_size = cache.mem_usage();
+    ASSERT_GT(entry_size, 0u);
+
+    static constexpr size_t MAX_ENTRIES = 10;
+    cache.init(1000, MAX_ENTRIES * entry_size);
+    for (int i = 0; i < 2 * (int) MAX_ENTRIES; ++i) {
+        cache.insert(make_response(i).get(), std::nullopt);
+        ASSERT_LE(cache.mem_usage(), MAX_ENTRIES * entry_size);
+    }
+    ASSERT_EQ(MAX_ENTRIES, cache.size());
+
+    cache.clear();
+    ASSERT_EQ(0u, cache.mem_usage());
+}
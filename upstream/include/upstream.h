@@ -1,6 +1,10 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdlib>
+#include <functional>
 #include <memory>
 #include <string>
 #include <string_view>
@@ -61,6 +65,9 @@ struct upstream_options {
 
     /** (Optional) name or index of the network interface to route traffic through */
     if_id_variant outbound_interface;
+
+    /** Share of the requests relative to the other upstreams, if the load is balanced between them. 0 means 1. */
+    uint32_t weight;
 };
 
 /**
@@ -75,8 +82,9 @@ public:
         err_string error;
     };
 
+    using exchange_callback = std::function<void(exchange_result)>;
+
     upstream(upstream_options opts, const upstream_factory_config &config) : m_options(std::move(opts)), m_config(config) {
-        m_rtt.val = std::chrono::milliseconds::zero();
         if (!this->m_options.timeout.count()) {
             this->m_options.timeout = DEFAULT_TIMEOUT;
         }
@@ -97,22 +105,71 @@ public:
      */
     virtual exchange_result exchange(ldns_pkt *request) = 0;
 
+    /**
+     * Do DNS request without waiting for the response.
+     * The default implementation calls `exchange()` in place, see `is_exchange_async()`.
+     * @param request DNS request packet, not referenced after the call returns
+     * @param callback called exactly once with the response packet or an error, either in place,
+     *                 on the upstream's event loop thread, or on the thread resolving the server address
+     *                 of the upstream if the request has waited for it. In the latter cases
+     *                 it must not block, and must not wait for another exchange with this upstream.
+     * The upstream must not be destroyed until all the callbacks are called.
+     */
+    virtual void exchange_async(ldns_pkt *request, exchange_callback callback) {
+        callback(exchange(request));
+    }
+
+    /**
+     * @return true if `exchange_async()` is implemented without blocking the caller till the response arrives
+     */
+    virtual bool is_exchange_async() const { return false; }
+
     const upstream_options &options() const { return m_options; }
 
     const upstream_factory_config &config() const { return m_config; }
 
-    std::chrono::milliseconds rtt() {
-        std::lock_guard<std::mutex> lk(m_rtt.mtx);
-        return m_rtt.val;
+    /**
+     * @return smoothed RTT of the successful exchanges (zero until the first one)
+     */
+    std::chrono::microseconds rtt() const {
+        return std::chrono::microseconds(std::max<int64_t>(m_srtt_us.load(std::memory_order_relaxed), 0));
     }
 
     /**
-     * Update RTT
+     * @return smoothed mean deviation of the RTT of the successful exchanges
+     */
+    std::chrono::microseconds rtt_variance() const {
+        return std::chrono::microseconds(m_rttvar_us.load(std::memory_order_relaxed));
+    }
+
+    /**
+     * @return recent share of the failed exchanges (0-1)
+     */
+    double failure_rate() const {
+        return (double) m_failure_rate.load(std::memory_order_relaxed) / FAILURE_RATE_ONE;
+    }
+
+    /**
+     * Update the health statistics with the outcome of an exchange.
+     * The statistics are updated without locking, so the values may be slightly out of sync with each other.
      * @param elapsed spent time in exchange()
+     * @param failed true if the exchange failed
      */
-    void adjust_rtt(std::chrono::milliseconds elapsed) {
-        std::lock_guard<std::mutex> lk(m_rtt.mtx);
-        m_rtt.val = (m_rtt.val + elapsed) / 2;
+    void update_stats(std::chrono::microseconds elapsed, bool failed) {
+        // The smoothing factors are the ones of the TCP retransmission timer (RFC 6298)
+        update_ewma(m_failure_rate, failed ? FAILURE_RATE_ONE : 0, 4);
+        if (failed) {
+            // The time spent in a failed exchange says little about how fast the upstream responds
+            return;
+        }
+        int64_t sample = elapsed.count();
+        int64_t srtt = -1;
+        if (m_srtt_us.compare_exchange_strong(srtt, sample, std::memory_order_relaxed)) {
+            m_rttvar_us.store(sample / 2, std::memory_order_relaxed);
+            return;
+        }
+        update_ewma(m_rttvar_us, std::abs(srtt - sample), 2);
+        update_ewma(m_srtt_us, sample, 3);
     }
 
 protected:
@@ -120,8 +177,21 @@ protected:
     upstream_options m_options;
     /** Upstream factory configuration */
     upstream_factory_config m_config;
-    /** RTT + mutex */
-    with_mtx<std::chrono::milliseconds> m_rtt;
+    /** Fixed-point representation of the failure rate of 1 */
+    static constexpr int64_t FAILURE_RATE_ONE = 1 << 16;
+    /** Smoothed RTT in microseconds, negative until the first successful exchange */
+    std::atomic<int64_t> m_srtt_us{-1};
+    /** Smoothed mean deviation of the RTT in microseconds */
+    std::atomic<int64_t> m_rttvar_us{0};
+    /** Smoothed failure rate, see `FAILURE_RATE_ONE` */
+    std::atomic<int64_t> m_failure_rate{0};
+
+    /** Move the average towards the sample by 1/2^shift of the difference */
+    static void update_ewma(std::atomic<int64_t> &avg, int64_t sample, int shift) {
+        int64_t cur = avg.load(std::memory_order_relaxed);
+        while (!avg.compare_exchange_weak(cur, cur + (sample - cur) / (1 << shift), std::memory_order_relaxed)) {
+        }
+    }
 
     /**
      * Bind a socket to either the configured interface,
@@ -114,13 +114,19 @@ ag::bootstrapper::resolve_result ag::bootstrapper::get() {
     assert(result.error.has_value() == result.addresses.empty());
     temporary_disabler_update(result.error);
     m_resolved_cache = result.addresses;
+    m_resolved.store(!m_resolved_cache.empty(), std::memory_order_release);
     return result;
 }
 
+bool ag::bootstrapper::has_resolved() const {
+    return m_resolved.load(std::memory_order_acquire);
+}
+
 void ag::bootstrapper::remove_resolved(const socket_address &addr) {
     std::scoped_lock l(m_resolved_cache_mutex);
     m_resolved_cache.erase(std::remove(m_resolved_cache.begin(), m_resolved_cache.end(), addr),
         m_resolved_cache.end());
+    m_resolved.store(!m_resolved_cache.empty(), std::memory_order_release);
 }
 
 static std::vector<ag::resolver_ptr> create_resolvers(const ag::logger &log, const ag::bootstrapper::params &p) {
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <string>
 #include <vector>
 #include <memory>
@@ -44,6 +45,12 @@ public:
      */
     resolve_result get();
 
+    /**
+     * Check if the addresses are resolved already, so `get()` returns without resolving them.
+     * Doesn't block.
+     */
+    bool has_resolved() const;
+
     /**
      * Remove resolved address from the cache
      * @param addr address to remove
@@ -81,6 +88,8 @@ private:
     std::chrono::milliseconds m_timeout;
     /** Resolved addresses cache */
     std::vector<socket_address> m_resolved_cache;
+    /** Whether `m_resolved_cache` is not empty, readable without locking */
+    std::atomic_bool m_resolved{false};
     /** Times of first and last remove fails */
     std::pair<int64_t, int64_t> m_resolve_fail_times_ms;
     /** Resolved addresses cache mutex */
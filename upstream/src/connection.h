@@ -5,6 +5,7 @@
 #include <memory>
 #include <vector>
 #include <chrono>
+#include <functional>
 
 namespace ag {
 
@@ -27,6 +28,8 @@ public:
         err_string error; // Some string in case of error
     };
 
+    using read_callback = std::function<void(read_result)>;
+
     connection(const socket_address &addr) : address(addr) {}
 
     virtual ~connection() = default;
@@ -45,6 +48,13 @@ public:
      */
     virtual read_result read(int request_id, std::chrono::milliseconds timeout) = 0;
 
+    /**
+     * Reads given DNS packet for given request id from framed connection without waiting for it
+     * @param request_id request id to wait
+     * @param callback called once with the `read_result`, either in place or on the event loop thread
+     */
+    virtual void read_async(int request_id, std::chrono::milliseconds timeout, read_callback callback) = 0;
+
     // Copy is prohibited
     connection(const connection &) = delete;
     connection &operator=(const connection &) = delete;
@@ -4,6 +4,7 @@
 #include <vector>
 #include <string>
 #include <ldns/wire2host.h>
+#include <ldns/error.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent_ssl.h>
 #include <ag_socket_address.h>
@@ -66,6 +67,10 @@ public:
 
     read_result read(int request_id, std::chrono::milliseconds timeout) override;
 
+    void read_async(int request_id, std::chrono::milliseconds timeout, read_callback callback) override;
+
+    struct async_read;
+
     /** Logger */
     logger m_log;
     /** Connection id */
@@ -87,10 +92,33 @@ public:
     int m_pending_reads_count = 0;
     /** Signals when all reads completed */
     std::condition_variable_any m_no_reads_cond;
+    /** Map of requests to the asynchronous reads waiting for their results */
+    hash_map<int, std::unique_ptr<async_read>> m_async_reads;
 
     void on_read();
 
     void on_event(int what);
+
+    void complete_async_read(int request_id, read_result result);
+
+    static void on_async_read_timeout(evutil_socket_t, short, void *arg);
+};
+
+/**
+ * Asynchronous read of a response.
+ * Like a blocking read, it keeps the connection alive until completed.
+ */
+struct ag::dns_framed_connection::async_read {
+    dns_framed_connection_ptr conn;
+    int request_id = 0;
+    read_callback callback;
+    event *timer = nullptr;
+
+    ~async_read() {
+        if (timer != nullptr) {
+            event_free(timer);
+        }
+    }
 };
 
 
@@ -162,6 +190,7 @@ void ag::dns_framed_connection::on_read() {
         return;
     }
 
+    std::vector<std::pair<int, std::vector<uint8_t>>> async_replies;
     auto *input = bufferevent_get_input(&*m_bev);
     for (;;) {
         if (evbuffer_get_length(input) < 2) {
@@ -186,11 +215,16 @@ void ag::dns_framed_connection::on_read() {
             auto found = m_requests.find(id);
             if (found != m_requests.end()) {
                 found->second = {std::move(buf), std::nullopt};
+            } else if (m_async_reads.count(id) != 0) {
+                async_replies.emplace_back(id, std::move(buf));
             }
             m_cond.notify_all();
         }
         log_conn(m_log, trace, this, "Got response for {}", id);
     }
+    for (auto &[id, reply] : async_replies) {
+        complete_async_read(id, {std::move(reply), std::nullopt});
+    }
     log_conn(m_log, trace, this, "{} finished", __func__);
 }
 
@@ -214,26 +248,35 @@ void ag::dns_framed_connection::on_event(int what) {
             log_conn(m_log, trace, this, "{} error {}", __func__, evutil_socket_error_to_string(evutil_socket_geterror(bufferevent_getfd(m_bev.get()))));
         }
         m_pool->remove_from_all(shared_from_this());
-        std::unique_lock l(m_mutex);
-        m_closed = true;
-        for (auto &entry : m_requests) {
-            // do not assign error, if we already got response
-            if (!entry.second.has_value()) {
-                std::string error;
-                if (what & BEV_EVENT_EOF) {
-                    error = std::string(UNEXPECTED_EOF);
-                } else if (auto bev_err = evutil_socket_geterror(bufferevent_getfd(m_bev.get())); bev_err > 0) {
-                    error = evutil_socket_error_to_string(bev_err);
-                } else if (auto openssl_errors = get_all_bufferevent_openssl_errors_err_string(*m_bev); openssl_errors) {
-                    error = *openssl_errors;
-                } else {
-                    error = "Unknown error";
+        std::string error;
+        if (what & BEV_EVENT_EOF) {
+            error = std::string(UNEXPECTED_EOF);
+        } else if (auto bev_err = evutil_socket_geterror(bufferevent_getfd(m_bev.get())); bev_err > 0) {
+            error = evutil_socket_error_to_string(bev_err);
+        } else if (auto openssl_errors = get_all_bufferevent_openssl_errors_err_string(*m_bev); openssl_errors) {
+            error = *openssl_errors;
+        } else {
+            error = "Unknown error";
+        }
+        hash_map<int, std::unique_ptr<async_read>> async_reads;
+        {
+            std::unique_lock l(m_mutex);
+            m_closed = true;
+            for (auto &entry : m_requests) {
+                // do not assign error, if we already got response
+                if (!entry.second.has_value()) {
+                    // Set result
+                    entry.second = {std::vector<uint8_t>{}, {error}};
                 }
-                // Set result
-                entry.second = {std::vector<uint8_t>{}, {std::move(error)}};
             }
+            async_reads.swap(m_async_reads);
+            m_cond.notify_all();
+        }
+        for (auto &[id, read] : async_reads) {
+            read_callback callback = std::move(read->callback);
+            read.reset();
+            callback({{}, error});
         }
-        m_cond.notify_all();
     }
     log_conn(m_log, trace, this, "{} finished", __func__);
 }
@@ -273,6 +316,61 @@ ag::connection::read_result ag::dns_framed_connection::read(int request_id, mill
     return result_node.mapped().value();
 }
 
+void ag::dns_framed_connection::read_async(int request_id, milliseconds timeout, read_callback callback) {
+    std::unique_lock l(m_mutex);
+
+    if (m_closed) {
+        l.unlock();
+        std::string msg = AG_FMT("{}: connection already closed", __func__);
+        log_conn(m_log, trace, this, "{}", msg);
+        callback({{}, std::move(msg)});
+        return;
+    }
+
+    // The response may have already arrived
+    if (auto it = m_requests.find(request_id); it != m_requests.end()) {
+        auto result_node = m_requests.extract(it);
+        if (result_node.mapped().has_value()) {
+            l.unlock();
+            callback(std::move(result_node.mapped().value()));
+            return;
+        }
+    }
+
+    auto read = std::make_unique<async_read>();
+    read->conn = shared_from_this();
+    read->request_id = request_id;
+    read->callback = std::move(callback);
+    read->timer = evtimer_new(bufferevent_get_base(m_bev.get()), on_async_read_timeout, read.get());
+    timeval tv = utils::duration_to_timeval(timeout);
+    evtimer_add(read->timer, &tv);
+    m_async_reads[request_id] = std::move(read);
+}
+
+void ag::dns_framed_connection::complete_async_read(int request_id, read_result result) {
+    std::unique_ptr<async_read> read;
+    {
+        std::scoped_lock l(m_mutex);
+        auto node = m_async_reads.extract(request_id);
+        if (node.empty()) {
+            return;
+        }
+        read = std::move(node.mapped());
+    }
+    read_callback callback = std::move(read->callback);
+    read.reset();
+    callback(std::move(result));
+}
+
+void ag::dns_framed_connection::on_async_read_timeout(evutil_socket_t, short, void *arg) {
+    auto *read = (async_read *) arg;
+    dns_framed_connection_ptr conn = read->conn;
+    log_conn(conn->m_log, trace, conn, "Request {} timed out", read->request_id);
+    // Request timed out, don't accept new connections on this endpoint
+    conn->m_pool->remove_from_all(conn);
+    conn->complete_async_read(read->request_id, {{}, {"Timed out"}});
+}
+
 void ag::dns_framed_pool::add_connected(const connection_ptr &ptr) {
     dns_framed_connection *conn = (dns_framed_connection *)ptr.get();
     log_conn(conn->m_log, trace, conn, "{}", __func__);
@@ -356,6 +454,29 @@ ag::connection::read_result ag::dns_framed_pool::perform_request_inner(uint8_vie
     return conn->read(write_result.id, timeout);
 }
 
+void ag::dns_framed_pool::perform_request_inner_async(uint8_view buf, milliseconds timeout,
+                                                      connection::read_callback callback) {
+    auto[conn, elapsed, err] = get();
+    if (!conn) {
+        callback({ {}, std::move(err) });
+        return;
+    }
+
+    timeout -= duration_cast<milliseconds>(elapsed);
+    if (timeout < milliseconds(0)) {
+        callback({ {}, AG_FMT("DNS server name resolving took too much time: {}", elapsed) });
+        return;
+    }
+
+    connection::write_result write_result = conn->write(buf);
+    if (write_result.error.has_value()) {
+        callback({ {}, std::move(write_result.error) });
+        return;
+    }
+
+    conn->read_async(write_result.id, timeout, std::move(callback));
+}
+
 ag::connection::read_result ag::dns_framed_pool::perform_request(uint8_view buf, milliseconds timeout) {
     utils::timer timer;
     connection::read_result result = perform_request_inner(buf, timeout);
@@ -371,3 +492,37 @@ ag::connection::read_result ag::dns_framed_pool::perform_request(uint8_view buf,
     }
     return result;
 }
+
+void ag::dns_framed_pool::perform_request_async(uint8_view buf, milliseconds timeout,
+                                                connection::read_callback callback) {
+    auto request = std::make_shared<std::vector<uint8_t>>(buf.begin(), buf.end());
+    perform_request_inner_async(buf, timeout,
+            [this, request, timeout, timer = utils::timer{}, callback = std::move(callback)]
+            (connection::read_result result) mutable {
+        // try one more time in case of the server closed the connection before we got the response
+        // https://github.com/AdguardTeam/DnsLibs/issues/24
+        if (result.error.has_value() && result.error.value() == dns_framed_connection::UNEXPECTED_EOF) {
+            timeout -= timer.elapsed<milliseconds>();
+            if (timeout < milliseconds(0)) {
+                result.error.emplace(TIMEOUT_STR.data());
+            } else {
+                perform_request_inner_async({request->data(), request->size()}, timeout, std::move(callback));
+                return;
+            }
+        }
+        callback(std::move(result));
+    });
+}
+
+ag::upstream::exchange_result ag::parse_dns_reply(const connection::read_result &result) {
+    if (result.error.has_value()) {
+        return { nullptr, result.error };
+    }
+
+    ldns_pkt *reply_pkt = nullptr;
+    ldns_status status = ldns_wire2pkt(&reply_pkt, result.reply.data(), result.reply.size());
+    if (status != LDNS_STATUS_OK) {
+        return {nullptr, ldns_get_errorstr_by_id(status)};
+    }
+    return {ag::ldns_pkt_ptr(reply_pkt), std::nullopt};
+}
@@ -39,6 +39,21 @@ public:
      */
     connection::read_result perform_request(uint8_view buf, std::chrono::milliseconds timeout);
 
+    /**
+     * Send given data to the server without waiting for the response
+     * @param buf request data, not referenced after the call returns
+     * @param timeout operation timeout
+     * @param callback called once with the response or an error, either in place or on the event loop thread
+     */
+    void perform_request_async(uint8_view buf, std::chrono::milliseconds timeout, connection::read_callback callback);
+
+    /**
+     * @return Event loop of the pool
+     */
+    const event_loop_ptr &loop() const {
+        return m_loop;
+    }
+
 protected:
     friend class dns_framed_connection;
 
@@ -59,6 +74,9 @@ protected:
 
     virtual connection::read_result perform_request_inner(uint8_view buf, std::chrono::milliseconds timeout);
 
+    virtual void perform_request_inner_async(uint8_view buf, std::chrono::milliseconds timeout,
+                                             connection::read_callback callback);
+
     /**
      * Creates DNS framed connection from bufferevent.
      * @param bev Bufferevent
@@ -70,4 +88,11 @@ protected:
     void close_connection(const connection_ptr &conn);
 };
 
+/**
+ * Parse the response read from a connection
+ * @param result Read result
+ * @return Response packet or an error
+ */
+upstream::exchange_result parse_dns_reply(const connection::read_result &result);
+
 } // namespace ag
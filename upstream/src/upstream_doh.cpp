@@ -48,9 +48,13 @@ struct dns_over_https::query_handle {
     std::vector<uint8_t> response;
     std::promise<void> barrier;
     std::promise<void> submit_barrier;
+    /** Result handler of an asynchronous request. If set, the handle is deleted on completion. */
+    exchange_callback callback;
 
     CURL *create_curl_handle();
     void cleanup_request();
+    void complete();
+    exchange_result get_result();
     void restore_packet_id(ldns_pkt *packet) const {
         ldns_pkt_set_id(packet, this->request_id);
     }
@@ -158,6 +162,34 @@ void dns_over_https::query_handle::cleanup_request() {
     }
 }
 
+// Signal the requester waiting for the result, or pass the result to the callback of an asynchronous request
+void dns_over_https::query_handle::complete() {
+    if (this->callback == nullptr) {
+        this->barrier.set_value();
+        return;
+    }
+
+    std::unique_ptr<query_handle> self(this);
+    exchange_callback cb = std::move(this->callback);
+    exchange_result result = this->get_result();
+    tracelog_id(this, "Completed");
+    self.reset();
+    cb(std::move(result));
+}
+
+dns_over_https::exchange_result dns_over_https::query_handle::get_result() {
+    if (this->error.has_value()) {
+        return { nullptr, std::move(this->error) };
+    }
+    ldns_pkt *response = nullptr;
+    if (ldns_status status = ldns_wire2pkt(&response, this->response.data(), this->response.size());
+            status != LDNS_STATUS_OK) {
+        return { nullptr, AG_FMT("Failed to parse response: {}", ldns_get_errorstr_by_id(status)) };
+    }
+    this->restore_packet_id(response);
+    return { ldns_pkt_ptr(response), std::nullopt };
+}
+
 std::unique_ptr<dns_over_https::query_handle> dns_over_https::create_handle(ldns_pkt *request,  milliseconds timeout) const {
     std::unique_ptr<query_handle> h = std::make_unique<query_handle>();
     h->log = &this->log;
@@ -395,7 +427,10 @@ void dns_over_https::read_messages() {
         curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, &handle);
         assert(message->easy_handle == handle->curl_handle);
 
-        if (message->data.result != CURLE_OK) {
+        if (message->data.result == CURLE_OPERATION_TIMEDOUT && handle->callback != nullptr) {
+            // Asynchronous requests rely on the curl timeout
+            handle->error = TIMEOUT_STR;
+        } else if (message->data.result != CURLE_OK) {
             handle->error = AG_FMT("Failed to perform request: {}", curl_easy_strerror(message->data.result));
         } else {
             tracelog_id(handle, "Got response {}", (void*)message->easy_handle);
@@ -412,7 +447,7 @@ void dns_over_https::read_messages() {
         std::deque<query_handle *> &queue = this->worker.running_queue;
         queue.erase(std::remove(queue.begin(), queue.end(), handle), queue.end());
 
-        handle->barrier.set_value();
+        handle->complete();
     }
 }
 
@@ -478,14 +513,18 @@ void dns_over_https::submit_request(evutil_socket_t, short, void *arg) {
     auto *handle = (query_handle *)arg;
     tracelog_id(handle, "Submitting request");
 
+    // Nobody waits for an asynchronous request to be submitted, and it may be deleted on completion
+    bool is_async = handle->callback != nullptr;
     ag::utils::scope_exit signal_submit_done([&] {
-        handle->submit_barrier.set_value();
+        if (!is_async) {
+            handle->submit_barrier.set_value();
+        }
     });
 
     CURL *curl_handle = handle->create_curl_handle();
     if (curl_handle == nullptr) {
         // error set already in `create_curl_handle`
-        handle->barrier.set_value();
+        handle->complete();
         return;
     }
 
@@ -494,7 +533,7 @@ void dns_over_https::submit_request(evutil_socket_t, short, void *arg) {
             e != CURLM_OK) {
         handle->error = AG_FMT("Failed to add request in pool: {}", curl_multi_strerror(e));
         curl_easy_cleanup(curl_handle);
-        handle->barrier.set_value();
+        handle->complete();
         return;
     }
 
@@ -529,7 +568,7 @@ void dns_over_https::stop_all_with_error(err_string e) {
         handle->error = e;
         handle->cleanup_request();
         i = queue.erase(i);
-        handle->barrier.set_value();
+        handle->complete();
     }
 }
 
@@ -549,38 +588,8 @@ dns_over_https::exchange_result dns_over_https::exchange(ldns_pkt *request) {
         });
 
     milliseconds timeout = this->m_options.timeout;
-
-    if (std::unique_lock guard(this->guard); this->resolved == nullptr) {
-        bootstrapper::resolve_result resolve_result = this->bootstrapper->get();
-        if (resolve_result.error.has_value()) {
-            return { nullptr, std::move(resolve_result.error) };
-        }
-        assert(!resolve_result.addresses.empty());
-
-        milliseconds resolve_time = duration_cast<milliseconds>(resolve_result.time_elapsed);
-        if (this->m_options.timeout < resolve_time) {
-            return { nullptr, AG_FMT("DNS server name resolving took too much time: {}us",
-                resolve_result.time_elapsed.count()) };
-        }
-        timeout = this->m_options.timeout - resolve_time;
-
-        std::string entry;
-        for (const socket_address &address : resolve_result.addresses) {
-            assert(address.valid());
-
-            std::string addr = address.str();
-            tracelog(log, "Server address: {}", addr);
-
-            auto [ip, port] = utils::split_host_port(addr);
-            std::string_view host = get_host_name(this->m_options.address);
-            if (entry.empty()) {
-                entry = AG_FMT("{}:{}:{}", host, port, ip);
-            } else {
-                entry = AG_FMT("{},{}", entry, ip);
-            }
-        }
-        this->resolved = curl_slist_ptr(curl_slist_append(nullptr, entry.c_str()));
-        tracelog(log, "Resolved server for curl: {}", entry);
+    if (err_string error = resolve_server(timeout); error.has_value()) {
+        return { nullptr, std::move(error) };
     }
 
     std::unique_ptr<query_handle> handle = create_handle(request, timeout);
@@ -594,24 +603,17 @@ dns_over_https::exchange_result dns_over_https::exchange(ldns_pkt *request) {
     std::future<void> request_submitted = handle->submit_barrier.get_future();
     event_base_once(this->worker.loop->c_base(), 0, EV_TIMEOUT, submit_request, handle.get(), nullptr);
 
-    err_string err;
-    ldns_pkt *response = nullptr;
+    exchange_result result;
     bool timed_out = false;
     if (std::future_status status = request_completed.wait_for(timeout);
             status != std::future_status::ready) {
-        err = TIMEOUT_STR;
+        result.error = TIMEOUT_STR;
         timed_out = true;
-    } else if (handle->error.has_value()) {
-        err = std::move(handle->error);
-    } else if (ldns_status status = ldns_wire2pkt(&response, handle->response.data(), handle->response.size());
-            status != LDNS_STATUS_OK) {
-        err = AG_FMT("Failed to parse response: {}", ldns_get_errorstr_by_id(status));
+    } else {
+        result = handle->get_result();
     }
 
     handle->restore_packet_id(request);
-    if (response != nullptr) {
-        handle->restore_packet_id(response);
-    }
 
     if (!timed_out) {
         tracelog_id(handle, "Completed");
@@ -635,5 +637,95 @@ dns_over_https::exchange_result dns_over_https::exchange(ldns_pkt *request) {
         }
     }
 
-    return { ldns_pkt_ptr(response), std::move(err) };
+    return result;
+}
+
+void dns_over_https::exchange_async(ldns_pkt *request, exchange_callback callback) {
+    {
+        std::scoped_lock l(this->guard);
+        if (this->resolved == nullptr) {
+            // Resolving blocks, so it's not done on the caller's thread, and the requests coming meanwhile wait for it
+            this->unresolved_requests.push_back({ ldns_pkt_ptr(ldns_pkt_clone(request)), std::move(callback) });
+            if (this->unresolved_requests.size() == 1) {
+                utils::async_detached([this] { resolve_server_async(); });
+            }
+            return;
+        }
+    }
+
+    start_exchange_async(request, std::move(callback), this->m_options.timeout);
+}
+
+void dns_over_https::resolve_server_async() {
+    milliseconds timeout = this->m_options.timeout;
+    err_string error = resolve_server(timeout);
+
+    std::vector<unresolved_request> requests;
+    {
+        std::scoped_lock l(this->guard);
+        requests.swap(this->unresolved_requests);
+    }
+    for (unresolved_request &r : requests) {
+        if (error.has_value()) {
+            r.callback({ nullptr, error });
+        } else {
+            start_exchange_async(r.request.get(), std::move(r.callback), timeout);
+        }
+    }
+}
+
+void dns_over_https::start_exchange_async(ldns_pkt *request, exchange_callback callback, milliseconds timeout) {
+    std::unique_ptr<query_handle> handle = create_handle(request, timeout);
+    if (handle == nullptr) {
+        callback({ nullptr, "Failed to create request handle" });
+        return;
+    }
+    // The request is serialized already, and the response id is restored on completion
+    handle->restore_packet_id(request);
+    handle->callback = std::move(callback);
+
+    tracelog_id(handle, "Started");
+    event_base_once(this->worker.loop->c_base(), 0, EV_TIMEOUT, submit_request, handle.release(), nullptr);
+}
+
+err_string dns_over_https::resolve_server(milliseconds &timeout) {
+    if (std::scoped_lock l(this->guard); this->resolved != nullptr) {
+        return std::nullopt;
+    }
+
+    // The guard is not held while resolving, so that the asynchronous requests are not blocked on it
+    bootstrapper::resolve_result resolve_result = this->bootstrapper->get();
+    if (resolve_result.error.has_value()) {
+        return std::move(resolve_result.error);
+    }
+    assert(!resolve_result.addresses.empty());
+
+    milliseconds resolve_time = duration_cast<milliseconds>(resolve_result.time_elapsed);
+    if (this->m_options.timeout < resolve_time) {
+        return AG_FMT("DNS server name resolving took too much time: {}us", resolve_result.time_elapsed.count());
+    }
+    timeout = this->m_options.timeout - resolve_time;
+
+    std::string entry;
+    for (const socket_address &address : resolve_result.addresses) {
+        assert(address.valid());
+
+        std::string addr = address.str();
+        tracelog(log, "Server address: {}", addr);
+
+        auto [ip, port] = utils::split_host_port(addr);
+        std::string_view host = get_host_name(this->m_options.address);
+        if (entry.empty()) {
+            entry = AG_FMT("{}:{}:{}", host, port, ip);
+        } else {
+            entry = AG_FMT("{},{}", entry, ip);
+        }
+    }
+    std::scoped_lock l(this->guard);
+    if (this->resolved == nullptr) {
+        this->resolved = curl_slist_ptr(curl_slist_append(nullptr, entry.c_str()));
+        tracelog(log, "Resolved server for curl: {}", entry);
+    }
+
+    return std::nullopt;
 }
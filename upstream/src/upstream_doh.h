@@ -10,6 +10,7 @@
 #include <future>
 #include <deque>
 #include <list>
+#include <vector>
 
 #include <ag_logger.h>
 #include <ag_defs.h>
@@ -50,6 +51,23 @@ public:
 private:
     err_string init() override;
     exchange_result exchange(ldns_pkt *) override;
+    void exchange_async(ldns_pkt *, exchange_callback callback) override;
+    bool is_exchange_async() const override { return true; }
+
+    /**
+     * Resolve the server address if it's not resolved yet
+     * @param timeout request timeout, reduced by the time spent on resolving
+     * @return non-nullopt string in case of error
+     */
+    err_string resolve_server(std::chrono::milliseconds &timeout);
+
+    /**
+     * Resolve the server address for the asynchronous requests waiting for it, and start their exchanges.
+     * Blocks till the address is resolved, so it's called on a separate thread.
+     */
+    void resolve_server_async();
+
+    void start_exchange_async(ldns_pkt *request, exchange_callback callback, std::chrono::milliseconds timeout);
 
     std::unique_ptr<query_handle> create_handle(ldns_pkt *request, std::chrono::milliseconds timeout) const;
     curl_pool_ptr create_pool() const;
@@ -92,6 +110,13 @@ private:
 
     std::list<std::unique_ptr<query_handle>> defied_handles;
 
+    struct unresolved_request {
+        ldns_pkt_ptr request;
+        exchange_callback callback;
+    };
+    // Asynchronous requests waiting for the server address to be resolved
+    std::vector<unresolved_request> unresolved_requests;
+
     struct pool_descriptor {
         curl_pool_ptr handle = nullptr;
         event_ptr timer_event = nullptr;
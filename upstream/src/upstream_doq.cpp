@@ -123,7 +123,7 @@ int dns_over_quic::send_alert(SSL *ssl, enum ssl_encryption_level_t level, uint8
             || res == SSL_AD_CERTIFICATE_UNKNOWN) {
         std::lock_guard lg(doq->m_global);
         for (auto &cur : doq->m_requests) {
-            cur.second.cond.notify_all();
+            doq->signal_request(cur.second);
         }
     }
 
@@ -157,6 +157,11 @@ void dns_over_quic::retransmit_cb(evutil_socket_t, short, void *data) {
     }
 }
 
+void dns_over_quic::async_request_timeout_cb(evutil_socket_t, short, void *data) {
+    auto *req = static_cast<request_t *>(data);
+    req->upstream->complete_async_request(req->request_id, true);
+}
+
 void dns_over_quic::idle_timer_cb(evutil_socket_t, short, void *data) {
     auto doq = static_cast<dns_over_quic *>(data);
     doq->disconnect("Idle timer expired");
@@ -342,32 +347,72 @@ err_string dns_over_quic::init() {
     return std::nullopt;
 }
 
-dns_over_quic::exchange_result dns_over_quic::exchange(ldns_pkt *request) {
+// Resolve the server address if needed.
+// `m_global` is not held while resolving, so that the asynchronous requests are not blocked on it.
+err_string dns_over_quic::resolve_server() {
+    if (std::scoped_lock l(m_global); !m_server_addresses.empty()) {
+        return std::nullopt;
+    }
+
+    bootstrapper::resolve_result bootstrapper_res = m_bootstrapper->get();
+    if (bootstrapper_res.error.has_value()) {
+        warnlog(m_log, "Bootstrapper hasn't results");
+        return "Failed to resolve address of server";
+    }
+
     if (std::scoped_lock l(m_global); m_server_addresses.empty()) {
-        bootstrapper::resolve_result bootstrapper_res = m_bootstrapper->get();
-        if (bootstrapper_res.error.has_value()) {
-            warnlog(m_log, "Bootstrapper hasn't results");
-            return {nullptr, "Failed to resolve address of server"};
+        m_server_addresses.assign(bootstrapper_res.addresses.begin(), bootstrapper_res.addresses.end());
+    }
+    return std::nullopt;
+}
+
+// Resolve the server address for the asynchronous requests waiting for it, and enqueue them.
+// Blocks till the address is resolved, so it's called on a separate thread.
+void dns_over_quic::resolve_server_async() {
+    err_string error = resolve_server();
+
+    std::vector<std::pair<ldns_pkt_ptr, exchange_callback>> requests;
+    {
+        std::scoped_lock l(m_global);
+        requests.swap(m_unresolved_requests);
+    }
+    for (auto &[request, callback] : requests) {
+        if (error.has_value()) {
+            callback({nullptr, error});
+        } else if (err_string enqueue_error = enqueue_request(request.get(), m_next_request_id++, callback);
+                enqueue_error.has_value()) {
+            callback({nullptr, std::move(enqueue_error)});
         }
+    }
+}
 
-        m_server_addresses.assign(bootstrapper_res.addresses.begin(), bootstrapper_res.addresses.end());
+// Resolve the server address if needed, and register the request to be sent on the event loop
+err_string dns_over_quic::enqueue_request(ldns_pkt *request, int64_t request_id, exchange_callback &callback) {
+    if (err_string error = resolve_server(); error.has_value()) {
+        return error;
     }
 
-    ldns_buffer *buffer = ldns_buffer_new(REQUEST_BUFFER_INITIAL_CAPACITY);
-    ldns_status status = ldns_pkt2buffer_wire(buffer, request);
+    ldns_buffer_ptr buffer{ldns_buffer_new(REQUEST_BUFFER_INITIAL_CAPACITY)};
+    ldns_status status = ldns_pkt2buffer_wire(buffer.get(), request);
     if (status != LDNS_STATUS_OK) {
         assert(0);
-        return {nullptr, ldns_get_errorstr_by_id(status)};
+        return ldns_get_errorstr_by_id(status);
     }
-    ldns_buffer_flip(buffer);
+    ldns_buffer_flip(buffer.get());
 
-    int64_t request_id = m_next_request_id++;
     {
         std::scoped_lock l(m_global);
         request_t &req = m_requests[request_id];
         req.starting_time = get_tstamp();
         req.request_id = request_id;
-        req.request_buffer.reset(buffer);
+        req.request_buffer = std::move(buffer);
+        if (callback != nullptr) {
+            req.callback = std::move(callback);
+            req.upstream = this;
+            req.timer = evtimer_new(m_loop->c_base(), async_request_timeout_cb, &req);
+            timeval tv = utils::duration_to_timeval(m_options.timeout);
+            evtimer_add(req.timer, &tv);
+        }
     }
     tracelog_id(m_log, request, "Creation new request, id: {}, connection state: {}", request_id, m_state);
 
@@ -382,6 +427,16 @@ dns_over_quic::exchange_result dns_over_quic::exchange(ldns_pkt *request) {
         }
     });
 
+    return std::nullopt;
+}
+
+dns_over_quic::exchange_result dns_over_quic::exchange(ldns_pkt *request) {
+    int64_t request_id = m_next_request_id++;
+    exchange_callback no_callback;
+    if (err_string error = enqueue_request(request, request_id, no_callback); error.has_value()) {
+        return {nullptr, std::move(error)};
+    }
+
     std::unique_lock l(m_global);
     request_t &req = m_requests[request_id];
     auto timeout = req.cond.wait_for(l, m_options.timeout);
@@ -402,6 +457,57 @@ dns_over_quic::exchange_result dns_over_quic::exchange(ldns_pkt *request) {
     return {nullptr, "Request failed (empty packet)"};
 }
 
+void dns_over_quic::exchange_async(ldns_pkt *request, exchange_callback callback) {
+    if (std::scoped_lock l(m_global); m_server_addresses.empty()) {
+        // Resolving blocks, so it's not done on the caller's thread, and the requests coming meanwhile wait for it
+        m_unresolved_requests.emplace_back(ldns_pkt_ptr(ldns_pkt_clone(request)), std::move(callback));
+        if (m_unresolved_requests.size() == 1) {
+            utils::async_detached([this] { resolve_server_async(); });
+        }
+        return;
+    }
+
+    int64_t request_id = m_next_request_id++;
+    if (err_string error = enqueue_request(request, request_id, callback); error.has_value()) {
+        callback({nullptr, std::move(error)});
+    }
+}
+
+// Wake up the requester waiting for the result, or schedule the completion of the asynchronous request.
+// Must be called with `m_global` locked.
+void dns_over_quic::signal_request(request_t &req) {
+    if (req.callback == nullptr) {
+        req.cond.notify_all();
+    } else {
+        submit([this, request_id = req.request_id] {
+            complete_async_request(request_id, false);
+        });
+    }
+}
+
+// Must be called on the event loop
+void dns_over_quic::complete_async_request(int64_t request_id, bool timed_out) {
+    std::unique_lock l(m_global);
+    auto node = m_requests.extract(request_id);
+    if (node.empty()) {
+        return;
+    }
+    l.unlock();
+
+    request_t &req = node.mapped();
+    event_free(std::exchange(req.timer, nullptr));
+    tracelog(m_log, "Erase request, id: {}, connection state: {}", request_id, m_state);
+
+    exchange_callback callback = std::move(req.callback);
+    if (timed_out) {
+        callback({nullptr, TIMEOUT_STR.data()});
+    } else if (req.reply_pkt != nullptr) {
+        callback({std::move(req.reply_pkt), std::nullopt});
+    } else {
+        callback({nullptr, "Request failed (empty packet)"});
+    }
+}
+
 int dns_over_quic::bind_addr(int fd, int family) {
     std::unique_ptr<addrinfo, decltype(&freeaddrinfo)> safe_res(nullptr, &freeaddrinfo);
     addrinfo *res, *rp;
@@ -1093,7 +1199,7 @@ void dns_over_quic::process_reply(int64_t request_id, const uint8_t *request_dat
             pkt = nullptr;
         }
         req_it->second.reply_pkt.reset(pkt);
-        req_it->second.cond.notify_all();
+        signal_request(req_it->second);
     }
 }
 
@@ -1125,7 +1231,7 @@ void dns_over_quic::disconnect(std::string_view reason) {
     for (auto &cur : m_requests) {
         if (cur.second.is_onfly) {
             tracelog(m_log, "Call condvar for request, id: {}", cur.first);
-            cur.second.cond.notify_all();
+            signal_request(cur.second);
         }
     }
 }
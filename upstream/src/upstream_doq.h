@@ -25,6 +25,7 @@
 #include <unordered_map>
 #include <condition_variable>
 #include <list>
+#include <vector>
 #include "tls_session_cache.h"
 
 using namespace std::chrono;
@@ -114,6 +115,11 @@ private:
         ag::ldns_buffer_ptr request_buffer;
         std::condition_variable cond;
         bool is_onfly{false};
+        /** Result handler of an asynchronous request. Otherwise, the requester waits on `cond`. */
+        exchange_callback callback;
+        /** Timeout of an asynchronous request */
+        struct event *timer{nullptr};
+        dns_over_quic *upstream{nullptr};
     };
     struct socket_state {
         evutil_socket_t fd{-1};
@@ -122,6 +128,8 @@ private:
 
     err_string init() override;
     exchange_result exchange(ldns_pkt *) override;
+    void exchange_async(ldns_pkt *, exchange_callback callback) override;
+    bool is_exchange_async() const override { return true; }
 
     static int recv_crypto_data(ngtcp2_conn *conn, ngtcp2_crypto_level crypto_level,
                                 uint64_t offset, const uint8_t *data, size_t datalen,
@@ -156,6 +164,7 @@ private:
     static void idle_timer_cb(evutil_socket_t, short, void *data);
     static void handshake_timer_cb(evutil_socket_t, short, void *data);
     static void retransmit_cb(evutil_socket_t, short, void *data);
+    static void async_request_timeout_cb(evutil_socket_t, short, void *data);
 
     int init_ssl_ctx();
     int init_ssl();
@@ -176,6 +185,11 @@ private:
     int feed_data(const ngtcp2_pkt_info *pi, uint8_t *data, size_t datalen);
     void submit(std::function<void()> &&func) const;
     void send_requests();
+    err_string resolve_server();
+    void resolve_server_async();
+    err_string enqueue_request(ldns_pkt *request, int64_t request_id, exchange_callback &callback);
+    void signal_request(request_t &req);
+    void complete_async_request(int64_t request_id, bool timed_out);
     void process_reply(int64_t request_id, const uint8_t *request_data, size_t request_data_len);
     void disconnect(std::string_view reason);
     void schedule_retransmit();
@@ -208,6 +222,8 @@ private:
     std::list<int64_t> m_stream_send_queue;
     std::unordered_map<int64_t, stream> m_streams;
     std::unordered_map<int64_t, request_t> m_requests;
+    // Asynchronous requests waiting for the server address to be resolved
+    std::vector<std::pair<ldns_pkt_ptr, exchange_callback>> m_unresolved_requests;
     std::mutex m_global;
     event_loop_ptr m_loop = event_loop::create();
     struct event *m_read_event{nullptr};
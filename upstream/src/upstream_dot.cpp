@@ -37,7 +37,30 @@ private:
 
     connection::read_result perform_request_inner(uint8_view buf, std::chrono::milliseconds timeout) override;
 
+    void perform_request_inner_async(uint8_view buf, std::chrono::milliseconds timeout,
+                                     connection::read_callback callback) override;
+
+    /**
+     * Resolve the server address for the asynchronous requests waiting for it, and perform them.
+     * Blocks till the address is resolved, so it's called on a separate thread.
+     */
+    void resolve_server_async();
+
+    void perform_resolved_request_async(uint8_view buf, std::chrono::milliseconds timeout,
+                                        connection::read_callback callback);
+
     get_result create();
+
+    struct unresolved_request {
+        std::vector<uint8_t> buf;
+        std::chrono::milliseconds timeout;
+        connection::read_callback callback;
+        utils::timer timer;
+    };
+    /** Asynchronous requests waiting for the server address to be resolved */
+    std::vector<unresolved_request> m_unresolved_requests;
+    /** Guards `m_unresolved_requests`, as `m_mutex` is held while resolving */
+    std::mutex m_unresolved_mutex;
 };
 
 
@@ -123,6 +146,67 @@ ag::connection::read_result ag::dns_over_tls::tls_pool::perform_request_inner(ui
     return read_result;
 }
 
+void ag::dns_over_tls::tls_pool::perform_request_inner_async(uint8_view buf, std::chrono::milliseconds timeout,
+                                                             connection::read_callback callback) {
+    if (!m_bootstrapper->has_resolved()) {
+        // Resolving blocks, so it's not done on the caller's thread, and the requests coming meanwhile wait for it
+        std::scoped_lock l(m_unresolved_mutex);
+        m_unresolved_requests.push_back({ { buf.begin(), buf.end() }, timeout, std::move(callback), {} });
+        if (m_unresolved_requests.size() == 1) {
+            utils::async_detached([this] { resolve_server_async(); });
+        }
+        return;
+    }
+
+    perform_resolved_request_async(buf, timeout, std::move(callback));
+}
+
+void ag::dns_over_tls::tls_pool::resolve_server_async() {
+    // The result is cached, and the errors are reported by `get()` as usual
+    m_bootstrapper->get();
+
+    std::vector<unresolved_request> requests;
+    {
+        std::scoped_lock l(m_unresolved_mutex);
+        requests.swap(m_unresolved_requests);
+    }
+    for (unresolved_request &r : requests) {
+        // The time spent waiting for the resolution is taken out of the timeout
+        perform_resolved_request_async({ r.buf.data(), r.buf.size() }, r.timeout - r.timer.elapsed<milliseconds>(),
+                                       std::move(r.callback));
+    }
+}
+
+void ag::dns_over_tls::tls_pool::perform_resolved_request_async(uint8_view buf, std::chrono::milliseconds timeout,
+                                                                connection::read_callback callback) {
+    auto[conn, elapsed, err] = get();
+    if (!conn) {
+        callback({ {}, std::move(err) });
+        return;
+    }
+
+    timeout -= duration_cast<milliseconds>(elapsed);
+    if (timeout < milliseconds(0)) {
+        callback({ {}, AG_FMT("DNS server name resolving took too much time: {}", elapsed) });
+        return;
+    }
+
+    connection::write_result write_result = conn->write(buf);
+    if (write_result.error.has_value()) {
+        m_bootstrapper->remove_resolved(conn->address);
+        callback({ {}, std::move(write_result.error) });
+        return;
+    }
+
+    conn->read_async(write_result.id, timeout,
+            [this, address = conn->address, callback = std::move(callback)] (connection::read_result result) {
+        if (result.error.has_value()) {
+            m_bootstrapper->remove_resolved(address);
+        }
+        callback(std::move(result));
+    });
+}
+
 static std::optional<std::string> get_resolved_ip(const ag::logger &log, const ag::ip_address_variant &addr) {
     if (std::holds_alternative<std::monostate>(addr)) {
         return std::nullopt;
@@ -235,7 +319,6 @@ int ag::dns_over_tls::ssl_verify_callback(X509_STORE_CTX *ctx, void *arg) {
 }
 
 ag::dns_over_tls::exchange_result ag::dns_over_tls::exchange(ldns_pkt *request_pkt) {
-    ldns_pkt *reply_pkt = nullptr;
     ldns_status status;
 
     using ldns_buffer_ptr = std::unique_ptr<ldns_buffer, ag::ftor<&ldns_buffer_free>>;
@@ -247,14 +330,20 @@ ag::dns_over_tls::exchange_result ag::dns_over_tls::exchange(ldns_pkt *request_p
 
     ag::uint8_view buf{ ldns_buffer_begin(buffer.get()), ldns_buffer_position(buffer.get()) };
     connection::read_result result = m_pool->perform_request(buf, this->m_options.timeout);
-    if (result.error.has_value()) {
-        return { nullptr, std::move(result.error) };
-    }
+    return parse_dns_reply(result);
+}
 
-    const std::vector<uint8_t> &reply = result.reply;
-    status = ldns_wire2pkt(&reply_pkt, reply.data(), reply.size());
+void ag::dns_over_tls::exchange_async(ldns_pkt *request_pkt, exchange_callback callback) {
+    ldns_buffer_ptr buffer{ldns_buffer_new(REQUEST_BUFFER_INITIAL_CAPACITY)};
+    ldns_status status = ldns_pkt2buffer_wire(&*buffer, request_pkt);
     if (status != LDNS_STATUS_OK) {
-        return {nullptr, ldns_get_errorstr_by_id(status)};
+        callback({nullptr, ldns_get_errorstr_by_id(status)});
+        return;
     }
-    return {ldns_pkt_ptr(reply_pkt), std::nullopt};
+
+    ag::uint8_view buf{ ldns_buffer_begin(buffer.get()), ldns_buffer_position(buffer.get()) };
+    m_pool->perform_request_async(buf, this->m_options.timeout,
+            [callback = std::move(callback)] (connection::read_result result) {
+        callback(parse_dns_reply(result));
+    });
 }
@@ -31,6 +31,8 @@ public:
 private:
     err_string init() override;
     exchange_result exchange(ldns_pkt *request_pkt) override;
+    void exchange_async(ldns_pkt *request_pkt, exchange_callback callback) override;
+    bool is_exchange_async() const override { return true; }
 
     static int ssl_verify_callback(X509_STORE_CTX *store_ctx, void *arg);
     class tls_pool;
@@ -8,6 +8,29 @@
 using std::chrono::milliseconds;
 using std::chrono::duration_cast;
 
+/**
+ * UDP request waiting for the response on the event loop of the TCP pool
+ */
+struct ag::plain_dns::udp_request {
+    plain_dns *upstream = nullptr;
+    /** DNS message id */
+    uint16_t id = 0;
+    /** Request data, also used in case the response is truncated */
+    ldns_buffer_ptr buffer;
+    exchange_callback callback;
+    evutil_socket_t fd = -1;
+    event *ev = nullptr;
+
+    ~udp_request() {
+        if (ev != nullptr) {
+            event_free(ev);
+        }
+        if (fd != -1) {
+            evutil_closesocket(fd);
+        }
+    }
+};
+
 static ag::socket_address prepare_address(const std::string &address_string) {
     auto address = ag::utils::str_to_socket_address(address_string);
     if (address.port() == 0) {
@@ -82,17 +105,123 @@ ag::plain_dns::exchange_result ag::plain_dns::exchange(ldns_pkt *request_pkt) {
     ag::uint8_view buf{ ldns_buffer_begin(buffer.get()), ldns_buffer_position(buffer.get()) };
     tracelog_id(m_log, request_pkt, "Sending TCP request for a domain: {}", domain ? domain.get() : "(unknown)");
     connection::read_result result = m_pool.perform_request(buf, this->m_options.timeout);
-    if (result.error.has_value()) {
-        return { nullptr, std::move(result.error) };
+    return parse_dns_reply(result);
+}
+
+void ag::plain_dns::exchange_async(ldns_pkt *request_pkt, exchange_callback callback) {
+    ldns_buffer_ptr buffer{ldns_buffer_new(REQUEST_BUFFER_INITIAL_CAPACITY)};
+    ldns_status status = ldns_pkt2buffer_wire(&*buffer, request_pkt);
+    if (status != LDNS_STATUS_OK) {
+        callback({nullptr, ldns_get_errorstr_by_id(status)});
+        return;
+    }
+
+    if (m_prefer_tcp) {
+        tracelog_id(m_log, request_pkt, "Sending TCP request");
+        exchange_tcp_async(std::move(buffer), std::move(callback));
+        return;
+    }
+
+    tracelog_id(m_log, request_pkt, "Sending UDP request");
+    auto *request = new udp_request;
+    request->upstream = this;
+    request->id = ldns_pkt_id(request_pkt);
+    request->buffer = std::move(buffer);
+    request->callback = std::move(callback);
+    event_base_once(m_pool.loop()->c_base(), -1, EV_TIMEOUT, start_udp_request, request, nullptr);
+}
+
+void ag::plain_dns::exchange_tcp_async(ldns_buffer_ptr buffer, exchange_callback callback) {
+    ag::uint8_view buf{ ldns_buffer_begin(buffer.get()), ldns_buffer_position(buffer.get()) };
+    m_pool.perform_request_async(buf, this->m_options.timeout,
+            [callback = std::move(callback)] (connection::read_result result) {
+        callback(parse_dns_reply(result));
+    });
+}
+
+void ag::plain_dns::start_udp_request(evutil_socket_t, short, void *arg) {
+    std::unique_ptr<udp_request> request((udp_request *) arg);
+    plain_dns *self = request->upstream;
+    const socket_address &address = self->m_pool.address();
+
+    request->fd = socket(address.c_sockaddr()->sa_family, SOCK_DGRAM, IPPROTO_UDP);
+    if (request->fd == -1) {
+        complete_udp_request(std::move(request),
+                {nullptr, evutil_socket_error_to_string(evutil_socket_geterror(-1))});
+        return;
+    }
+    evutil_make_socket_nonblocking(request->fd);
+    evutil_make_socket_closeonexec(request->fd);
+
+    if (!prepare_fd(request->fd, address.c_sockaddr(), self)) {
+        complete_udp_request(std::move(request), {nullptr, "Failed to bind socket to interface"});
+        return;
+    }
+
+    const uint8_t *data = ldns_buffer_begin(request->buffer.get());
+    size_t size = ldns_buffer_position(request->buffer.get());
+    if (0 != connect(request->fd, address.c_sockaddr(), address.c_socklen())
+            || 0 > send(request->fd, (const char *) data, size, 0)) {
+        complete_udp_request(std::move(request),
+                {nullptr, evutil_socket_error_to_string(evutil_socket_geterror(request->fd))});
+        return;
+    }
+
+    request->ev = event_new(self->m_pool.loop()->c_base(), request->fd, EV_READ | EV_PERSIST,
+                            on_udp_event, request.get());
+    timeval tv = utils::duration_to_timeval(self->m_options.timeout);
+    event_add(request->ev, &tv);
+    request.release();
+}
+
+void ag::plain_dns::on_udp_event(evutil_socket_t fd, short what, void *arg) {
+    auto *request = (udp_request *) arg;
+    plain_dns *self = request->upstream;
+
+    if (what & EV_TIMEOUT) {
+        // To cancel second retry of exchange
+        complete_udp_request(std::unique_ptr<udp_request>(request), {nullptr, TIMEOUT_STR.data()});
+        return;
+    }
+
+    uint8_t reply[LDNS_MAX_PACKETLEN];
+    ev_ssize_t reply_size = recv(fd, (char *) reply, sizeof(reply), 0);
+    if (reply_size < 0) {
+        int error = evutil_socket_geterror(fd);
+        if (EVUTIL_ERR_RW_RETRIABLE(error)) {
+            return;
+        }
+        complete_udp_request(std::unique_ptr<udp_request>(request),
+                {nullptr, evutil_socket_error_to_string(error)});
+        return;
     }
 
-    const std::vector<uint8_t> &reply = result.reply;
     ldns_pkt *reply_pkt = nullptr;
-    status = ldns_wire2pkt(&reply_pkt, reply.data(), reply.size());
-    if (status != LDNS_STATUS_OK) {
-        return {nullptr, ldns_get_errorstr_by_id(status)};
+    if (ldns_status status = ldns_wire2pkt(&reply_pkt, reply, reply_size); status != LDNS_STATUS_OK) {
+        complete_udp_request(std::unique_ptr<udp_request>(request), {nullptr, ldns_get_errorstr_by_id(status)});
+        return;
     }
-    return {ldns_pkt_ptr(reply_pkt), std::nullopt};
+    ldns_pkt_ptr reply_ptr{reply_pkt};
+    if (ldns_pkt_id(reply_pkt) != request->id) {
+        tracelog_id(self->m_log, reply_pkt, "Ignoring response to another request");
+        return;
+    }
+
+    // If not truncated, return result. Otherwise, try TCP.
+    if (!ldns_pkt_tc(reply_pkt)) {
+        complete_udp_request(std::unique_ptr<udp_request>(request), {std::move(reply_ptr), std::nullopt});
+        return;
+    }
+
+    tracelog_id(self->m_log, reply_pkt, "Response is truncated, sending TCP request");
+    std::unique_ptr<udp_request> truncated(request);
+    self->exchange_tcp_async(std::move(truncated->buffer), std::move(truncated->callback));
+}
+
+void ag::plain_dns::complete_udp_request(std::unique_ptr<udp_request> request, exchange_result result) {
+    exchange_callback callback = std::move(request->callback);
+    request.reset();
+    callback(std::move(result));
 }
 
 int ag::plain_dns::prepare_fd(int fd, const sockaddr *peer, void *arg) {
@@ -57,8 +57,14 @@ public:
     ~plain_dns() override = default;
 
 private:
+    struct udp_request;
+
     err_string init() override;
     exchange_result exchange(ldns_pkt *request_pkt) override;
+    void exchange_async(ldns_pkt *request_pkt, exchange_callback callback) override;
+    bool is_exchange_async() const override { return true; }
+
+    void exchange_tcp_async(ldns_buffer_ptr buffer, exchange_callback callback);
 
     ag::logger m_log;
 
@@ -70,6 +76,10 @@ private:
     tcp_pool m_pool;
 
     static int prepare_fd(int fd, const sockaddr *peer, void *arg);
+
+    static void start_udp_request(evutil_socket_t, short, void *arg);
+    static void on_udp_event(evutil_socket_t fd, short what, void *arg);
+    static void complete_udp_request(std::unique_ptr<udp_request> request, exchange_result result);
 };
 
 } // namespace ag
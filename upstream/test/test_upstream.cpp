@@ -105,6 +105,24 @@ static ag::ldns_pkt_ptr create_test_message() {
     return assert_response(*reply);
 }
 
+static ag::upstream::exchange_result exchange_async(ag::upstream &upstream, ldns_pkt *request) {
+    std::promise<ag::upstream::exchange_result> promise;
+    std::future<ag::upstream::exchange_result> future = promise.get_future();
+    upstream.exchange_async(request, [&promise](ag::upstream::exchange_result result) {
+        promise.set_value(std::move(result));
+    });
+    return future.get();
+}
+
+[[nodiscard]] static ag::err_string check_upstream_async(ag::upstream &upstream, const std::string &addr) {
+    auto req = create_test_message();
+    auto[reply, err] = exchange_async(upstream, req.get());
+    if (err) {
+        return AG_FMT("Couldn't talk to upstream {}: {}", addr, *err);
+    }
+    return assert_response(*reply);
+}
+
 using err_futures = std::vector<std::future<ag::err_string>>;
 
 template<typename F>
@@ -273,6 +291,19 @@ TEST_P(dns_truncated_test, test_dns_truncated) {
     ASSERT_FALSE(ldns_pkt_tc(res.get())) << "Response must NOT be truncated";
 }
 
+TEST_P(dns_truncated_test, test_dns_truncated_async) {
+    const auto &address = GetParam();
+    auto[upstream, upstream_err] = create_upstream({std::string(address), {}, std::chrono::seconds(5)});
+    ASSERT_FALSE(upstream_err) << "Error while creating an upstream: " << *upstream_err;
+    auto request = ag::dnscrypt::create_request_ldns_pkt(LDNS_RR_TYPE_TXT, LDNS_RR_CLASS_IN, LDNS_RD,
+                                                         "unit-test2.dns.adguard.com.", std::nullopt);
+    ldns_pkt_set_random_id(request.get());
+    auto[res, err] = exchange_async(*upstream, request.get());
+    ASSERT_FALSE(err) << "Error while making a request: " << *err;
+    ASSERT_FALSE(ldns_pkt_tc(res.get())) << "Response must NOT be truncated";
+    ASSERT_EQ(ldns_pkt_id(res.get()), ldns_pkt_id(request.get()));
+}
+
 INSTANTIATE_TEST_CASE_P(dns_truncated_test, dns_truncated_test, testing::ValuesIn(truncated_test_data));
 
 struct upstream_test_data {
@@ -393,6 +424,17 @@ TEST_F(upstream_test, test_upstreams) {
     parallel_test(test_upstreams_data);
 }
 
+TEST_F(upstream_test, test_upstreams_async) {
+    parallel_test_basic(test_upstreams_data,
+            [](const auto &address, const auto &bootstrap, const auto &server_ip) -> ag::err_string {
+        auto[upstream_ptr, upstream_err] = create_upstream({address, bootstrap, DEFAULT_TIMEOUT, server_ip});
+        if (upstream_err) {
+            return AG_FMT("Failed to generate upstream from address {}: {}", address, *upstream_err);
+        }
+        return check_upstream_async(*upstream_ptr, address);
+    });
+}
+
 static const upstream_test_data upstream_dot_bootstrap_test_data[]{
     {
         "tls://one.one.one.one/",
@@ -502,6 +544,36 @@ TEST_F(upstream_test, test_upstreams_with_server_ip) {
     parallel_test(test_upstreams_with_server_ip_data);
 }
 
+TEST_F(upstream_test, health_stats) {
+    auto[upstream_ptr, upstream_err] = create_upstream({ .address = "8.8.8.8", .timeout = DEFAULT_TIMEOUT });
+    ASSERT_FALSE(upstream_err.has_value()) << *upstream_err;
+    ag::upstream &u = *upstream_ptr;
+    ASSERT_EQ(std::chrono::microseconds(0), u.rtt());
+    ASSERT_EQ(0, u.failure_rate());
+
+    // the first RTT is taken as is
+    u.update_stats(std::chrono::milliseconds(80), false);
+    ASSERT_EQ(std::chrono::milliseconds(80), u.rtt());
+    ASSERT_EQ(std::chrono::milliseconds(40), u.rtt_variance());
+
+    // the failures don't affect the RTT
+    u.update_stats(DEFAULT_TIMEOUT, true);
+    ASSERT_EQ(std::chrono::milliseconds(80), u.rtt());
+    ASSERT_GT(u.failure_rate(), 0);
+
+    // the following ones are smoothed
+    u.update_stats(std::chrono::milliseconds(160), false);
+    ASSERT_EQ(std::chrono::milliseconds(90), u.rtt());
+    ASSERT_EQ(std::chrono::milliseconds(50), u.rtt_variance());
+
+    for (int i = 0; i < 200; ++i) {
+        u.update_stats(std::chrono::milliseconds(20), false);
+    }
+    ASSERT_NEAR(20, std::chrono::duration_cast<std::chrono::milliseconds>(u.rtt()).count(), 1);
+    ASSERT_LT(u.rtt_variance(), std::chrono::milliseconds(1));
+    ASSERT_LT(u.failure_rate(), 0.01);
+}
+
 TEST_F(upstream_test, DISABLED_concurrent_requests) {
     using namespace std::chrono_literals;
     using namespace concat_err_string;